@@ -0,0 +1,398 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../include/cpu.hpp"
+#include "../include/keypad.hpp"
+#include "../include/lanebatch.hpp"
+#include "../include/linkcable.hpp"
+#include "../include/log.hpp"
+#include "../include/memory.hpp"
+#include "../include/workload.hpp"
+
+/*
+Interpreter throughput: runs the same code with the call-based loop (CPU::executeinst per
+instruction) and with the threaded interpreter, and reports guest MIPS for both.
+Usage: PlusBoyBench [rom] [--frames=N] [--workload=NAME|all] [--size=N] [--seed=N]
+                    [--write-rom=FILE] [--list] [--link=N] [--lanes=N]
+Without a ROM or workload a built-in ARM loop is used (ALU, load/store, BL/return, multiply,
+and the pairs the threaded interpreter fuses). --workload picks one of the generated stress
+ROMs (workload.hpp), --size and --seed shape it, --write-rom keeps the image for PlusBoy.
+--link=N runs N copies on a link cable instead (made for --workload=link), each on its own
+thread, and compares their combined throughput with one copy alone.
+--lanes=N runs N copies with keys of their own as a lane batch (lanebatch.hpp) against N
+separate runs, with groups only and in lockstep (against call loop runs, which it matches).
+The keys follow a search tree: all lanes press the same ones at first, and every
+LANE_BENCH_SPLIT_FRAMES frames each set of lanes splits in two.
+*/
+
+#define LANE_BENCH_SPLIT_FRAMES 60
+
+// Built-in workload, runs forever
+static const uint32_t benchProgram[] = {
+    0xE3A00000,  //         mov r0, #0
+    0xE3A01403,  //         mov r1, #0x03000000
+    0xE3A07000,  //         mov r7, #0
+    0xE2900001,  // loop:   adds r0, r0, #1
+    0xE0202180,  //         eor r2, r0, r0, lsl #3
+    0xE20230FF,  //         and r3, r2, #0xFF
+    0xE1834000,  //         orr r4, r3, r0
+    0xE5814004,  //         str r4, [r1, #4]
+    0xE5915004,  //         ldr r5, [r1, #4]
+    0xE0556000,  //         subs r6, r5, r0
+    0xE3560C01,  //         cmp r6, #0x100
+    0x83A06000,  //         movhi r6, #0
+    0xEB00000A,  //         bl func
+    0xE0080290,  //         mul r8, r0, r2
+    0xE3A09C12,  //         mov r9, #0x1200
+    0xE3899034,  //         orr r9, r9, #0x34
+    0xE3A0A000,  //         mov r10, #0
+    0xE28AA001,  // inner:  add r10, r10, #1
+    0xE35A0004,  //         cmp r10, #4
+    0x1AFFFFFC,  //         bne inner
+    0xE3A0B003,  //         mov r11, #3
+    0xE25BB001,  // count:  subs r11, r11, #1
+    0x1AFFFFFD,  //         bne count
+    0xEAFFFFEA,  //         b loop
+    0xE2877001,  // func:   add r7, r7, #1
+    0xE59FC000,  //         ldr r12, [pc, #0]
+    0xE12FFF1C,  //         bx r12
+    0x08000034,  //         .word return address (the mul after bl func)
+};
+
+struct BenchResult {
+  double seconds;
+  uint64_t instructions;
+  uint64_t cycles;
+  uint32_t registers[16];
+  uint32_t cpsr;
+};
+
+static BenchResult runOnce(const std::vector<uint8_t> &rom, bool threaded, int frames) {
+  Memory memory;
+  memory.loadROMData(rom.data(), rom.size());
+  CPU cpu(memory);
+  cpu.setThreadedInterpreter(threaded);
+  cpu.detectThumbinst();
+
+  auto start = std::chrono::steady_clock::now();
+  cpu.runFor((uint64_t)frames * CYCLES_PER_FRAME);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  BenchResult result;
+  result.seconds = elapsed.count();
+  result.instructions =
+      cpu.getStats().armInstructions.get() + cpu.getStats().thumbInstructions.get();
+  result.cycles = cpu.getCycles();
+  std::memcpy(result.registers, cpu.getRegisters().r, sizeof(result.registers));
+  result.cpsr = cpu.getRegisters().cpsr;
+  return result;
+}
+
+// Both interpreters on one ROM, false if they end up in different states
+static bool benchROM(const std::vector<uint8_t> &rom, int frames) {
+  BenchResult results[2];
+  const char *names[2] = {"call loop", "threaded"};
+  for (int mode = 0; mode < 2; ++mode) {
+    // Best of three, the first run also warms up the host caches
+    for (int run = 0; run < 3; ++run) {
+      BenchResult result = runOnce(rom, mode == 1, frames);
+      if (run == 0 || result.seconds < results[mode].seconds) results[mode] = result;
+    }
+    std::printf("%-10s %8.3f s  %10llu instructions  %8.2f MIPS\n", names[mode],
+                results[mode].seconds, (unsigned long long)results[mode].instructions,
+                results[mode].instructions / results[mode].seconds / 1e6);
+  }
+
+  std::printf("speedup    %8.2fx\n", results[0].seconds / results[1].seconds);
+  if (std::memcmp(results[0].registers, results[1].registers, sizeof(results[0].registers)) != 0 ||
+      results[0].instructions != results[1].instructions ||
+      results[0].cycles != results[1].cycles ||
+      // NZCV can differ where the run stopped right after a flag update nothing reads
+      ((results[0].cpsr ^ results[1].cpsr) & 0x0FFFFFFF) != 0) {
+    std::cerr << "Interpreters disagree on the final state!" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+struct LinkResult {
+  double seconds;
+  uint64_t instructions;  // all players
+  uint64_t transfers;
+  uint64_t waits;
+  std::vector<uint32_t> state;  // registers, cycles and SIOMULTI of every player
+};
+
+static LinkResult runLinked(const std::vector<uint8_t> &rom, int frames, uint32_t players) {
+  std::vector<std::unique_ptr<Memory>> memories;
+  std::vector<std::unique_ptr<CPU>> cpus;
+  std::vector<CPU *> linked;
+  for (uint32_t i = 0; i < players; ++i) {
+    memories.push_back(std::make_unique<Memory>());
+    memories.back()->loadROMData(rom.data(), rom.size());
+    cpus.push_back(std::make_unique<CPU>(*memories.back()));
+    cpus.back()->detectThumbinst();
+    linked.push_back(cpus.back().get());
+  }
+  LinkCable cable(linked);
+
+  auto start = std::chrono::steady_clock::now();
+  cable.run(frames);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  LinkResult result = {elapsed.count(), 0, 0, 0, {}};
+  for (uint32_t i = 0; i < players; ++i) {
+    Stats &stats = cpus[i]->getStats();
+    result.instructions += stats.armInstructions.get() + stats.thumbInstructions.get();
+    result.transfers += stats.serialTransfers.get();
+    result.waits += stats.linkWaits.get();
+    const uint32_t *r = cpus[i]->getRegisters().r;
+    result.state.insert(result.state.end(), r, r + 16);
+    result.state.push_back((uint32_t)cpus[i]->getCycles());
+    for (uint32_t slot = 0; slot < LINK_MAX_PLAYERS; ++slot) {
+      result.state.push_back(memories[i]->readIO(SIOMULTI0 + slot * 2));
+    }
+  }
+  return result;
+}
+
+// Linked copies against one alone, false if two linked runs end up in different states
+static bool benchLink(const std::vector<uint8_t> &rom, int frames, uint32_t players) {
+  BenchResult alone = runOnce(rom, true, frames);
+  std::printf("alone      %8.3f s  %10llu instructions  %8.2f MIPS\n", alone.seconds,
+              (unsigned long long)alone.instructions, alone.instructions / alone.seconds / 1e6);
+  LinkResult results[2];
+  for (int run = 0; run < 2; ++run) {
+    results[run] = runLinked(rom, frames, players);
+  }
+  const LinkResult &best = results[0].seconds < results[1].seconds ? results[0] : results[1];
+  double mips = best.instructions / best.seconds / 1e6;
+  std::printf("%u linked   %8.3f s  %10llu instructions  %8.2f MIPS  %llu transfers  "
+              "%llu waits\n",
+              players, best.seconds, (unsigned long long)best.instructions, mips,
+              (unsigned long long)best.transfers / players, (unsigned long long)best.waits);
+  std::printf("scaling    %8.2fx of %u\n", mips / (alone.instructions / alone.seconds / 1e6),
+              players);
+  if (results[0].state != results[1].state) {
+    std::cerr << "Linked runs disagree on the final state!" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Keys of one lane, the same for every lane in its branch of the tree
+static uint16_t laneKeys(uint32_t lane, uint32_t lanes, int frame) {
+  uint32_t depth = 0;
+  while ((1u << depth) < lanes && depth < (uint32_t)frame / LANE_BENCH_SPLIT_FRAMES) {
+    ++depth;
+  }
+  uint32_t bits = 0;
+  while ((1u << bits) < lanes) {
+    ++bits;
+  }
+  uint64_t x = (uint64_t)frame * 0x9E3779B97F4A7C15ULL ^ ((uint64_t)(lane >> (bits - depth)) << 32);
+  x ^= x >> 29;
+  x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 32;
+  return (uint16_t)(x & KEY_ALL);
+}
+
+// Separate runs of every lane, their final states in 'states'. Returns the seconds taken.
+static double runLanesSeparately(const std::vector<uint8_t> &rom, const std::vector<uint8_t> &start,
+                                 int frames, uint32_t lanes, bool threaded,
+                                 std::vector<std::vector<uint8_t>> &states) {
+  double seconds = 0;
+  states.assign(lanes, {});
+  for (uint32_t lane = 0; lane < lanes; ++lane) {
+    auto laneStart = std::chrono::steady_clock::now();
+    Memory laneMemory;
+    laneMemory.loadROMData(rom.data(), rom.size());
+    CPU cpu(laneMemory);
+    cpu.setThreadedInterpreter(threaded);
+    cpu.loadState(start.data(), start.size());
+    for (int frame = 0; frame < frames; ++frame) {
+      cpu.getKeypad().setPressed(laneKeys(lane, lanes, frame));
+      cpu.runFrame();
+    }
+    seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - laneStart).count();
+    cpu.saveState(states[lane]);
+  }
+  return seconds;
+}
+
+// A lane batch, false if a lane doesn't end up where its separate run in 'expected' does
+static bool runLaneBatch(CPU &origin, int frames, uint32_t lanes, bool lockstep,
+                         const std::vector<std::vector<uint8_t>> &expected, double reference) {
+  std::vector<uint16_t> keys(lanes);
+  auto batchStart = std::chrono::steady_clock::now();
+  LaneBatch batch(origin, lanes);
+  batch.setLockstep(lockstep);
+  for (int frame = 0; frame < frames; ++frame) {
+    for (uint32_t lane = 0; lane < lanes; ++lane) {
+      keys[lane] = laneKeys(lane, lanes, frame);
+    }
+    batch.runFrame(keys.data());
+  }
+  std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - batchStart;
+
+  bool agree = true;
+  std::vector<uint8_t> got;
+  for (uint32_t lane = 0; lane < lanes; ++lane) {
+    got.clear();
+    batch.getCPU(lane).saveState(got);
+    agree = agree && got == expected[lane];
+  }
+  std::printf("%-10s %8.3f s  %10llu frames  %llu splits  %llu merges  %u groups left  %.2fx\n",
+              lockstep ? "lockstep" : "batch", seconds.count(),
+              (unsigned long long)batch.getGroupFrames(), (unsigned long long)batch.getSplits(),
+              (unsigned long long)batch.getMerges(), batch.getGroupCount(),
+              reference / seconds.count());
+  if (lockstep) {
+    uint64_t bundled = batch.getBundledInstructions();
+    uint64_t total = bundled + batch.getSingleInstructions();
+    std::printf("           %5.1f%% of lane instructions bundled, %.2f lanes a bundle step, "
+                "%5.1f%% of those steps vector\n",
+                total ? 100.0 * bundled / total : 0.0,
+                batch.getBundleSteps() ? (double)bundled / batch.getBundleSteps() : 0.0,
+                batch.getBundleSteps() ? 100.0 * batch.getVectorSteps() / batch.getBundleSteps()
+                                       : 0.0);
+  }
+  if (!agree) {
+    std::cerr << (lockstep ? "Lockstep lanes" : "Lanes") << " disagree with their separate runs!"
+              << std::endl;
+  }
+  return agree;
+}
+
+// Lane batches (groups only, then lockstep) against separate runs with the interpreter each
+// has to match: the threaded one, and the call loop for lockstep
+static bool benchLanes(const std::vector<uint8_t> &rom, int frames, uint32_t lanes) {
+  Memory memory;
+  memory.loadROMData(rom.data(), rom.size());
+  CPU origin(memory);
+  origin.detectThumbinst();
+  std::vector<uint8_t> start;
+  origin.saveState(start);
+
+  std::vector<std::vector<uint8_t>> threadedStates, callStates;
+  double threaded = runLanesSeparately(rom, start, frames, lanes, true, threadedStates);
+  double call = runLanesSeparately(rom, start, frames, lanes, false, callStates);
+  std::printf("separate   %8.3f s  %10llu frames  (threaded)\n", threaded,
+              (unsigned long long)lanes * frames);
+  std::printf("separate   %8.3f s  %10llu frames  (call loop)\n", call,
+              (unsigned long long)lanes * frames);
+  bool agree = runLaneBatch(origin, frames, lanes, false, threadedStates, threaded);
+  agree = runLaneBatch(origin, frames, lanes, true, callStates, call) && agree;
+  return agree;
+}
+
+static void usage(const char *program) {
+  std::cerr << "Usage: " << program
+            << " [rom] [--frames=N] [--workload=NAME|all] [--size=N] [--seed=N]"
+               " [--write-rom=FILE] [--list] [--link=N] [--lanes=N]"
+            << std::endl;
+}
+
+int main(int argc, char **argv) {
+  std::string romPath, workloadName, writePath;
+  Workload::Options options;
+  int frames = 600;
+  uint32_t linkPlayers = 0;
+  uint32_t lanes = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strncmp(argv[i], "--frames=", 9) == 0) {
+      frames = std::atoi(argv[i] + 9);
+    } else if (std::strncmp(argv[i], "--workload=", 11) == 0) {
+      workloadName = argv[i] + 11;
+    } else if (std::strncmp(argv[i], "--size=", 7) == 0) {
+      options.size = std::strtoul(argv[i] + 7, nullptr, 0);
+    } else if (std::strncmp(argv[i], "--seed=", 7) == 0) {
+      options.seed = std::strtoul(argv[i] + 7, nullptr, 0);
+    } else if (std::strncmp(argv[i], "--write-rom=", 12) == 0) {
+      writePath = argv[i] + 12;
+    } else if (std::strncmp(argv[i], "--link=", 7) == 0) {
+      linkPlayers = std::strtoul(argv[i] + 7, nullptr, 0);
+    } else if (std::strncmp(argv[i], "--lanes=", 8) == 0) {
+      lanes = std::strtoul(argv[i] + 8, nullptr, 0);
+    } else if (std::strcmp(argv[i], "--list") == 0) {
+      for (const Workload::Info &info : Workload::list()) {
+        std::printf("%s\n", info.name);
+      }
+      return 0;
+    } else if (argv[i][0] != '-') {
+      romPath = argv[i];
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if ((!romPath.empty() && !workloadName.empty()) || (linkPlayers != 0 && lanes != 0)) {
+    usage(argv[0]);
+    return 2;
+  }
+  verboseLogging = false;
+
+  try {
+    // Name and image of everything to run
+    std::vector<std::pair<std::string, std::vector<uint8_t>>> roms;
+    if (!romPath.empty()) {
+      std::ifstream file(romPath, std::ios::binary);
+      if (!file) {
+        std::cerr << "Can't open " << romPath << std::endl;
+        return 1;
+      }
+      roms.emplace_back(romPath, std::vector<uint8_t>(std::istreambuf_iterator<char>(file), {}));
+    } else if (workloadName == "all") {
+      for (const Workload::Info &info : Workload::list()) {
+        roms.emplace_back(info.name, Workload::build(info, options));
+      }
+    } else if (!workloadName.empty()) {
+      const Workload::Info *info = Workload::find(workloadName);
+      if (info == nullptr) {
+        std::cerr << "Unknown workload: " << workloadName << " (see --list)" << std::endl;
+        return 2;
+      }
+      roms.emplace_back(info->name, Workload::build(*info, options));
+    } else {
+      const uint8_t *program = reinterpret_cast<const uint8_t *>(benchProgram);
+      roms.emplace_back("built-in", std::vector<uint8_t>(program, program + sizeof(benchProgram)));
+    }
+
+    if (!writePath.empty()) {
+      if (roms.size() != 1) {
+        std::cerr << "--write-rom takes a single workload" << std::endl;
+        return 2;
+      }
+      std::ofstream out(writePath, std::ios::binary);
+      out.write(reinterpret_cast<const char *>(roms[0].second.data()), roms[0].second.size());
+    }
+
+    bool agree = true;
+    for (const auto &[name, rom] : roms) {
+      if (roms.size() > 1) {
+        std::printf("%s:\n", name.c_str());
+      }
+      if (linkPlayers != 0) {
+        agree = benchLink(rom, frames, linkPlayers) && agree;
+      } else if (lanes != 0) {
+        agree = benchLanes(rom, frames, lanes) && agree;
+      } else {
+        agree = benchROM(rom, frames) && agree;
+      }
+    }
+    if (!agree) {
+      return 1;
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "Bench stopped: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,343 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../include/arm.hpp"
+#include "../include/cpu.hpp"
+#include "../include/log.hpp"
+#include "../include/memory.hpp"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+/*
+Times the interpreter's building blocks one at a time, so a regression shows up as the
+primitive that got slower instead of a few percent off the whole-ROM MIPS of PlusBoyBench.
+Usage: PlusBoyMicrobench [--filter=text] [--cpu=N] [--samples=N] [--fastmem]
+
+Every benchmark is warmed up, then timed in SAMPLES batches sized to take about
+SAMPLE_MICROSECONDS each. Batches more than OUTLIER_SIGMAS robust standard deviations
+(1.4826 x the median absolute deviation) from the median are dropped (interrupts,
+migrations, frequency steps) and the rest averaged.
+The thread is pinned to one core (--cpu, default the one it starts on).
+*/
+
+#define WARMUP_MILLISECONDS 20
+#define SAMPLE_MICROSECONDS 500
+#define DEFAULT_SAMPLES 31
+#define OUTLIER_SIGMAS 3.0
+#define BATCH 64  // operations per timed call, keeps the clock out of the numbers
+
+// Keeps the compiler from dropping work whose result nothing reads
+template <typename T>
+static inline void keep(const T &value) {
+#if defined(__GNUC__) || defined(__clang__)
+  asm volatile("" : : "r,m"(value) : "memory");
+#else
+  static volatile T sink;
+  sink = value;
+#endif
+}
+
+struct Measurement {
+  double nanoseconds;  // per operation, outliers dropped
+  double spread;       // standard deviation of the kept batches, per operation
+  int rejected;
+};
+
+static int samples = DEFAULT_SAMPLES;
+
+// 'body' runs BATCH operations per call
+template <typename Body>
+static Measurement measure(Body &&body) {
+  using Clock = std::chrono::steady_clock;
+  auto warmupEnd = Clock::now() + std::chrono::milliseconds(WARMUP_MILLISECONDS);
+  uint64_t calls = 0;
+  while (Clock::now() < warmupEnd) {
+    body();
+    calls++;
+  }
+  // As many calls as fit in one sample, going by the warm-up rate
+  uint64_t perSample = std::max<uint64_t>(
+      1, calls * SAMPLE_MICROSECONDS / (WARMUP_MILLISECONDS * 1000));
+
+  std::vector<double> perOp(samples);
+  for (double &sample : perOp) {
+    auto start = Clock::now();
+    for (uint64_t i = 0; i < perSample; ++i) {
+      body();
+    }
+    std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+    sample = elapsed.count() / (perSample * BATCH);
+  }
+
+  std::vector<double> sorted(perOp);
+  std::sort(sorted.begin(), sorted.end());
+  double median = sorted[sorted.size() / 2];
+  std::vector<double> deviations;
+  for (double sample : sorted) deviations.push_back(std::fabs(sample - median));
+  std::sort(deviations.begin(), deviations.end());
+  double sigma = 1.4826 * std::max(deviations[deviations.size() / 2], median * 1e-3);
+
+  double sum = 0, squares = 0;
+  int kept = 0;
+  for (double sample : perOp) {
+    if (std::fabs(sample - median) <= OUTLIER_SIGMAS * sigma) {
+      sum += sample;
+      squares += sample * sample;
+      kept++;
+    }
+  }
+  double mean = sum / kept;
+  return {mean, std::sqrt(std::max(0.0, squares / kept - mean * mean)), samples - kept};
+}
+
+static std::string filter;
+
+template <typename Body>
+static void run(const char *group, const std::string &name, Body &&body) {
+  std::string label = std::string(group) + "/" + name;
+  if (!filter.empty() && label.find(filter) == std::string::npos) {
+    return;
+  }
+  Measurement m = measure(body);
+  std::printf("%-34s %9.2f ns/op  +-%6.2f  %2d dropped\n", label.c_str(), m.nanoseconds,
+              m.spread, m.rejected);
+  std::fflush(stdout);
+}
+
+// Opcodes in roughly the proportions game code has them: mostly ALU and loads/stores,
+// some compares and branches, a few multiplies. Nothing that leaves the benchmark's
+// sandbox (SWI, PSR writes, PC as a destination).
+static const uint32_t opcodeMix[] = {
+    0xE3A00001,  // mov r0, #1
+    0xE2800004,  // add r0, r0, #4
+    0xE0811002,  // add r1, r1, r2
+    0xE0422003,  // sub r2, r2, r3
+    0xE1A03104,  // mov r3, r4, lsl #2
+    0xE20440FF,  // and r4, r4, #0xFF
+    0xE1855006,  // orr r5, r5, r6
+    0xE0266007,  // eor r6, r6, r7
+    0xE3500010,  // cmp r0, #16
+    0xE1510002,  // cmp r1, r2
+    0xE2533001,  // subs r3, r3, #1
+    0xE5987000,  // ldr r7, [r8]
+    0xE5986004,  // ldr r6, [r8, #4]
+    0xE5880008,  // str r0, [r8, #8]
+    0xE5D85001,  // ldrb r5, [r8, #1]
+    0xE5C8100C,  // strb r1, [r8, #12]
+    0x0A000002,  // beq +8
+    0x1AFFFFFA,  // bne -16
+    0xEB000010,  // bl +64
+    0xE0090291,  // mul r9, r1, r2
+    0xE1B00FA0,  // movs r0, r0, lsr #31
+    0xE3C11003,  // bic r1, r1, #3
+    0xE1E02003,  // mvn r2, r3
+    0xE0A33004,  // adc r3, r3, r4
+};
+#define MIX_SIZE (sizeof(opcodeMix) / sizeof(opcodeMix[0]))
+
+static const char *conditionNames[16] = {"EQ", "NE", "CS", "CC", "MI", "PL", "VS", "VC",
+                                         "HI", "LS", "GE", "LT", "GT", "LE", "AL", "NV"};
+static const char *aluNames[16] = {"AND", "EOR", "SUB", "RSB", "ADD", "ADC", "SBC", "RSC",
+                                   "TST", "TEQ", "CMP", "CMN", "ORR", "MOV", "BIC", "MVN"};
+static const char *shiftNames[4] = {"LSL", "LSR", "ASR", "ROR"};
+
+static void resetRegisters(CPU &cpu) {
+  Registers &r = cpu.getRegisters();
+  for (int i = 0; i < 15; ++i) r.r[i] = 0x1234567 * (i + 1);
+  r.r[8] = IWRAM_START + 0x100;  // load/store base
+  r.pc = ROM_START + 8;
+  r.cpsr = MODE_SYSTEM;
+}
+
+static void decoderBenchmarks(CPU &cpu, Memory &memory) {
+  run("decode", "decodeHandler(mix)", [&] {
+    for (int i = 0; i < BATCH; ++i) keep(ARM::decodeHandler(opcodeMix[i % MIX_SIZE]));
+  });
+  run("decode", "decodeARM(mix)", [&] {
+    Registers &r = cpu.getRegisters();
+    for (int i = 0; i < BATCH; ++i) {
+      r.pc = ROM_START + 8;  // branches in the mix would wander off
+      r.r[8] = IWRAM_START + 0x100;
+      ARM::decodeARM(&cpu, &memory, opcodeMix[i % MIX_SIZE]);
+    }
+    keep(r.r[0]);
+  });
+}
+
+static void conditionBenchmarks(CPU &cpu) {
+  // Flags change every operation so the branch predictor can't learn one answer
+  static const uint32_t flagPatterns[8] = {0x00000000, 0x40000000, 0x20000000, 0x80000000,
+                                           0x10000000, 0x60000000, 0x90000000, 0xF0000000};
+  for (uint32_t condition = 0; condition < 16; ++condition) {
+    run("checkCondition", conditionNames[condition], [&] {
+      uint32_t inst = (condition << 28) | 0x01A00000;
+      uint32_t taken = 0;
+      for (int i = 0; i < BATCH; ++i) {
+        cpu.getRegisters().cpsr = flagPatterns[i & 7] | MODE_SYSTEM;
+        taken += ARM::checkCondition(&cpu, inst);
+      }
+      keep(taken);
+    });
+  }
+}
+
+static void shifterBenchmarks(CPU &cpu) {
+  static const uint32_t amounts[] = {0, 1, 16, 31};
+  for (uint32_t type = 0; type < 4; ++type) {
+    for (uint32_t amount : amounts) {
+      run("Shifter", std::string(shiftNames[type]) + " #" + std::to_string(amount), [&] {
+        uint32_t value = 0x80000001, total = 0;
+        for (int i = 0; i < BATCH; ++i) {
+          bool carry;
+          total += ARM::Shifter(&cpu, value + i, type, amount, carry) + carry;
+        }
+        keep(total);
+      });
+    }
+  }
+}
+
+static void aluBenchmarks(CPU &cpu) {
+  for (uint32_t opcode = 0; opcode < 16; ++opcode) {
+    // <op>s r2, r0, r1, lsl #2 (the compares only write flags)
+    uint32_t inst = 0xE0100000 | (opcode << 21) | (2 << 12) | (2 << 7) | 1;
+    run("executeArmALU", aluNames[opcode], [&] {
+      Registers &r = cpu.getRegisters();
+      for (int i = 0; i < BATCH; ++i) {
+        r.r[0] = 0x7FFFFFF0u + i;
+        ARM::executeArmALU(&cpu, inst);
+      }
+      keep(r.r[2]);
+    });
+  }
+}
+
+static void memoryBenchmarks(Memory &memory) {
+  static const struct {
+    const char *name;
+    uint32_t base;
+    uint32_t window;  // bytes the accesses cycle through
+    bool writable;
+  } regions[] = {
+      {"bios", BIOS_START, 0x1000, false},     {"wram", WRAM_START, 0x4000, true},
+      {"iwram", IWRAM_START, 0x4000, true},    {"io", IO_START + 0x10, 0x40, true},
+      {"palette", PALETTE_START, 0x400, true}, {"vram", VRAM_START, 0x4000, true},
+      {"oam", OAM_START, 0x400, true},         {"rom", ROM_START, 0x100, false},
+  };
+  for (const auto &region : regions) {
+    std::string name = region.name;
+    uint32_t mask = region.window - 1;
+    run("read", name + " word", [&] {
+      uint32_t total = 0;
+      for (int i = 0; i < BATCH; ++i) total += memory.readWord(region.base + ((i * 4) & mask));
+      keep(total);
+    });
+    run("read", name + " halfword", [&] {
+      uint32_t total = 0;
+      for (int i = 0; i < BATCH; ++i) {
+        total += memory.readHalfWord(region.base + ((i * 2) & mask));
+      }
+      keep(total);
+    });
+    run("read", name + " byte", [&] {
+      uint32_t total = 0;
+      for (int i = 0; i < BATCH; ++i) total += memory.readByte(region.base + (i & mask));
+      keep(total);
+    });
+    if (!region.writable) {
+      continue;
+    }
+    run("write", name + " word", [&] {
+      for (int i = 0; i < BATCH; ++i) memory.writeWord(region.base + ((i * 4) & mask), i);
+    });
+    run("write", name + " halfword", [&] {
+      for (int i = 0; i < BATCH; ++i) memory.writeHalfWord(region.base + ((i * 2) & mask), i);
+    });
+    run("write", name + " byte", [&] {
+      for (int i = 0; i < BATCH; ++i) memory.writeByte(region.base + (i & mask), i);
+    });
+  }
+}
+
+static void pinThread(int cpu) {
+#ifdef __linux__
+  if (cpu < 0) {
+    cpu = sched_getcpu();
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (cpu >= 0) {
+    CPU_SET(cpu, &set);
+  }
+  if (cpu < 0 || sched_setaffinity(0, sizeof(set), &set) != 0) {
+    std::cerr << "Couldn't pin to a core, numbers will be noisier" << std::endl;
+    return;
+  }
+  std::printf("Pinned to CPU %d\n", cpu);
+#else
+  (void)cpu;
+#endif
+}
+
+int main(int argc, char **argv) {
+  int pinCPU = -1;
+  bool useFastmem = false;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strncmp(argv[i], "--filter=", 9) == 0) {
+      filter = argv[i] + 9;
+    } else if (std::strncmp(argv[i], "--cpu=", 6) == 0) {
+      pinCPU = std::atoi(argv[i] + 6);
+    } else if (std::strncmp(argv[i], "--samples=", 10) == 0) {
+      samples = std::max(3, std::atoi(argv[i] + 10));
+    } else if (std::strcmp(argv[i], "--fastmem") == 0) {
+      useFastmem = true;
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [--filter=text] [--cpu=N] [--samples=N] [--fastmem]" << std::endl;
+      return 2;
+    }
+  }
+  verboseLogging = false;
+  pinThread(pinCPU);
+
+  // Something for the ROM reads to hit, the opcode mix is as good as anything
+  std::string romPath = (std::filesystem::temp_directory_path() / "plusboy_micro.gba").string();
+  {
+    std::ofstream rom(romPath, std::ios::binary);
+    for (int i = 0; i < 16; ++i) {
+      rom.write(reinterpret_cast<const char *>(opcodeMix), sizeof(opcodeMix));
+    }
+  }
+
+  try {
+    Memory memory;
+    if (useFastmem) {
+      memory.enableFastmem();
+    }
+    memory.loadBinFile(romPath);
+    CPU cpu(memory);
+    resetRegisters(cpu);
+
+    decoderBenchmarks(cpu, memory);
+    conditionBenchmarks(cpu);
+    shifterBenchmarks(cpu);
+    resetRegisters(cpu);
+    aluBenchmarks(cpu);
+    memoryBenchmarks(memory);
+  } catch (const std::exception &e) {
+    std::cerr << "Microbench stopped: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
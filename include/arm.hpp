@@ -1,14 +1,27 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
 
 // Forward declarations
 class CPU;
 class Memory;
 
+// NZCV as a 4 bit mask (CPSR bits 28-31)
+#define FLAG_V 0x1
+#define FLAG_C 0x2
+#define FLAG_Z 0x4
+#define FLAG_N 0x8
+#define FLAGS_ALL 0xF
+
 // Bitfield extraction helper macros
 #define EXTRACT_BITS(value, start, count) (((value) >> (start)) & ((1 << (count)) - 1))
 #define CHECK_BIT(value, bit) (((value) >> (bit)) & 1)
 
+// Bump with every change to what BlockCache makes of the decoded instructions (block ends,
+// flag liveness, pair fusion, idle loops), it's part of decoderFingerprint(). CMake builds
+// also mix in a hash of the decoder's sources (PLUSBOY_DECODER_HASH).
+#define DECODER_ANALYSIS_VERSION 2
+
 namespace ARM {
 typedef void (*InstructionHandler)(CPU* cpu, Memory* memory, uint32_t inst);
 
@@ -21,16 +34,44 @@ struct InstructionEntry {
 
 // ARM instruction decoding and execution
 void decodeARM(CPU* cpu, Memory* memory, uint32_t inst);
+size_t dispatchTableSize();
+size_t handlerCount();  // dispatch table plus fused pairs
+const char* dispatchTableName(size_t index);
+const char* instructionClass(uint32_t inst);  // "CMP", "Bcc", "LDR(literal)", ...
+uint8_t decodeHandler(uint32_t inst);  // dispatch table index of an opcode
+bool isALU(uint32_t inst);             // decodeARM runs it with executeArmALU
+uint32_t decoderFingerprint();         // changes whenever the dispatch table or analysis does
+bool endsBlock(uint32_t inst);
+
+// Flag liveness, see BlockCache. Conservative: anything that might look at the CPSR
+// (branches through registers, SWIs, PSR transfers, mode changes) reads all of them.
+uint8_t flagsRead(uint32_t inst, uint8_t handler);
+uint8_t flagsWritten(uint32_t inst, uint8_t handler);  // only counts unconditional writes
+uint8_t noFlagsHandler(uint32_t inst, uint8_t handler);  // variant for dead flags, or 'handler'
+
+// Fused pairs: CMP+B, flag setting ALU op+B, MOV+ORR, LDR literal+BX. Only the threaded
+// interpreter runs them, the first instruction's entry gets the fused handler index.
+uint8_t fusedHandler(uint32_t first, uint8_t firstHandler, uint32_t second,
+                     uint8_t secondHandler);
+bool isFusedHandler(uint8_t handler);
+
+// Threaded interpreter: runs ARM code out of the decode cache, each handler jumping straight
+// to the next one. Returns at 'cycleTarget' (checked before every instruction, so lowering it
+// from a handler stops the run), on a switch to Thumb or at an address the cache can't serve,
+// CPU::runFor takes it from there.
+void runThreaded(CPU* cpu, Memory* memory, const uint64_t& cycleTarget);
 bool checkCondition(CPU* cpu, uint32_t inst);
 
 // ARM instruction execution functions
 void executeArmLoadStore(CPU* cpu, Memory* memory, uint32_t inst);
 void executeArmBranch(CPU* cpu, uint32_t inst);
+void executeArmBranchExchange(CPU* cpu, uint32_t inst);
 void executeArmUndefined(uint32_t inst);
 void executeArmALU(CPU* cpu, uint32_t inst);
+void executeArmALUNoFlags(CPU* cpu, uint32_t inst);
 void executeArmBlockTransfer(CPU* cpu, Memory* memory, uint32_t inst);
 void executeArmBranchLink(CPU* cpu, uint32_t inst);
-void executeArmSoftwareInterrupt(uint32_t inst);
+void executeArmSoftwareInterrupt(CPU* cpu, Memory* memory, uint32_t inst);
 void executeArmSWP(CPU* cpu, Memory* memory, uint32_t inst);
 void executeArmMultiply(CPU* cpu, uint32_t inst);
 void executeArmMultiplyLong(CPU* cpu, Memory* memory, uint32_t inst);
@@ -41,11 +82,13 @@ void executeArmHalfWord(CPU* cpu, Memory* memory, uint32_t inst);
 
 // wrappers
 void wrappedExecuteArmBranch(CPU* cpu, Memory* memory, uint32_t inst);
+void wrappedExecuteArmBranchExchange(CPU* cpu, Memory* memory, uint32_t inst);
 void wrappedExecuteArmMultiply(CPU* cpu, Memory* memory, uint32_t inst);
 void wrappedExecuteArmSWI(CPU* cpu, Memory* memory, uint32_t inst);
 void wrappedExecuteArmUndefined(CPU* cpu, Memory* memory, uint32_t inst);
 void wrappedExecuteArmBranchLink(CPU* cpu, Memory* memory, uint32_t inst);
 void wrappedExecuteArmALU(CPU* cpu, Memory* memory, uint32_t inst);
+void wrappedExecuteArmALUNoFlags(CPU* cpu, Memory* memory, uint32_t inst);
 
 // ARM helper functions
 void updateFlags(CPU* cpu, uint32_t result, bool carry, bool overflow);
@@ -0,0 +1,79 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "spscqueue.hpp"
+
+class Stats;  // Forward declaration
+
+#define AUDIO_CHANNELS 2
+#define AUDIO_OUTPUT_RATE 48000  // sample frames per second the device plays
+#define AUDIO_PERIOD_FRAMES 256  // the device takes this many at a time (5.3 ms)
+
+// Stereo samples from the emulation thread to the device's: one writer, one reader, no locks
+// (the same split as SpscQueue, in bulk). Sizes count sample frames, a sample per channel.
+class AudioRing {
+ public:
+  explicit AudioRing(uint32_t frames);  // rounded up to a power of 2
+
+  // Writer side: as much of 'frames' as fits, returns how much did
+  uint32_t write(const int16_t *samples, uint32_t frames);
+  // Reader side: up to 'frames', returns how many were there
+  uint32_t read(int16_t *samples, uint32_t frames);
+
+  uint32_t getFill() const;  // either side
+  uint32_t getCapacity() const {
+    return capacity;
+  }
+
+ private:
+  uint32_t capacity;
+  std::vector<int16_t> samples;
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> writeIndex{0};
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> readIndex{0};
+};
+
+/*
+Audio device: plays the ring at AUDIO_OUTPUT_RATE from a thread of its own, a period at a
+time on the steady clock the way a sound card pulls its buffer. There's no host audio
+backend yet, so the periods go nowhere (a null sink), but the clock is the one a real one
+would keep, which is all pacing needs.
+
+A period the ring can't fill once playback got going is an underrun (the rest is played as
+silence). Latency is measured at every period: what's queued in front of the newest sample
+plus the period being played.
+*/
+class AudioDevice {
+ public:
+  // 'stats' (optional) gets the underruns and the latency
+  AudioDevice(uint32_t ringFrames, Stats *stats);
+  ~AudioDevice();  // stops playing
+  AudioDevice(const AudioDevice &) = delete;
+  AudioDevice &operator=(const AudioDevice &) = delete;
+
+  AudioRing &getRing() {
+    return ring;
+  }
+  uint64_t getUnderruns() const {
+    return underruns.load(std::memory_order_relaxed);
+  }
+  // Average over the periods played so far, and the last one
+  double getAverageLatencyMs() const;
+  double getLatencyMs() const {
+    return latencyMicros.load(std::memory_order_relaxed) / 1000.0;
+  }
+
+ private:
+  void playLoop();
+
+  AudioRing ring;
+  Stats *stats;
+  std::atomic<bool> stopping{false};
+  std::atomic<uint64_t> underruns{0};
+  std::atomic<uint64_t> latencyMicros{0};
+  std::atomic<uint64_t> latencyMicrosTotal{0};
+  std::atomic<uint64_t> periods{0};
+  std::thread player;
+};
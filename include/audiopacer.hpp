@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+class CPU;  // Forward declaration
+class AudioDevice;
+
+#define AUDIO_SAMPLE_RATE 32768       // the GBA's mixer at its default bias setting
+#define AUDIO_CYCLES_PER_SAMPLE 512   // 16.78 MHz / 32768
+#define AUDIO_MAX_RATE_ADJUST 0.005   // the resampler is nudged by up to +-0.5%
+#define AUDIO_DEFAULT_LATENCY_MS 32
+
+/*
+Frame pacing clocked by the audio device instead of a wall-clock sleep: every frame's
+samples go into the device's ring and the emulation waits until the next frame's fit under
+the target latency, so it runs exactly as fast as the device plays, without the crackle of a
+timer that drifts against the sound card or the judder of dropping samples to catch up.
+
+A GBA frame's worth of samples doesn't match the device's clock exactly (and hosts are
+late now and then), so they're resampled at a ratio nudged by up to AUDIO_MAX_RATE_ADJUST
+from the fill level each frame leaves: below target makes a few more, above a few less
+(dynamic rate control). That keeps the ring at the target without an audible pitch change.
+
+No APU yet: each frame adds its length in silence. The sound channels get mixed in here
+once there is one.
+*/
+class AudioPacer {
+ public:
+  // The target is kept between a period and half the device's ring
+  AudioPacer(CPU &cpu, AudioDevice &device, double targetLatencyMs);
+
+  // One frame (CPU::runFrame) and its samples to the device, then waits until the next
+  // frame's fit under the target
+  void runFrame();
+
+  // Output samples per input sample on top of the nominal rate, 1 +- AUDIO_MAX_RATE_ADJUST
+  double getRatio() const {
+    return ratio;
+  }
+  uint32_t getTargetFrames() const {
+    return targetFrames;
+  }
+
+ private:
+  void resample(uint32_t inputFrames);
+
+  CPU &cpu;
+  AudioDevice &device;
+  uint32_t targetFrames;   // in the ring, at AUDIO_OUTPUT_RATE
+  uint32_t cyclesCarried;  // cycles that didn't make a whole sample yet
+  double ratio;
+  double position;  // next output sample, in input samples from the first one of this frame
+  int16_t last[2];  // the last input sample of the previous frame
+  std::vector<int16_t> input;
+  std::vector<int16_t> output;
+};
@@ -0,0 +1,97 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "memory.hpp"
+#include "savefile.hpp"
+
+// https://problemkaputt.de/gbatek.htm#gbacartbackupids
+enum BackupType : int {
+  BACKUP_NONE,
+  BACKUP_SRAM,      // 32 KB battery backed RAM at 0x0E000000
+  BACKUP_FLASH64,   // 64 KB Flash at 0x0E000000
+  BACKUP_FLASH128,  // 128 KB Flash, two 64 KB banks
+  BACKUP_EEPROM,    // 512 bytes or 8 KB, bit-serial at 0x0D000000
+};
+
+#define SRAM_SIZE 0x8000
+#define FLASH_BANK_SIZE 0x10000
+#define FLASH_SECTOR_SIZE 0x1000
+#define EEPROM_SMALL_SIZE 512
+#define EEPROM_LARGE_SIZE 8192
+
+// EEPROM lives in the upper Game Pak mirror
+#define EEPROM_START 0x0D000000
+#define EEPROM_END 0x0DFFFFFF
+
+// Flash command addresses (offsets into the 64 KB window)
+#define FLASH_COMMAND_1 0x5555
+#define FLASH_COMMAND_2 0x2AAA
+
+class StateWriter;  // Forward declaration
+class StateReader;
+
+/*
+The cartridge's save chip. SRAM is plain bytes; Flash takes commands written to magic
+addresses (ID mode, erase, program a byte, bank switch) and finishes them right away;
+EEPROM talks one bit per halfword access (DMA on hardware), commands are put together from
+the bits and run once complete. Which EEPROM size a game has only shows in how long its
+address is: it's worked out from the first read command (9 or 17 bits) unless the save file
+already gave it away by its size.
+*/
+class Backup {
+ public:
+  // Bytes come from 'savePath', in memory only when it's empty
+  Backup(BackupType type, const std::string &savePath);
+
+  // Looks for the ID strings the Nintendo SDK libraries leave in the ROM
+  static BackupType detect(const uint8_t *rom, size_t size);
+  static const char *typeName(BackupType type);
+
+  BackupType getType() const {
+    return type;
+  }
+  bool contains(uint32_t address) const {
+    return type == BACKUP_EEPROM ? address >= EEPROM_START && address <= EEPROM_END
+                                 : address >= SRAM_START && address <= SRAM_END;
+  }
+  SaveFile &getFile() {
+    return *file;
+  }
+
+  // The 8-bit bus: wider reads see the byte repeated, wider writes store one byte lane
+  uint8_t read8(uint32_t address);
+  void write8(uint32_t address, uint8_t value);
+  // EEPROM only: bit 0 is the serial line
+  uint16_t readSerial();
+  void writeSerial(uint16_t value);
+
+  // Chip state and contents
+  void saveState(StateWriter &writer) const;
+  void loadState(StateReader &reader);
+
+ private:
+  void flashCommand(uint32_t offset, uint8_t value);
+  void runEEPROMCommand();
+
+  BackupType type;
+  std::unique_ptr<SaveFile> file;
+
+  // Flash
+  enum FlashState { FLASH_READY, FLASH_UNLOCK_1, FLASH_UNLOCK_2 };
+  FlashState flashState;
+  bool flashIDMode;
+  bool flashErasing;  // got 0x80, the next command picks chip or sector erase
+  bool flashProgram;  // the next write is a byte to program
+  bool flashBankSwitch;
+  uint32_t flashBank;
+
+  // EEPROM
+  uint32_t eepromAddressBits;  // 6 or 14, 0 until known
+  uint8_t eepromBits[96];      // serial bits written so far (1 per entry)
+  uint32_t eepromBitCount;
+  uint64_t eepromReadData;
+  uint32_t eepromReadPosition;  // bits of the current read sent, 68 = done
+};
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+
+// Forward declarations
+class CPU;
+class Memory;
+
+// SWI numbers (comment field of the SWI instruction)
+// https://problemkaputt.de/gbatek.htm#biosfunctions
+#define SWI_HALT 0x02
+#define SWI_STOP 0x03
+#define SWI_INTR_WAIT 0x04
+#define SWI_VBLANK_INTR_WAIT 0x05
+#define SWI_DIV 0x06
+#define SWI_DIV_ARM 0x07
+#define SWI_SQRT 0x08
+#define SWI_ARCTAN 0x09
+#define SWI_ARCTAN2 0x0A
+#define SWI_CPU_SET 0x0B
+#define SWI_CPU_FAST_SET 0x0C
+#define SWI_BG_AFFINE_SET 0x0E
+#define SWI_OBJ_AFFINE_SET 0x0F
+#define SWI_LZ77_UNCOMP_WRAM 0x11
+#define SWI_LZ77_UNCOMP_VRAM 0x12
+#define SWI_HUFF_UNCOMP 0x13
+#define SWI_RL_UNCOMP_WRAM 0x14
+#define SWI_RL_UNCOMP_VRAM 0x15
+#define SWI_HLE_IRQ_RETURN 0xFF  // not a real BIOS call, see BIOS_IRQ_RETURN
+
+// BIOS IRQ handler
+// https://problemkaputt.de/gbatek.htm#biosfunctions (IntrWait)
+#define BIOS_IRQ_RETURN 0x138         // where the handler goes on after the user's one returns
+#define BIOS_IRQ_FLAGS 0x03007FF8     // user handlers OR the IRQs they served in here
+#define BIOS_IRQ_HANDLER 0x03007FFC   // address of the user handler
+
+namespace BIOS {
+// High-level emulation of the BIOS calls, used while the bios region is empty.
+// Returns false if the SWI is not emulated so the caller can fall back.
+bool handleSWI(CPU* cpu, Memory* memory, uint32_t comment);
+
+// Writes what the emulated calls need into the empty bios region (the IRQ handler's way back)
+void installHLE(Memory* memory);
+
+// What the BIOS IRQ handler does: enter IRQ mode, push r0-r3, r12 and lr and call the user
+// handler with lr pointing at BIOS_IRQ_RETURN, which traps back into returnFromIRQ()
+void enterIRQ(CPU* cpu, Memory* memory);
+void returnFromIRQ(CPU* cpu, Memory* memory);
+
+// Sleeping
+void swiHalt(CPU* cpu);
+void swiIntrWait(CPU* cpu, Memory* memory, bool discard, uint16_t wanted);
+
+// Arithmetic
+void swiDiv(CPU* cpu, int32_t numerator, int32_t denominator);
+void swiSqrt(CPU* cpu);
+void swiArcTan(CPU* cpu);
+void swiArcTan2(CPU* cpu);
+
+// Memory copy / fill
+void swiCpuSet(CPU* cpu, Memory* memory);
+void swiCpuFastSet(CPU* cpu, Memory* memory);
+
+// Affine matrix setup
+void swiBgAffineSet(CPU* cpu, Memory* memory);
+void swiObjAffineSet(CPU* cpu, Memory* memory);
+
+// Decompression
+void swiLZ77UnComp(CPU* cpu, Memory* memory);
+void swiHuffUnComp(CPU* cpu, Memory* memory);
+void swiRLUnComp(CPU* cpu, Memory* memory);
+}  // namespace BIOS
@@ -0,0 +1,98 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "memory.hpp"
+#include "sha1.hpp"
+
+class Stats;  // Forward declaration
+class BlockCacheFile;
+class CodeDiscovery;
+
+#define BLOCK_MAX_INSTRUCTIONS 64
+#define BLOCK_CACHE_MAX_BLOCKS 0x10000  // flushed completely past this
+#define ARM_HANDLER_NOP 0xFF            // opcode 0, skipped like decodeARM does
+
+// Block flags
+#define BLOCK_IDLE_LOOP 0x1  // spins on memory until something else changes it
+
+// One pre-decoded ARM instruction
+struct DecodedInst {
+  uint32_t opcode;
+  uint8_t handler;    // index into the ARM dispatch table
+  uint8_t liveFlags;  // FLAG_* read after this instruction before anything sets them again
+};
+
+// Straight run of ARM instructions inside one FETCH_PAGE_SIZE page, decoded once.
+// All flags count as live at the end, so flag liveness never looks past the block.
+// Ends at the first B (conditional or not), other unconditional branches, SWI or write to
+// the PC, or at the page end.
+struct Block {
+  uint32_t start;
+  uint32_t generation;     // Memory::getMappingGeneration() when decoded
+  const uint32_t *version;  // write counter of the page, see Memory::getPageVersion()
+  uint32_t decodedVersion;
+  MemoryRegion region;
+  uint8_t flags;
+  std::vector<DecodedInst> instructions;
+
+  uint32_t byteSize() const {
+    return (uint32_t)instructions.size() * 4;
+  }
+  // Still matches memory (no remap, no write to the page since decoding)
+  bool isCurrent(const Memory &memory) const {
+    return generation == memory.getMappingGeneration() && *version == decodedVersion;
+  }
+};
+
+// Decoded ARM blocks by start address. Blocks end before a breakpoint and none starts at one
+// (see Debugger), so breakpoints are only ever met on the regular fetch path.
+class BlockCache {
+ public:
+  BlockCache(Memory &memory, Stats &stats);
+  ~BlockCache();
+
+  // Block starting at 'address', decoded on a miss. nullptr if the address isn't
+  // backed by host memory (I/O, unmapped), callers fall back to the regular fetch.
+  const Block *lookup(uint32_t address);
+  void clear();
+
+  size_t size() const {
+    return blocks.size();
+  }
+
+  // Persistent copy of the ROM blocks (see BlockCacheFile), <directory>/<ROM SHA-1>.pbblocks.
+  // Call after the ROM is loaded, saveFile() writes everything decoded so far back.
+  void attachDirectory(const std::string &directory);
+  bool saveFile();
+
+  // Misses in the ROM look there before decoding (optional, see CodeDiscovery)
+  void setDiscovery(CodeDiscovery *d) {
+    discovery = d;
+  }
+
+  // Decodes and analyzes the block at 'address' from the bytes of the page at 'pageStart',
+  // everything but the generation/version/region fields. No Memory involved, so it runs on
+  // any thread. false if there's no instruction there.
+  static bool decodeBlock(const uint8_t *page, uint32_t pageStart, uint32_t pageLength,
+                          uint32_t address, Block &block);
+
+ private:
+  bool decode(uint32_t address, Block &block);
+  bool load(uint32_t address, Block &block);
+  bool adopt(uint32_t address, Block &block);
+  bool place(uint32_t address, Block &block);
+
+  Memory &memory;
+  Stats &stats;
+  std::unordered_map<uint32_t, Block> blocks;
+
+  std::unique_ptr<BlockCacheFile> file;
+  std::string filePath;
+  SHA1::Digest romHash;
+  bool dirty;  // ROM blocks were decoded since the file was read
+  CodeDiscovery *discovery;
+};
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "sha1.hpp"
+
+struct Block;  // Forward declaration
+
+/*
+Decoded ROM blocks on disk, so repeat boots of the same ROM skip decoding and analysis.
+
+File layout (host endian, the emulator only builds for little endian hosts):
+  header: "PBBLOCKS", format version, decoder fingerprint, emulator version, ROM SHA-1,
+          block count, instruction count
+  index:  per block (sorted by address): start, first instruction, count, block flags
+  instructions: opcode, dispatch table index, flags live after it
+
+A file whose format, decoder fingerprint, emulator version or ROM hash doesn't match is
+ignored and replaced on the next save. The fingerprint covers the dispatch table, the
+analysis version and the decoder's sources (ARM::decoderFingerprint), so a build that
+changes how blocks are decoded or analyzed never picks up another build's. The file is mapped read-only, blocks are only
+copied out when the interpreter asks for one.
+*/
+
+#define BLOCK_FILE_MAGIC "PBBLOCKS"
+#define BLOCK_FILE_VERSION 3
+
+class BlockCacheFile {
+ public:
+  BlockCacheFile(const std::string &path, const SHA1::Digest &romHash);
+  ~BlockCacheFile();
+  BlockCacheFile(const BlockCacheFile &) = delete;
+  BlockCacheFile &operator=(const BlockCacheFile &) = delete;
+
+  // false when the file is missing or stale
+  bool isValid() const {
+    return index != nullptr;
+  }
+  size_t getBlockCount() const;
+  uint32_t getBlockStart(size_t i) const;
+
+  // Fills everything but the generation/version fields, false if there's no block there
+  bool find(uint32_t address, Block &block) const;
+
+  // Replaces the file at 'path' (through a rename, so readers never see half a file)
+  static bool write(const std::string &path, const SHA1::Digest &romHash,
+                    const std::vector<const Block *> &blocks);
+
+ private:
+  struct Header;
+  struct IndexEntry;
+  struct Instruction;
+
+  void *mapping;
+  size_t mappingSize;
+  const Header *header;
+  const IndexEntry *index;
+  const Instruction *instructions;
+};
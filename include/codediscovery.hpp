@@ -0,0 +1,93 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "blockcache.hpp"
+
+class Memory;  // Forward declaration
+
+#define DISCOVERY_MAX_THREADS 4
+#define DISCOVERY_MAX_RUN 0x4000  // Thumb halfwords one run is followed for at most
+
+/*
+Code discovery: finds the ROM's code on background threads right after it's loaded and
+decodes its ARM blocks before the CPU gets there, so the first pass through each path
+doesn't pay for decoding (the stutter of the first seconds of a game).
+
+Starting from the header's branch at 0x08000000, the workers follow ARM and Thumb code:
+B and BL targets (BL targets count as functions), fall-throughs of conditional branches and
+calls, and BX to an address loaded from a literal pool or built with ADD Rd, PC. Each ARM
+block start gets decoded (BlockCache::decodeBlock) into a table the block cache asks on a
+miss. Thumb code is only followed for the ARM code it leads to, there's no Thumb block cache.
+
+Games mix data into their code, so a run stops at the first thing no ARMv4 program runs
+(NV condition, undefined encodings, half a BL, BLX) and anything outside the ROM. Guessing
+wrong there only costs work: a block is exactly what the CPU would decode at its address,
+and the CPU only asks for addresses it actually runs.
+
+The workers read a copy of the ROM, never Memory. The CPU side never waits: it takes blocks
+with a try_lock and decodes on its own when a worker holds the table.
+*/
+class CodeDiscovery {
+ public:
+  // Copies the ROM and starts 'threads' workers (1 to DISCOVERY_MAX_THREADS)
+  CodeDiscovery(const Memory &memory, uint32_t threads);
+  ~CodeDiscovery();  // stops the workers
+  CodeDiscovery(const CodeDiscovery &) = delete;
+  CodeDiscovery &operator=(const CodeDiscovery &) = delete;
+
+  // CPU side: moves the block decoded for 'address' out, false if there's none (yet) or a
+  // worker holds the table
+  bool take(uint32_t address, Block &block);
+
+  // Blocks until the workers ran out of code to follow, for tools and benchmarks
+  void wait();
+
+  uint64_t getBlocksFound() const {
+    return blocksFound.load(std::memory_order_relaxed);
+  }
+  uint64_t getFunctionsFound() const {
+    return functionsFound.load(std::memory_order_relaxed);
+  }
+  uint64_t getBlocksTaken() const {
+    return blocksTaken.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Entry {
+    uint32_t address;
+    bool thumb;
+  };
+
+  void workerLoop();
+  void followARM(uint32_t address);
+  void followThumb(uint32_t address);
+  // Queues code at 'address' unless it's outside the ROM or was queued before
+  void push(uint32_t address, bool thumb);
+  bool markSeen(std::vector<std::atomic<uint32_t>> &bits, uint32_t index);
+  bool readWord(uint32_t address, uint32_t &value) const;
+  bool readHalfWord(uint32_t address, uint16_t &value) const;
+
+  std::vector<uint8_t> rom;
+  std::vector<std::atomic<uint32_t>> armSeen;    // per word: queued as an ARM block start
+  std::vector<std::atomic<uint32_t>> thumbSeen;  // per halfword: followed as Thumb
+
+  std::mutex workMutex;  // the workers' only, the CPU never takes it
+  std::condition_variable workChanged;
+  std::vector<Entry> work;
+  uint32_t busy;  // workers following something
+  bool stopping;
+
+  std::mutex readyMutex;
+  std::unordered_map<uint32_t, Block> ready;
+
+  std::atomic<uint64_t> blocksFound{0};
+  std::atomic<uint64_t> functionsFound{0};
+  std::atomic<uint64_t> blocksTaken{0};
+  std::vector<std::thread> workers;
+};
@@ -1,23 +1,113 @@
 // Thank you to https://problemkaputt.de/gbatek.htm#gbamemorymap for the memory map
 #pragma once
 #include <cstdint>
+#include <vector>
+
+#include "blockcache.hpp"
+#include "interrupts.hpp"
+#include "keypad.hpp"
+#include "ppu.hpp"
+#include "scheduler.hpp"
+#include "serial.hpp"
+#include "stats.hpp"
+
+#define CYCLES_PER_FRAME (SCANLINES_PER_FRAME * CYCLES_PER_SCANLINE)
+
+// CPSR bits
+#define CPSR_MODE_MASK 0x1F
+#define CPSR_THUMB 0x20
+#define CPSR_FIQ_DISABLE 0x40
+#define CPSR_IRQ_DISABLE 0x80
+
+// Processor modes (CPSR bits 0-4)
+#define MODE_USER 0x10
+#define MODE_FIQ 0x11
+#define MODE_IRQ 0x12
+#define MODE_SUPERVISOR 0x13
+#define MODE_ABORT 0x17
+#define MODE_UNDEFINED 0x1B
+#define MODE_SYSTEM 0x1F
+
+// Register banks, user and system mode share one
+#define BANK_USER 0
+#define BANK_FIQ 1
+#define BANK_IRQ 2
+#define BANK_SUPERVISOR 3
+#define BANK_ABORT 4
+#define BANK_UNDEFINED 5
+#define BANK_COUNT 6
+
+// Exception vectors (in the BIOS)
+#define VECTOR_RESET 0x00
+#define VECTOR_UNDEFINED 0x04
+#define VECTOR_SWI 0x08
+#define VECTOR_PREFETCH_ABORT 0x0C
+#define VECTOR_DATA_ABORT 0x10
+#define VECTOR_IRQ 0x18
+#define VECTOR_FIQ 0x1C
 
 struct Registers {
   uint32_t r[16];  // 16 general-purpose registers (r0-r15)
   uint32_t cpsr;   // Current Program Status Register
-  uint32_t spsr;   // Saved Program Status Register
+  uint32_t spsr;   // Saved Program Status Register of the current mode (none in user/system)
   uint32_t &sp;    // Stack Pointer (r13)
   uint32_t &lr;    // Link Register (r14)
   uint32_t &pc;    // Program Counter (r15)
+
+  // Registers of the modes that aren't active, swapped in by CPU::switchMode()
+  uint32_t bankedR8R12[2][5];  // [0] every mode but FIQ, [1] FIQ
+  uint32_t bankedSP[BANK_COUNT];
+  uint32_t bankedLR[BANK_COUNT];
+  uint32_t bankedSPSR[BANK_COUNT];
+
   Registers() : sp(r[13]), lr(r[14]), pc(r[15]) {}
 };
 
 class Memory;  // Forward declaration
+class Profiler;
+class TraceWriter;
+class Debugger;
 
 class CPU {
  private:
   Registers registers;
   Memory &memory;
+  uint64_t cycles;  // Total cycles executed since reset
+  bool hleBios;     // Emulate BIOS calls natively instead of jumping into the bios region
+  uint16_t hleIntrWait;  // IRQ_* bits an emulated IntrWait sleeps on, 0 when there's none
+  Profiler *profiler;  // Optional, nullptr when profiling is off
+  TraceWriter *tracer;  // Optional binary execution trace
+  Stats stats;
+  Scheduler scheduler;
+  InterruptController interrupts;
+  PPU ppu;
+  Keypad keypad;
+  SerialPort serial;
+  BlockCache blockCache;     // decoded ARM code for the threaded interpreter
+  bool threadedInterpreter;  // runFor uses ARM::runThreaded for ARM code
+  bool validatingFlags;      // check the flag liveness analysis while running
+
+  // Instruction fetch fast path: host pointer to the page holding the PC.
+  // Only branches out of the page, page crossings and remapping go back to Memory.
+  const uint8_t *fetchBase;
+  uint32_t fetchStart;
+  uint32_t fetchLength;
+  uint32_t fetchGeneration;
+  MemoryRegion fetchRegion;
+
+  // Game Pak prefetch buffer
+  uint32_t lastFetchEnd;      // address right after the previous opcode
+  uint32_t prefetchCount;     // halfwords waiting in the buffer (max 8)
+  uint32_t prefetchProgress;  // cycles spent on the halfword being fetched
+
+  bool refreshFetchPage(uint32_t address);
+  [[gnu::noinline]] void clampFetchPage(uint32_t address);  // around breakpoints
+  uint32_t fetchWord(uint32_t address);
+  uint16_t fetchHalfWord(uint32_t address);
+  bool peekHalfWord(uint32_t address, uint16_t &value) const;  // fetch page only, no timing
+
+  void printState() const;
+  void runEvents();
 
  public:
   CPU(Memory &mem);
@@ -25,7 +115,23 @@ class CPU {
   uint32_t readRegister(int index) const;
   void writeRegister(int index, uint32_t value);
   void executeinst();
-  void run();
+  void runFor(uint64_t cycleBudget);
+  // executeinst() and runFor() in pieces, for lane batches that run ARM opcodes themselves:
+  // fetchARM() fetches the next one (timing, prefetch, counters) and moves the PC past it,
+  // retireInstruction() adds the cycles of its data accesses. readyToExecute() is what
+  // runFor() does between instructions (due events, halts), false once 'target' is reached.
+  uint32_t fetchARM();
+  void retireInstruction();
+  bool readyToExecute(uint64_t target);
+  void run(uint64_t frames = 0);  // 0 runs forever
+  // The pieces of run() for callers that do something between frames (input movies)
+  void boot();
+  void runFrame();
+
+  // Whole machine state, see savestate.hpp. Loading throws std::runtime_error if the state
+  // is damaged or from another version. Saving appends to 'out', clear it to reuse it.
+  void saveState(std::vector<uint8_t> &out) const;
+  void loadState(const uint8_t *data, size_t size);
 
   Registers &getRegisters() {
     return registers;
@@ -37,10 +143,101 @@ class CPU {
     return memory;
   }
 
+  uint64_t getCycles() const {
+    return cycles;
+  }
+  void addCycles(uint32_t count) {
+    cycles += count;
+  }
+
+  bool isHLEBios() const {
+    return hleBios;
+  }
+  void setHLEBios(bool enabled) {
+    hleBios = enabled;
+  }
+  uint16_t getHLEIntrWait() const {
+    return hleIntrWait;
+  }
+  void setHLEIntrWait(uint16_t wanted) {
+    hleIntrWait = wanted;
+  }
+
+  Stats &getStats() {
+    return stats;
+  }
+  Scheduler &getScheduler() {
+    return scheduler;
+  }
+  InterruptController &getInterrupts() {
+    return interrupts;
+  }
+  PPU &getPPU() {
+    return ppu;
+  }
+  Keypad &getKeypad() {
+    return keypad;
+  }
+  SerialPort &getSerial() {
+    return serial;
+  }
+
+  Profiler *getProfiler() {
+    return profiler;
+  }
+  void setProfiler(Profiler *p) {
+    profiler = p;
+  }
+
+  TraceWriter *getTracer() {
+    return tracer;
+  }
+  void setTracer(TraceWriter *t) {
+    tracer = t;
+  }
+
+  // Optional breakpoints and watchpoints, kept by Memory (the bus needs it for watchpoints)
+  Debugger *getDebugger();
+  // Called by Debugger
+  void setDebugger(Debugger *d);
+  // Forgets decoded blocks and the fetch page, for when breakpoints change
+  void dropDecodedCode();
+
+  BlockCache &getBlockCache() {
+    return blockCache;
+  }
+  bool isThreadedInterpreter() const {
+    return threadedInterpreter;
+  }
+  void setThreadedInterpreter(bool enabled) {
+    threadedInterpreter = enabled;
+  }
+  bool isValidatingFlags() const {
+    return validatingFlags;
+  }
+  void setValidatingFlags(bool enabled) {
+    validatingFlags = enabled;
+  }
+
+  // Fetch timing, shared with the threaded interpreter
+  uint32_t fetchCycles(uint32_t address, bool thumb);
+  void runPrefetch(uint32_t idleCycles, bool romAccessed);
+  void syncFetchPage(uint32_t address);
+
   // === Instruction Set Support ===
   // Thumb (16-bit) instructions
   void decodeThumb(uint16_t inst);
   void detectThumbinst();
+  static const char *thumbInstructionClass(uint16_t inst);  // for the profiler's pair table
 
   void updateFlags(uint32_t result, bool carry, bool overflow);
+
+  // === Modes and exceptions ===
+  // Swaps in the registers banked for 'mode', only the ones that differ between the two
+  void switchMode(uint32_t mode);
+  // Full CPSR write (MSR, exception return), switches banks when the mode changes
+  void setCPSR(uint32_t value);
+  // Saves the CPSR into the new mode's SPSR, switches to ARM state with IRQs off and jumps
+  // to 'vector'. 'returnAddress' ends up in the new mode's LR.
+  void enterException(uint32_t vector, uint32_t mode, uint32_t returnAddress);
 };
\ No newline at end of file
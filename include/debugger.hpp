@@ -0,0 +1,108 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+class CPU;  // Forward declaration
+class Memory;
+
+// Watchpoint kinds
+#define WATCH_READ 0x1
+#define WATCH_WRITE 0x2
+
+enum DebugEventType { DEBUG_BREAKPOINT, DEBUG_READ, DEBUG_WRITE };
+
+struct DebugEvent {
+  DebugEventType type;
+  uint32_t pc;  // breakpoint: the instruction about to run, watchpoint: the one running
+  uint64_t cycle;
+  uint32_t address;  // the access for watchpoints, the breakpoint otherwise
+  uint32_t value;    // read or written, 0 for breakpoints
+  int width;         // 0/1/2 for 8/16/32-bit accesses
+};
+
+// Thrown out of CPU::runFor when a hit stops the CPU: right before the instruction at a
+// breakpoint, after the instruction that did the access for a watchpoint (a DMA's access
+// stops it at the next scheduler event). Running again carries on from there.
+class DebugStop : public std::runtime_error {
+ public:
+  explicit DebugStop(const DebugEvent &event);
+  const DebugEvent event;
+};
+
+/*
+Breakpoints and watchpoints that cost nothing while none are set, and nothing on code and
+pages that don't have one:
+
+- Breakpoints never get checked per instruction. The CPU's fetch page is cut short in front
+  of every breakpoint and decoded blocks end before one (and never start at one), so only
+  reaching a breakpoint drops the CPU into the fetch slow path, where it's checked.
+- Watchpoints mark their FETCH_PAGE_SIZE pages slow in the bus: fastmem unmaps them so only
+  accesses to those fault to the regular path, and the regular path's region lookup hands
+  out no buffer for a region with a watched page. Its existing unmapped-address test sends
+  those accesses to a slow accessor that checks the page in a table that's only there while
+  a watchpoint is set. Every other region keeps the exact same path.
+
+Addresses are guest addresses as the game uses them, mirrors aren't followed. Writes the
+emulated BIOS calls make through host pointers (CpuSet and friends) aren't seen.
+Only change breakpoints and watchpoints between runs, not from the handler.
+*/
+class Debugger {
+ public:
+  // true stops the CPU (see DebugStop), false lets it carry on
+  using Handler = std::function<bool(const DebugEvent &)>;
+
+  explicit Debugger(CPU &cpu);  // attaches itself
+  ~Debugger();                  // detaches, clearing everything it set
+  Debugger(const Debugger &) = delete;
+  Debugger &operator=(const Debugger &) = delete;
+
+  // Without a handler every hit stops
+  void setHandler(Handler h) {
+    handler = std::move(h);
+  }
+
+  void addBreakpoint(uint32_t address);
+  bool removeBreakpoint(uint32_t address);  // false if there was none
+  // 'kinds' is WATCH_READ and/or WATCH_WRITE, any access overlapping the range hits
+  void addWatchpoint(uint32_t address, uint32_t length, uint32_t kinds);
+  bool removeWatchpoint(uint32_t address);  // by start address, false if there was none
+
+  // CPU side
+  bool hasBreakpoints() const {
+    return !breakpoints.empty();
+  }
+  bool isBreakpoint(uint32_t address) const;
+  // Narrows [start, end), which holds 'address', to leave out every breakpoint but 'address'
+  void clampToBreakpoints(uint32_t address, uint32_t &start, uint32_t &end) const;
+  // Fetch from a breakpoint: calls the handler and throws DebugStop if it stops. The one the
+  // CPU stopped at lets the next fetch through, so running again gets past it.
+  void hitBreakpoint(uint32_t address);
+  // Throws the stop a watchpoint asked for, called where the CPU can stop
+  void takeStop();
+
+  // Memory side, for accesses to watched pages only
+  void checkAccess(uint32_t address, uint32_t value, int width, bool write);
+
+ private:
+  struct Watchpoint {
+    uint32_t start;
+    uint32_t length;
+    uint32_t kinds;
+  };
+
+  void codeChanged();
+  bool report(const DebugEvent &event);
+
+  CPU &cpu;
+  Memory &memory;
+  Handler handler;
+  std::vector<uint32_t> breakpoints;  // sorted
+  std::vector<Watchpoint> watchpoints;
+  bool resuming;  // the CPU stopped at resumeAddress and hasn't run it yet
+  uint32_t resumeAddress;
+  bool stopPending;
+  DebugEvent pendingStop;
+};
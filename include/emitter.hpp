@@ -0,0 +1,148 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "memory.hpp"
+
+/*
+Small assembler for building test and benchmark ROMs in-process, no arm-none-eabi needed.
+Instructions are appended in order; branches and addresses can point at labels that are
+bound later, finish() patches them in and returns the image.
+
+Only the forms PlusBoy runs are here: ARM data processing (immediate or shifted register),
+MUL, LDR/STR with a positive immediate offset, LDM/STM, B/BL/BX, SWI, MSR/MRS, and the Thumb
+MOV/ADD/B/BL/BX/SWI. https://problemkaputt.de/gbatek.htm#armopcodes
+*/
+
+// Condition field
+#define COND_EQ 0x0
+#define COND_NE 0x1
+#define COND_CS 0x2
+#define COND_CC 0x3
+#define COND_MI 0x4
+#define COND_PL 0x5
+#define COND_VS 0x6
+#define COND_VC 0x7
+#define COND_HI 0x8
+#define COND_LS 0x9
+#define COND_GE 0xA
+#define COND_LT 0xB
+#define COND_GT 0xC
+#define COND_LE 0xD
+#define COND_AL 0xE
+
+// Shift types for register operands
+#define SHIFT_LSL 0
+#define SHIFT_LSR 1
+#define SHIFT_ASR 2
+#define SHIFT_ROR 3
+
+// Data processing opcodes (bits 21-24)
+enum ArmAluOp : uint32_t {
+  ALU_AND,
+  ALU_EOR,
+  ALU_SUB,
+  ALU_RSB,
+  ALU_ADD,
+  ALU_ADC,
+  ALU_SBC,
+  ALU_RSC,
+  ALU_TST,
+  ALU_TEQ,
+  ALU_CMP,
+  ALU_CMN,
+  ALU_ORR,
+  ALU_MOV,
+  ALU_BIC,
+  ALU_MVN,
+};
+
+// LDM/STM addressing: increment/decrement, after/before
+enum BlockMode { BLOCK_IA, BLOCK_IB, BLOCK_DA, BLOCK_DB };
+
+class Emitter {
+ public:
+  typedef int Label;
+
+  Emitter(uint32_t base = ROM_START);
+
+  // Address the next instruction goes to
+  uint32_t here() const {
+    return base + (uint32_t)code.size();
+  }
+  size_t size() const {
+    return code.size();
+  }
+
+  Label newLabel();
+  void bind(Label label);
+
+  // ARM. Immediates have to fit 8 bits rotated by an even amount, std::runtime_error if not.
+  void alu(ArmAluOp op, int rd, int rn, uint32_t imm, bool setFlags = false, int cond = COND_AL);
+  void aluReg(ArmAluOp op, int rd, int rn, int rm, int shiftType = SHIFT_LSL,
+              int shiftAmount = 0, bool setFlags = false, int cond = COND_AL);
+  void mul(int rd, int rm, int rs, bool setFlags = false, int cond = COND_AL);
+  void ldr(int rd, int rn, uint32_t offset = 0, int cond = COND_AL);
+  void str(int rd, int rn, uint32_t offset = 0, int cond = COND_AL);
+  void ldrb(int rd, int rn, uint32_t offset = 0, int cond = COND_AL);
+  void strb(int rd, int rn, uint32_t offset = 0, int cond = COND_AL);
+  void ldm(int rn, uint16_t list, BlockMode mode = BLOCK_IA, bool writeback = true,
+           int cond = COND_AL);
+  void stm(int rn, uint16_t list, BlockMode mode = BLOCK_IA, bool writeback = true,
+           int cond = COND_AL);
+  void push(uint16_t list);  // STMDB sp!
+  void pop(uint16_t list);   // LDMIA sp!
+  void b(Label label, int cond = COND_AL);
+  void bl(Label label, int cond = COND_AL);
+  void bx(int rm, int cond = COND_AL);
+  void swi(uint32_t comment, int cond = COND_AL);
+  void msrControl(uint32_t value);  // MSR CPSR_c, #value: mode and interrupt masks
+  void mrs(int rd, bool spsr = false);
+
+  // MOV, MVN or MOV plus an ORR per remaining byte
+  void loadConstant(int rd, uint32_t value);
+  // Always 4 instructions (MOV and 3 ORRs) so it can be patched once the label is bound,
+  // 'thumb' sets bit 0 for BX
+  void loadAddress(int rd, Label label, bool thumb = false);
+
+  // Thumb, the caller switches with BX
+  void thumbMov(int rd, uint32_t imm);
+  void thumbAdd(int rd, int rs, int rn);
+  void thumbB(Label label);
+  void thumbBL(Label label);
+  void thumbBX(int rm);
+  void thumbSWI(uint32_t comment);
+
+  // Raw data, zeros until the address is a multiple of 'alignment'
+  void word(uint32_t value);
+  void align(uint32_t alignment);
+
+  // Patches every label use, std::runtime_error for unbound labels or branches out of range
+  std::vector<uint8_t> finish();
+
+  // Rotated immediate field for 'value', false if it can't be encoded
+  static bool encodeImmediate(uint32_t value, uint32_t &field);
+
+ private:
+  enum FixupKind { FIXUP_ARM_BRANCH, FIXUP_THUMB_BRANCH, FIXUP_THUMB_BL, FIXUP_ADDRESS };
+  struct Fixup {
+    size_t offset;
+    Label label;
+    FixupKind kind;
+    uint32_t addend;
+  };
+
+  void arm(uint32_t inst);
+  void thumb(uint16_t inst);
+  void loadStore(bool load, bool byte, int rd, int rn, uint32_t offset, int cond);
+  void blockTransfer(bool load, int rn, uint16_t list, BlockMode mode, bool writeback,
+                     int cond);
+  void patch32(size_t offset, uint32_t value);
+  void patch16(size_t offset, uint16_t value);
+
+  uint32_t base;
+  std::vector<uint8_t> code;
+  std::vector<int64_t> labels;  // address, -1 while unbound
+  std::vector<Fixup> fixups;
+};
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+class HostBuffer;  // Forward declaration
+
+// The whole 32-bit guest address space, plus a guard page for accesses straddling the top
+#define FASTMEM_SIZE 0x100000000ULL
+#define FASTMEM_GUARD 0x1000
+
+// Access stubs (x86-64 assembly in fastmem.cpp). They return false when the access
+// faulted, the SIGSEGV handler resumes them at a "return false" exit.
+extern "C" {
+bool fastmemLoad8(const uint8_t *host, uint8_t *value);
+bool fastmemLoad16(const uint8_t *host, uint16_t *value);
+bool fastmemLoad32(const uint8_t *host, uint32_t *value);
+bool fastmemStore8(uint8_t *host, uint8_t value);
+bool fastmemStore16(uint8_t *host, uint16_t value);
+bool fastmemStore32(uint8_t *host, uint32_t value);
+}
+
+/*
+Guest address space backed by one host virtual memory reservation, so a guest access
+to 'address' is a host access to base + address.
+Memory regions are mapped in as views of their shared HostBuffers (at every mirror),
+everything else stays PROT_NONE. Accesses there fault and the caller falls back to the
+regular bus code, which is where I/O side effects and invalid addresses are handled.
+Linux x86-64 only, isSupported() is false elsewhere.
+*/
+class Fastmem {
+ public:
+  Fastmem();
+  ~Fastmem();
+  Fastmem(const Fastmem &) = delete;
+  Fastmem &operator=(const Fastmem &) = delete;
+
+  static bool isSupported();
+
+  // Maps 'length' bytes of 'buffer' from 'offset' at guest 'address' (page aligned)
+  void mapView(uint32_t address, const HostBuffer &buffer, size_t offset, size_t length);
+  // Maps the whole buffer over [start, end], repeating it every buffer size
+  void mapMirrored(uint32_t start, uint32_t end, const HostBuffer &buffer);
+  // Back to PROT_NONE
+  void unmap(uint32_t address, size_t length);
+
+  uint8_t *getBase() {
+    return base;
+  }
+
+  bool load8(uint32_t address, uint8_t &value) const {
+    return fastmemLoad8(base + address, &value);
+  }
+  bool load16(uint32_t address, uint16_t &value) const {
+    return fastmemLoad16(base + address, &value);
+  }
+  bool load32(uint32_t address, uint32_t &value) const {
+    return fastmemLoad32(base + address, &value);
+  }
+  bool store8(uint32_t address, uint8_t value) {
+    return fastmemStore8(base + address, value);
+  }
+  bool store16(uint32_t address, uint16_t value) {
+    return fastmemStore16(base + address, value);
+  }
+  bool store32(uint32_t address, uint32_t value) {
+    return fastmemStore32(base + address, value);
+  }
+
+ private:
+  uint8_t *base;
+};
@@ -0,0 +1,75 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "memory.hpp"
+
+/*
+Finished frames for readers outside the emulation thread, possibly in another process.
+
+Layout of the mapping (host endian):
+  header: "PBFRAMES", version, slot count, width, height, pixel format,
+          number of the newest finished frame (frames count from 1, 0 = none yet)
+  slots:  sequence, frame number, WIDTH * HEIGHT pixels (0xFFRRGGBB)
+
+Frame n is drawn straight into slot n % slots, nothing is copied once it's done. Readers
+don't lock anything, each slot is a seqlock: the sequence is odd while the PPU draws into
+it, so a reader copies the pixels and keeps them only if the sequence was even and the same
+before and after, and the frame number is the one it wanted. A reader more than
+slots - 1 frames behind loses frames instead of holding up the emulator.
+*/
+
+#define FRAME_RING_MAGIC "PBFRAMES"
+#define FRAME_RING_VERSION 1
+#define FRAME_RING_SLOTS 8
+#define FRAME_FORMAT_XRGB8888 1
+#define FRAME_PIXELS (WIDTH * HEIGHT)
+
+class FrameRing {
+ public:
+  // In the POSIX shared memory object 'name' (shm_open, e.g. "/plusboy") when given,
+  // otherwise in private memory. The owner unlinks the object again when it's done.
+  FrameRing(const std::string &name = "");
+  ~FrameRing();
+  FrameRing(const FrameRing &) = delete;
+  FrameRing &operator=(const FrameRing &) = delete;
+
+  // Read-only view of a ring another process exports, nullptr if there's none (or it's stale)
+  static std::unique_ptr<FrameRing> attach(const std::string &name);
+
+  bool isShared() const {
+    return !name.empty();
+  }
+
+  // Writer side (emulation thread): pixels of the slot the next frame goes into, then
+  // publishing it once every line is drawn
+  uint32_t *beginFrame();
+  void endFrame();
+
+  // Reader side, any thread
+  uint64_t getLatest() const;
+  // Copies frame 'frame' out, false if it isn't finished yet or was overwritten meanwhile
+  bool readFrame(uint64_t frame, uint32_t *pixels) const;
+  // Returns once a frame newer than 'seen' is out or wake() was called (or spuriously,
+  // callers check again). Readers in other processes can't be woken, they poll.
+  void waitForFrame(uint64_t seen) const;
+  void wake();
+
+ private:
+  struct Header;
+  struct Slot;
+
+  FrameRing(const std::string &name, bool owner);
+  Slot *slot(uint64_t frame) const;
+
+  std::string name;
+  bool owner;
+  void *mapping;
+  size_t mappingSize;
+  Header *header;
+  uint64_t drawing;  // frame between beginFrame() and endFrame(), 0 otherwise
+  std::atomic<uint32_t> wakeups;  // this process only
+};
@@ -0,0 +1,49 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+class FrameRing;  // Forward declaration
+
+/*
+Writes the frames coming out of a FrameRing to a file on a background thread, so converting
+and writing never hold up emulation. A writer that can't keep up loses frames (counted)
+rather than slowing the emulator down.
+
+Formats, picked by the file extension:
+  .y4m: YUV4MPEG2, 4:4:4, BT.601 limited range, at the GBA refresh rate
+  anything else: raw 24-bit RGB, one WIDTH x HEIGHT frame after the other
+*/
+class FrameWriter {
+ public:
+  FrameWriter(FrameRing &ring, const std::string &filename);
+  ~FrameWriter();
+
+  // Writes what's already finished, then stops the thread
+  void close();
+
+  uint64_t getFramesWritten() const {
+    return written.load(std::memory_order_relaxed);
+  }
+  uint64_t getFramesDropped() const {
+    return dropped.load(std::memory_order_relaxed);
+  }
+
+ private:
+  void writerLoop();
+  void writeFrame();
+
+  FrameRing &ring;
+  std::ofstream file;
+  bool y4m;
+  std::vector<uint32_t> pixels;
+  std::vector<uint8_t> encoded;
+  std::atomic<uint64_t> written;
+  std::atomic<uint64_t> dropped;
+  std::atomic<bool> closing;
+  std::atomic<uint64_t> lastFrame;  // newest frame when close() was called
+  std::thread writer;
+};
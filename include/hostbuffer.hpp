@@ -0,0 +1,72 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Zero-filled bytes backing one piece of guest memory.
+// Starts out on the heap; share() moves the contents into a memfd so the same bytes can
+// be mapped again somewhere else (fastmem views), mapPrivate() makes it a copy-on-write view
+// of another buffer's memfd. data() may move on resize()/share()/mapPrivate().
+class HostBuffer {
+ public:
+  HostBuffer(size_t size = 0);
+  ~HostBuffer();
+  HostBuffer(const HostBuffer &) = delete;
+  HostBuffer &operator=(const HostBuffer &) = delete;
+
+  uint8_t *data() {
+    return bytes;
+  }
+  const uint8_t *data() const {
+    return bytes;
+  }
+  size_t size() const {
+    return length;
+  }
+  bool empty() const {
+    return length == 0;
+  }
+  uint8_t &operator[](size_t index) {
+    return bytes[index];
+  }
+  const uint8_t &operator[](size_t index) const {
+    return bytes[index];
+  }
+
+  // Keeps the contents, new bytes are zero
+  void resize(size_t newSize);
+
+  // Moves the contents into a memfd, false if the host can't do that
+  bool share();
+  bool isShared() const {
+    return fd >= 0;
+  }
+  // Drops the contents for a MAP_PRIVATE view of 'base' (shared first): the host pages stay
+  // the base's until this side writes to them. resize() and share() make a copy of their own.
+  // False (nothing changes) if the host can't do that.
+  bool mapPrivate(HostBuffer &base);
+  // Moves the contents of a shared buffer into a memfd of its own (after fork() the old one
+  // is the parent's too, writes would reach it). Heap bytes and private views are the
+  // process's own already. False if the host ran out of memfds.
+  bool reshare();
+  bool isPrivateView() const {
+    return privateView;
+  }
+  int getFd() const {
+    return fd;
+  }
+  // Size of the memfd, the size rounded up to whole pages
+  size_t getMappedSize() const {
+    return mapped;
+  }
+
+ private:
+  void mapShared(size_t newSize);
+  void release();     // frees or unmaps the bytes, whichever they are
+  void copyToHeap();  // private view to heap bytes
+
+  uint8_t *bytes;
+  size_t length;
+  size_t mapped;
+  int fd;  // -1 while the buffer is on the heap
+  bool privateView;  // 'bytes' is a MAP_PRIVATE view of another buffer's memfd
+};
@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+
+// https://problemkaputt.de/gbatek.htm#gbainterruptcontrol
+#define INTERRUPT_ENABLE 0x04000200  // IE
+#define INTERRUPT_FLAGS 0x04000202   // IF, writing a 1 acknowledges
+#define INTERRUPT_MASTER 0x04000208  // IME
+#define HALTCNT 0x04000301
+
+// IE/IF bits
+#define IRQ_VBLANK 0x0001
+#define IRQ_HBLANK 0x0002
+#define IRQ_VCOUNT 0x0004
+#define IRQ_TIMER0 0x0008
+#define IRQ_SERIAL 0x0080
+#define IRQ_DMA0 0x0100
+#define IRQ_KEYPAD 0x1000
+#define IRQ_GAMEPAK 0x2000
+#define IRQ_ALL 0x3FFF
+
+class CPU;  // Forward declaration
+class Memory;
+class Scheduler;
+class StateWriter;
+class StateReader;
+
+// IE/IF/IME live in the I/O buffer like every other register, this keeps track of whether
+// they (and the CPSR I bit) let an interrupt through. Nothing polls them per instruction:
+// the pending state is worked out again only when one of them changes, and a pending IRQ is
+// an EVENT_IRQ at the current cycle, which stops the interpreter before the next instruction.
+class InterruptController {
+ public:
+  InterruptController(CPU &cpu, Memory &memory, Scheduler &scheduler);
+
+  // Sets IF bits (hardware side)
+  void raise(uint16_t sources);
+  // After a write to IE/IF/IME or a change of the CPSR I bit
+  void update();
+
+  // IME on, I bit clear and something enabled is flagged
+  bool isPending() const {
+    return pending;
+  }
+  // HALTCNT/SWI 2: the CPU sleeps until IE & IF, IME and the I bit don't matter for that
+  void halt();
+  bool isHalted() const {
+    return halted;
+  }
+
+  // EVENT_IRQ came up: enters the IRQ exception if it's still pending
+  void dispatch();
+
+  void saveState(StateWriter &writer) const;
+  void loadState(StateReader &reader);
+
+ private:
+  CPU &cpu;
+  Memory &memory;
+  Scheduler &scheduler;
+  bool pending;
+  bool halted;
+};
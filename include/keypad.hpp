@@ -0,0 +1,38 @@
+#pragma once
+#include <cstdint>
+
+// https://problemkaputt.de/gbatek.htm#gbakeypadinput
+#define KEYINPUT 0x04000130  // 0 = pressed, read-only for the CPU
+#define KEYCNT 0x04000132
+
+// KEYINPUT/KEYCNT bits
+#define KEY_A 0x0001
+#define KEY_B 0x0002
+#define KEY_SELECT 0x0004
+#define KEY_START 0x0008
+#define KEY_RIGHT 0x0010
+#define KEY_LEFT 0x0020
+#define KEY_UP 0x0040
+#define KEY_DOWN 0x0080
+#define KEY_R 0x0100
+#define KEY_L 0x0200
+#define KEY_ALL 0x03FF
+#define KEYCNT_IRQ 0x4000  // raise IRQ_KEYPAD when the selected keys are pressed
+#define KEYCNT_AND 0x8000  // all of them instead of any of them
+
+class Memory;  // Forward declaration
+class InterruptController;
+
+// The buttons. Whoever drives them (an input movie, a frontend) hands over the pressed keys,
+// active high; KEYINPUT holds them inverted like the hardware does.
+class Keypad {
+ public:
+  Keypad(Memory &memory, InterruptController &interrupts);
+
+  void setPressed(uint16_t keys);
+  uint16_t getPressed() const;
+
+ private:
+  Memory &memory;
+  InterruptController &interrupts;
+};
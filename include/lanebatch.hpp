@@ -0,0 +1,127 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class CPU;  // Forward declaration
+class Memory;
+
+#define LANE_MERGE_INTERVAL 30  // frames between looks for groups that ended up the same
+
+/*
+Lane batch: many copies ("lanes") of one game from one state, each with keys of its own, for
+input search and fuzzing.
+
+- Lockstep (on by default): lanes at the same ARM PC run as bundles of up to LANE_WIDTH, one
+  decode per instruction and its ALU, shifter, condition and branch work done for all of them
+  at once on their registers in structure-of-arrays form (lanevector.hpp, AVX2 where the
+  host has it). Where their branches go different ways the bundle ends and the lanes are
+  regrouped: the ones furthest behind in the code run first, alone or bundled again, so the
+  others can catch up with them where the paths join. Thumb code and lanes on their own run
+  the call loop (CPU::executeinst). So do the lanes' results: a lockstep batch matches runs
+  with the threaded interpreter off, whatever the origin uses.
+- Lanes that are in the same state and hold the same keys are one group, run once on one
+  instance. A group splits when its lanes' keys differ, the lanes with other keys get a copy
+  of its state (on an instance left over from a merge when there is one).
+- Every 'mergeInterval' frames groups that ended up in the same state (same keys since, or
+  the game ignored them) join again: states are hashed, the ones with equal hashes compared.
+- Every instance reads the ROM through a copy-on-write view of the origin's, and WRAM, IWRAM
+  and VRAM through copy-on-write views of one frozen image of the starting state
+  (Memory::shareROM/shareRAM): a lane only has host pages of its own where it wrote. Not with
+  fastmem, its instances get copies.
+
+Every lane ends up exactly where it would on its own, groups, bundles or not.
+*/
+class LaneBatch {
+ public:
+  // 'lanes' lanes, all in the state 'origin' is in now. The origin isn't run, but it has to
+  // outlive the batch and keep its ROM.
+  LaneBatch(CPU &origin, uint32_t lanes, uint32_t mergeInterval = LANE_MERGE_INTERVAL);
+  ~LaneBatch();
+  LaneBatch(const LaneBatch &) = delete;
+  LaneBatch &operator=(const LaneBatch &) = delete;
+
+  // One frame of every lane, 'keys' has a KEY_* mask (active high) for each
+  void runFrame(const uint16_t *keys);
+
+  // Off, every group runs its frames on its own with the origin's interpreter
+  void setLockstep(bool enabled);
+  bool isLockstep() const {
+    return lockstep;
+  }
+
+  uint32_t getLaneCount() const {
+    return (uint32_t)laneGroups.size();
+  }
+  uint32_t getGroupCount() const {
+    return (uint32_t)groups.size();
+  }
+  // The instance a lane is on, shared with the rest of its group: look, don't run or change it
+  CPU &getCPU(uint32_t lane);
+
+  uint64_t getLaneFrames() const {  // frames the lanes got
+    return laneFrames;
+  }
+  uint64_t getGroupFrames() const {  // frames actually emulated
+    return groupFrames;
+  }
+  uint64_t getSplits() const {
+    return splits;
+  }
+  uint64_t getMerges() const {
+    return merges;
+  }
+  // Lockstep: instructions bundles ran (once for all their lanes), how many of those were
+  // executed across the lanes, and the lane instructions bundles covered. The rest of the
+  // lane instructions ran one lane at a time.
+  uint64_t getBundleSteps() const {
+    return bundleSteps;
+  }
+  uint64_t getVectorSteps() const {
+    return vectorSteps;
+  }
+  uint64_t getBundledInstructions() const {
+    return bundledInstructions;
+  }
+  uint64_t getSingleInstructions() const {
+    return singleInstructions;
+  }
+
+ private:
+  struct Instance {
+    std::unique_ptr<Memory> memory;
+    std::unique_ptr<CPU> cpu;
+  };
+
+  std::unique_ptr<Instance> takeInstance();  // a spare one or a new one
+  void split(const uint16_t *keys);
+  void merge();
+  uint64_t hashState(CPU &cpu);
+  void runLockstep();
+
+  CPU &origin;
+  uint32_t mergeInterval;
+  bool lockstep;
+  std::unique_ptr<Instance> base;  // the shared RAM image, never run (nullptr with fastmem)
+  std::vector<std::unique_ptr<Instance>> groups;
+  std::vector<std::unique_ptr<Instance>> spares;  // left over by merges
+  std::vector<uint32_t> laneGroups;               // group of every lane
+  std::vector<uint16_t> groupKeys;                // keys every group holds this frame
+  std::vector<uint32_t> splitFrom;                // split(): group each new one is copied from
+  std::vector<uint64_t> groupHashes;              // merge(): state hash of every group
+  std::vector<uint32_t> mergedInto;               // merge(): group each one is the same as
+  std::vector<uint8_t> state;                     // reused, no allocation once it's big enough
+  std::vector<uint8_t> otherState;
+  std::vector<uint64_t> frameEnds;  // runLockstep(): cycle every group's frame ends at
+  std::vector<uint32_t> running;    // runLockstep(): groups still short of it
+  std::vector<CPU *> bundle;        // runLockstep(): the CPUs at the lowest PC
+  uint64_t frame;
+  uint64_t laneFrames;
+  uint64_t groupFrames;
+  uint64_t splits;
+  uint64_t merges;
+  uint64_t bundleSteps;
+  uint64_t vectorSteps;
+  uint64_t bundledInstructions;
+  uint64_t singleInstructions;
+};
@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdint>
+
+class CPU;  // Forward declaration
+
+#define LANE_WIDTH 8  // lanes in a bundle, 8 32-bit words fill an AVX2 register
+
+// One register of every lane in a bundle. GCC/clang vector extension: the compiler picks the
+// instructions, lanevector.cpp is built for AVX2 and for the baseline (see LANE_TARGETS).
+typedef uint32_t LaneWord __attribute__((vector_size(LANE_WIDTH * 4)));
+
+// The register files of a bundle in structure-of-arrays form: r[n] holds rn of every lane
+struct LaneRegisters {
+  LaneWord r[16];
+  LaneWord cpsr;
+};
+
+/*
+Lockstep execution for lane batches (lanebatch.hpp): CPUs at the same ARM PC fetch the same
+opcode, so it's decoded once and, where it's data processing or a branch, executed for all of
+them at once on their registers in LaneRegisters (what executeArmALU, Shifter and
+checkCondition do to one CPU, done to every lane). Anything else, or lanes whose opcodes
+differ (RAM code), runs lane by lane through ARM::decodeARM in the middle of the bundle.
+Fetch timing, the prefetch buffer and the scheduler stay per lane, so each lane ends up
+exactly where CPU::executeinst would have taken it.
+*/
+namespace LaneVector {
+// Runs 'count' (1 to LANE_WIDTH) CPUs that are at the same PC in ARM state, none halted, each
+// short of its scheduler horizon, until one of them reaches its horizon or their PCs part
+// (a branch taken by some of them, or whatever ran lane by lane). Returns the instructions
+// run, 'vectorSteps' counts the ones executed across the lanes.
+uint32_t runBundle(CPU *const *cpus, uint32_t count, uint64_t &vectorSteps);
+}  // namespace LaneVector
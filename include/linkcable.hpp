@@ -0,0 +1,90 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <vector>
+
+#include "serial.hpp"
+#include "spscqueue.hpp"
+
+class CPU;  // Forward declaration
+
+#define LINK_QUEUE_SIZE 8     // messages in flight from one player to another, 3 at most
+#define LINK_SYNC_MARGIN 512  // more than one instruction can overshoot the horizon by
+
+// One player to another: the parent announcing a transfer, or a player's data for one
+struct LinkMessage {
+  uint64_t end;  // cycle the transfer ends at
+  bool start;    // announcement, no data
+  uint16_t data;
+};
+
+/*
+Link cable: 2 to 4 emulator instances in one process, each on a thread of its own, talking
+through their serial ports (serial.hpp). They aren't kept in lockstep:
+
+Only the parent (player 0) starts transfers, and one that starts at cycle T ends at
+T + getLookahead() at the earliest. The parent publishes its cycle every so often (an
+EVENT_LINK_SYNC), so the children can run freely up to that plus the lookahead (minus a
+margin for the instruction that overshoots it) and know no transfer they haven't heard of
+yet ends before. Only there do they stop for the parent to catch up. The parent never waits
+on that, it runs ahead as far as it likes. At the end of a transfer every player sends its
+data to the others and waits for theirs, that's the one point where they meet.
+
+Messages go through a lock-free single-producer single-consumer queue per ordered pair of
+players. A player that has to wait sleeps on a counter of its own (std::atomic::wait), bumped
+by every message to it and every move of the parent's clock.
+
+Transfers end at the same cycle on every player and carry the data each one had then,
+whichever thread got there first, so linked runs are as deterministic as single ones.
+*/
+class LinkCable {
+ public:
+  // Plugs the serial ports in, the first CPU is the parent. They have to be at the same cycle.
+  LinkCable(const std::vector<CPU *> &players);
+  ~LinkCable();  // unplugs them
+  LinkCable(const LinkCable &) = delete;
+  LinkCable &operator=(const LinkCable &) = delete;
+
+  // Runs every player for 'frames' frames (0 = forever), each on its own thread. Rethrows
+  // what the first one that failed threw.
+  void run(uint64_t frames);
+
+  uint32_t getPlayerCount() const {
+    return playerCount;
+  }
+  // Shortest possible transfer with this many players
+  uint64_t getLookahead() const {
+    return lookahead;
+  }
+
+  // Serial port side, from the player's own thread
+  void publishParentClock(uint64_t cycle);
+  // Cycle the children may run to, UINT64_MAX once the parent stopped
+  uint64_t getChildHorizon() const;
+  // std::runtime_error if the queue is full (a protocol bug)
+  void send(uint32_t from, uint32_t to, const LinkMessage &message);
+  bool peek(uint32_t to, uint32_t from, LinkMessage &message) const;
+  void drop(uint32_t to, uint32_t from);
+  bool hasStopped(uint32_t player) const;
+  // Read the signal, check what to wait for, then wait(player, signal) if it's not there yet
+  uint32_t getSignal(uint32_t player) const;
+  void wait(uint32_t player, uint32_t signal) const;
+
+ private:
+  void runPlayer(uint32_t player, uint64_t frames);
+  void notify(uint32_t player);
+
+  struct alignas(CACHE_LINE_SIZE) Player {
+    CPU *cpu = nullptr;
+    std::atomic<uint32_t> signal{0};
+    std::atomic<bool> stopped{false};
+    std::exception_ptr error;
+  };
+
+  uint32_t playerCount;
+  uint64_t lookahead;
+  Player players[LINK_MAX_PLAYERS];
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> parentClock{0};
+  SpscQueue<LinkMessage, LINK_QUEUE_SIZE> queues[LINK_MAX_PLAYERS][LINK_MAX_PLAYERS];  // [from][to]
+};
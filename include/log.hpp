@@ -0,0 +1,14 @@
+#pragma once
+#include <iostream>
+
+// Per-instruction debug chatter (fetches, dispatch, register dumps).
+// Off by default, --verbose turns it on. Only the call loop logs, so it also turns off the
+// threaded interpreter.
+inline bool verboseLogging = false;
+
+#define DEBUG_LOG(message)                    \
+  do {                                        \
+    if (verboseLogging) {                     \
+      std::cout << message << std::endl;      \
+    }                                         \
+  } while (0)
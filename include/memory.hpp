@@ -1,21 +1,96 @@
 #pragma once
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "hostbuffer.hpp"
+
+class Stats;  // Forward declaration
+class Fastmem;
+class InterruptController;
+class Backup;
+class SerialPort;
+class Debugger;
+enum BackupType : int;
+class StateWriter;
+class StateReader;
+
+// Regions of the memory map, used to index per-region tables
+enum MemoryRegion {
+  REGION_BIOS,
+  REGION_WRAM,
+  REGION_IWRAM,
+  REGION_IO,
+  REGION_PALETTE,
+  REGION_VRAM,
+  REGION_OAM,
+  REGION_ROM,
+  REGION_BACKUP,  // SRAM/Flash/EEPROM, see backup.hpp
+  REGION_COUNT
+};
+
 class Memory {
  private:
-  std::vector<uint8_t> bios;
-  std::vector<uint8_t> wram;
-  std::vector<uint8_t> iwram;
-  std::vector<uint8_t> io;
-  std::vector<uint8_t> palette;
-  std::vector<uint8_t> vram;
-  std::vector<uint8_t> oam;
-  std::vector<uint8_t> rom;
+  HostBuffer bios;
+  HostBuffer wram;
+  HostBuffer iwram;
+  HostBuffer io;
+  HostBuffer palette;
+  HostBuffer vram;
+  HostBuffer oam;
+  HostBuffer rom;
+
+  Stats *stats;  // Optional, per-region access counters
+  InterruptController *interrupts;  // Optional, told about IE/IF/IME/HALTCNT writes
+  SerialPort *serial;               // Optional, told when a transfer is started
+  std::unique_ptr<Fastmem> fastmem;  // Optional, guest address space as one host reservation
+  std::unique_ptr<Backup> backup;    // Optional, the cartridge's save chip
+
+  // Bus timing
+  mutable uint32_t busCycles;     // cycles spent on data accesses since takeBusCycles()
+  mutable bool romDataAccess;     // a data access went to the Game Pak since takeBusCycles()
+  uint8_t accessCycles[REGION_COUNT][3];  // non-sequential cycles of 8/16/32-bit accesses
+  uint8_t romSequentialCycles;            // S cycles of a 16-bit Game Pak access
+  bool prefetchEnabled;                   // WAITCNT bit 14
+  uint32_t mappingGeneration;  // bumped whenever host buffers move (cached pointers go stale)
+  std::vector<uint32_t> pageVersions;  // write counters of the WRAM and IWRAM pages
+  uint64_t videoVersion;               // write counter of everything the picture depends on
+  Debugger *debugger;                  // Optional, told about accesses to watched pages
+  std::vector<uint16_t> watchedPages;  // watchpoints on each page, empty while there are none
+  uint32_t watchedPageCount;           // pages with a watchpoint
+  uint32_t regionWatchedPages[REGION_COUNT];
+  // The buffer the accessors see for each region: nullptr while one of its pages is watched,
+  // which sends them down the slow path (readWatched/writeWatched) from their existing null
+  // test, so the regular path doesn't check for watchpoints at all
+  HostBuffer *accessBuffers[REGION_COUNT];
+
+  void updateWaitstates();
+  void ioWrite(uint32_t offset, uint8_t value);
+  void mapFastmem();
+  // Save chip accesses, 'width' is 0/1/2 for 8/16/32-bit
+  uint32_t readBackup(uint32_t address, int width) const;
+  void writeBackup(uint32_t address, uint32_t value, int width);
+
+  // Per-access bookkeeping, 'width' is 0/1/2 for 8/16/32-bit
+  void countAccess(MemoryRegion region, int width, bool write) const;
+  void noteWrite(MemoryRegion region, uint32_t address);
+  void watchAccess(uint32_t address, uint32_t value, int width, bool write) const;
+  uint32_t readWatched(uint32_t address, int width) const;
+  void writeWatched(uint32_t address, uint32_t value, int width);
+  void updateAccessBuffers();
+
+  // Finds the buffer backing an address, nullptr if nothing is mapped there
+  const HostBuffer *resolve(uint32_t address, size_t &offset, MemoryRegion &region) const;
+  HostBuffer *resolve(uint32_t address, size_t &offset, MemoryRegion &region);
+  // The same for the accessors: also nullptr in a region with a watched page, 'region' is
+  // REGION_COUNT if nothing is mapped there
+  const HostBuffer *resolveAccess(uint32_t address, size_t &offset, MemoryRegion &region) const;
+  HostBuffer *resolveAccess(uint32_t address, size_t &offset, MemoryRegion &region);
 
  public:
   Memory();  // Constructor
+  ~Memory();
   // For ARM mode
   uint32_t readWord(uint32_t address) const;
   void writeWord(uint32_t address, uint32_t value);
@@ -27,10 +102,111 @@ class Memory {
   uint8_t readByte(uint32_t address) const;
   void writeByte(uint32_t address, uint8_t value);
 
+  // Direct access to the host buffer backing a guest address (nullptr for I/O or unmapped).
+  // 'available' is set to the number of bytes left in the region from that address.
+  uint8_t *getHostPointer(uint32_t address, size_t &available);
+
+  // Host pointer to the FETCH_PAGE_SIZE page holding 'address' for the instruction fetch fast
+  // path. 'start'/'length' give the guest range it covers. nullptr for I/O or unmapped.
+  const uint8_t *getFetchPage(uint32_t address, uint32_t &start, uint32_t &length,
+                              MemoryRegion &region) const;
+  uint32_t getMappingGeneration() const {
+    return mappingGeneration;
+  }
+
+  // Counter bumped by every write to the FETCH_PAGE_SIZE page holding 'address', for
+  // dropping decoded code. Only RAM pages count, everything else points at a constant 0.
+  const uint32_t *getPageVersion(uint32_t address) const;
+  // For writes that don't go through the accessors (host pointers)
+  void markWritten(uint32_t address, size_t length);
+  // Bumped by every write to palette RAM, VRAM, OAM or the display registers (not DISPSTAT
+  // and VCOUNT, the PPU's own bookkeeping) and by state loads. Equal values, same picture.
+  uint64_t getVideoVersion() const {
+    return videoVersion;
+  }
+
+  // Timing, 'width' is 0/1/2 for 8/16/32-bit
+  uint32_t getAccessCycles(MemoryRegion region, int width) const {
+    return accessCycles[region][width];
+  }
+  uint32_t getROMSequentialCycles() const {
+    return romSequentialCycles;
+  }
+  bool isPrefetchEnabled() const {
+    return prefetchEnabled;
+  }
+  // Cycles spent on data accesses since the last call
+  uint32_t takeBusCycles(bool &romAccessed) {
+    uint32_t taken = busCycles;
+    romAccessed = romDataAccess;
+    busCycles = 0;
+    romDataAccess = false;
+    return taken;
+  }
+
+  // Switches the accessors to the fastmem reservation, false if the host can't do it.
+  // Accesses fastmem can't serve (I/O, palette, OAM, unmapped) still go the regular way.
+  bool enableFastmem();
+  bool isFastmemEnabled() const {
+    return fastmem != nullptr;
+  }
+  // In a fork()ed child: fastmem's buffers are memfds the parent still writes through, they
+  // get memfds of their own and are mapped again. Heap buffers are copy-on-write already,
+  // without fastmem there's nothing to do. False if the host ran out of memfds.
+  bool unshareAfterFork();
+
   // For both ARM and Thumb modes
   void loadBinFile(const std::string &filename);
+  // A ROM image built in memory (see Emitter)
+  void loadROMData(const uint8_t *data, size_t size);
+  // The ROM of 'base' as a copy-on-write view instead of a copy, for many instances of one
+  // ROM. 'base' has to outlive this and keep its ROM. False (nothing changes) if the host
+  // can't do it or fastmem is on here (its views need a memfd of their own).
+  bool shareROM(Memory &base);
+  // WRAM, IWRAM and VRAM the same way: copy-on-write views of 'base's, so this only has host
+  // pages of its own where it wrote something. Takes on their contents, load a state after
+  // it. 'base' has to outlive this and never be written to again (it's the shared image).
+  bool shareRAM(Memory &base);
   size_t getROMSize() const;
+  const uint8_t *getROMData() const {
+    return rom.data();
+  }
+  // Detects the save chip from the ROM's ID strings and backs it with 'savePath' (in memory
+  // only when empty). After loadBinFile.
+  BackupType attachBackup(const std::string &savePath);
+  Backup *getBackup() {
+    return backup.get();
+  }
   void dumpROM() const;
+
+  void setStats(Stats *s) {
+    stats = s;
+  }
+  void setInterrupts(InterruptController *i) {
+    interrupts = i;
+  }
+  void setSerial(SerialPort *s) {
+    serial = s;
+  }
+  Debugger *getDebugger() const {
+    return debugger;
+  }
+  void setDebugger(Debugger *d) {
+    debugger = d;
+  }
+  // Marks the pages of a range slow (or back) for a watchpoint: unmapped in fastmem, their
+  // regions taken off the regular path. Watched twice needs unwatching twice.
+  void watchPages(uint32_t address, uint32_t length, bool watched);
+
+  // I/O registers as the hardware side sees them: no timing, no side effects
+  uint16_t readIO(uint32_t address) const;
+  void writeIO(uint32_t address, uint16_t value);
+
+  // RAM, I/O, palette, VRAM and OAM for save states. Loading drops decoded code in the RAM
+  // pages that change and picks up the restored WAITCNT. It only writes RAM and VRAM pages
+  // that differ, copy-on-write views (shareRAM) keep the rest shared.
+  void saveState(StateWriter &writer) const;
+  void loadState(StateReader &reader);
 };
 
 // Screen dimensions
@@ -76,6 +252,16 @@ class Memory {
 #define ROM_START 0x08000000
 #define ROM_END 0x09FFFFFF
 
+// On-board RAM, on-chip RAM, palette, VRAM and OAM repeat through the rest of their 16 MB area
+#define MIRROR_END(start) ((start) | 0x00FFFFFF)
+#define VRAM_MIRROR_SIZE 0x20000  // 96 KB + the upper 32 KB again
+
+// Instruction fetch fast path granularity
+#define FETCH_PAGE_SIZE 0x1000
+
+// Game Pak waitstate control
+#define WAITCNT 0x04000204
+
 // Game Pak SRAM
 #define SRAM_START 0x0E000000
 #define SRAM_END 0x0E00FFFF
\ No newline at end of file
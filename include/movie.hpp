@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "sha1.hpp"
+
+/*
+Input movie: the keys held in every frame, for replaying a session exactly.
+
+File layout (little endian):
+  header:    "PBMOVIE" + version byte, SHA-1 of the ROM, u32 frame count, u32 keyframe count
+  inputs:    u16 pressed keys (KEY_* bits, active high) per frame
+  keyframes: u32 frame, u32 raw size, u32 compressed size, compressed save state
+
+A keyframe is the state right before its frame runs, so seeking to frame n loads the last
+keyframe at or before n and plays the inputs from there. Keyframes are optional, a movie
+without any plays from power-on. States are compressed with the trace codec (most of VRAM
+and WRAM is zeros).
+*/
+
+#define MOVIE_MAGIC "PBMOVIE"
+#define MOVIE_VERSION 1
+
+class Movie {
+ public:
+  struct Keyframe {
+    uint32_t frame;
+    uint32_t rawSize;
+    std::vector<uint8_t> compressed;
+  };
+
+  Movie();
+
+  // Throws std::runtime_error if the file can't be read or isn't a movie
+  void load(const std::string &filename);
+  void save(const std::string &filename) const;
+
+  const SHA1::Digest &getROMHash() const {
+    return romHash;
+  }
+  void setROMHash(const SHA1::Digest &hash) {
+    romHash = hash;
+  }
+
+  uint32_t getFrameCount() const {
+    return (uint32_t)inputs.size();
+  }
+  // Nothing is pressed past the end
+  uint16_t getKeys(uint64_t frame) const {
+    return frame < inputs.size() ? inputs[frame] : 0;
+  }
+  void appendKeys(uint16_t keys) {
+    inputs.push_back(keys);
+  }
+
+  // Replaces a keyframe already at that frame
+  void addKeyframe(uint32_t frame, const std::vector<uint8_t> &state);
+  bool hasKeyframe(uint32_t frame) const;
+  // Last keyframe at or before 'frame', nullptr if there's none
+  const Keyframe *findKeyframe(uint64_t frame) const;
+  std::vector<uint8_t> getState(const Keyframe &keyframe) const;
+  size_t getKeyframeCount() const {
+    return keyframes.size();
+  }
+
+ private:
+  SHA1::Digest romHash;
+  std::vector<uint16_t> inputs;
+  std::vector<Keyframe> keyframes;  // sorted by frame
+};
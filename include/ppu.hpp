@@ -0,0 +1,112 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "scheduler.hpp"
+
+// https://problemkaputt.de/gbatek.htm#lcdiodisplaycontrol
+#define DISPCNT 0x04000000
+#define DISPSTAT 0x04000004
+#define VCOUNT 0x04000006
+
+// DISPCNT bits
+#define DISPCNT_MODE_MASK 0x0007
+#define DISPCNT_FRAME_SELECT 0x0010  // second bitmap frame in modes 4 and 5
+#define DISPCNT_FORCED_BLANK 0x0080
+
+// DISPSTAT bits
+#define DISPSTAT_VBLANK 0x0001
+#define DISPSTAT_HBLANK 0x0002
+#define DISPSTAT_VCOUNT_MATCH 0x0004
+#define DISPSTAT_VBLANK_IRQ 0x0008
+#define DISPSTAT_HBLANK_IRQ 0x0010
+#define DISPSTAT_VCOUNT_IRQ 0x0020
+
+// 960 cycles of drawing, 272 of horizontal blank, 160 visible lines out of 228
+#define CYCLES_PER_SCANLINE 1232
+#define HDRAW_CYCLES 960
+#define VISIBLE_SCANLINES 160
+#define SCANLINES_PER_FRAME 228
+
+class Memory;  // Forward declaration
+class InterruptController;
+class FrameRing;
+class Stats;
+
+// Display timing: keeps DISPSTAT/VCOUNT moving on scheduler events and raises the
+// VBlank/HBlank/VCount interrupts. With a FrameRing attached, each visible line is drawn
+// into the ring slot of the current frame when its HBlank starts. Only the bitmap modes
+// (3, 4, 5) are drawn, the tile modes show the backdrop color for now.
+//
+// Drawing is skipped where it can't change anything: a line nothing the picture depends on
+// was written to since it was last drawn (Memory::getVideoVersion()) is copied from a host
+// copy of the last frame, and a frame made only of those keeps its hash. For fast-forward,
+// frameskip leaves whole frames out of the ring; they still run in full (DISPSTAT, VCOUNT,
+// interrupts), only the pixels aren't produced.
+class PPU {
+ public:
+  PPU(Memory &memory, Scheduler &scheduler, InterruptController &interrupts);
+
+  // EVENT_HBLANK or EVENT_SCANLINE, 'when' is the cycle it was scheduled for
+  void handleEvent(EventType type, uint64_t when);
+
+  // nullptr turns drawing off (the default, headless runs don't pay for it). Drawing starts
+  // with the next frame, or right away if no line of this one is drawn yet.
+  void setFrameRing(FrameRing *ring);
+  // After a state load: the frame being drawn belonged to the old state
+  void restartFrame();
+  // Draws one frame out of every skip + 1 (0 draws them all), counting from the next one
+  void setFrameskip(uint32_t skip);
+  // Copying unchanged lines from the last frame instead of drawing them, on by default
+  void setReusingLines(bool enabled);
+  // Optional, drawing is timed as SUBSYSTEM_PPU
+  void setStats(Stats *s) {
+    stats = s;
+  }
+
+  // Frames drawn so far and a hash of the last one (FNV-1a over its pixels), for checking
+  // that two runs show the same thing
+  uint64_t getFramesDrawn() const {
+    return framesDrawn;
+  }
+  uint64_t getFrameHash() const {
+    return frameHash;
+  }
+  uint64_t getFramesSkipped() const {
+    return framesSkipped;
+  }
+  // Lines drawn from video memory and lines copied from the last frame
+  uint64_t getLinesDrawn() const {
+    return linesDrawn;
+  }
+  uint64_t getLinesReused() const {
+    return linesReused;
+  }
+
+ private:
+  void startScanline(uint32_t line, uint64_t when);
+  void updateScanline(uint32_t line);
+  void drawScanline(uint32_t line);
+
+  Memory &memory;
+  Scheduler &scheduler;
+  InterruptController &interrupts;
+  Stats *stats;
+  FrameRing *frameRing;
+  uint32_t *frame;  // pixels of the frame being drawn, nullptr between frames
+  uint64_t framesDrawn;
+  uint64_t frameHash;
+
+  // Frameskip
+  uint32_t frameskip;
+  uint32_t framesToSkip;  // before the next one is drawn
+  uint64_t framesSkipped;
+
+  // Unchanged lines
+  bool reusingLines;
+  std::vector<uint32_t> lastPixels;  // every line as last drawn, allocated with the first frame
+  uint64_t lineVersions[VISIBLE_SCANLINES];  // video version each line was drawn at
+  bool hashStale;  // a line was drawn since frameHash was taken
+  uint64_t linesDrawn;
+  uint64_t linesReused;
+};
@@ -0,0 +1,83 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Guest PC profiler.
+// Exact mode counts every instruction, sampling mode only looks at one instruction every
+// 'sampleInterval' and charges it all the cycles since the previous sample.
+// Calls are tracked from BL so time can be attributed to a call stack (for flamegraphs).
+class Profiler {
+ public:
+  enum class Mode { Exact, Sampling };
+
+  struct Counter {
+    uint64_t executions = 0;
+    uint64_t cycles = 0;
+  };
+
+  Profiler(Mode mode = Mode::Exact, uint32_t sampleInterval = 1000);
+
+  // Called by the CPU before every instruction, 'cycles' is the running cycle count
+  void recordInstruction(uint32_t pc, uint32_t opcode, bool thumb, uint64_t cycles) {
+    if (pc == expectedReturn) {
+      returnFrom();
+    }
+    if (mode == Mode::Sampling) {
+      if (--countdown != 0) {
+        return;
+      }
+      countdown = sampleInterval;
+      sample(pc, cycles);
+      return;
+    }
+    count(pc, opcode, thumb, cycles);
+  }
+
+  // Called on BL, 'returnAddress' is the value left in LR
+  void recordCall(uint32_t from, uint32_t to, uint32_t returnAddress);
+
+  // Sorted hot instruction / block / function tables, the call edges and the most common
+  // pairs of consecutive instructions (candidates for the threaded interpreter's fused pairs)
+  void writeHotSpots(const std::string &filename, size_t limit = 50);
+  // One line per call stack: "frame;frame;frame cycles"
+  void writeFoldedStacks(const std::string &filename);
+
+ private:
+  // Node of the call tree, a path from the root is one call stack
+  struct Frame {
+    uint32_t function;
+    uint32_t parent;
+    uint64_t cycles;
+    std::map<uint32_t, uint32_t> children;  // function -> frame index
+  };
+
+  void count(uint32_t pc, uint32_t opcode, bool thumb, uint64_t cycles);
+  void sample(uint32_t pc, uint64_t cycles);
+  void charge(uint32_t pc, uint64_t executions, uint64_t cycles);
+  void returnFrom();
+  std::string stackName(uint32_t frame) const;
+
+  Mode mode;
+  uint32_t sampleInterval;
+  uint32_t countdown;
+
+  uint32_t lastPC;
+  uint64_t lastCycles;
+  bool started;
+  uint32_t blockStart;
+
+  std::unordered_map<uint32_t, Counter> instructions;  // per guest PC
+  std::unordered_map<uint32_t, Counter> blocks;        // per basic block start
+  std::map<std::pair<uint32_t, uint32_t>, uint64_t> callEdges;
+  const char *lastClass;  // instruction class names are static strings, compared by address
+  std::map<std::pair<const char *, const char *>, uint64_t> pairs;  // exact mode only
+
+  std::vector<Frame> frames;  // frames[0] is the root (code outside any tracked call)
+  uint32_t currentFrame;
+  std::vector<uint32_t> returnStack;  // return addresses of the active calls
+  uint32_t expectedReturn;
+};
@@ -0,0 +1,87 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class CPU;  // Forward declaration
+class Memory;
+class FrameRing;
+
+/*
+Run-ahead: hides the frames of lag many games have by design. Every frame the real one runs
+without drawing, the state is saved, 'frames' more run with the same keys held, only the last
+of them drawn into the ring, then the state is loaded back. What's shown is always 'frames'
+ahead of the real emulation, so a key press shows up that much earlier.
+
+On one core that's frames + 1 frames of emulation plus a save and a load each time. With a
+second core the frames ahead run on a CPU and Memory of their own on a worker thread: after
+its frame the real CPU hands its state over and goes on with the next one while the worker
+loads it and runs ahead. The worker's save chip is in memory only, its writes are thrown away.
+*/
+class RunAhead {
+ public:
+  // The ring gets the frames shown, nullptr draws nothing (only the hashes are kept then)
+  RunAhead(CPU &cpu, uint32_t frames, bool secondCore, FrameRing *ring);
+  ~RunAhead();
+
+  // One real frame with 'keys' held (KEY_* bits, active high), then the frames ahead
+  void runFrame(uint16_t keys);
+  // Waits for the worker to show its last frame
+  void finish();
+
+  // The last frame shown: its number (frames since power-on, counting from 0) and pixel hash.
+  // With a second core it can be from the runFrame() before the last one.
+  uint64_t getShownFrame() const {
+    return shownFrame;
+  }
+  uint64_t getShownHash() const {
+    return shownHash;
+  }
+  uint64_t getFramesShown() const {
+    return framesShown;
+  }
+
+  // Average host time of one runFrame() and of the state save and load in it
+  double getAverageFrameMs() const;
+  double getAverageSaveUs() const;
+  double getAverageLoadUs() const;
+
+ private:
+  // Runs the frames ahead on 'target' from 'state' and leaves what it showed in result*
+  void runAhead(CPU &target, const std::vector<uint8_t> &state);
+  void collect();  // result* to shown*
+  void workerLoop();
+
+  CPU &cpu;
+  uint32_t frames;
+  FrameRing *ring;
+
+  std::vector<uint8_t> states[2];  // one being written while the worker loads the other
+  uint32_t current;
+  uint64_t shownFrame;
+  uint64_t shownHash;
+  uint64_t framesShown;
+  uint64_t resultFrame;
+  uint64_t resultHash;
+  bool resultDrawn;
+
+  uint64_t steps;
+  double frameSeconds;
+  double saveSeconds;
+  double loadSeconds;
+
+  // Second core
+  std::unique_ptr<Memory> workerMemory;
+  std::unique_ptr<CPU> workerCPU;
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable changed;
+  bool pending;  // states[job] is waiting for the worker or being run ahead from
+  uint32_t job;
+  bool stopping;
+  std::exception_ptr error;  // thrown on the worker, rethrown by the next runFrame()/finish()
+};
@@ -0,0 +1,72 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define SAVE_FLUSH_DEBOUNCE_MS 250   // quiet time after the last write before syncing
+#define SAVE_FLUSH_MAX_DELAY_MS 2000  // sync at least this often while writes keep coming
+
+/*
+Bytes of a cartridge save, mapped straight from the file (MAP_SHARED), so a write from the
+game is a store to host memory and the kernel owns the copy on disk. Getting it onto the
+disk for sure (msync, which is the fsync) happens on a background thread once the game has
+stopped writing for SAVE_FLUSH_DEBOUNCE_MS, so a game that saves every frame costs one sync
+every SAVE_FLUSH_MAX_DELAY_MS at most and emulation never waits on the disk.
+
+Without a path (or off Linux) the bytes live on the heap; off Linux the file is written out
+in one go when the SaveFile goes away.
+*/
+class SaveFile {
+ public:
+  // A missing file (or the part past its end) starts out as 'fill'
+  SaveFile(const std::string &path, size_t size, uint8_t fill);
+  ~SaveFile();
+  SaveFile(const SaveFile &) = delete;
+  SaveFile &operator=(const SaveFile &) = delete;
+
+  uint8_t *data() {
+    return bytes;
+  }
+  const uint8_t *data() const {
+    return bytes;
+  }
+  size_t size() const {
+    return length;
+  }
+  const std::string &getPath() const {
+    return path;
+  }
+
+  // After every write, cheap enough for each byte: wakes the flusher only when it's idle
+  void markDirty() {
+    writes.fetch_add(1, std::memory_order_relaxed);
+    if (!dirty.load(std::memory_order_relaxed) && !dirty.exchange(true)) {
+      std::lock_guard<std::mutex> lock(mutex);
+      changed.notify_one();
+    }
+  }
+
+  uint64_t getSyncCount() const {
+    return syncs.load(std::memory_order_relaxed);
+  }
+
+ private:
+  void flusherLoop();
+  void sync();
+
+  std::string path;
+  uint8_t *bytes;
+  size_t length;
+  bool mapped;  // bytes is a file mapping, otherwise heap
+  std::atomic<uint64_t> writes;
+  std::atomic<bool> dirty;
+  std::atomic<uint64_t> syncs;
+  bool stopping;  // under mutex
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::thread flusher;
+};
@@ -0,0 +1,76 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+/*
+Save states: everything the emulation depends on, so loading one and running on gives the
+same cycles, registers and frames as the run it was taken from.
+
+Layout (host endian, only meant for the machine that wrote it):
+  header:     "PBSTATE" + version byte
+  CPU:        r0-r15, CPSR, SPSR, banked registers, cycles, HLE IntrWait, prefetch buffer
+  interrupts: pending, halted
+  scheduler:  due cycle of every event type
+  memory:     WRAM, IWRAM, I/O, palette, VRAM, OAM
+  backup:     whether there's a save chip, then its state and contents
+
+ROM and BIOS aren't in it, a state only makes sense with the ROM it was taken with.
+Host-side caches (decoded blocks, fetch page) aren't saved. Loading only drops decoded code
+in RAM pages the state changes, and writing into a cleared vector that already grew to a
+state's size doesn't allocate, so save/load can run every frame (run-ahead).
+*/
+
+#define SAVE_STATE_MAGIC "PBSTATE"
+#define SAVE_STATE_VERSION 3
+
+class StateWriter {
+ public:
+  StateWriter(std::vector<uint8_t> &out) : out(out) {}
+
+  template <typename T>
+  void put(const T &value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    putBytes(&value, sizeof(T));
+  }
+  void putBytes(const void *data, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    out.insert(out.end(), bytes, bytes + size);
+  }
+
+ private:
+  std::vector<uint8_t> &out;
+};
+
+class StateReader {
+ public:
+  StateReader(const uint8_t *data, size_t size) : data(data), size(size), position(0) {}
+
+  template <typename T>
+  void get(T &value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    getBytes(&value, sizeof(T));
+  }
+  void getBytes(void *target, size_t length) {
+    std::memcpy(target, take(length), length);
+  }
+  // The next 'length' bytes in place, for comparing before copying
+  const uint8_t *take(size_t length) {
+    if (length > size - position) {
+      throw std::runtime_error("StateReader::take: state is truncated");
+    }
+    position += length;
+    return data + position - length;
+  }
+  bool atEnd() const {
+    return position == size;
+  }
+
+ private:
+  const uint8_t *data;
+  size_t size;
+  size_t position;
+};
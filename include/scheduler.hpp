@@ -0,0 +1,69 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+class StateWriter;  // Forward declaration
+class StateReader;
+
+// Things that happen at a known cycle instead of being polled every instruction
+enum EventType {
+  EVENT_IRQ,        // an enabled interrupt is pending, see InterruptController
+  EVENT_HBLANK,     // horizontal blank of the current scanline starts
+  EVENT_SCANLINE,   // next scanline (VCOUNT++)
+  EVENT_SERIAL,     // a serial transfer ends
+  EVENT_LINK_SYNC,  // linked: time to check on the other players, see LinkCable
+  EVENT_COUNT
+};
+
+#define SCHEDULER_NEVER UINT64_MAX
+
+// Min-heap of events, at most one pending per type (rescheduling replaces it).
+// The CPU runs to getHorizon(), the earlier of its budget end and the next event, so
+// scheduling something earlier breaks it out of its inner loop at the next instruction.
+class Scheduler {
+ public:
+  Scheduler();
+
+  void schedule(EventType type, uint64_t when);
+  void cancel(EventType type);
+  bool isScheduled(EventType type) const {
+    return due[type] != SCHEDULER_NEVER;
+  }
+  uint64_t getNextEvent();  // SCHEDULER_NEVER when nothing is scheduled
+
+  // Removes the earliest event if it's due at 'now', false if nothing is
+  bool popDue(uint64_t now, EventType &type, uint64_t &when);
+
+  // Where the CPU loop has to stop, the interpreters hold on to the reference
+  const uint64_t &getHorizon() const {
+    return horizon;
+  }
+  void setBudgetEnd(uint64_t end);
+  // Makes the CPU loop return after the current instruction (halt), the next popDue() puts
+  // the horizon back
+  void breakOut() {
+    horizon = 0;
+  }
+
+  // Only the due cycles, the heap is built again on load
+  void saveState(StateWriter &writer) const;
+  void loadState(StateReader &reader);
+
+ private:
+  struct Entry {
+    uint64_t when;
+    EventType type;
+
+    bool operator>(const Entry &other) const {  // earliest on top of the heap
+      return when > other.when;
+    }
+  };
+
+  void dropStale();
+  void updateHorizon();
+
+  std::vector<Entry> heap;  // may hold replaced entries, skipped when they surface
+  uint64_t due[EVENT_COUNT];
+  uint64_t budgetEnd;
+  uint64_t horizon;
+};
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+
+#include "scheduler.hpp"
+
+// https://problemkaputt.de/gbatek.htm#siomultiplayermode
+#define SIOMULTI0 0x04000120  // data of player 0-3 after a transfer
+#define SIOCNT 0x04000128
+#define SIOMLT_SEND 0x0400012A  // what this one sends
+#define RCNT 0x04000134
+
+// SIOCNT bits (multiplayer mode)
+#define SIOCNT_BAUD_MASK 0x0003
+#define SIOCNT_CHILD 0x0004  // SI terminal, 0 on the parent
+#define SIOCNT_READY 0x0008  // SD, every player is connected
+#define SIOCNT_ID_MASK 0x0030
+#define SIOCNT_ID_SHIFT 4
+#define SIOCNT_ERROR 0x0040
+#define SIOCNT_BUSY 0x0080  // write 1 on the parent to start a transfer
+#define SIOCNT_MODE_MASK 0x3000
+#define SIOCNT_MODE_MULTIPLAYER 0x2000
+#define SIOCNT_IRQ 0x4000
+#define SIOCNT_PORT_BITS 0x00FC  // the port's, writes leave them alone
+#define RCNT_GENERAL_PURPOSE 0x8000  // off for the SIO modes
+
+#define LINK_MAX_PLAYERS 4
+#define SIO_CLOCK 16777216      // cycles per second
+#define SIO_BITS_PER_PLAYER 18  // start bit, 16 data bits, stop bit
+
+class CPU;  // Forward declaration
+class Memory;
+class InterruptController;
+class LinkCable;
+
+// Serial port, multiplayer mode only. The parent (player 0) starts a transfer by setting the
+// busy bit; when it ends, SIOMULTI0-3 on every player hold the SIOMLT_SEND each player had at
+// that cycle (0xFFFF for nobody), the busy bit clears and IRQ_SERIAL comes if enabled.
+// Unplugged, a GBA is a parent on its own and only gets its own data back.
+class SerialPort {
+ public:
+  SerialPort(CPU &cpu, Memory &memory, Scheduler &scheduler, InterruptController &interrupts);
+
+  // Plugs into a cable as 'player', nullptr unplugs. Called by LinkCable.
+  void attach(LinkCable *cable, uint32_t player);
+
+  // SIOCNT was written with the busy bit set
+  void start();
+  // EVENT_SERIAL (end of a transfer) or EVENT_LINK_SYNC
+  void handleEvent(EventType type, uint64_t when);
+
+  // Length of a transfer at a baud rate setting (SIOCNT bits 0-1)
+  static uint64_t transferCycles(uint32_t baud, uint32_t players);
+
+ private:
+  bool isMultiplayer() const;
+  void finishTransfer(uint64_t when);
+  void sync(uint64_t when);
+  void receive();  // everything the other players sent that can be taken now
+
+  CPU &cpu;
+  Memory &memory;
+  Scheduler &scheduler;
+  InterruptController &interrupts;
+  LinkCable *cable;
+  uint32_t player;
+
+  // Data of the other players for the transfer ending at receivedFor, not taken yet
+  bool received[LINK_MAX_PLAYERS];
+  uint16_t receivedData[LINK_MAX_PLAYERS];
+  uint64_t receivedFor[LINK_MAX_PLAYERS];
+};
@@ -0,0 +1,13 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// SHA-1, only used to identify ROMs (nothing security related)
+namespace SHA1 {
+typedef std::array<uint8_t, 20> Digest;
+
+Digest hash(const uint8_t *data, size_t size);
+std::string toHex(const Digest &digest);
+}  // namespace SHA1
@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+class CPU;  // Forward declaration
+
+/*
+Snapshot farm: boots a game once, up to a frame or a PC, and runs every job of a test farm
+from there in a fork() of the process, so no job pays for the BIOS and the intro again.
+
+fork() hands each job the whole warm machine copy-on-write, decoded blocks included: only
+the pages a job dirties get copied, so starting one takes about as long as the fork itself,
+however long the boot was. With fastmem the RAM the reservation maps is shared with the
+parent (memfds), a job copies that into memfds of its own first (Memory::unshareAfterFork).
+
+The save chip has to be in memory only, and nothing else may run on other threads while
+jobs are forked (run-ahead, link cables, frame writers): a child only gets the forking one.
+Linux only, run() throws elsewhere.
+*/
+class SnapshotFarm {
+ public:
+  // One job, in its own process on the warm CPU. The number it returns is its exit status.
+  using Job = std::function<int(CPU &cpu, uint32_t job)>;
+
+  explicit SnapshotFarm(CPU &cpu);
+
+  // Boots and runs 'frames' frames
+  void warmUp(uint64_t frames);
+  // Boots and runs until the CPU is about to run the instruction at 'pc', false if it didn't
+  // get there within 'maxFrames' frames (the CPU is left wherever it got to)
+  bool warmUpTo(uint32_t pc, uint64_t maxFrames);
+
+  // Runs jobs 0 to count - 1, at most 'workers' at a time. Returns their exit statuses,
+  // 128 + the signal for one that got killed.
+  std::vector<int> run(uint32_t count, uint32_t workers, const Job &job);
+
+  // Host time from fork() to a job starting, in the child, over the jobs of the last run()
+  double getAverageStartUs() const;
+  double getMaxStartUs() const {
+    return maxStartUs;
+  }
+
+ private:
+  CPU &cpu;
+  double totalStartUs;
+  double maxStartUs;
+  uint32_t jobsStarted;
+};
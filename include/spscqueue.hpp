@@ -0,0 +1,44 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+#define CACHE_LINE_SIZE 64
+
+// Fixed-size ring between exactly one producer thread and one consumer thread. Nothing
+// locks or allocates; each side owns one index and only reads the other's, and the two sit
+// on cache lines of their own so the threads don't fight over them.
+template <typename T, size_t Capacity>
+class SpscQueue {
+  static_assert((Capacity & (Capacity - 1)) == 0, "SpscQueue: capacity has to be a power of 2");
+
+ public:
+  // Producer side, false if it's full
+  bool push(const T &value) {
+    size_t tail = writeIndex.load(std::memory_order_relaxed);
+    if (tail - readIndex.load(std::memory_order_acquire) == Capacity) {
+      return false;
+    }
+    slots[tail % Capacity] = value;
+    writeIndex.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side: the oldest value without taking it out, false if it's empty
+  bool peek(T &value) const {
+    size_t head = readIndex.load(std::memory_order_relaxed);
+    if (head == writeIndex.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = slots[head % Capacity];
+    return true;
+  }
+  // Consumer side, after a peek() that returned true
+  void drop() {
+    readIndex.store(readIndex.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+ private:
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> writeIndex{0};
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> readIndex{0};
+  alignas(CACHE_LINE_SIZE) T slots[Capacity];
+};
@@ -0,0 +1,134 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "memory.hpp"
+
+// Counter owned by the emulation thread.
+// Bumped with a relaxed load + store (a plain add, no locked instruction) but still
+// readable from other threads without tearing.
+struct StatCounter {
+  std::atomic<uint64_t> value{0};
+
+  void add(uint64_t n = 1) {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+  void set(uint64_t n) {
+    value.store(n, std::memory_order_relaxed);
+  }
+  uint64_t get() const {
+    return value.load(std::memory_order_relaxed);
+  }
+};
+
+// Parts of the core that get their host time measured per frame. A scope opened inside
+// another one is taken out of it, so the CPU's time is what's left once the PPU, the audio
+// and the link cable had theirs.
+enum Subsystem {
+  SUBSYSTEM_CPU,
+  SUBSYSTEM_PPU,        // drawing scanlines
+  SUBSYSTEM_AUDIO,      // resampling and queueing a frame's samples (--audio-pacing)
+  SUBSYSTEM_LINK_WAIT,  // blocked on another instance (--link)
+  SUBSYSTEM_COUNT
+};
+
+#define STATS_MAX_DISPATCH_ENTRIES 32
+
+// Runtime performance counters of one emulator instance
+class Stats {
+ public:
+  // Bus
+  StatCounter regionReads[REGION_COUNT];
+  StatCounter regionWrites[REGION_COUNT];
+  StatCounter fastmemFallbacks;  // accesses fastmem handed to the regular bus (I/O, faults)
+
+  // Decoder
+  StatCounter armDispatch[STATS_MAX_DISPATCH_ENTRIES];  // per armDispatchTable entry
+  StatCounter armInstructions;
+  StatCounter thumbInstructions;
+  StatCounter blockCacheHits;
+  StatCounter blockCacheMisses;
+  StatCounter blockCacheLoads;  // misses served from the on-disk cache
+  StatCounter blockCacheDiscovered;  // misses served by the code discovery threads
+  StatCounter idleLoopSkips;
+  StatCounter flagCheckFailures;  // --validate-flags: dead flags that were read after all
+
+  // Interrupts
+  StatCounter interruptsTaken;
+  StatCounter haltedCycles;  // skipped while the CPU waited for an interrupt
+
+  // Serial port
+  StatCounter serialTransfers;
+  StatCounter linkWaits;  // times a linked instance had to wait for another one
+
+  // Audio (--audio-pacing), both written by the audio device's thread
+  StatCounter audioUnderruns;
+  StatCounter audioLatencyMicros;  // queued in front of the newest sample, last measured
+
+  // Frames
+  StatCounter frames;
+  StatCounter timeToFirstFrameNanos;  // host time from reset to the end of frame 1
+  StatCounter schedulerEvents;           // total
+  StatCounter schedulerEventsLastFrame;  // events dispatched during the last frame
+  StatCounter hostNanos[SUBSYSTEM_COUNT];           // total
+  StatCounter hostNanosLastFrame[SUBSYSTEM_COUNT];  // host time spent in the last frame
+
+  // Frame bookkeeping, called by the frame loop
+  void beginFrame();
+  void endFrame();
+  // ScopedTimer's bookkeeping: the subsystem being timed, and handing time back to the
+  // one around it. Time spent between frames goes to the next one.
+  Subsystem enterScope(Subsystem subsystem) {
+    Subsystem outer = timing;
+    timing = subsystem;
+    return outer;
+  }
+  void leaveScope(Subsystem subsystem, Subsystem outer, uint64_t nanos) {
+    timing = outer;
+    frameNanos[subsystem] += nanos;
+    if (outer != SUBSYSTEM_COUNT) {
+      frameNanos[outer] -= nanos;
+    }
+  }
+
+  // Snapshot of every counter, safe to call from any thread
+  std::string toJSON() const;
+  void writeJSON(const std::string &filename) const;
+
+  // SIGUSR1 asks for a dump, the frame loop writes it out at the next frame boundary
+  static void installSignalHandler();
+  static bool dumpRequested();
+
+ private:
+  std::chrono::steady_clock::time_point created = std::chrono::steady_clock::now();
+  uint64_t frameStartEvents = 0;
+  uint64_t frameNanos[SUBSYSTEM_COUNT] = {};
+  Subsystem timing = SUBSYSTEM_COUNT;  // innermost open scope, SUBSYSTEM_COUNT for none
+};
+
+// Adds the host time of a scope to a subsystem (and takes it out of the enclosing one).
+// A null Stats times nothing.
+class ScopedTimer {
+ public:
+  ScopedTimer(Stats *stats, Subsystem subsystem) : stats(stats), subsystem(subsystem) {
+    if (stats != nullptr) {
+      outer = stats->enterScope(subsystem);
+      start = std::chrono::steady_clock::now();
+    }
+  }
+  ~ScopedTimer() {
+    if (stats != nullptr) {
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      stats->leaveScope(subsystem, outer,
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+  }
+
+ private:
+  Stats *stats;
+  Subsystem subsystem;
+  Subsystem outer = SUBSYSTEM_COUNT;
+  std::chrono::steady_clock::time_point start;
+};
@@ -0,0 +1,107 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+Binary execution trace, for diffing two runs instruction by instruction.
+
+File layout:
+  header: "PBTRACE" + version byte
+  blocks: u32 raw size, u32 compressed size, u32 record count, compressed bytes
+
+Record layout (inside a block, before compression):
+  flags byte: bit 0 = PC is not the next sequential instruction
+              bit 1 = Thumb (16-bit opcode)
+              bit 2 = register mask follows
+  [zigzag varint PC delta from the expected PC]
+  opcode (4 or 2 bytes, little endian)
+  [varint mask of changed registers, bit 16 = CPSR]
+  [zigzag varint (new - old) per changed register, lowest first]
+
+Registers are the state after the instruction executed. Every block starts from the
+state at the end of the previous one, so a reader has to go through blocks in order.
+*/
+
+#define TRACE_MAGIC "PBTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BLOCK_SIZE (1 << 20)  // raw bytes per block
+#define TRACE_REGISTERS 17          // r0-r15 + CPSR
+
+struct TraceRecord {
+  uint32_t pc;
+  uint32_t opcode;
+  bool thumb;
+  uint32_t registers[TRACE_REGISTERS];  // full state after the instruction
+  uint32_t changedMask;
+};
+
+namespace TraceCodec {
+// LZ-style byte compressor for trace blocks
+void compress(const std::vector<uint8_t> &in, std::vector<uint8_t> &out);
+bool decompress(const uint8_t *in, size_t inSize, std::vector<uint8_t> &out, size_t outSize);
+}  // namespace TraceCodec
+
+// Collects records on the emulation thread, compresses and writes them on a background thread
+class TraceWriter {
+ public:
+  TraceWriter(const std::string &filename);
+  ~TraceWriter();
+
+  void record(uint32_t pc, uint32_t opcode, bool thumb, const uint32_t *r, uint32_t cpsr);
+  void close();
+
+  uint64_t getRecordCount() const {
+    return records;
+  }
+
+ private:
+  void putVarint(uint64_t value);
+  void submitBlock();
+  void writerLoop();
+
+  std::ofstream file;
+  std::vector<uint8_t> block;
+  uint32_t blockRecords;
+  uint64_t records;
+
+  uint32_t expectedPC;
+  uint32_t previous[TRACE_REGISTERS];
+
+  // Filled blocks waiting for the writer thread
+  std::mutex queueLock;
+  std::condition_variable queueChanged;
+  std::deque<std::pair<std::vector<uint8_t>, uint32_t>> queue;
+  std::vector<std::vector<uint8_t>> spare;  // recycled buffers
+  bool closing;
+  std::thread writer;
+};
+
+class TraceReader {
+ public:
+  TraceReader(const std::string &filename);
+
+  // false at the end of the trace
+  bool next(TraceRecord &record);
+
+  uint64_t getIndex() const {
+    return index;
+  }
+
+ private:
+  bool loadBlock();
+  uint64_t getVarint();
+
+  std::ifstream file;
+  std::vector<uint8_t> compressed;
+  std::vector<uint8_t> block;
+  size_t position;
+  uint64_t index;
+  uint32_t expectedPC;
+  uint32_t state[TRACE_REGISTERS];
+};
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+Synthetic stress ROMs for the benchmarks, built with the Emitter. Each one is an endless loop
+leaning on one part of the interpreter:
+  alu        random data processing (immediates, shifted registers, S, conditions) and MUL
+  ls-<region> word and byte loads/stores streaming through a window of one memory region
+  ldm-stm    calls with STMDB/LDMIA prologues and epilogues, and LDM/STM block copies
+  branches   dense forward branches on counter bits, short backward loops, calls
+  modes      MSR switches through IRQ, SVC, FIQ and System, ARM to Thumb and back
+  thumb      a Thumb loop with calls
+  link       ALU work between multiplayer serial transfers, the parent starts them back to
+             back (for linked instances, alone it only talks to itself)
+They start in ARM state, system mode, with the stacks the reset leaves.
+*/
+
+enum WorkloadKind {
+  WORKLOAD_ALU,
+  WORKLOAD_LOAD_STORE,
+  WORKLOAD_BLOCK_TRANSFER,
+  WORKLOAD_BRANCHES,
+  WORKLOAD_MODES,
+  WORKLOAD_THUMB,
+  WORKLOAD_LINK,
+};
+
+namespace Workload {
+struct Info {
+  const char *name;
+  WorkloadKind kind;
+  uint32_t region;  // load/store only: base of the region streamed through
+  uint32_t window;  // bytes of it that get touched
+  bool writable;
+};
+
+struct Options {
+  uint32_t size = 64;  // instructions (or branch sites, or transfers) per loop iteration
+  uint32_t seed = 1;   // for the random instruction mixes
+};
+
+const std::vector<Info> &list();
+// nullptr if there's no workload called 'name'
+const Info *find(const std::string &name);
+// The ROM image, std::runtime_error if 'options' can't be encoded
+std::vector<uint8_t> build(const Info &info, const Options &options);
+}  // namespace Workload
@@ -1,11 +1,25 @@
 #include "../include/arm.hpp"
 
+#include <bit>
+#include <cstdio>
 #include <iostream>
+#include <stdexcept>
 
+#include "../include/bios.hpp"
+#include "../include/blockcache.hpp"
 #include "../include/cpu.hpp"
+#include "../include/log.hpp"
 #include "../include/memory.hpp"
+#include "../include/profiler.hpp"
+#include "../include/trace.hpp"
 #include "arm.hpp"
 
+#if __has_include("decoderhash.hpp")
+#include "decoderhash.hpp"  // generated by CMake
+#else
+#define PLUSBOY_DECODER_HASH 0  // not built with CMake, DECODER_ANALYSIS_VERSION has to do
+#endif
+
 namespace ARM {
 
 // Wrappers to match InstructionHandler type
@@ -13,6 +27,10 @@ void wrappedExecuteArmBranch(CPU* cpu, Memory* memory, uint32_t inst) {
   executeArmBranch(cpu, inst);
 }
 
+void wrappedExecuteArmBranchExchange(CPU* cpu, Memory* memory, uint32_t inst) {
+  executeArmBranchExchange(cpu, inst);
+}
+
 void wrappedExecuteArmBranchLink(CPU* cpu, Memory* memory, uint32_t inst) {
   executeArmBranchLink(cpu, inst);
 }
@@ -21,6 +39,10 @@ void wrappedExecuteArmALU(CPU* cpu, Memory* memory, uint32_t inst) {
   executeArmALU(cpu, inst);
 }
 
+void wrappedExecuteArmALUNoFlags(CPU* cpu, Memory* memory, uint32_t inst) {
+  executeArmALUNoFlags(cpu, inst);
+}
+
 void wrappedExecuteArmMultiply(CPU* cpu, Memory* memory, uint32_t inst) {
   executeArmMultiply(cpu, inst);
 }
@@ -30,44 +52,247 @@ void wrappedExecuteArmUndefined(CPU* cpu, Memory* memory, uint32_t inst) {
 }
 
 void wrappedExecuteArmSWI(CPU* cpu, Memory* memory, uint32_t inst) {
-  executeArmSoftwareInterrupt(inst);
+  executeArmSoftwareInterrupt(cpu, memory, inst);
 }
 
-static const InstructionEntry armDispatchTable[] = {
-    {0x0FFFFFF0, 0x012FFF10, wrappedExecuteArmBranch, "BX"},
-    {0x0FBF0FFF, 0x010F0000, executeArmMRS, "MRS"},
-    {0x0FBFF000, 0x0129F000, executeArmMSRregister, "MSR(Register)"},
-    {0x0DBFF000, 0x0320F000, executeArmMSRimm, "MSR(Immediate)"},
-    {0x0FF00FF0, 0x01000090, executeArmSWP, "SWP"},
-    {0x0FC000F0, 0x00000090, wrappedExecuteArmMultiply, "MUL/MLA"},
-    {0x0F8000F0, 0x00800090, executeArmMultiplyLong, "Multiply Long"},
-    {0x0E4000F0, 0x004000B0, executeArmHalfWord, "Halfword/Sign Transfer"},
+// Rows: label, mask, pattern, handler, name. First match wins, the last row is the fallback.
+// Shared by the dispatch table and the threaded interpreter below. ALU_NO_FLAGS never
+// matches, the block decoder puts it in place of ALU when nothing reads the flags it sets.
+#define ARM_DISPATCH_TABLE(X)                                                                  \
+  X(BX, 0x0FFFFFF0, 0x012FFF10, wrappedExecuteArmBranchExchange, "BX")                         \
+  X(MRS, 0x0FBF0FFF, 0x010F0000, executeArmMRS, "MRS")                                         \
+  X(MSR_REGISTER, 0x0FB0FFF0, 0x0120F000, executeArmMSRregister, "MSR(Register)")              \
+  X(MSR_IMMEDIATE, 0x0FB0F000, 0x0320F000, executeArmMSRimm, "MSR(Immediate)")                 \
+  X(SWP, 0x0FF00FF0, 0x01000090, executeArmSWP, "SWP")                                         \
+  X(MULTIPLY, 0x0FC000F0, 0x00000090, wrappedExecuteArmMultiply, "MUL/MLA")                    \
+  X(MULTIPLY_LONG, 0x0F8000F0, 0x00800090, executeArmMultiplyLong, "Multiply Long")            \
+  X(HALFWORD, 0x0E4000F0, 0x004000B0, executeArmHalfWord, "Halfword/Sign Transfer")            \
+  X(BRANCH, 0x0F000000, 0x0A000000, wrappedExecuteArmBranch, "Branch")                         \
+  X(BRANCH_LINK, 0x0F000000, 0x0B000000, wrappedExecuteArmBranchLink, "Branch with Link")      \
+  X(LOAD_STORE, 0x0C000000, 0x04000000, executeArmLoadStore, "Load/Store")                     \
+  X(BLOCK_TRANSFER, 0x0C000000, 0x08000000, executeArmBlockTransfer, "Block Transfer")         \
+  X(SWI, 0x0F000000, 0x0F000000, wrappedExecuteArmSWI, "SWI")                                  \
+  X(ALU, 0x0C000000, 0x00000000, wrappedExecuteArmALU, "ALU")                                  \
+  X(ALU_NO_FLAGS, 0x00000000, 0xFFFFFFFF, wrappedExecuteArmALUNoFlags, "ALU(Flags Dead)")      \
+  X(UNDEFINED, 0x00000000, 0x00000000, wrappedExecuteArmUndefined, "Undefined")
+
+// Pairs the block decoder runs as one step in the threaded interpreter, see fusedHandler().
+// Rows: label, handler (taking the ThreadedState), name. Their indices follow the table above.
+#define ARM_FUSED_TABLE(X)                          \
+  X(COMPARE_BRANCH, fusedFlagsBranch, "CMP+B")      \
+  X(ALU_FLAGS_BRANCH, fusedFlagsBranch, "ALUS+B")   \
+  X(MOV_ORR, fusedMovOrr, "MOV+ORR")                \
+  X(LOAD_BX, fusedLoadBranchExchange, "LDR+BX")
+
+#define ARM_TABLE_ENTRY(label, mask, pattern, handler, name) {mask, pattern, handler, name},
+static const InstructionEntry armDispatchTable[] = {ARM_DISPATCH_TABLE(ARM_TABLE_ENTRY)};
 
-    {0x0E000000, 0x0A000000, wrappedExecuteArmBranch, "Branch"},
-    {0x0E000000, 0x0B000000, wrappedExecuteArmBranchLink, "Branch with Link"},
-    {0x0C000000, 0x04000000, executeArmLoadStore, "Load/Store"},
-    {0x0C000000, 0x08000000, executeArmBlockTransfer, "Block Transfer"},
-    {0x0F000000, 0x0F000000, wrappedExecuteArmSWI, "SWI"},
-    {0x0C000000, 0x00000000, wrappedExecuteArmALU, "ALU"},
+#define ARM_HANDLER_INDEX(label, mask, pattern, handler, name) HANDLER_##label,
+#define ARM_FUSED_INDEX(label, handler, name) HANDLER_##label,
+enum HandlerIndex {
+  ARM_DISPATCH_TABLE(ARM_HANDLER_INDEX) ARM_FUSED_TABLE(ARM_FUSED_INDEX) HANDLER_COUNT
+};
+static_assert(HANDLER_COUNT <= STATS_MAX_DISPATCH_ENTRIES, "Stats::armDispatch too small");
 
-    // Fallback
-    {0x00000000, 0x00000000, wrappedExecuteArmUndefined, "Undefined"}};
+#define ARM_FUSED_NAME(label, handler, name) name,
+static const char* const fusedNames[] = {ARM_FUSED_TABLE(ARM_FUSED_NAME)};
 
 void decodeARM(CPU* cpu, Memory* memory, uint32_t inst) {
-  std::cout << "ARM inst: 0x" << std::hex << inst << std::endl;
+  DEBUG_LOG("ARM inst: 0x" << std::hex << inst);
   if (!checkCondition(cpu, inst) || inst == 0) {
     return;
   }
 
-  for (const auto& entry : armDispatchTable) {
+  uint8_t index = decodeHandler(inst);
+  const InstructionEntry& entry = armDispatchTable[index];
+  DEBUG_LOG("Dispatch: " << entry.name);
+  cpu->getStats().armDispatch[index].add();
+  entry.handler(cpu, memory, inst);
+}
+
+uint8_t decodeHandler(uint32_t inst) {
+  for (size_t i = 0; i < dispatchTableSize(); ++i) {
+    const InstructionEntry& entry = armDispatchTable[i];
     if ((inst & entry.mask) == entry.pattern) {
-      std::cout << "Dispatch: " << entry.name << std::endl;
-      entry.handler(cpu, memory, inst);
-      return;
+      return (uint8_t)i;
+    }
+  }
+  return (uint8_t)(dispatchTableSize() - 1);  // never reached, the fallback matches everything
+}
+
+bool isALU(uint32_t inst) {
+  return decodeHandler(inst) == HANDLER_ALU;
+}
+
+// FNV-1a over the table and the analysis version/sources, saved decode results are only
+// reused while this matches
+uint32_t decoderFingerprint() {
+  uint32_t hash = 2166136261u;
+  auto mix = [&hash](uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+      hash = (hash ^ ((value >> (i * 8)) & 0xFF)) * 16777619u;
+    }
+  };
+  for (const InstructionEntry& entry : armDispatchTable) {
+    mix(entry.mask);
+    mix(entry.pattern);
+    for (const char* c = entry.name; *c; ++c) mix((uint8_t)*c);
+  }
+  for (const char* name : fusedNames) {
+    for (const char* c = name; *c; ++c) mix((uint8_t)*c);
+  }
+  mix(DECODER_ANALYSIS_VERSION);
+  mix(PLUSBOY_DECODER_HASH);
+  return hash;
+}
+
+// Decode cache blocks stop after anything that always leaves the straight line
+bool endsBlock(uint32_t inst) {
+  if ((inst & 0x0F000000) == 0x0A000000) {
+    return true;  // any B, so loops branch back to the start of a block
+  }
+  if ((inst >> 28) != 0xE) {
+    return false;  // conditional, may fall through
+  }
+  if ((inst & 0x0E000000) == 0x0A000000 ||  // B, BL
+      (inst & 0x0FFFFFF0) == 0x012FFF10 ||  // BX
+      (inst & 0x0F000000) == 0x0F000000) {  // SWI
+    return true;
+  }
+  // Data processing or loads into r15, LDM with r15 in the list
+  bool writesPC = (inst & 0x0000F000) == 0x0000F000 &&
+                  ((inst & 0x0C000000) == 0x00000000 || (inst & 0x0C100000) == 0x04100000);
+  bool popsPC = (inst & 0x0E108000) == 0x08108000;
+  return writesPC || popsPC;
+}
+
+uint8_t noFlagsHandler(uint32_t inst, uint8_t handler) {
+  // Rd = r15 with S copies the SPSR into the CPSR, that has to stay
+  if (handler == HANDLER_ALU && CHECK_BIT(inst, 20) && EXTRACT_BITS(inst, 12, 4) != 15) {
+    return HANDLER_ALU_NO_FLAGS;
+  }
+  return handler;
+}
+
+uint8_t flagsRead(uint32_t inst, uint8_t handler) {
+  static const uint8_t conditionFlags[16] = {
+      FLAG_Z,          FLAG_Z,          FLAG_C, FLAG_C, FLAG_N, FLAG_N, FLAG_V, FLAG_V,
+      FLAG_C | FLAG_Z, FLAG_C | FLAG_Z, FLAG_N | FLAG_V, FLAG_N | FLAG_V,
+      FLAG_N | FLAG_Z | FLAG_V, FLAG_N | FLAG_Z | FLAG_V, 0, 0};
+  uint8_t read = conditionFlags[inst >> 28];
+
+  switch (handler) {
+    case HANDLER_ALU:
+    case HANDLER_ALU_NO_FLAGS: {
+      uint32_t opcode = EXTRACT_BITS(inst, 21, 4);
+      if (opcode >= 0x5 && opcode <= 0x7) read |= FLAG_C;  // ADC, SBC, RSC
+      if (!CHECK_BIT(inst, 25) && EXTRACT_BITS(inst, 4, 8) == 0x06) read |= FLAG_C;  // RRX
+      if (CHECK_BIT(inst, 20) && EXTRACT_BITS(inst, 12, 4) == 15) read = FLAGS_ALL;
+      break;
     }
+    case HANDLER_BRANCH:
+    case HANDLER_BRANCH_LINK:
+    case HANDLER_LOAD_STORE:
+    case HANDLER_HALFWORD:
+    case HANDLER_SWP:
+    case HANDLER_MULTIPLY:
+    case HANDLER_MULTIPLY_LONG:
+      break;
+    default:
+      read = FLAGS_ALL;  // BX, SWI, PSR transfers, LDM/STM (^ restores the CPSR), undefined
+      break;
+  }
+  return read;
+}
+
+uint8_t flagsWritten(uint32_t inst, uint8_t handler) {
+  if ((inst >> 28) != 0xE) {
+    return 0;  // might not run, so doesn't end the life of earlier flags
+  }
+  switch (handler) {
+    case HANDLER_ALU:
+    case HANDLER_ALU_NO_FLAGS:
+      return CHECK_BIT(inst, 20) && EXTRACT_BITS(inst, 12, 4) != 15 ? FLAGS_ALL : 0;
+    case HANDLER_MULTIPLY:
+      return FLAGS_ALL;  // executeArmMultiply always updates them
+    default:
+      return 0;
   }
+}
 
-  wrappedExecuteArmUndefined(cpu, memory, inst);  // fallback
+// First instruction of a pair that can run as one fused handler, or 'firstHandler'.
+// Both have to come out of the same block and run unconditionally up to the branch.
+uint8_t fusedHandler(uint32_t first, uint8_t firstHandler, uint32_t second,
+                     uint8_t secondHandler) {
+  if ((first >> 28) != 0xE) {
+    return firstHandler;
+  }
+  uint32_t rd = EXTRACT_BITS(first, 12, 4);
+  if (firstHandler == HANDLER_ALU && CHECK_BIT(first, 20) && rd != 15 &&
+      secondHandler == HANDLER_BRANCH) {
+    uint32_t opcode = EXTRACT_BITS(first, 21, 4);
+    return opcode >= 0x8 && opcode <= 0xB ? HANDLER_COMPARE_BRANCH : HANDLER_ALU_FLAGS_BRANCH;
+  }
+  if ((second >> 28) != 0xE) {
+    return firstHandler;
+  }
+  // MOV rd, #a; ORR rd, rd, #b (constants too wide for one rotated immediate)
+  if (firstHandler == HANDLER_ALU && secondHandler == HANDLER_ALU &&
+      (first & 0x0FF00000) == 0x03A00000 && (second & 0x0FF00000) == 0x03800000 && rd != 15 &&
+      EXTRACT_BITS(second, 16, 4) == rd && EXTRACT_BITS(second, 12, 4) == rd) {
+    return HANDLER_MOV_ORR;
+  }
+  // LDR rd, [pc, #imm]; BX rd (long calls and jumps through a literal pool)
+  if (firstHandler == HANDLER_LOAD_STORE && (first & 0x0F7F0000) == 0x051F0000 && rd != 15 &&
+      secondHandler == HANDLER_BX && EXTRACT_BITS(second, 0, 4) == rd) {
+    return HANDLER_LOAD_BX;
+  }
+  return firstHandler;
+}
+
+bool isFusedHandler(uint8_t handler) {
+  return handler >= dispatchTableSize() && handler < HANDLER_COUNT;
+}
+
+size_t dispatchTableSize() {
+  return sizeof(armDispatchTable) / sizeof(armDispatchTable[0]);
+}
+
+size_t handlerCount() {
+  return HANDLER_COUNT;
+}
+
+const char* dispatchTableName(size_t index) {
+  if (index >= dispatchTableSize()) {
+    return fusedNames[index - dispatchTableSize()];
+  }
+  return armDispatchTable[index].name;
+}
+
+// Short name of an instruction for the profiler's pair table, just detailed enough to spot
+// fusion candidates
+const char* instructionClass(uint32_t inst) {
+  static const char* const aluNames[16] = {"AND", "EOR", "SUB", "RSB", "ADD", "ADC",
+                                           "SBC", "RSC", "TST", "TEQ", "CMP", "CMN",
+                                           "ORR", "MOV", "BIC", "MVN"};
+  static const char* const aluFlagNames[16] = {"ANDS", "EORS", "SUBS", "RSBS", "ADDS", "ADCS",
+                                               "SBCS", "RSCS", "TST",  "TEQ",  "CMP",  "CMN",
+                                               "ORRS", "MOVS", "BICS", "MVNS"};
+  uint8_t handler = decodeHandler(inst);
+  switch (handler) {
+    case HANDLER_BRANCH:
+      return (inst >> 28) != 0xE ? "Bcc" : "B";
+    case HANDLER_BRANCH_LINK:
+      return "BL";
+    case HANDLER_LOAD_STORE:
+      if (!CHECK_BIT(inst, 20)) return "STR";
+      return EXTRACT_BITS(inst, 16, 4) == 15 ? "LDR(literal)" : "LDR";
+    case HANDLER_ALU:
+      if (CHECK_BIT(inst, 20)) return aluFlagNames[EXTRACT_BITS(inst, 21, 4)];
+      return aluNames[EXTRACT_BITS(inst, 21, 4)];
+    default:
+      return dispatchTableName(handler);
+  }
 }
 
 bool checkCondition(CPU* cpu, uint32_t inst) {
@@ -150,10 +375,10 @@ void executeArmMRS(CPU* cpu, Memory* memory, uint32_t inst) {
   uint32_t rd = EXTRACT_BITS(inst, 12, 4);
   bool spsr = CHECK_BIT(inst, 22);
 
-  uint32_t mode = cpu->getRegisters().cpsr & 0x1F;
-  bool privileged = (mode != 0x10);
+  uint32_t mode = cpu->getRegisters().cpsr & CPSR_MODE_MASK;
 
-  if (spsr && !privileged) {
+  // No SPSR in user and system mode
+  if (spsr && (mode == MODE_USER || mode == MODE_SYSTEM)) {
     cpu->writeRegister(rd, cpu->getRegisters().cpsr);
     return;
   }
@@ -162,86 +387,136 @@ void executeArmMRS(CPU* cpu, Memory* memory, uint32_t inst) {
   cpu->writeRegister(rd, value);
 }
 
-void executeArmMSRimm(CPU* cpu, Memory* memory, uint32_t inst) {
-  bool spsr = CHECK_BIT(inst, 22);
-  uint8_t fieldMask = EXTRACT_BITS(inst, 16, 4);
-  uint32_t immediate = EXTRACT_BITS(inst, 0, 8);
-  uint32_t rotate = EXTRACT_BITS(inst, 8, 4);
-
-  uint32_t value = (immediate >> (2 * rotate)) | (immediate << (32 - 2 * rotate));
+static uint32_t rotatedImmediate(uint32_t inst) {
+  uint32_t imm = EXTRACT_BITS(inst, 0, 8);
+  uint32_t rotate = EXTRACT_BITS(inst, 8, 4) * 2;
+  return rotate == 0 ? imm : (imm >> rotate) | (imm << (32 - rotate));
+}
 
-  uint32_t mode = cpu->getRegisters().cpsr & 0x1F;
-  bool privileged = (mode != 0x10);  // everything other than usermode basically
+// MSR: field mask bits are control, extension, status, flags (one byte each).
+// User mode can only change the flags, mode changes swap the banked registers.
+static void writePSR(CPU* cpu, bool spsr, uint8_t fieldMask, uint32_t value) {
+  uint32_t mode = cpu->getRegisters().cpsr & CPSR_MODE_MASK;
+  bool privileged = (mode != MODE_USER);  // everything other than usermode basically
+  uint32_t mask = 0;
+  for (int field = 0; field < 4; ++field) {
+    if (fieldMask & (1 << field)) mask |= 0xFFu << (field * 8);
+  }
 
   if (spsr) {
-    if (!privileged) {
-      return;
-    }
-    uint32_t& spsr_reg = cpu->getRegisters().spsr;
-    if (fieldMask & 0x1) spsr_reg = (spsr_reg & ~0x000000FF) | (value & 0x000000FF);  // Control
-    if (fieldMask & 0x2) spsr_reg = (spsr_reg & ~0x0000FF00) | (value & 0x0000FF00);  // Extension
-    if (fieldMask & 0x4) spsr_reg = (spsr_reg & ~0x00FF0000) | (value & 0x00FF0000);  // Status
-    if (fieldMask & 0x8) spsr_reg = (spsr_reg & ~0xF0000000) | (value & 0xF0000000);  // Flags
-  } else {
-    uint32_t& cpsr = cpu->getRegisters().cpsr;
-
-    if (fieldMask & 0x8) {
-      cpsr = (cpsr & ~0xF0000000) | (value & 0xF0000000);
-    }
-
-    if (privileged) {
-      if (fieldMask & 0x1) cpsr = (cpsr & ~0x000000FF) | (value & 0x000000FF);  // Control
-      if (fieldMask & 0x2) cpsr = (cpsr & ~0x0000FF00) | (value & 0x0000FF00);  // Extension
-      if (fieldMask & 0x4) cpsr = (cpsr & ~0x00FF0000) | (value & 0x00FF0000);  // Status
+    // User and system mode have no SPSR
+    if (privileged && mode != MODE_SYSTEM) {
+      uint32_t& spsr_reg = cpu->getRegisters().spsr;
+      spsr_reg = (spsr_reg & ~mask) | (value & mask);
     }
+    return;
+  }
+  if (!privileged) {
+    mask &= 0xFF000000;
   }
+  uint32_t cpsr = cpu->getRegisters().cpsr;
+  cpu->setCPSR((cpsr & ~mask) | (value & mask));
+}
+
+void executeArmMSRimm(CPU* cpu, Memory* memory, uint32_t inst) {
+  bool spsr = CHECK_BIT(inst, 22);
+  uint8_t fieldMask = EXTRACT_BITS(inst, 16, 4);
+  writePSR(cpu, spsr, fieldMask, rotatedImmediate(inst));
 }
 
 void executeArmMSRregister(CPU* cpu, Memory* memory, uint32_t inst) {
   bool spsr = CHECK_BIT(inst, 22);
   uint8_t fieldMask = EXTRACT_BITS(inst, 16, 4);
   uint32_t rm = EXTRACT_BITS(inst, 0, 4);
-  uint32_t value = cpu->readRegister(rm);
-  uint32_t mode = cpu->getRegisters().cpsr & 0x1F;
-  bool privileged = (mode != 0x10);  // 0x10 = User mode, all others are privileged
-
-  if (spsr) {
-    if (!privileged) {
-      return;
-    }
-    uint32_t& spsr_reg = cpu->getRegisters().spsr;
-    if (fieldMask & 0x1) spsr_reg = (spsr_reg & ~0x000000FF) | (value & 0x000000FF);  // Control
-    if (fieldMask & 0x2) spsr_reg = (spsr_reg & ~0x0000FF00) | (value & 0x0000FF00);  // Extension
-    if (fieldMask & 0x4) spsr_reg = (spsr_reg & ~0x00FF0000) | (value & 0x00FF0000);  // Status
-    if (fieldMask & 0x8) spsr_reg = (spsr_reg & ~0xF0000000) | (value & 0xF0000000);  // Flags
-  } else {
-    uint32_t& cpsr = cpu->getRegisters().cpsr;
-
-    if (fieldMask & 0x8) {
-      cpsr = (cpsr & ~0xF0000000) | (value & 0xF0000000);
-    }
-
-    if (privileged) {
-      if (fieldMask & 0x1) cpsr = (cpsr & ~0x000000FF) | (value & 0x000000FF);  // Control
-      if (fieldMask & 0x2) cpsr = (cpsr & ~0x0000FF00) | (value & 0x0000FF00);  // Extension
-      if (fieldMask & 0x4) cpsr = (cpsr & ~0x00FF0000) | (value & 0x00FF0000);  // Status
-    }
-  }
+  writePSR(cpu, spsr, fieldMask, cpu->readRegister(rm));
 }
 
 void executeArmMultiplyLong(CPU* cpu, Memory* memory, uint32_t inst) {
   // placeholder
 }
 
+// https://problemkaputt.de/gbatek.htm#armopcodesmemoryblockdatatransferldmstm
+// Lowest register at the lowest address whatever the direction. S without r15 in an LDM (or
+// any STM with S) moves the user bank, LDM with S and r15 also copies the SPSR into the CPSR.
 void executeArmBlockTransfer(CPU* cpu, Memory* memory, uint32_t inst) {
-  // placeholder
+  bool pre = CHECK_BIT(inst, 24);
+  bool up = CHECK_BIT(inst, 23);
+  bool psr = CHECK_BIT(inst, 22);
+  bool writeback = CHECK_BIT(inst, 21);
+  bool load = CHECK_BIT(inst, 20);
+  uint32_t Rn = EXTRACT_BITS(inst, 16, 4);
+  uint32_t list = EXTRACT_BITS(inst, 0, 16);
+  if (list == 0) {
+    return;  // r15 and a 0x40 step on hardware, nothing uses that
+  }
+
+  Registers& regs = cpu->getRegisters();
+  uint32_t count = std::popcount(list);
+  uint32_t base = cpu->readRegister(Rn);
+  uint32_t newBase = up ? base + count * 4 : base - count * 4;
+  uint32_t address = (up ? base : newBase) + (pre == up ? 4 : 0);
+
+  bool userBank = psr && !(load && (list & 0x8000));
+  uint32_t mode = regs.cpsr & CPSR_MODE_MASK;
+  if (userBank && mode != MODE_USER && mode != MODE_SYSTEM) {
+    cpu->switchMode(MODE_SYSTEM);
+  } else {
+    userBank = false;
+  }
+
+  bool first = true;
+  for (uint32_t r = 0; r < 16; ++r) {
+    if (!(list & (1u << r))) {
+      continue;
+    }
+    if (load) {
+      uint32_t value = memory->readWord(address);
+      cpu->writeRegister(r, value);
+    } else {
+      // The base goes out as it was only when it's the first one stored
+      uint32_t value = (r == Rn && writeback && !first) ? newBase : cpu->readRegister(r);
+      memory->writeWord(address, r == 15 ? value + 8 : value);  // r15 as address + 12
+    }
+    first = false;
+    address += 4;
+  }
+
+  if (userBank) {
+    cpu->switchMode(mode);
+  }
+  // A loaded base wins over the writeback
+  if (writeback && !(load && (list & (1u << Rn)))) {
+    cpu->writeRegister(Rn, newBase);
+  }
+  if (load && (list & 0x8000)) {
+    if (psr && mode != MODE_USER && mode != MODE_SYSTEM) {
+      cpu->setCPSR(regs.spsr);
+    }
+    regs.pc &= (regs.cpsr & CPSR_THUMB) ? ~1u : ~3u;
+  }
 }
 
 void executeArmBranchLink(CPU* cpu, uint32_t inst) {
   int32_t offset = EXTRACT_BITS(inst, 0, 24) << 2;     // Extract 24-bit offset, multiply by 4
   offset = (offset << 6) >> 6;                         // Sign-extend the 26-bit offset
-  cpu->writeRegister(14, cpu->getRegisters().pc - 4);  // Save return address in LR (R14)
+  uint32_t from = cpu->getRegisters().pc - 4;
+  cpu->writeRegister(14, cpu->getRegisters().pc);  // Save return address (next inst) in LR (R14)
   cpu->getRegisters().pc += offset + 4;
+  if (cpu->getProfiler() != nullptr) {
+    cpu->getProfiler()->recordCall(from, cpu->getRegisters().pc, cpu->getRegisters().lr);
+  }
+}
+
+// Bit 0 of the target picks Thumb
+void executeArmBranchExchange(CPU* cpu, uint32_t inst) {
+  uint32_t target = cpu->readRegister(EXTRACT_BITS(inst, 0, 4));
+  Registers& regs = cpu->getRegisters();
+  if (target & 1) {
+    regs.cpsr |= 0x20;
+    regs.pc = target & ~1u;
+  } else {
+    regs.pc = target & ~3u;
+  }
 }
 
 void executeArmBranch(CPU* cpu, uint32_t inst) {
@@ -250,9 +525,20 @@ void executeArmBranch(CPU* cpu, uint32_t inst) {
   cpu->getRegisters().pc += offset + 4;
 }
 
-void executeArmSoftwareInterrupt(uint32_t inst) {
-  std::cerr << "Software Interrupt: 0x" << std::hex << inst << std::endl;
-  exit(0);
+void executeArmSoftwareInterrupt(CPU* cpu, Memory* memory, uint32_t inst) {
+  // ARM state keeps the BIOS function number in bits 16-23 of the comment field
+  uint32_t comment = EXTRACT_BITS(inst, 16, 8);
+  if (cpu->isHLEBios() && BIOS::handleSWI(cpu, memory, comment)) {
+    return;
+  }
+  if (!cpu->isHLEBios()) {
+    cpu->enterException(VECTOR_SWI, MODE_SUPERVISOR, cpu->getRegisters().pc);
+    return;
+  }
+  char message[64];
+  std::snprintf(message, sizeof(message), "executeArmSoftwareInterrupt: unhandled SWI %08x",
+                inst);
+  throw std::runtime_error(message);
 }
 
 void executeArmLoadStore(CPU* cpu, Memory* memory, uint32_t inst) {
@@ -331,21 +617,21 @@ void executeArmMultiply(CPU* cpu, uint32_t inst) {
 
   if (accumulate) {
     result = cpu->readRegister(Rn) + (operand1 * operand2);
-    std::cout << "MLA: R" << Rd << " = R" << Rn << " + (R" << Rm << " * R" << Rs << ")"
-              << std::endl;
+    DEBUG_LOG("MLA: R" << Rd << " = R" << Rn << " + (R" << Rm << " * R" << Rs << ")");
   } else {
     result = operand1 * operand2;
-    std::cout << "MUL: R" << Rd << " = R" << Rm << " * R" << Rs << std::endl;
+    DEBUG_LOG("MUL: R" << Rd << " = R" << Rm << " * R" << Rs);
   }
 
   cpu->writeRegister(Rd, result);
   updateFlags(cpu, result, false, false);  // MUL/MLA don't set C or V
 
-  std::cout << "Result: " << std::hex << result << std::endl;
-  std::cout << "CPSR: " << std::hex << cpu->getRegisters().cpsr << std::endl;
+  DEBUG_LOG("Result: " << std::hex << result);
+  DEBUG_LOG("CPSR: " << std::hex << cpu->getRegisters().cpsr);
 }
 
-void executeArmALU(CPU* cpu, uint32_t inst) {
+template <bool setFlags>
+static void executeALU(CPU* cpu, uint32_t inst) {
   bool carryout = false, overflow = false;
   uint32_t opcode = EXTRACT_BITS(inst, 21, 4);
   uint32_t Rd = EXTRACT_BITS(inst, 12, 4);
@@ -377,37 +663,48 @@ void executeArmALU(CPU* cpu, uint32_t inst) {
       overflow = ((src ^ ~operand2) & (src ^ result) & 0x80000000) != 0;
       break;
     case 0x5:  // ADC
-      result = src + operand2 + ((cpu->getRegisters().cpsr >> 29) & 1);
-      carryout = (result < src);
+    {
+      uint64_t wide = (uint64_t)src + operand2 + ((cpu->getRegisters().cpsr >> 29) & 1);
+      result = (uint32_t)wide;
+      carryout = wide >> 32;
       overflow = ((src ^ ~operand2) & (src ^ result) & 0x80000000) != 0;
       break;
-    case 0x6:  // SBC
-      result = src - operand2 - (carryout ? 0 : 1);
-      carryout = (src >= operand2);
+    }
+    case 0x6:  // SBC, carry clear borrows one more
+    {
+      uint32_t borrow = ((cpu->getRegisters().cpsr >> 29) & 1) ^ 1;
+      result = src - operand2 - borrow;
+      carryout = (uint64_t)src >= (uint64_t)operand2 + borrow;
       overflow = ((src ^ operand2) & (src ^ result) & 0x80000000) != 0;
       break;
+    }
     case 0x7:  // RSC
-      result = operand2 - src - (carryout ? 0 : 1);
-      carryout = (operand2 >= src);
+    {
+      uint32_t borrow = ((cpu->getRegisters().cpsr >> 29) & 1) ^ 1;
+      result = operand2 - src - borrow;
+      carryout = (uint64_t)operand2 >= (uint64_t)src + borrow;
       overflow = ((operand2 ^ src) & (operand2 ^ result) & 0x80000000) != 0;
       break;
-    case 0x8:  // TST
+    }
+    case 0x8:  // TST, flags only like CMP
       result = src & operand2;
-      break;
+      if (setFlags) updateFlags(cpu, result, carryout, overflow);
+      return;
     case 0x9:  // TEQ
       result = src ^ operand2;
-      break;
+      if (setFlags) updateFlags(cpu, result, carryout, overflow);
+      return;
     case 0xA:  // CMP
       result = src - operand2;
       carryout = (src >= operand2);
       overflow = ((src ^ operand2) & (src ^ result) & 0x80000000);
-      updateFlags(cpu, result, carryout, overflow);
+      if (setFlags) updateFlags(cpu, result, carryout, overflow);
       return;
     case 0xB:  // CMN
       result = src + operand2;
       carryout = (result < src);
       overflow = ((src ^ ~operand2) & (src ^ result) & 0x80000000) != 0;
-      updateFlags(cpu, result, carryout, overflow);
+      if (setFlags) updateFlags(cpu, result, carryout, overflow);
       return;
     case 0xC:  // ORR
       result = src | operand2;
@@ -427,7 +724,25 @@ void executeArmALU(CPU* cpu, uint32_t inst) {
   }
 
   cpu->writeRegister(Rd, result);
-  if (inst & (1 << 20)) updateFlags(cpu, result, carryout, overflow);
+  if (inst & (1 << 20)) {
+    if (Rd == 15) {
+      // MOVS pc, lr / SUBS pc, lr, #4: return from an exception
+      uint32_t mode = cpu->getRegisters().cpsr & CPSR_MODE_MASK;
+      if (mode != MODE_USER && mode != MODE_SYSTEM) cpu->setCPSR(cpu->getRegisters().spsr);
+    } else if (setFlags) {
+      updateFlags(cpu, result, carryout, overflow);
+    }
+  }
+}
+
+void executeArmALU(CPU* cpu, uint32_t inst) {
+  executeALU<true>(cpu, inst);
+}
+
+// Same result, NZCV left alone. Only used where flag liveness says they're overwritten
+// before anything reads them.
+void executeArmALUNoFlags(CPU* cpu, uint32_t inst) {
+  executeALU<false>(cpu, inst);
 }
 
 uint32_t Shifter(CPU* cpu, uint32_t value, uint32_t type, uint32_t amount, bool& carryout) {
@@ -494,4 +809,285 @@ void updateFlags(CPU* cpu, uint32_t result, bool carry, bool overflow) {
     cpsr |= (1 << 28);
 }
 
-}  // namespace ARM
\ No newline at end of file
+// === Threaded interpreter ===
+// PLUSBOY_DISPATCH_GOTO: one function, computed goto between labels.
+// PLUSBOY_DISPATCH_MUSTTAIL: one function per handler, guaranteed tail calls between them.
+// Otherwise a plain loop calling through the dispatch table (still using the decode cache).
+
+#define THREADED_EXIT -1
+
+#if defined(__clang__)
+#define MUSTTAIL [[clang::musttail]]
+#elif defined(__GNUC__) && __GNUC__ >= 15
+#define MUSTTAIL [[gnu::musttail]]
+#endif
+
+struct ThreadedState {
+  CPU* cpu;
+  Memory* memory;
+  const uint64_t& cycleTarget;  // the scheduler horizon, drops when an event gets posted
+  const Block* block;
+  uint32_t pc;  // instruction in flight, for the trace
+  uint32_t opcode;
+  // Tracing, profiling, validating or debugging: no fused pairs, no skipped flags (a
+  // watchpoint stops after any instruction and has to see its flags)
+  bool exact;
+  uint8_t deadFlags;  // validation: flags the last ALU_NO_FLAGS left stale
+  uint32_t deadFlagsPC;
+
+  ThreadedState(CPU* cpu, Memory* memory, const uint64_t& cycleTarget)
+      : cpu(cpu),
+        memory(memory),
+        cycleTarget(cycleTarget),
+        block(nullptr),
+        pc(0),
+        opcode(0),
+        exact(cpu->getTracer() != nullptr || cpu->getProfiler() != nullptr ||
+              cpu->isValidatingFlags() || memory->getDebugger() != nullptr),
+        deadFlags(0),
+        deadFlagsPC(0) {}
+};
+
+// Slow path for exact runs: one instruction at a time with full flags, so traces and
+// profiles see the same steps as the call loop. With validation on, also checks nothing
+// reads the flags ALU_NO_FLAGS would have skipped before they're set again. Every block end
+// counts as a read of all of them.
+[[gnu::noinline]] static uint8_t exactHandler(ThreadedState& s, uint32_t pc, bool leftBlock,
+                                              const DecodedInst& decoded) {
+  uint8_t handler = isFusedHandler(decoded.handler) ? decodeHandler(decoded.opcode)
+                                                    : decoded.handler;
+  if (!s.cpu->isValidatingFlags()) {
+    return handler == HANDLER_ALU_NO_FLAGS ? (uint8_t)HANDLER_ALU : handler;
+  }
+  uint8_t read = leftBlock ? FLAGS_ALL : flagsRead(decoded.opcode, handler);
+  if (s.deadFlags & read) {
+    std::cerr << "ARM::runThreaded: flags skipped at 0x" << std::hex << s.deadFlagsPC
+              << " are read at 0x" << pc << std::dec << std::endl;
+    s.cpu->getStats().flagCheckFailures.add();
+    s.deadFlags = 0;
+  }
+  s.deadFlags &= ~flagsWritten(decoded.opcode, handler);
+  if (handler == HANDLER_ALU_NO_FLAGS) {
+    s.deadFlags = FLAGS_ALL;
+    s.deadFlagsPC = pc;
+    return HANDLER_ALU;
+  }
+  return handler;
+}
+
+// Second instruction of a fused pair: retires the first and fetches the next one out of the
+// block, the same bookkeeping threadedNext does between two handlers. false when the budget
+// ran out in between, the pair is then split like the call loop would.
+[[gnu::always_inline]] inline bool threadedStep(ThreadedState& s) {
+  CPU* cpu = s.cpu;
+  Stats& stats = cpu->getStats();
+  bool romAccessed;
+  uint32_t dataCycles = s.memory->takeBusCycles(romAccessed);
+  cpu->addCycles(dataCycles);
+  cpu->runPrefetch(dataCycles, romAccessed);
+  if (cpu->getCycles() >= s.cycleTarget) {
+    return false;
+  }
+
+  uint32_t pc = s.pc + 4;
+  stats.regionReads[s.block->region].add();
+  cpu->addCycles(cpu->fetchCycles(pc, false));
+  cpu->getRegisters().pc = pc + 4;
+  stats.armInstructions.add();
+  s.pc = pc;
+  s.opcode = s.block->instructions[(pc - s.block->start) >> 2].opcode;
+  return true;
+}
+
+// CMP/CMN/TST/TEQ or another flag setting ALU op, then a B reading those flags
+static void fusedFlagsBranch(ThreadedState& s) {
+  executeArmALU(s.cpu, s.opcode);
+  if (threadedStep(s) && checkCondition(s.cpu, s.opcode)) {
+    executeArmBranch(s.cpu, s.opcode);
+  }
+}
+
+static void fusedMovOrr(ThreadedState& s) {
+  uint32_t value = rotatedImmediate(s.opcode);
+  uint32_t rd = EXTRACT_BITS(s.opcode, 12, 4);
+  if (threadedStep(s)) {
+    value |= rotatedImmediate(s.opcode);
+  }
+  s.cpu->writeRegister(rd, value);
+}
+
+static void fusedLoadBranchExchange(ThreadedState& s) {
+  executeArmLoadStore(s.cpu, s.memory, s.opcode);
+  if (threadedStep(s)) {
+    executeArmBranchExchange(s.cpu, s.opcode);
+  }
+}
+
+// Retires the instruction in flight and fetches the next one to run, doing the same
+// bookkeeping as CPU::executeinst. Returns its dispatch table index or THREADED_EXIT.
+[[gnu::always_inline]] inline int threadedNext(ThreadedState& s, bool retire) {
+  CPU* cpu = s.cpu;
+  Registers& regs = cpu->getRegisters();
+  Stats& stats = cpu->getStats();
+
+  for (;;) {
+    if (retire) {
+      bool romAccessed;
+      uint32_t dataCycles = s.memory->takeBusCycles(romAccessed);
+      cpu->addCycles(dataCycles);
+      cpu->runPrefetch(dataCycles, romAccessed);
+      if (cpu->getTracer() != nullptr) {
+        cpu->getTracer()->record(s.pc, s.opcode, false, regs.r, regs.cpsr);
+      }
+    }
+    retire = true;
+
+    if (cpu->getCycles() >= s.cycleTarget || (regs.cpsr & 0x20)) {
+      return THREADED_EXIT;
+    }
+
+    // Straight on inside the block, otherwise (branch, block end, code written) look it up
+    uint32_t pc = regs.pc;
+    uint32_t offset = pc - (s.block != nullptr ? s.block->start : 0);
+    if (s.block == nullptr || offset >= s.block->byteSize() || !s.block->isCurrent(*s.memory)) {
+      s.block = cpu->getBlockCache().lookup(pc);
+      if (s.block == nullptr) {
+        return THREADED_EXIT;
+      }
+      cpu->syncFetchPage(pc);
+      offset = 0;
+    }
+    // Back at the top of an idle loop: nothing can change until the next scheduler event
+    if (offset == 0 && (s.block->flags & BLOCK_IDLE_LOOP) &&
+        s.pc == s.block->start + s.block->byteSize() - 4 && cpu->getTracer() == nullptr &&
+        cpu->getProfiler() == nullptr) {
+      stats.idleLoopSkips.add();
+      cpu->addCycles(s.cycleTarget - cpu->getCycles());
+      return THREADED_EXIT;
+    }
+    const DecodedInst& decoded = s.block->instructions[offset >> 2];
+    bool leftBlock = offset == 0 || pc != s.pc + 4;
+
+    if (cpu->getProfiler() != nullptr) {
+      cpu->getProfiler()->recordInstruction(pc, decoded.opcode, false, cpu->getCycles());
+    }
+    stats.regionReads[s.block->region].add();
+    cpu->addCycles(cpu->fetchCycles(pc, false));
+    regs.pc = pc + 4;
+    stats.armInstructions.add();
+    s.pc = pc;
+    s.opcode = decoded.opcode;
+
+    uint8_t handler = decoded.handler;
+    if (s.exact && handler != ARM_HANDLER_NOP) {
+      handler = exactHandler(s, pc, leftBlock, decoded);
+    }
+    if (handler == ARM_HANDLER_NOP || !checkCondition(cpu, decoded.opcode)) {
+      continue;
+    }
+    stats.armDispatch[handler].add();
+    return handler;
+  }
+}
+
+#if defined(PLUSBOY_DISPATCH_GOTO)
+
+void runThreaded(CPU* cpu, Memory* memory, const uint64_t& cycleTarget) {
+  ThreadedState s(cpu, memory, cycleTarget);
+#define ARM_LABEL_ADDRESS(label, mask, pattern, handler, name) &&op_##label,
+#define ARM_FUSED_LABEL_ADDRESS(label, handler, name) &&op_##label,
+  static void* const labels[] = {ARM_DISPATCH_TABLE(ARM_LABEL_ADDRESS)
+                                     ARM_FUSED_TABLE(ARM_FUSED_LABEL_ADDRESS)};
+
+  // Every handler gets its own copy of the dispatch, so each indirect jump has its own
+  // branch history instead of all of them sharing the one in a loop
+#define THREADED_DISPATCH(retire)             \
+  do {                                        \
+    int next = threadedNext(s, retire);       \
+    if (next == THREADED_EXIT) return;        \
+    goto* labels[next];                       \
+  } while (0)
+
+  THREADED_DISPATCH(false);
+
+#define ARM_LABEL_BODY(label, mask, pattern, handler, name) \
+  op_##label:                                               \
+  handler(cpu, memory, s.opcode);                           \
+  THREADED_DISPATCH(true);
+
+#define ARM_FUSED_LABEL_BODY(label, handler, name) \
+  op_##label:                                      \
+  handler(s);                                      \
+  THREADED_DISPATCH(true);
+
+  ARM_DISPATCH_TABLE(ARM_LABEL_BODY)
+  ARM_FUSED_TABLE(ARM_FUSED_LABEL_BODY)
+}
+
+#elif defined(PLUSBOY_DISPATCH_MUSTTAIL)
+
+#ifndef MUSTTAIL
+#error "PLUSBOY_DISPATCH_MUSTTAIL needs clang or GCC 15+"
+#endif
+
+typedef void (*ThreadedHandler)(ThreadedState& s);
+
+#define ARM_TAIL_DECLARATION(label, mask, pattern, handler, name) \
+  static void op_##label(ThreadedState& s);
+#define ARM_FUSED_TAIL_DECLARATION(label, handler, name) static void op_##label(ThreadedState& s);
+ARM_DISPATCH_TABLE(ARM_TAIL_DECLARATION)
+ARM_FUSED_TABLE(ARM_FUSED_TAIL_DECLARATION)
+
+#define ARM_TAIL_ADDRESS(label, mask, pattern, handler, name) op_##label,
+#define ARM_FUSED_TAIL_ADDRESS(label, handler, name) op_##label,
+static const ThreadedHandler threadedHandlers[] = {
+    ARM_DISPATCH_TABLE(ARM_TAIL_ADDRESS) ARM_FUSED_TABLE(ARM_FUSED_TAIL_ADDRESS)};
+
+#define ARM_TAIL_BODY(label, mask, pattern, handler, name) \
+  static void op_##label(ThreadedState& s) {               \
+    handler(s.cpu, s.memory, s.opcode);                    \
+    int next = threadedNext(s, true);                      \
+    if (next == THREADED_EXIT) return;                     \
+    MUSTTAIL return threadedHandlers[next](s);             \
+  }
+#define ARM_FUSED_TAIL_BODY(label, handler, name) \
+  static void op_##label(ThreadedState& s) {      \
+    handler(s);                                   \
+    int next = threadedNext(s, true);             \
+    if (next == THREADED_EXIT) return;            \
+    MUSTTAIL return threadedHandlers[next](s);    \
+  }
+ARM_DISPATCH_TABLE(ARM_TAIL_BODY)
+ARM_FUSED_TABLE(ARM_FUSED_TAIL_BODY)
+
+void runThreaded(CPU* cpu, Memory* memory, const uint64_t& cycleTarget) {
+  ThreadedState s(cpu, memory, cycleTarget);
+  int next = threadedNext(s, false);
+  if (next != THREADED_EXIT) {
+    threadedHandlers[next](s);
+  }
+}
+
+#else
+
+#define ARM_FUSED_ADDRESS(label, handler, name) handler,
+static void (*const fusedHandlers[])(ThreadedState& s) = {ARM_FUSED_TABLE(ARM_FUSED_ADDRESS)};
+
+void runThreaded(CPU* cpu, Memory* memory, const uint64_t& cycleTarget) {
+  ThreadedState s(cpu, memory, cycleTarget);
+  for (bool retire = false;; retire = true) {
+    int next = threadedNext(s, retire);
+    if (next == THREADED_EXIT) {
+      return;
+    }
+    if (isFusedHandler(next)) {
+      fusedHandlers[next - dispatchTableSize()](s);
+    } else {
+      armDispatchTable[next].handler(cpu, memory, s.opcode);
+    }
+  }
+}
+
+#endif
+
+}  // namespace ARM
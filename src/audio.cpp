@@ -0,0 +1,90 @@
+#include "../include/audio.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "../include/stats.hpp"
+
+AudioRing::AudioRing(uint32_t frames) : capacity(1) {
+  while (capacity < frames) {
+    capacity <<= 1;
+  }
+  samples.resize((size_t)capacity * AUDIO_CHANNELS);
+}
+
+uint32_t AudioRing::write(const int16_t *input, uint32_t frames) {
+  uint64_t tail = writeIndex.load(std::memory_order_relaxed);
+  uint32_t space = capacity - (uint32_t)(tail - readIndex.load(std::memory_order_acquire));
+  frames = std::min(frames, space);
+  // In up to two pieces, around the end of the buffer
+  uint32_t start = (uint32_t)(tail & (capacity - 1));
+  uint32_t first = std::min(frames, capacity - start);
+  std::memcpy(&samples[(size_t)start * AUDIO_CHANNELS], input,
+              (size_t)first * AUDIO_CHANNELS * sizeof(int16_t));
+  std::memcpy(samples.data(), input + (size_t)first * AUDIO_CHANNELS,
+              (size_t)(frames - first) * AUDIO_CHANNELS * sizeof(int16_t));
+  writeIndex.store(tail + frames, std::memory_order_release);
+  return frames;
+}
+
+uint32_t AudioRing::read(int16_t *output, uint32_t frames) {
+  uint64_t head = readIndex.load(std::memory_order_relaxed);
+  frames = std::min(frames, (uint32_t)(writeIndex.load(std::memory_order_acquire) - head));
+  uint32_t start = (uint32_t)(head & (capacity - 1));
+  uint32_t first = std::min(frames, capacity - start);
+  std::memcpy(output, &samples[(size_t)start * AUDIO_CHANNELS],
+              (size_t)first * AUDIO_CHANNELS * sizeof(int16_t));
+  std::memcpy(output + (size_t)first * AUDIO_CHANNELS, samples.data(),
+              (size_t)(frames - first) * AUDIO_CHANNELS * sizeof(int16_t));
+  readIndex.store(head + frames, std::memory_order_release);
+  return frames;
+}
+
+uint32_t AudioRing::getFill() const {
+  uint64_t head = readIndex.load(std::memory_order_acquire);
+  return (uint32_t)(writeIndex.load(std::memory_order_acquire) - head);
+}
+
+AudioDevice::AudioDevice(uint32_t ringFrames, Stats *stats) : ring(ringFrames), stats(stats) {
+  player = std::thread(&AudioDevice::playLoop, this);
+}
+
+AudioDevice::~AudioDevice() {
+  stopping.store(true, std::memory_order_relaxed);
+  player.join();
+}
+
+double AudioDevice::getAverageLatencyMs() const {
+  uint64_t played = periods.load(std::memory_order_relaxed);
+  return played != 0 ? latencyMicrosTotal.load(std::memory_order_relaxed) / 1000.0 / played : 0;
+}
+
+void AudioDevice::playLoop() {
+  std::vector<int16_t> period((size_t)AUDIO_PERIOD_FRAMES * AUDIO_CHANNELS);
+  auto periodLength = std::chrono::nanoseconds(1000000000LL * AUDIO_PERIOD_FRAMES /
+                                               AUDIO_OUTPUT_RATE);
+  auto next = std::chrono::steady_clock::now();
+  bool playing = false;  // the ring filled a period once, running dry from now on is an underrun
+  while (!stopping.load(std::memory_order_relaxed)) {
+    next += periodLength;
+    std::this_thread::sleep_until(next);
+    uint32_t queued = ring.getFill();
+    uint32_t got = ring.read(period.data(), AUDIO_PERIOD_FRAMES);
+    if (got == AUDIO_PERIOD_FRAMES) {
+      playing = true;
+    } else if (playing) {
+      underruns.fetch_add(1, std::memory_order_relaxed);
+      if (stats != nullptr) stats->audioUnderruns.add();
+    }
+    if (!playing) {
+      continue;
+    }
+    uint64_t latency = (uint64_t)(queued + AUDIO_PERIOD_FRAMES) * 1000000 / AUDIO_OUTPUT_RATE;
+    latencyMicros.store(latency, std::memory_order_relaxed);
+    latencyMicrosTotal.fetch_add(latency, std::memory_order_relaxed);
+    periods.fetch_add(1, std::memory_order_relaxed);
+    if (stats != nullptr) stats->audioLatencyMicros.set(latency);
+    // No backend yet: the period would go to the host's sound card here
+  }
+}
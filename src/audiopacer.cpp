@@ -0,0 +1,79 @@
+#include "../include/audiopacer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "../include/audio.hpp"
+#include "../include/cpu.hpp"
+
+AudioPacer::AudioPacer(CPU &cpu, AudioDevice &device, double targetLatencyMs)
+    : cpu(cpu),
+      device(device),
+      targetFrames((uint32_t)(targetLatencyMs * AUDIO_OUTPUT_RATE / 1000)),
+      cyclesCarried(0),
+      ratio(1),
+      position(0),
+      last() {
+  // Room for a frame on top of it, whatever the ratio
+  targetFrames = std::clamp<uint32_t>(targetFrames, AUDIO_PERIOD_FRAMES,
+                                      device.getRing().getCapacity() / 2);
+}
+
+// Linear interpolation between the input samples around each output one, the one before the
+// first comes from the last frame
+void AudioPacer::resample(uint32_t inputFrames) {
+  double step = (double)AUDIO_SAMPLE_RATE / AUDIO_OUTPUT_RATE / ratio;
+  output.clear();
+  for (; position < inputFrames; position += step) {
+    uint32_t index = (uint32_t)position;
+    double fraction = position - index;
+    for (int channel = 0; channel < AUDIO_CHANNELS; ++channel) {
+      int before = index != 0 ? input[(index - 1) * AUDIO_CHANNELS + channel] : last[channel];
+      int after = input[index * AUDIO_CHANNELS + channel];
+      output.push_back((int16_t)(before + (after - before) * fraction));
+    }
+  }
+  position -= inputFrames;
+  if (inputFrames != 0) {
+    last[0] = input[(inputFrames - 1) * AUDIO_CHANNELS];
+    last[1] = input[(inputFrames - 1) * AUDIO_CHANNELS + 1];
+  }
+}
+
+void AudioPacer::runFrame() {
+  uint64_t start = cpu.getCycles();
+  cpu.runFrame();
+  uint64_t cycles = cpu.getCycles() - start + cyclesCarried;
+  uint32_t inputFrames = (uint32_t)(cycles / AUDIO_CYCLES_PER_SAMPLE);
+  cyclesCarried = (uint32_t)(cycles % AUDIO_CYCLES_PER_SAMPLE);
+  {
+    ScopedTimer timer(&cpu.getStats(), SUBSYSTEM_AUDIO);
+    input.assign((size_t)inputFrames * AUDIO_CHANNELS, 0);  // silence until there's an APU
+    resample(inputFrames);
+  }
+
+  AudioRing &ring = device.getRing();
+  auto period = std::chrono::microseconds(1000000LL * AUDIO_PERIOD_FRAMES / AUDIO_OUTPUT_RATE);
+  uint32_t frames = (uint32_t)(output.size() / AUDIO_CHANNELS);
+  for (uint32_t written = 0; written < frames;) {
+    {
+      ScopedTimer timer(&cpu.getStats(), SUBSYSTEM_AUDIO);  // the sleeps are pacing, not work
+      written += ring.write(output.data() + (size_t)written * AUDIO_CHANNELS, frames - written);
+    }
+    if (written < frames) {
+      std::this_thread::sleep_for(period);
+    }
+  }
+
+  // Short of the target with this frame in: a few more samples per frame, over it: a few less
+  double error = ((double)targetFrames - ring.getFill()) / targetFrames;
+  ratio = 1 + AUDIO_MAX_RATE_ADJUST * std::clamp(error, -1.0, 1.0);
+
+  // The pacing: the device plays until the next frame fits under the target
+  uint32_t threshold = targetFrames - std::min(frames, targetFrames);
+  for (uint32_t fill = ring.getFill(); fill > threshold; fill = ring.getFill()) {
+    std::this_thread::sleep_for(
+        std::chrono::microseconds((uint64_t)(fill - threshold) * 1000000 / AUDIO_OUTPUT_RATE));
+  }
+}
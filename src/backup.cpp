@@ -0,0 +1,309 @@
+#include "../include/backup.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+
+#include "../include/memory.hpp"
+#include "../include/savestate.hpp"
+
+// Device IDs Flash answers with in ID mode (manufacturer, device)
+static const uint8_t flash64ID[2] = {0x32, 0x1B};   // Panasonic
+static const uint8_t flash128ID[2] = {0x62, 0x13};  // Sanyo
+
+// EEPROM reads send 4 junk bits before the 64 data bits
+#define EEPROM_READ_BITS 68
+
+static size_t backupSize(BackupType type, const std::string &savePath) {
+  switch (type) {
+    case BACKUP_SRAM:
+      return SRAM_SIZE;
+    case BACKUP_FLASH64:
+      return FLASH_BANK_SIZE;
+    case BACKUP_FLASH128:
+      return FLASH_BANK_SIZE * 2;
+    case BACKUP_EEPROM: {
+      std::error_code error;
+      uint64_t existing = savePath.empty() ? 0 : std::filesystem::file_size(savePath, error);
+      return !error && existing == EEPROM_SMALL_SIZE ? EEPROM_SMALL_SIZE : EEPROM_LARGE_SIZE;
+    }
+    default:
+      return 0;
+  }
+}
+
+Backup::Backup(BackupType type, const std::string &savePath)
+    : type(type),
+      file(std::make_unique<SaveFile>(savePath, backupSize(type, savePath), 0xFF)),
+      flashState(FLASH_READY),
+      flashIDMode(false),
+      flashErasing(false),
+      flashProgram(false),
+      flashBankSwitch(false),
+      flashBank(0),
+      eepromAddressBits(0),
+      eepromBits{},
+      eepromBitCount(0),
+      eepromReadData(0),
+      eepromReadPosition(EEPROM_READ_BITS) {
+  if (type == BACKUP_EEPROM && file->size() == EEPROM_SMALL_SIZE) {
+    eepromAddressBits = 6;  // an old save told us
+  }
+}
+
+BackupType Backup::detect(const uint8_t *rom, size_t size) {
+  static const struct {
+    const char *id;
+    BackupType type;
+  } ids[] = {{"EEPROM_V", BACKUP_EEPROM},      {"SRAM_V", BACKUP_SRAM},
+             {"SRAM_F_V", BACKUP_SRAM},        {"FLASH_V", BACKUP_FLASH64},
+             {"FLASH512_V", BACKUP_FLASH64},   {"FLASH1M_V", BACKUP_FLASH128}};
+
+  // The strings are word aligned
+  for (size_t offset = 0; offset + 12 <= size; offset += 4) {
+    if (rom[offset] != 'E' && rom[offset] != 'S' && rom[offset] != 'F') {
+      continue;
+    }
+    for (const auto &entry : ids) {
+      if (std::memcmp(rom + offset, entry.id, std::strlen(entry.id)) == 0) {
+        return entry.type;
+      }
+    }
+  }
+  return BACKUP_NONE;
+}
+
+const char *Backup::typeName(BackupType type) {
+  switch (type) {
+    case BACKUP_SRAM:
+      return "SRAM";
+    case BACKUP_FLASH64:
+      return "Flash 64K";
+    case BACKUP_FLASH128:
+      return "Flash 128K";
+    case BACKUP_EEPROM:
+      return "EEPROM";
+    default:
+      return "none";
+  }
+}
+
+uint8_t Backup::read8(uint32_t address) {
+  uint32_t offset = address & (FLASH_BANK_SIZE - 1);
+  switch (type) {
+    case BACKUP_SRAM:
+      return file->data()[address & (SRAM_SIZE - 1)];
+    case BACKUP_FLASH64:
+    case BACKUP_FLASH128:
+      if (flashIDMode && offset < 2) {
+        return (type == BACKUP_FLASH64 ? flash64ID : flash128ID)[offset];
+      }
+      return file->data()[flashBank * FLASH_BANK_SIZE + offset];
+    default:
+      return 0xFF;  // open bus, close enough
+  }
+}
+
+void Backup::write8(uint32_t address, uint8_t value) {
+  uint32_t offset = address & (FLASH_BANK_SIZE - 1);
+  if (type == BACKUP_SRAM) {
+    file->data()[address & (SRAM_SIZE - 1)] = value;
+    file->markDirty();
+    return;
+  }
+  if (type != BACKUP_FLASH64 && type != BACKUP_FLASH128) {
+    return;
+  }
+
+  if (flashProgram) {
+    flashProgram = false;
+    file->data()[flashBank * FLASH_BANK_SIZE + offset] = value;
+    file->markDirty();
+    return;
+  }
+  if (flashBankSwitch && offset == 0) {
+    flashBankSwitch = false;
+    flashBank = value & 1;
+    return;
+  }
+  flashCommand(offset, value);
+}
+
+// https://problemkaputt.de/gbatek.htm#gbacartbackupflashrom
+// Every command is AA to 5555, 55 to 2AAA, then the command byte. Erasing and programming
+// take no time here, status polls see them done right away.
+void Backup::flashCommand(uint32_t offset, uint8_t value) {
+  switch (flashState) {
+    case FLASH_READY:
+      if (offset == FLASH_COMMAND_1 && value == 0xAA) {
+        flashState = FLASH_UNLOCK_1;
+      } else if (value == 0xF0) {
+        flashIDMode = false;  // some chips take the bare reset
+      }
+      return;
+    case FLASH_UNLOCK_1:
+      flashState = (offset == FLASH_COMMAND_2 && value == 0x55) ? FLASH_UNLOCK_2 : FLASH_READY;
+      return;
+    case FLASH_UNLOCK_2:
+      flashState = FLASH_READY;
+      break;
+  }
+
+  if (flashErasing) {
+    flashErasing = false;
+    if (offset == FLASH_COMMAND_1 && value == 0x10) {
+      std::memset(file->data(), 0xFF, file->size());
+    } else if (value == 0x30) {
+      uint32_t sector = flashBank * FLASH_BANK_SIZE + (offset & ~(FLASH_SECTOR_SIZE - 1));
+      std::memset(file->data() + sector, 0xFF, FLASH_SECTOR_SIZE);
+    }
+    file->markDirty();
+    return;
+  }
+  if (offset != FLASH_COMMAND_1) {
+    return;
+  }
+  switch (value) {
+    case 0x90:
+      flashIDMode = true;
+      break;
+    case 0xF0:
+      flashIDMode = false;
+      break;
+    case 0x80:
+      flashErasing = true;
+      break;
+    case 0xA0:
+      flashProgram = true;
+      break;
+    case 0xB0:
+      flashBankSwitch = type == BACKUP_FLASH128;
+      break;
+  }
+}
+
+// https://problemkaputt.de/gbatek.htm#gbacartbackupeeprom
+// Read:  11, address, 0                  then 4 junk bits and 64 data bits come back
+// Write: 10, address, 64 data bits, 0    then reads give 1 once it's done (right away here)
+void Backup::writeSerial(uint16_t value) {
+  if (eepromBitCount == sizeof(eepromBits)) {
+    eepromBitCount = 0;  // garbage, start over
+  }
+  eepromBits[eepromBitCount++] = value & 1;
+  if (eepromBitCount >= 2 && eepromBits[0] == 0) {
+    eepromBitCount = 0;  // not a command
+    return;
+  }
+  if (eepromBitCount < 2) {
+    return;
+  }
+
+  bool read = eepromBits[1] == 1;
+  if (eepromAddressBits == 0) {
+    // Only a full-length write gives the width away before the next read does
+    if (!read && eepromBitCount == 2 + 14 + 64 + 1) {
+      eepromAddressBits = 14;
+      runEEPROMCommand();
+    }
+    return;
+  }
+  uint32_t length = 2 + eepromAddressBits + (read ? 0 : 64) + 1;
+  if (eepromBitCount == length) {
+    runEEPROMCommand();
+  }
+}
+
+uint16_t Backup::readSerial() {
+  if (eepromBitCount > 0 && eepromAddressBits == 0) {
+    // First read after the first command: its length tells how wide addresses are
+    if (eepromBitCount == 9 || eepromBitCount == 2 + 6 + 64 + 1) {
+      eepromAddressBits = 6;
+    } else if (eepromBitCount == 17) {
+      eepromAddressBits = 14;
+    }
+    if (eepromAddressBits != 0) {
+      runEEPROMCommand();
+    }
+  }
+  if (eepromReadPosition < EEPROM_READ_BITS) {
+    uint32_t position = eepromReadPosition++;
+    return position < 4 ? 0 : (eepromReadData >> (63 - (position - 4))) & 1;
+  }
+  return 1;  // ready
+}
+
+void Backup::runEEPROMCommand() {
+  auto bits = [this](uint32_t from, uint32_t count) {
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+      value = (value << 1) | eepromBits[from + i];
+    }
+    return value;
+  };
+  uint32_t blocks = std::min<uint32_t>(file->size() / 8, 1u << eepromAddressBits);
+  uint8_t *block = file->data() + (bits(2, eepromAddressBits) & (blocks - 1)) * 8;
+
+  if (eepromBits[1] == 1) {
+    eepromReadData = 0;
+    for (int i = 0; i < 8; ++i) {
+      eepromReadData = (eepromReadData << 8) | block[i];
+    }
+    eepromReadPosition = 0;
+  } else {
+    for (uint32_t i = 0; i < 8; ++i) {
+      block[i] = (uint8_t)bits(2 + eepromAddressBits + i * 8, 8);
+    }
+    file->markDirty();
+    eepromReadPosition = EEPROM_READ_BITS;
+  }
+  eepromBitCount = 0;
+}
+
+void Backup::saveState(StateWriter &writer) const {
+  writer.put(type);
+  writer.put(flashState);
+  writer.put(flashIDMode);
+  writer.put(flashErasing);
+  writer.put(flashProgram);
+  writer.put(flashBankSwitch);
+  writer.put(flashBank);
+  writer.put(eepromAddressBits);
+  writer.put(eepromBits);
+  writer.put(eepromBitCount);
+  writer.put(eepromReadData);
+  writer.put(eepromReadPosition);
+  writer.put((uint32_t)file->size());
+  writer.putBytes(file->data(), file->size());
+}
+
+void Backup::loadState(StateReader &reader) {
+  BackupType savedType;
+  reader.get(savedType);
+  if (savedType != type) {
+    throw std::runtime_error("Backup::loadState: state has another save type");
+  }
+  reader.get(flashState);
+  reader.get(flashIDMode);
+  reader.get(flashErasing);
+  reader.get(flashProgram);
+  reader.get(flashBankSwitch);
+  reader.get(flashBank);
+  reader.get(eepromAddressBits);
+  reader.get(eepromBits);
+  reader.get(eepromBitCount);
+  reader.get(eepromReadData);
+  reader.get(eepromReadPosition);
+  uint32_t size;
+  reader.get(size);
+  if (size != file->size()) {
+    throw std::runtime_error("Backup::loadState: state has another save size");
+  }
+  // Only a real change goes to the disk, run-ahead loads a state every frame
+  const uint8_t *saved = reader.take(size);
+  if (std::memcmp(file->data(), saved, size) != 0) {
+    std::memcpy(file->data(), saved, size);
+    file->markDirty();
+  }
+}
@@ -0,0 +1,644 @@
+#include "../include/bios.hpp"
+
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "../include/arm.hpp"
+#include "../include/cpu.hpp"
+#include "../include/interrupts.hpp"
+#include "../include/memory.hpp"
+
+/*
+High-level emulation of the BIOS calls.
+The bios region is empty, so instead of jumping to the SWI vector we do the work natively
+and charge roughly what the real routine would have cost.
+Cycle counts are taken from the loop bodies of the original BIOS routines (no waitstates).
+*/
+
+// Cycle costs
+#define DIV_CYCLES_PROLOGUE 4
+#define DIV_CYCLES_PER_LOOP 13
+#define DIV_CYCLES_EPILOGUE 7
+#define SQRT_CYCLES_BASE 17
+#define SQRT_CYCLES_PER_BIT 11
+#define ARCTAN_CYCLES 37
+#define ARCTAN2_CYCLES 76  // includes the division done before ArcTan
+#define CPUSET_CYCLES_SETUP 27
+#define CPUSET_CYCLES_PER_UNIT 9
+#define CPUSET_FILL_CYCLES_PER_UNIT 6
+#define CPUFASTSET_CYCLES_SETUP 31
+#define CPUFASTSET_CYCLES_PER_BLOCK 21  // LDMIA/STMIA of 8 words
+#define CPUFASTSET_FILL_CYCLES_PER_BLOCK 11
+#define BGAFFINE_CYCLES_PER_ENTRY 98
+#define OBJAFFINE_CYCLES_PER_ENTRY 55
+#define UNCOMP_CYCLES_SETUP 40
+#define LZ77_CYCLES_PER_BYTE 10
+#define HUFF_CYCLES_PER_BIT 9
+#define RL_CYCLES_PER_BYTE 7
+#define IRQ_ENTRY_CYCLES 24  // STMFD of 6 registers, MOV, ADD, LDR PC
+#define IRQ_EXIT_CYCLES 14   // LDMFD of 6 registers, SUBS PC
+
+namespace BIOS {
+
+namespace {
+
+// Signed 1.14 sine table with 256 steps per turn, same layout as the one in the BIOS
+struct SineTable {
+  int16_t values[256];
+  SineTable() {
+    for (int i = 0; i < 256; ++i) {
+      values[i] = (int16_t)std::lround(std::sin(i * 2.0 * M_PI / 256.0) * 0x4000);
+    }
+  }
+};
+
+const SineTable sineTable;
+
+int32_t sine(uint32_t angle) {
+  return sineTable.values[angle & 0xFF];
+}
+
+int32_t cosine(uint32_t angle) {
+  return sineTable.values[(angle + 64) & 0xFF];
+}
+
+// Source of compressed data, always has to live in host memory (ROM or RAM)
+const uint8_t* sourcePointer(Memory* memory, uint32_t address, size_t& available) {
+  uint8_t* host = memory->getHostPointer(address, available);
+  if (host == nullptr) {
+    std::cerr << "BIOS: compressed data is not in RAM/ROM: 0x" << std::hex << address
+              << std::endl;
+    throw std::out_of_range("BIOS: invalid source address");
+  }
+  return host;
+}
+
+// Destination of decompressed data.
+// Writes straight into the host buffer when the whole output fits in one region,
+// otherwise falls back to the regular bus.
+struct Output {
+  Memory* memory;
+  uint32_t address;
+  uint8_t* host;
+  size_t size;
+  size_t pos;
+
+  Output(Memory* mem, uint32_t addr, size_t length)
+      : memory(mem), address(addr), host(nullptr), size(length), pos(0) {
+    size_t available = 0;
+    uint8_t* pointer = memory->getHostPointer(address, available);
+    if (pointer != nullptr && available >= size) {
+      host = pointer;
+      memory->markWritten(address, size);
+    }
+  }
+
+  bool done() const {
+    return pos >= size;
+  }
+
+  void put(uint8_t value) {
+    if (host != nullptr) {
+      host[pos] = value;
+    } else {
+      memory->writeByte(address + pos, value);
+    }
+    ++pos;
+  }
+
+  uint8_t at(size_t index) const {
+    return host != nullptr ? host[index] : memory->readByte(address + index);
+  }
+};
+
+uint32_t readSource32(const uint8_t* src) {
+  return src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+}  // namespace
+
+bool handleSWI(CPU* cpu, Memory* memory, uint32_t comment) {
+  Registers& regs = cpu->getRegisters();
+  switch (comment) {
+    case SWI_HALT:
+    case SWI_STOP:  // only keypad/serial/Game Pak IRQs end it, close enough
+      swiHalt(cpu);
+      return true;
+    case SWI_INTR_WAIT:
+      swiIntrWait(cpu, memory, regs.r[0] != 0, regs.r[1]);
+      return true;
+    case SWI_VBLANK_INTR_WAIT:
+      swiIntrWait(cpu, memory, true, IRQ_VBLANK);
+      return true;
+    case SWI_DIV:
+      swiDiv(cpu, (int32_t)regs.r[0], (int32_t)regs.r[1]);
+      return true;
+    case SWI_DIV_ARM:
+      swiDiv(cpu, (int32_t)regs.r[1], (int32_t)regs.r[0]);
+      return true;
+    case SWI_SQRT:
+      swiSqrt(cpu);
+      return true;
+    case SWI_ARCTAN:
+      swiArcTan(cpu);
+      return true;
+    case SWI_ARCTAN2:
+      swiArcTan2(cpu);
+      return true;
+    case SWI_CPU_SET:
+      swiCpuSet(cpu, memory);
+      return true;
+    case SWI_CPU_FAST_SET:
+      swiCpuFastSet(cpu, memory);
+      return true;
+    case SWI_BG_AFFINE_SET:
+      swiBgAffineSet(cpu, memory);
+      return true;
+    case SWI_OBJ_AFFINE_SET:
+      swiObjAffineSet(cpu, memory);
+      return true;
+    case SWI_LZ77_UNCOMP_WRAM:
+    case SWI_LZ77_UNCOMP_VRAM:
+      swiLZ77UnComp(cpu, memory);
+      return true;
+    case SWI_HUFF_UNCOMP:
+      swiHuffUnComp(cpu, memory);
+      return true;
+    case SWI_RL_UNCOMP_WRAM:
+    case SWI_RL_UNCOMP_VRAM:
+      swiRLUnComp(cpu, memory);
+      return true;
+    case SWI_HLE_IRQ_RETURN:
+      if (regs.pc - 4 != BIOS_IRQ_RETURN) {
+        break;  // only the trap installHLE() put there
+      }
+      returnFromIRQ(cpu, memory);
+      return true;
+    default:
+      break;
+  }
+  std::cerr << "BIOS: SWI 0x" << std::hex << comment << " is not emulated" << std::endl;
+  return false;
+}
+
+void installHLE(Memory* memory) {
+  size_t available = 0;
+  uint8_t* bios = memory->getHostPointer(BIOS_START, available);
+  uint32_t trap = 0xEF000000 | (SWI_HLE_IRQ_RETURN << 16);  // SWI, always
+  std::memcpy(bios + BIOS_IRQ_RETURN, &trap, 4);
+  memory->markWritten(BIOS_IRQ_RETURN, 4);
+}
+
+// Registers the BIOS handler saves on the IRQ stack (STMFD sp!, {r0-r3, r12, lr})
+static const int irqSaved[] = {0, 1, 2, 3, 12, 14};
+#define IRQ_SAVED_COUNT 6
+
+void enterIRQ(CPU* cpu, Memory* memory) {
+  Registers& regs = cpu->getRegisters();
+  cpu->enterException(VECTOR_IRQ, MODE_IRQ, regs.pc + 4);
+  regs.sp -= IRQ_SAVED_COUNT * 4;
+  for (int i = 0; i < IRQ_SAVED_COUNT; ++i) {
+    memory->writeWord(regs.sp + i * 4, regs.r[irqSaved[i]]);
+  }
+  regs.r[0] = IO_START;
+  regs.lr = BIOS_IRQ_RETURN;
+  regs.pc = memory->readWord(BIOS_IRQ_HANDLER) & ~3u;  // LDR PC doesn't switch to Thumb
+  cpu->addCycles(IRQ_ENTRY_CYCLES);
+}
+
+void returnFromIRQ(CPU* cpu, Memory* memory) {
+  Registers& regs = cpu->getRegisters();
+  for (int i = 0; i < IRQ_SAVED_COUNT; ++i) {
+    regs.r[irqSaved[i]] = memory->readWord(regs.sp + i * 4);
+  }
+  regs.sp += IRQ_SAVED_COUNT * 4;
+  regs.pc = regs.lr - 4;  // SUBS pc, lr, #4
+  cpu->setCPSR(regs.spsr);
+  cpu->addCycles(IRQ_EXIT_CYCLES);
+}
+
+void swiHalt(CPU* cpu) {
+  cpu->getInterrupts().halt();
+}
+
+// Sleeps until the user IRQ handler has put one of the 'wanted' IRQ_* bits into
+// BIOS_IRQ_FLAGS, 'discard' drops the ones already there first. Sets IME like the BIOS.
+// Instead of looping in here the SWI runs again after every interrupt until it's satisfied,
+// CPU::getHLEIntrWait() tells those rounds apart from a new call.
+void swiIntrWait(CPU* cpu, Memory* memory, bool discard, uint16_t wanted) {
+  Registers& regs = cpu->getRegisters();
+  bool again = cpu->getHLEIntrWait() != 0;
+  if (again) {
+    wanted = cpu->getHLEIntrWait();
+  } else {
+    memory->writeHalfWord(INTERRUPT_MASTER, 1);
+  }
+  uint16_t flags = memory->readHalfWord(BIOS_IRQ_FLAGS);
+  if (discard && !again) {
+    memory->writeHalfWord(BIOS_IRQ_FLAGS, flags & ~wanted);
+  } else if (flags & wanted) {
+    memory->writeHalfWord(BIOS_IRQ_FLAGS, flags & ~wanted);
+    cpu->setHLEIntrWait(0);
+    return;
+  }
+
+  cpu->setHLEIntrWait(wanted);
+  regs.pc -= (regs.cpsr & CPSR_THUMB) ? 2 : 4;
+  cpu->getInterrupts().halt();
+}
+
+void swiDiv(CPU* cpu, int32_t numerator, int32_t denominator) {
+  Registers& regs = cpu->getRegisters();
+  if (denominator == 0) {
+    // The real BIOS never returns here, this is what it leaves behind before hanging
+    regs.r[0] = numerator < 0 ? -1 : 1;
+    regs.r[1] = numerator;
+    regs.r[3] = 1;
+    cpu->addCycles(DIV_CYCLES_PROLOGUE + DIV_CYCLES_EPILOGUE);
+    return;
+  }
+
+  // INT_MIN / -1 wraps around on hardware
+  int32_t quotient = (numerator == INT32_MIN && denominator == -1)
+                         ? INT32_MIN
+                         : numerator / denominator;
+  int32_t remainder = (numerator == INT32_MIN && denominator == -1)
+                          ? 0
+                          : numerator % denominator;
+  regs.r[0] = quotient;
+  regs.r[1] = remainder;
+  regs.r[3] = quotient < 0 ? -(uint32_t)quotient : quotient;
+
+  // The BIOS does one shift-subtract loop per bit of difference in magnitude
+  uint32_t num = numerator < 0 ? -(uint32_t)numerator : numerator;
+  uint32_t den = denominator < 0 ? -(uint32_t)denominator : denominator;
+  int loops = std::countl_zero(den) - std::countl_zero(num);
+  if (loops < 1) {
+    loops = 1;
+  }
+  cpu->addCycles(DIV_CYCLES_PROLOGUE + DIV_CYCLES_PER_LOOP * loops + DIV_CYCLES_EPILOGUE);
+}
+
+void swiSqrt(CPU* cpu) {
+  Registers& regs = cpu->getRegisters();
+  uint32_t value = regs.r[0];
+
+  // Bitwise integer square root, same result as the BIOS
+  uint32_t result = 0;
+  uint32_t bit = 1u << 30;
+  while (bit > value) {
+    bit >>= 2;
+  }
+  while (bit != 0) {
+    if (value >= result + bit) {
+      value -= result + bit;
+      result = (result >> 1) + bit;
+    } else {
+      result >>= 1;
+    }
+    bit >>= 2;
+  }
+  regs.r[0] = result;
+
+  int bits = 32 - std::countl_zero(regs.r[0]);
+  cpu->addCycles(SQRT_CYCLES_BASE + SQRT_CYCLES_PER_BIT * bits);
+}
+
+// Polynomial approximation used by the BIOS, input and output are 1.14 fixed point
+static int32_t arcTan(int32_t value) {
+  int32_t a = -((value * value) >> 14);
+  int32_t b = ((0xA9 * a) >> 14) + 0x390;
+  b = ((b * a) >> 14) + 0x91C;
+  b = ((b * a) >> 14) + 0xFB6;
+  b = ((b * a) >> 14) + 0x16AA;
+  b = ((b * a) >> 14) + 0x2081;
+  b = ((b * a) >> 14) + 0x3651;
+  b = ((b * a) >> 14) + 0xA2F9;
+  return (value * b) >> 16;
+}
+
+void swiArcTan(CPU* cpu) {
+  Registers& regs = cpu->getRegisters();
+  regs.r[0] = arcTan((int32_t)regs.r[0]);
+  cpu->addCycles(ARCTAN_CYCLES);
+}
+
+void swiArcTan2(CPU* cpu) {
+  Registers& regs = cpu->getRegisters();
+  int32_t x = (int32_t)regs.r[0];
+  int32_t y = (int32_t)regs.r[1];
+  uint32_t result = 0;
+
+  if (y == 0) {
+    result = x >= 0 ? 0 : 0x8000;
+  } else if (x == 0) {
+    result = y >= 0 ? 0x4000 : 0xC000;
+  } else if (y >= 0) {
+    if (x >= 0) {
+      result = x >= y ? arcTan((y << 14) / x) : 0x4000 - arcTan((x << 14) / y);
+    } else {
+      result = -x >= y ? 0x8000 + arcTan((y << 14) / x) : 0x4000 - arcTan((x << 14) / y);
+    }
+  } else {
+    if (x <= 0) {
+      result = -x > -y ? 0x8000 + arcTan((y << 14) / x) : 0xC000 - arcTan((x << 14) / y);
+    } else {
+      result = x >= -y ? 0x10000 + arcTan((y << 14) / x) : 0xC000 - arcTan((x << 14) / y);
+    }
+  }
+
+  regs.r[0] = result & 0xFFFF;
+  cpu->addCycles(ARCTAN2_CYCLES);
+}
+
+// r0 = source, r1 = destination, r2 = count (bits 0-20) | fill (bit 24) | 32-bit (bit 26)
+void swiCpuSet(CPU* cpu, Memory* memory) {
+  Registers& regs = cpu->getRegisters();
+  bool fill = CHECK_BIT(regs.r[2], 24);
+  bool word = CHECK_BIT(regs.r[2], 26);
+  uint32_t count = regs.r[2] & 0x1FFFFF;
+  uint32_t unit = word ? 4 : 2;
+  uint32_t src = regs.r[0] & ~(unit - 1);
+  uint32_t dst = regs.r[1] & ~(unit - 1);
+  size_t length = (size_t)count * unit;
+
+  cpu->addCycles(CPUSET_CYCLES_SETUP +
+                 count * (fill ? CPUSET_FILL_CYCLES_PER_UNIT : CPUSET_CYCLES_PER_UNIT));
+  if (count == 0) {
+    return;
+  }
+
+  size_t srcAvailable = 0, dstAvailable = 0;
+  uint8_t* srcHost = memory->getHostPointer(src, srcAvailable);
+  uint8_t* dstHost = memory->getHostPointer(dst, dstAvailable);
+  bool overlap = src < dst + length && dst < src + (fill ? unit : length);
+
+  if (srcHost != nullptr && dstHost != nullptr && srcAvailable >= (fill ? unit : length) &&
+      dstAvailable >= length && !overlap) {
+    if (fill) {
+      // Replicate the first unit, then double the filled span each step
+      std::memcpy(dstHost, srcHost, unit);
+      size_t filled = unit;
+      while (filled < length) {
+        size_t chunk = std::min(filled, length - filled);
+        std::memcpy(dstHost + filled, dstHost, chunk);
+        filled += chunk;
+      }
+    } else {
+      std::memcpy(dstHost, srcHost, length);
+    }
+    memory->markWritten(dst, length);
+    return;
+  }
+
+  // Slow path: I/O targets or overlapping copies, done unit by unit like the BIOS does
+  if (word) {
+    uint32_t value = memory->readWord(src);
+    for (uint32_t i = 0; i < count; ++i) {
+      if (!fill) value = memory->readWord(src + i * 4);
+      memory->writeWord(dst + i * 4, value);
+    }
+  } else {
+    uint16_t value = memory->readHalfWord(src);
+    for (uint32_t i = 0; i < count; ++i) {
+      if (!fill) value = memory->readHalfWord(src + i * 2);
+      memory->writeHalfWord(dst + i * 2, value);
+    }
+  }
+}
+
+// Same as CpuSet but always 32-bit and in blocks of 8 words
+void swiCpuFastSet(CPU* cpu, Memory* memory) {
+  Registers& regs = cpu->getRegisters();
+  bool fill = CHECK_BIT(regs.r[2], 24);
+  uint32_t count = ((regs.r[2] & 0x1FFFFF) + 7) & ~7u;  // rounded up to whole blocks
+  uint32_t src = regs.r[0] & ~3u;
+  uint32_t dst = regs.r[1] & ~3u;
+  size_t length = (size_t)count * 4;
+
+  cpu->addCycles(CPUFASTSET_CYCLES_SETUP +
+                 (count / 8) *
+                     (fill ? CPUFASTSET_FILL_CYCLES_PER_BLOCK : CPUFASTSET_CYCLES_PER_BLOCK));
+  if (count == 0) {
+    return;
+  }
+
+  size_t srcAvailable = 0, dstAvailable = 0;
+  uint8_t* srcHost = memory->getHostPointer(src, srcAvailable);
+  uint8_t* dstHost = memory->getHostPointer(dst, dstAvailable);
+  bool overlap = src < dst + length && dst < src + (fill ? 4 : length);
+
+  if (srcHost != nullptr && dstHost != nullptr && srcAvailable >= (fill ? 4 : length) &&
+      dstAvailable >= length && !overlap) {
+    if (fill) {
+      std::memcpy(dstHost, srcHost, 4);
+      size_t filled = 4;
+      while (filled < length) {
+        size_t chunk = std::min(filled, length - filled);
+        std::memcpy(dstHost + filled, dstHost, chunk);
+        filled += chunk;
+      }
+    } else {
+      std::memcpy(dstHost, srcHost, length);
+    }
+    memory->markWritten(dst, length);
+    return;
+  }
+
+  uint32_t value = memory->readWord(src);
+  for (uint32_t i = 0; i < count; ++i) {
+    if (!fill) value = memory->readWord(src + i * 4);
+    memory->writeWord(dst + i * 4, value);
+  }
+}
+
+// r0 = source (20 bytes per entry), r1 = destination (16 bytes per entry), r2 = count
+void swiBgAffineSet(CPU* cpu, Memory* memory) {
+  Registers& regs = cpu->getRegisters();
+  uint32_t src = regs.r[0];
+  uint32_t dst = regs.r[1];
+  uint32_t count = regs.r[2];
+
+  for (uint32_t i = 0; i < count; ++i, src += 20, dst += 16) {
+    int32_t originX = (int32_t)memory->readWord(src);                // 19.8 texture coordinates
+    int32_t originY = (int32_t)memory->readWord(src + 4);
+    int32_t displayX = (int16_t)memory->readHalfWord(src + 8);       // screen coordinates
+    int32_t displayY = (int16_t)memory->readHalfWord(src + 10);
+    int32_t scaleX = (int16_t)memory->readHalfWord(src + 12);        // 8.8
+    int32_t scaleY = (int16_t)memory->readHalfWord(src + 14);
+    uint32_t angle = memory->readHalfWord(src + 16) >> 8;            // only the upper 8 bits
+
+    int32_t pa = (scaleX * cosine(angle)) >> 14;
+    int32_t pb = (-scaleX * sine(angle)) >> 14;
+    int32_t pc = (scaleY * sine(angle)) >> 14;
+    int32_t pd = (scaleY * cosine(angle)) >> 14;
+
+    memory->writeHalfWord(dst, (uint16_t)pa);
+    memory->writeHalfWord(dst + 2, (uint16_t)pb);
+    memory->writeHalfWord(dst + 4, (uint16_t)pc);
+    memory->writeHalfWord(dst + 6, (uint16_t)pd);
+    memory->writeWord(dst + 8, (uint32_t)(originX - (pa * displayX + pb * displayY)));
+    memory->writeWord(dst + 12, (uint32_t)(originY - (pc * displayX + pd * displayY)));
+  }
+  cpu->addCycles(BGAFFINE_CYCLES_PER_ENTRY * count);
+}
+
+// r0 = source (8 bytes per entry), r1 = destination, r2 = count, r3 = stride (2 or 8)
+void swiObjAffineSet(CPU* cpu, Memory* memory) {
+  Registers& regs = cpu->getRegisters();
+  uint32_t src = regs.r[0];
+  uint32_t dst = regs.r[1];
+  uint32_t count = regs.r[2];
+  uint32_t stride = regs.r[3];
+
+  for (uint32_t i = 0; i < count; ++i, src += 8, dst += stride * 4) {
+    int32_t scaleX = (int16_t)memory->readHalfWord(src);
+    int32_t scaleY = (int16_t)memory->readHalfWord(src + 2);
+    uint32_t angle = memory->readHalfWord(src + 4) >> 8;
+
+    memory->writeHalfWord(dst, (uint16_t)((scaleX * cosine(angle)) >> 14));
+    memory->writeHalfWord(dst + stride, (uint16_t)((-scaleX * sine(angle)) >> 14));
+    memory->writeHalfWord(dst + stride * 2, (uint16_t)((scaleY * sine(angle)) >> 14));
+    memory->writeHalfWord(dst + stride * 3, (uint16_t)((scaleY * cosine(angle)) >> 14));
+  }
+  cpu->addCycles(OBJAFFINE_CYCLES_PER_ENTRY * count);
+}
+
+// Header: bits 0-7 = type (0x10), bits 8-31 = decompressed size
+// Flag byte per 8 blocks, bit set = back reference (4 bit length-3, 12 bit displacement-1)
+void swiLZ77UnComp(CPU* cpu, Memory* memory) {
+  Registers& regs = cpu->getRegisters();
+  size_t available = 0;
+  const uint8_t* src = sourcePointer(memory, regs.r[0], available);
+  if (available < 4) {
+    throw std::out_of_range("BIOS::swiLZ77UnComp: truncated header");
+  }
+  uint32_t size = readSource32(src) >> 8;
+  Output out(memory, regs.r[1], size);
+  size_t pos = 4;
+
+  while (!out.done() && pos < available) {
+    uint8_t flags = src[pos++];
+    for (int block = 0; block < 8 && !out.done(); ++block, flags <<= 1) {
+      if ((flags & 0x80) == 0) {
+        if (pos >= available) break;
+        out.put(src[pos++]);
+        continue;
+      }
+      if (pos + 1 >= available) break;
+      uint32_t length = (src[pos] >> 4) + 3;
+      uint32_t displacement = (((src[pos] & 0xF) << 8) | src[pos + 1]) + 1;
+      pos += 2;
+      if (displacement > out.pos) {
+        std::cerr << "BIOS: LZ77 reference before start of output" << std::endl;
+        displacement = out.pos;  // the BIOS would read garbage, keep it in bounds
+        if (displacement == 0) break;
+      }
+      for (uint32_t i = 0; i < length && !out.done(); ++i) {
+        out.put(out.at(out.pos - displacement));
+      }
+    }
+  }
+
+  cpu->addCycles(UNCOMP_CYCLES_SETUP + LZ77_CYCLES_PER_BYTE * out.pos);
+}
+
+// Header: bits 0-3 = data size (4 or 8), bits 4-7 = type (2), bits 8-31 = decompressed size
+// Followed by the tree size byte, the tree and a bitstream of 32-bit words (MSB first)
+void swiHuffUnComp(CPU* cpu, Memory* memory) {
+  Registers& regs = cpu->getRegisters();
+  size_t available = 0;
+  const uint8_t* src = sourcePointer(memory, regs.r[0] & ~3u, available);
+  if (available < 5) {
+    throw std::out_of_range("BIOS::swiHuffUnComp: truncated header");
+  }
+  uint32_t header = readSource32(src);
+  uint32_t dataBits = header & 0xF;
+  uint32_t size = header >> 8;
+  size_t treeSize = (src[4] + 1) * 2;
+  size_t root = 5;
+  size_t pos = 4 + treeSize;
+  if (dataBits != 4 && dataBits != 8) {
+    std::cerr << "BIOS: Huffman data size " << std::dec << dataBits << " is not supported"
+              << std::endl;
+    return;
+  }
+
+  Output out(memory, regs.r[1], size & ~3u);
+  size_t node = root;
+  uint32_t buffer = 0;  // decoded units are packed into words before being written
+  uint32_t bufferBits = 0;
+  uint64_t bitsRead = 0;
+
+  while (!out.done() && pos + 3 < available) {
+    uint32_t bits = readSource32(src + pos);
+    pos += 4;
+    for (int i = 31; i >= 0 && !out.done(); --i) {
+      ++bitsRead;
+      uint8_t value = src[node];
+      size_t next = (node & ~(size_t)1) + (value & 0x3F) * 2 + 2;
+      bool right = (bits >> i) & 1;
+      bool leaf = right ? (value & 0x40) : (value & 0x80);
+      node = next + (right ? 1 : 0);
+      if (node >= available) {
+        throw std::out_of_range("BIOS::swiHuffUnComp: tree node out of range");
+      }
+      if (!leaf) {
+        continue;
+      }
+
+      buffer |= (uint32_t)(src[node] & ((1 << dataBits) - 1)) << bufferBits;
+      bufferBits += dataBits;
+      node = root;
+      if (bufferBits == 32) {
+        out.put(buffer & 0xFF);
+        out.put((buffer >> 8) & 0xFF);
+        out.put((buffer >> 16) & 0xFF);
+        out.put(buffer >> 24);
+        buffer = 0;
+        bufferBits = 0;
+      }
+    }
+  }
+
+  cpu->addCycles(UNCOMP_CYCLES_SETUP + HUFF_CYCLES_PER_BIT * bitsRead);
+}
+
+// Header: bits 0-7 = type (0x30), bits 8-31 = decompressed size
+// Flag byte: bit 7 set = run of (bits 0-6) + 3 copies of the next byte,
+// otherwise (bits 0-6) + 1 literal bytes follow
+void swiRLUnComp(CPU* cpu, Memory* memory) {
+  Registers& regs = cpu->getRegisters();
+  size_t available = 0;
+  const uint8_t* src = sourcePointer(memory, regs.r[0], available);
+  if (available < 4) {
+    throw std::out_of_range("BIOS::swiRLUnComp: truncated header");
+  }
+  uint32_t size = readSource32(src) >> 8;
+  Output out(memory, regs.r[1], size);
+  size_t pos = 4;
+
+  while (!out.done() && pos < available) {
+    uint8_t flag = src[pos++];
+    if (flag & 0x80) {
+      if (pos >= available) break;
+      uint32_t length = (flag & 0x7F) + 3;
+      uint8_t value = src[pos++];
+      for (uint32_t i = 0; i < length && !out.done(); ++i) {
+        out.put(value);
+      }
+    } else {
+      uint32_t length = (flag & 0x7F) + 1;
+      for (uint32_t i = 0; i < length && !out.done() && pos < available; ++i) {
+        out.put(src[pos++]);
+      }
+    }
+  }
+
+  cpu->addCycles(UNCOMP_CYCLES_SETUP + RL_CYCLES_PER_BYTE * out.pos);
+}
+
+}  // namespace BIOS
@@ -0,0 +1,285 @@
+#include "../include/blockcache.hpp"
+
+#include <cstring>
+
+#include "../include/arm.hpp"
+#include "../include/blockcachefile.hpp"
+#include "../include/codediscovery.hpp"
+#include "../include/debugger.hpp"
+#include "../include/stats.hpp"
+
+#define IDLE_LOOP_MAX_INSTRUCTIONS 8
+
+BlockCache::BlockCache(Memory &memory, Stats &stats)
+    : memory(memory), stats(stats), romHash{}, dirty(false), discovery(nullptr) {}
+
+BlockCache::~BlockCache() = default;
+
+// A short block that branches back to its own start and rebuilds all of its state from
+// memory on every pass (loads, compares, register ops fed by earlier instructions of the
+// same pass) can't leave the loop until something else writes that memory.
+static bool isIdleLoop(const Block &block) {
+  const std::vector<DecodedInst> &instructions = block.instructions;
+  if (instructions.size() > IDLE_LOOP_MAX_INSTRUCTIONS) {
+    return false;
+  }
+  uint32_t branch = instructions.back().opcode;
+  uint32_t branchAddress = block.start + (uint32_t)(instructions.size() - 1) * 4;
+  int32_t offset = (int32_t)(branch << 8) >> 6;
+  if ((branch & 0x0F000000) != 0x0A000000 || branchAddress + 8 + offset != block.start) {
+    return false;  // not a B back to the start
+  }
+
+  uint32_t reads[IDLE_LOOP_MAX_INSTRUCTIONS], writes[IDLE_LOOP_MAX_INSTRUCTIONS];
+  uint32_t allWrites = 0;
+  bool setsFlags = false;
+  for (size_t i = 0; i + 1 < instructions.size(); ++i) {
+    uint32_t inst = instructions[i].opcode;
+    uint32_t rn = EXTRACT_BITS(inst, 16, 4), rd = EXTRACT_BITS(inst, 12, 4);
+    if ((inst >> 28) != 0xE) {
+      return false;  // conditional writes would carry state over to the next pass
+    }
+
+    if ((inst & 0x0F300000) == 0x05100000) {  // LDR/LDRB [Rn, #imm], no writeback
+      reads[i] = 1 << rn;
+      writes[i] = 1 << rd;
+    } else if ((inst & 0x0C000000) == 0 && (inst & 0x02000090) != 0x00000090) {
+      uint32_t opcode = EXTRACT_BITS(inst, 21, 4);
+      bool compare = opcode >= 0x8 && opcode <= 0xB;
+      if ((compare && !CHECK_BIT(inst, 20)) || (opcode >= 0x5 && opcode <= 0x7)) {
+        return false;  // MRS/MSR/BX, or reads the carry of the last pass
+      }
+      reads[i] = (opcode == 0xD || opcode == 0xF) ? 0 : 1 << rn;
+      if (!CHECK_BIT(inst, 25)) {
+        if (EXTRACT_BITS(inst, 4, 8) == 0x06) return false;  // RRX reads the carry
+        reads[i] |= 1 << EXTRACT_BITS(inst, 0, 4);
+        if (CHECK_BIT(inst, 4)) reads[i] |= 1 << EXTRACT_BITS(inst, 8, 4);
+      }
+      writes[i] = compare ? 0 : 1 << rd;
+      setsFlags |= CHECK_BIT(inst, 20);
+    } else {
+      return false;
+    }
+    if (writes[i] & (1 << 15)) {
+      return false;
+    }
+    allWrites |= writes[i];
+  }
+  if ((branch >> 28) != 0xE && !setsFlags) {
+    return false;  // the exit condition has to be computed inside the loop
+  }
+
+  // Nothing may read a register the loop writes before this pass wrote it
+  uint32_t written = 0;
+  for (size_t i = 0; i + 1 < instructions.size(); ++i) {
+    if (reads[i] & allWrites & ~written) {
+      return false;
+    }
+    written |= writes[i];
+  }
+  return true;
+}
+
+// Backwards over the block: which flags does anything still read after each instruction.
+// Flag setters whose result is dead switch to the handler that skips them.
+static void analyzeFlags(Block &block) {
+  uint8_t live = FLAGS_ALL;
+  for (size_t i = block.instructions.size(); i-- > 0;) {
+    DecodedInst &inst = block.instructions[i];
+    inst.liveFlags = live;
+    if (inst.handler == ARM_HANDLER_NOP) {
+      continue;
+    }
+    if (live == 0) {
+      inst.handler = ARM::noFlagsHandler(inst.opcode, inst.handler);
+    }
+    live &= ~ARM::flagsWritten(inst.opcode, inst.handler);
+    live |= ARM::flagsRead(inst.opcode, inst.handler);
+  }
+}
+
+// Pairs that run as one step, see ARM::fusedHandler(). The second instruction keeps its own
+// handler, nothing jumps into the middle of a pair without starting a new block.
+static void fusePairs(Block &block) {
+  std::vector<DecodedInst> &instructions = block.instructions;
+  for (size_t i = 0; i + 1 < instructions.size(); ++i) {
+    DecodedInst &first = instructions[i];
+    const DecodedInst &second = instructions[i + 1];
+    if (first.handler == ARM_HANDLER_NOP || second.handler == ARM_HANDLER_NOP) {
+      continue;
+    }
+    first.handler = ARM::fusedHandler(first.opcode, first.handler, second.opcode, second.handler);
+    if (ARM::isFusedHandler(first.handler)) {
+      ++i;
+    }
+  }
+}
+
+const Block *BlockCache::lookup(uint32_t address) {
+  auto it = blocks.find(address);
+  if (it != blocks.end() && it->second.isCurrent(memory)) {
+    stats.blockCacheHits.add();
+    return &it->second;
+  }
+
+  stats.blockCacheMisses.add();
+  if (it == blocks.end()) {
+    if (blocks.size() >= BLOCK_CACHE_MAX_BLOCKS) {
+      blocks.clear();  // cheaper than tracking what's cold, and rare
+    }
+    it = blocks.emplace(address, Block()).first;
+    if (load(address, it->second) || adopt(address, it->second)) {
+      return &it->second;
+    }
+  }
+  if (!decode(address, it->second)) {
+    blocks.erase(it);
+    return nullptr;
+  }
+  return &it->second;
+}
+
+void BlockCache::clear() {
+  blocks.clear();
+}
+
+// Reads straight from the host buffers, decoding must not show up as bus accesses
+bool BlockCache::decode(uint32_t address, Block &block) {
+  uint32_t pageStart, pageLength;
+  MemoryRegion region;
+  const uint8_t *page = memory.getFetchPage(address, pageStart, pageLength, region);
+  if (page == nullptr) {
+    return false;
+  }
+  const Debugger *debugger = memory.getDebugger();
+  if (debugger != nullptr && debugger->hasBreakpoints()) {
+    // A breakpoint is run the regular way, where the fetch checks it
+    if (debugger->isBreakpoint(address)) {
+      return false;
+    }
+    uint32_t start = pageStart;
+    uint32_t end = pageStart + pageLength;
+    debugger->clampToBreakpoints(address, start, end);
+    pageLength = end - pageStart;
+  }
+
+  if (!decodeBlock(page, pageStart, pageLength, address, block)) {
+    return false;
+  }
+  block.generation = memory.getMappingGeneration();
+  block.version = memory.getPageVersion(address);
+  block.decodedVersion = *block.version;
+  block.region = region;
+  dirty |= region == REGION_ROM;
+  return true;
+}
+
+bool BlockCache::decodeBlock(const uint8_t *page, uint32_t pageStart, uint32_t pageLength,
+                             uint32_t address, Block &block) {
+  block.start = address;
+  block.flags = 0;
+  block.instructions.clear();
+  for (uint32_t offset = address - pageStart;
+       offset + 4 <= pageLength && block.instructions.size() < BLOCK_MAX_INSTRUCTIONS;
+       offset += 4) {
+    uint32_t inst;
+    std::memcpy(&inst, page + offset, 4);
+    uint8_t handler = inst == 0 ? ARM_HANDLER_NOP : ARM::decodeHandler(inst);
+    block.instructions.push_back({inst, handler, FLAGS_ALL});
+    if (ARM::endsBlock(inst)) {
+      break;
+    }
+  }
+  if (block.instructions.empty()) {
+    return false;
+  }
+
+  analyzeFlags(block);
+  fusePairs(block);
+  if (isIdleLoop(block)) {
+    block.flags |= BLOCK_IDLE_LOOP;
+  }
+  return true;
+}
+
+// ROM blocks decoded by an earlier run
+bool BlockCache::load(uint32_t address, Block &block) {
+  if (file == nullptr || address < ROM_START || address > ROM_END ||
+      !file->find(address, block) || !place(address, block)) {
+    return false;
+  }
+  stats.blockCacheLoads.add();
+  return true;
+}
+
+// ROM blocks the discovery threads decoded ahead of the CPU
+bool BlockCache::adopt(uint32_t address, Block &block) {
+  if (discovery == nullptr || address < ROM_START || address > ROM_END ||
+      !discovery->take(address, block) || !place(address, block)) {
+    return false;
+  }
+  stats.blockCacheDiscovered.add();
+  dirty = true;
+  return true;
+}
+
+// A ROM block decoded elsewhere, checked against the fetch page it lands in
+bool BlockCache::place(uint32_t address, Block &block) {
+  uint32_t pageStart, pageLength;
+  MemoryRegion region;
+  if (memory.getFetchPage(address, pageStart, pageLength, region) == nullptr ||
+      address - pageStart + block.byteSize() > pageLength) {
+    return false;  // can't happen with a matching ROM hash, but don't trust the disk
+  }
+  const Debugger *debugger = memory.getDebugger();
+  if (debugger != nullptr && debugger->hasBreakpoints()) {
+    uint32_t start = address;
+    uint32_t end = address + block.byteSize();
+    debugger->clampToBreakpoints(address, start, end);
+    if (debugger->isBreakpoint(address) || end != address + block.byteSize()) {
+      return false;  // decoded again, cut at the breakpoint
+    }
+  }
+  block.generation = memory.getMappingGeneration();
+  block.version = memory.getPageVersion(address);
+  block.decodedVersion = *block.version;
+  block.region = region;
+  return true;
+}
+
+void BlockCache::attachDirectory(const std::string &directory) {
+  romHash = SHA1::hash(memory.getROMData(), memory.getROMSize());
+  filePath = directory + "/" + SHA1::toHex(romHash) + ".pbblocks";
+  file = std::make_unique<BlockCacheFile>(filePath, romHash);
+}
+
+// Everything from the old file plus the ROM blocks decoded this run
+bool BlockCache::saveFile() {
+  if (filePath.empty()) {
+    return false;
+  }
+  if (!dirty) {
+    return true;  // everything came from the file
+  }
+
+  std::vector<const Block *> saved;
+  for (const auto &entry : blocks) {
+    const Block &block = entry.second;
+    if (block.region == REGION_ROM && block.isCurrent(memory)) {
+      saved.push_back(&block);
+    }
+  }
+
+  std::vector<Block> previous;
+  size_t previousCount = file != nullptr ? file->getBlockCount() : 0;
+  previous.reserve(previousCount);
+  for (size_t i = 0; i < previousCount; ++i) {
+    uint32_t start = file->getBlockStart(i);
+    if (blocks.count(start) == 0) {
+      previous.emplace_back();
+      if (file->find(start, previous.back())) saved.push_back(&previous.back());
+    }
+  }
+  dirty = false;
+  return BlockCacheFile::write(filePath, romHash, saved);
+}
@@ -0,0 +1,205 @@
+#include "../include/blockcachefile.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "../include/arm.hpp"
+#include "../include/blockcache.hpp"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifndef PLUSBOY_VERSION
+#define PLUSBOY_VERSION "dev"
+#endif
+
+struct BlockCacheFile::Header {
+  char magic[8];
+  uint32_t format;
+  uint32_t decoder;
+  char version[16];
+  uint8_t rom[20];
+  uint32_t blockCount;
+  uint32_t instructionCount;
+};
+
+struct BlockCacheFile::IndexEntry {
+  uint32_t start;
+  uint32_t first;
+  uint16_t count;
+  uint16_t flags;
+};
+
+struct BlockCacheFile::Instruction {
+  uint32_t opcode;
+  uint8_t handler;
+  uint8_t liveFlags;
+  uint8_t reserved[2];
+};
+
+static void fillVersion(char (&version)[16]) {
+  std::memset(version, 0, sizeof(version));
+  std::strncpy(version, PLUSBOY_VERSION, sizeof(version) - 1);
+}
+
+BlockCacheFile::BlockCacheFile(const std::string &path, const SHA1::Digest &romHash)
+    : mapping(nullptr),
+      mappingSize(0),
+      header(nullptr),
+      index(nullptr),
+      instructions(nullptr) {
+#ifdef __linux__
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;  // first boot of this ROM
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(Header)) {
+    close(fd);
+    return;
+  }
+  mappingSize = info.st_size;
+  mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    mapping = nullptr;
+    return;
+  }
+
+  header = static_cast<const Header *>(mapping);
+  char version[16];
+  fillVersion(version);
+  size_t expected = sizeof(Header) + (size_t)header->blockCount * sizeof(IndexEntry) +
+                    (size_t)header->instructionCount * sizeof(Instruction);
+  if (std::memcmp(header->magic, BLOCK_FILE_MAGIC, 8) != 0 ||
+      header->format != BLOCK_FILE_VERSION || header->decoder != ARM::decoderFingerprint() ||
+      std::memcmp(header->version, version, sizeof(version)) != 0 ||
+      std::memcmp(header->rom, romHash.data(), romHash.size()) != 0 || expected != mappingSize) {
+    return;  // stale, isValid() stays false
+  }
+  index = reinterpret_cast<const IndexEntry *>(header + 1);
+  instructions = reinterpret_cast<const Instruction *>(index + header->blockCount);
+#else
+  (void)path, (void)romHash;
+#endif
+}
+
+BlockCacheFile::~BlockCacheFile() {
+#ifdef __linux__
+  if (mapping != nullptr) munmap(mapping, mappingSize);
+#endif
+}
+
+size_t BlockCacheFile::getBlockCount() const {
+  return index != nullptr ? header->blockCount : 0;
+}
+
+uint32_t BlockCacheFile::getBlockStart(size_t i) const {
+  return index[i].start;
+}
+
+// Handlers are jump table indices to the threaded interpreter, so each one has to be what
+// BlockCache would have picked for its opcode: the decoded one, its dead flags variant or a
+// pair fused with the instruction after it. The fingerprint only covers the header.
+static bool validHandlers(const Block &block) {
+  const std::vector<DecodedInst> &instructions = block.instructions;
+  for (size_t i = 0; i < instructions.size(); ++i) {
+    const DecodedInst &inst = instructions[i];
+    if (inst.opcode == 0) {
+      if (inst.handler != ARM_HANDLER_NOP) return false;
+      continue;
+    }
+    uint8_t decoded = ARM::decodeHandler(inst.opcode);
+    uint8_t noFlags = ARM::noFlagsHandler(inst.opcode, decoded);
+    if (inst.handler == decoded || inst.handler == noFlags) {
+      continue;
+    }
+    if (!ARM::isFusedHandler(inst.handler) || i + 1 == instructions.size()) {
+      return false;
+    }
+    const DecodedInst &second = instructions[i + 1];
+    if (second.handler == ARM_HANDLER_NOP ||
+        (inst.handler != ARM::fusedHandler(inst.opcode, decoded, second.opcode, second.handler) &&
+         inst.handler != ARM::fusedHandler(inst.opcode, noFlags, second.opcode, second.handler))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool BlockCacheFile::find(uint32_t address, Block &block) const {
+  if (index == nullptr) {
+    return false;
+  }
+  const IndexEntry *end = index + header->blockCount;
+  const IndexEntry *entry = std::lower_bound(
+      index, end, address, [](const IndexEntry &e, uint32_t a) { return e.start < a; });
+  if (entry == end || entry->start != address || entry->count == 0 ||
+      (uint64_t)entry->first + entry->count > header->instructionCount) {
+    return false;
+  }
+
+  block.start = address;
+  block.flags = (uint8_t)entry->flags;
+  block.instructions.resize(entry->count);
+  for (uint32_t i = 0; i < entry->count; ++i) {
+    const Instruction &inst = instructions[entry->first + i];
+    block.instructions[i] = {inst.opcode, inst.handler, inst.liveFlags};
+  }
+  return validHandlers(block);  // else decoded afresh
+}
+
+bool BlockCacheFile::write(const std::string &path, const SHA1::Digest &romHash,
+                           const std::vector<const Block *> &blocks) {
+  std::vector<const Block *> sorted(blocks);
+  std::sort(sorted.begin(), sorted.end(),
+            [](const Block *a, const Block *b) { return a->start < b->start; });
+
+  Header header = {};
+  std::memcpy(header.magic, BLOCK_FILE_MAGIC, 8);
+  header.format = BLOCK_FILE_VERSION;
+  header.decoder = ARM::decoderFingerprint();
+  fillVersion(header.version);
+  std::memcpy(header.rom, romHash.data(), romHash.size());
+  header.blockCount = (uint32_t)sorted.size();
+
+  std::vector<IndexEntry> entries;
+  std::vector<Instruction> records;
+  for (const Block *block : sorted) {
+    entries.push_back({block->start, (uint32_t)records.size(),
+                       (uint16_t)block->instructions.size(), block->flags});
+    for (const DecodedInst &inst : block->instructions) {
+      records.push_back({inst.opcode, inst.handler, inst.liveFlags, {0, 0}});
+    }
+  }
+  header.instructionCount = (uint32_t)records.size();
+
+  // Several emulators may boot the same ROM at once, each writes its own file first
+#ifdef __linux__
+  std::string temporary = path + "." + std::to_string(getpid()) + ".tmp";
+#else
+  std::string temporary = path + ".tmp";
+#endif
+  std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    std::cerr << "BlockCacheFile: Failed to write " << temporary << std::endl;
+    return false;
+  }
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(IndexEntry));
+  file.write(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(Instruction));
+  file.close();
+  if (!file || std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::cerr << "BlockCacheFile: Failed to write " << path << std::endl;
+    std::remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
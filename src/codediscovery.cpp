@@ -0,0 +1,281 @@
+#include "../include/codediscovery.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#include "../include/arm.hpp"
+#include "../include/memory.hpp"
+
+CodeDiscovery::CodeDiscovery(const Memory &memory, uint32_t threads)
+    : rom(memory.getROMData(), memory.getROMData() + memory.getROMSize()),
+      armSeen((rom.size() / 4 + 31) / 32),
+      thumbSeen((rom.size() / 2 + 31) / 32),
+      busy(0),
+      stopping(false) {
+  push(ROM_START, false);  // the header's branch to the entry point
+  threads = std::clamp<uint32_t>(threads, 1, DISCOVERY_MAX_THREADS);
+  for (uint32_t i = 0; i < threads; ++i) {
+    workers.emplace_back(&CodeDiscovery::workerLoop, this);
+  }
+}
+
+CodeDiscovery::~CodeDiscovery() {
+  {
+    std::lock_guard<std::mutex> lock(workMutex);
+    stopping = true;
+  }
+  workChanged.notify_all();
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+}
+
+bool CodeDiscovery::take(uint32_t address, Block &block) {
+  std::unique_lock<std::mutex> lock(readyMutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    return false;  // a worker is adding blocks, decoding is quicker than waiting for it
+  }
+  auto it = ready.find(address);
+  if (it == ready.end()) {
+    return false;
+  }
+  block = std::move(it->second);
+  ready.erase(it);
+  blocksTaken.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void CodeDiscovery::wait() {
+  std::unique_lock<std::mutex> lock(workMutex);
+  workChanged.wait(lock, [this] { return stopping || (work.empty() && busy == 0); });
+}
+
+void CodeDiscovery::workerLoop() {
+  std::unique_lock<std::mutex> lock(workMutex);
+  for (;;) {
+    workChanged.wait(lock, [this] { return stopping || !work.empty(); });
+    if (stopping) {
+      return;
+    }
+    Entry entry = work.back();
+    work.pop_back();
+    busy++;
+    lock.unlock();
+    if (entry.thumb) {
+      followThumb(entry.address);
+    } else {
+      followARM(entry.address);
+    }
+    lock.lock();
+    busy--;
+    if (work.empty() && busy == 0) {
+      workChanged.notify_all();  // wait()
+    }
+  }
+}
+
+bool CodeDiscovery::markSeen(std::vector<std::atomic<uint32_t>> &bits, uint32_t index) {
+  uint32_t bit = 1u << (index % 32);
+  return bits[index / 32].fetch_or(bit, std::memory_order_relaxed) & bit;
+}
+
+void CodeDiscovery::push(uint32_t address, bool thumb) {
+  address &= thumb ? ~1u : ~3u;
+  uint32_t offset = address - ROM_START;
+  if (address < ROM_START || offset >= rom.size() || offset + (thumb ? 2 : 4) > rom.size()) {
+    return;  // RAM code is copied there at runtime, nothing to follow yet
+  }
+  if (thumb ? markSeen(thumbSeen, offset / 2) : markSeen(armSeen, offset / 4)) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(workMutex);
+    work.push_back({address, thumb});
+  }
+  workChanged.notify_one();
+}
+
+bool CodeDiscovery::readWord(uint32_t address, uint32_t &value) const {
+  uint32_t offset = address - ROM_START;
+  if (address < ROM_START || offset >= rom.size() || offset + 4 > rom.size()) {
+    return false;
+  }
+  std::memcpy(&value, &rom[offset], 4);
+  return true;
+}
+
+bool CodeDiscovery::readHalfWord(uint32_t address, uint16_t &value) const {
+  uint32_t offset = address - ROM_START;
+  if (address < ROM_START || offset >= rom.size() || offset + 2 > rom.size()) {
+    return false;
+  }
+  std::memcpy(&value, &rom[offset], 2);
+  return true;
+}
+
+// Registers an instruction may write, for forgetting what they were loaded with. Stores,
+// compares and the like count too, that only forgets more than it has to.
+static uint32_t armWrites(uint32_t inst) {
+  uint32_t rn = EXTRACT_BITS(inst, 16, 4), rd = EXTRACT_BITS(inst, 12, 4);
+  switch (EXTRACT_BITS(inst, 25, 3)) {
+    case 0:
+    case 1:
+      // Multiplies put Rd in Rn's place, halfword transfers can write Rn back
+      return 1 << rd | ((inst & 0x02000090) == 0x00000090 ? 1 << rn : 0);
+    case 2:
+    case 3:
+      return 1 << rd | 1 << rn;
+    case 4:
+      return (CHECK_BIT(inst, 20) ? inst & 0xFFFF : 0) | 1 << rn;
+    case 5:
+      return CHECK_BIT(inst, 24) ? 0x500F : 0;  // BL: LR, and what the callee may clobber
+    default:
+      return (inst & 0x0F000000) == 0x0F000000 ? 0xF : 0;  // SWIs return in r0-r3
+  }
+}
+
+// The same for the Thumb low registers
+static uint32_t thumbWrites(uint16_t inst) {
+  switch (inst >> 12) {
+    case 0x0:
+    case 0x1:
+    case 0x5:
+    case 0x6:
+    case 0x7:
+    case 0x8:
+      return 1 << (inst & 7);  // shifts, ADD/SUB, loads and stores
+    case 0x2:
+    case 0x3:
+    case 0x9:
+    case 0xA:
+      return 1 << EXTRACT_BITS(inst, 8, 3);  // immediates, SP-relative, ADD Rd, SP/PC
+    case 0x4:
+      if (inst >= 0x4800) {
+        return 1 << EXTRACT_BITS(inst, 8, 3);  // LDR Rd, [PC, #imm]
+      } else if (inst >= 0x4700) {
+        return 0;  // BX
+      }
+      return inst < 0x4400 || !CHECK_BIT(inst, 7) ? 1 << (inst & 7) : 0;  // ALU, hi reg ops
+    case 0xB:
+      return (inst & 0x0E00) == 0x0C00 ? inst & 0xFF : 0;  // POP
+    case 0xC:
+      return (inst & 0xFF) | 1 << EXTRACT_BITS(inst, 8, 3);  // LDMIA/STMIA
+    case 0xD:
+      return (inst & 0xFF00) == 0xDF00 ? 0xF : 0;  // SWI
+    case 0xF:
+      return 0xF;  // BL, the callee may clobber r0-r3
+    default:
+      return 0;
+  }
+}
+
+// One block, the same one BlockCache::decode makes there
+void CodeDiscovery::followARM(uint32_t address) {
+  uint32_t pageOffset = (address - ROM_START) & ~(uint32_t)(FETCH_PAGE_SIZE - 1);
+  uint32_t pageLength = (uint32_t)std::min<size_t>(FETCH_PAGE_SIZE, rom.size() - pageOffset);
+  Block block;
+  if (!BlockCache::decodeBlock(&rom[pageOffset], ROM_START + pageOffset, pageLength, address,
+                               block)) {
+    return;
+  }
+
+  uint32_t constants[16];  // what registers were last loaded with, for BX
+  uint32_t known = 0;
+  for (size_t i = 0; i < block.instructions.size(); ++i) {
+    uint32_t inst = block.instructions[i].opcode;
+    uint32_t pc = address + (uint32_t)i * 4;
+    uint32_t rd = EXTRACT_BITS(inst, 12, 4);
+    if (inst == 0 || (inst >> 28) == 0xF ||
+        ARM::decodeHandler(inst) == ARM::dispatchTableSize() - 1) {
+      return;  // padding, NV or coprocessor: ran into data
+    }
+    known &= ~armWrites(inst);
+    if ((inst & 0x0F7F0000) == 0x051F0000) {  // LDR Rd, [PC, #imm]
+      uint32_t imm = EXTRACT_BITS(inst, 0, 12);
+      uint32_t literal = pc + 8 + (CHECK_BIT(inst, 23) ? imm : -imm);
+      known = readWord(literal, constants[rd]) ? known | 1 << rd : known & ~(1 << rd);
+    } else if ((inst & 0x0FFF0000) == 0x028F0000) {  // ADD Rd, PC, #imm
+      constants[rd] = pc + 8 + std::rotr<uint32_t>(inst & 0xFF, EXTRACT_BITS(inst, 8, 4) * 2);
+      known |= 1 << rd;
+    } else if ((inst & 0x0FFFFFF0) == 0x012FFF10) {  // BX Rm
+      uint32_t rm = EXTRACT_BITS(inst, 0, 4);
+      if (known & (1 << rm)) push(constants[rm], constants[rm] & 1);
+    } else if ((inst & 0x0E000000) == 0x0A000000) {  // B, BL
+      int32_t offset = (int32_t)(inst << 8) >> 6;
+      push(pc + 8 + offset, false);
+      if (CHECK_BIT(inst, 24)) functionsFound.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  // Carries on after it unless it ended in an unconditional jump (BL and SWI come back)
+  uint32_t last = block.instructions.back().opcode;
+  bool calls = (last & 0x0F000000) == 0x0B000000 || (last & 0x0F000000) == 0x0F000000;
+  if (!ARM::endsBlock(last) || (last >> 28) != 0xE || calls) {
+    push(address + block.byteSize(), false);
+  }
+  {
+    std::lock_guard<std::mutex> lock(readyMutex);
+    ready.emplace(address, std::move(block));
+  }
+  blocksFound.fetch_add(1, std::memory_order_relaxed);
+}
+
+// A straight run of Thumb code, up to where it can't go on
+void CodeDiscovery::followThumb(uint32_t address) {
+  uint32_t constants[8];  // low registers, loaded from literal pools or ADD Rd, PC
+  uint32_t known = 0;
+  for (uint32_t count = 0; count < DISCOVERY_MAX_RUN; ++count, address += 2) {
+    uint16_t inst;
+    if (!readHalfWord(address, inst) ||
+        (count != 0 && markSeen(thumbSeen, (address - ROM_START) / 2))) {
+      return;  // out of the ROM, or another run got here first
+    }
+    uint32_t pc = address + 4;
+    uint32_t rd = EXTRACT_BITS(inst, 8, 3);
+    known &= ~thumbWrites(inst);
+    if ((inst & 0xF800) == 0x4800) {  // LDR Rd, [PC, #imm]
+      uint32_t literal = (pc & ~3u) + EXTRACT_BITS(inst, 0, 8) * 4;
+      known = readWord(literal, constants[rd]) ? known | 1 << rd : known & ~(1 << rd);
+    } else if ((inst & 0xF800) == 0xA000) {  // ADD Rd, PC, #imm
+      constants[rd] = (pc & ~3u) + EXTRACT_BITS(inst, 0, 8) * 4;
+      known |= 1 << rd;
+    } else if ((inst & 0xFF87) == 0x4700) {  // BX Rs
+      uint32_t rs = EXTRACT_BITS(inst, 3, 4);
+      if (rs == 15) {
+        push(pc & ~3u, false);
+      } else if (rs < 8 && (known & (1 << rs))) {
+        push(constants[rs], constants[rs] & 1);
+      }
+      return;
+    } else if ((inst & 0xF000) == 0xD000) {
+      uint32_t condition = EXTRACT_BITS(inst, 8, 4);
+      if (condition == 0xE) {
+        return;  // undefined
+      }
+      if (condition != 0xF) {  // Bcc, SWI goes on after it
+        push(pc + ((int32_t)(int8_t)(inst & 0xFF) << 1), true);
+      }
+    } else if ((inst & 0xF800) == 0xE000) {  // B
+      push(pc + ((int32_t)((uint32_t)inst << 21) >> 20), true);
+      return;
+    } else if ((inst & 0xF800) == 0xE800) {
+      return;  // BLX, ARMv5
+    } else if ((inst & 0xF800) == 0xF000) {  // BL, two halves
+      uint16_t low;
+      if (!readHalfWord(address + 2, low) || (low & 0xF800) != 0xF800) {
+        return;  // half a BL: data
+      }
+      int32_t high = (int32_t)((uint32_t)inst << 21) >> 9;
+      push(pc + high + ((low & 0x7FF) << 1), true);
+      functionsFound.fetch_add(1, std::memory_order_relaxed);
+      address += 2;
+      count++;
+    } else if ((inst & 0xF800) == 0xF800) {
+      return;  // the second half of a BL on its own
+    } else if ((inst & 0xFF00) == 0xBD00 || (inst & 0xFF87) == 0x4687 ||
+               (inst & 0xFF87) == 0x4487) {
+      return;  // POP {PC}, MOV PC or ADD PC
+    }
+  }
+}
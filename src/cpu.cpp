@@ -2,22 +2,145 @@
 
 #include <stdint.h>
 
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <bitset>
+#include <cstring>
 #include <iostream>
 #include <ostream>
+#include <stdexcept>
 
 #include "../include/arm.hpp"  // Include ARM namespace
+#include "../include/bios.hpp"
+#include "../include/debugger.hpp"
+#include "../include/log.hpp"
 #include "../include/memory.hpp"
+#include "../include/profiler.hpp"
+#include "../include/savestate.hpp"
+#include "../include/trace.hpp"
+
+// Opcodes are copied straight out of the host buffers
+static_assert(std::endian::native == std::endian::little, "host must be little endian");
+
+// Stack pointers the BIOS sets up before jumping to the cartridge
+#define BOOT_SP_USER 0x03007F00
+#define BOOT_SP_IRQ 0x03007FA0
+#define BOOT_SP_SUPERVISOR 0x03007FE0
+
+// Register bank of every mode number, undefined modes behave like user mode
+static constexpr std::array<uint8_t, 32> modeBanks = [] {
+  std::array<uint8_t, 32> banks{};
+  banks[MODE_FIQ] = BANK_FIQ;
+  banks[MODE_IRQ] = BANK_IRQ;
+  banks[MODE_SUPERVISOR] = BANK_SUPERVISOR;
+  banks[MODE_ABORT] = BANK_ABORT;
+  banks[MODE_UNDEFINED] = BANK_UNDEFINED;
+  return banks;
+}();
+
+// What a switch from one bank to another has to swap
+#define SWAP_R8_R12 0x1    // only FIQ has its own r8-r12
+#define SWAP_R13_R14 0x2   // and SPSR, every bank but user/system has its own
+static constexpr std::array<std::array<uint8_t, BANK_COUNT>, BANK_COUNT> bankSwaps = [] {
+  std::array<std::array<uint8_t, BANK_COUNT>, BANK_COUNT> swaps{};
+  for (int from = 0; from < BANK_COUNT; ++from) {
+    for (int to = 0; to < BANK_COUNT; ++to) {
+      swaps[from][to] = (from != to ? SWAP_R13_R14 : 0) |
+                        ((from == BANK_FIQ) != (to == BANK_FIQ) ? SWAP_R8_R12 : 0);
+    }
+  }
+  return swaps;
+}();
 
 CPU::CPU(Memory &mem)
-    : memory(mem)  // Constructor
+    : memory(mem),  // Constructor
+      cycles(0),
+      hleBios(true),  // No BIOS image is shipped, so HLE is the default
+      hleIntrWait(0),
+      profiler(nullptr),
+      tracer(nullptr),
+      interrupts(*this, mem, scheduler),
+      ppu(mem, scheduler, interrupts),
+      keypad(mem, interrupts),
+      serial(*this, mem, scheduler, interrupts),
+      blockCache(mem, stats),
+      threadedInterpreter(true),
+      validatingFlags(false),
+      fetchBase(nullptr),
+      fetchStart(0),
+      fetchLength(0),
+      fetchGeneration(0),
+      fetchRegion(REGION_ROM),
+      lastFetchEnd(0xFFFFFFFF),
+      prefetchCount(0),
+      prefetchProgress(0)
 {
-  for (int i = 0; i < 16; ++i) {
-    registers.r[i] = 0;
-  }
-  registers.pc = ROM_START;
-  registers.cpsr = 0x00000010;  // Initialize CPSR as User (Thumb mode is off by default)
+  memory.setStats(&stats);
+  ppu.setStats(&stats);
+  memory.setInterrupts(&interrupts);
+  memory.setSerial(&serial);
+  BIOS::installHLE(&memory);
+  std::memset(registers.r, 0, sizeof(registers.r));
+  std::memset(registers.bankedR8R12, 0, sizeof(registers.bankedR8R12));
+  std::memset(registers.bankedSP, 0, sizeof(registers.bankedSP));
+  std::memset(registers.bankedLR, 0, sizeof(registers.bankedLR));
+  std::memset(registers.bankedSPSR, 0, sizeof(registers.bankedSPSR));
   registers.spsr = 0;
+
+  // Where the BIOS leaves things: system mode, ARM state, stacks at the top of IWRAM
+  registers.cpsr = MODE_SYSTEM;
+  registers.bankedSP[BANK_IRQ] = BOOT_SP_IRQ;
+  registers.bankedSP[BANK_SUPERVISOR] = BOOT_SP_SUPERVISOR;
+  registers.sp = BOOT_SP_USER;
+  registers.pc = ROM_START;
+}
+
+void CPU::switchMode(uint32_t mode) {
+  uint32_t from = modeBanks[registers.cpsr & CPSR_MODE_MASK];
+  uint32_t to = modeBanks[mode & CPSR_MODE_MASK];
+  registers.cpsr = (registers.cpsr & ~CPSR_MODE_MASK) | (mode & CPSR_MODE_MASK);
+
+  uint8_t swaps = bankSwaps[from][to];
+  if (swaps & SWAP_R8_R12) {
+    std::memcpy(registers.bankedR8R12[from == BANK_FIQ], &registers.r[8], 5 * sizeof(uint32_t));
+    std::memcpy(&registers.r[8], registers.bankedR8R12[to == BANK_FIQ], 5 * sizeof(uint32_t));
+  }
+  if (swaps & SWAP_R13_R14) {
+    registers.bankedSP[from] = registers.sp;
+    registers.bankedLR[from] = registers.lr;
+    registers.bankedSPSR[from] = registers.spsr;
+    registers.sp = registers.bankedSP[to];
+    registers.lr = registers.bankedLR[to];
+    registers.spsr = registers.bankedSPSR[to];
+  }
+}
+
+void CPU::setCPSR(uint32_t value) {
+  uint32_t changed = value ^ registers.cpsr;
+  if (changed & CPSR_MODE_MASK) {
+    switchMode(value);
+  }
+  registers.cpsr = value;
+  if (changed & CPSR_IRQ_DISABLE) {
+    interrupts.update();
+  }
+}
+
+// https://problemkaputt.de/gbatek.htm#armcpuexceptions
+void CPU::enterException(uint32_t vector, uint32_t mode, uint32_t returnAddress) {
+  uint32_t saved = registers.cpsr;
+  switchMode(mode);
+  registers.spsr = saved;
+  registers.lr = returnAddress;
+  registers.cpsr = (registers.cpsr & ~CPSR_THUMB) | CPSR_IRQ_DISABLE;
+  if (mode == MODE_FIQ) {
+    registers.cpsr |= CPSR_FIQ_DISABLE;
+  }
+  registers.pc = vector;
+  if (!(saved & CPSR_IRQ_DISABLE)) {
+    interrupts.update();
+  }
 }
 
 void CPU::updateFlags(uint32_t result, bool carry, bool overflow) {
@@ -63,41 +186,363 @@ void CPU::writeRegister(int index, uint32_t value) {
 }
 
 void CPU::executeinst() {
-  if ((registers.cpsr & 0x20) != 0) {
+  uint32_t pc = registers.pc;
+  uint32_t opcode;
+  bool thumb = (registers.cpsr & 0x20) != 0;
+  if (thumb) {
     // Thumb mode: 16-bit inst
-    uint16_t inst = memory.readHalfWord(registers.pc);
+    uint16_t inst = fetchHalfWord(registers.pc);
+    if (profiler != nullptr) {
+      profiler->recordInstruction(pc, inst, true, cycles);
+    }
+    cycles += fetchCycles(pc, true);
     registers.pc += 2;
+    stats.thumbInstructions.add();
+    opcode = inst;
     decodeThumb(inst);
   } else {
     // ARM mode: 32-bit inst
-    // The ARM inst is always word-aligned, so we can read 4 bytes directly
     // The functions are defined in arm.cpp
-    uint32_t inst = memory.readWord(registers.pc);
-    registers.pc += 4;
-    ARM::decodeARM(this, &memory, inst);
+    opcode = fetchARM();
+    ARM::decodeARM(this, &memory, opcode);
+  }
+
+  retireInstruction();
+  if (tracer != nullptr) {
+    tracer->record(pc, opcode, thumb, registers.r, registers.cpsr);
   }
 }
 
-// Run the CPU
-void CPU::run() {
+uint32_t CPU::fetchARM() {
+  // The ARM inst is always word-aligned, so we can read 4 bytes directly
+  uint32_t pc = registers.pc;
+  uint32_t inst = fetchWord(pc);
+  if (profiler != nullptr) {
+    profiler->recordInstruction(pc, inst, false, cycles);
+  }
+  cycles += fetchCycles(pc, false);
+  registers.pc += 4;
+  stats.armInstructions.add();
+  return inst;
+}
+
+// Internal cycles aren't modelled yet, only the bus
+void CPU::retireInstruction() {
+  bool romAccessed;
+  uint32_t dataCycles = memory.takeBusCycles(romAccessed);
+  cycles += dataCycles;
+  runPrefetch(dataCycles, romAccessed);
+}
+
+bool CPU::refreshFetchPage(uint32_t address) {
+  fetchGeneration = memory.getMappingGeneration();
+  fetchBase = memory.getFetchPage(address, fetchStart, fetchLength, fetchRegion);
+  if (fetchBase == nullptr) {
+    fetchLength = 0;
+    return false;
+  }
+  if (memory.getDebugger() != nullptr && memory.getDebugger()->hasBreakpoints()) {
+    clampFetchPage(address);
+  }
+  return true;
+}
+
+// Only the fetch from a breakpoint comes back here, the page stops short of every other
+void CPU::clampFetchPage(uint32_t address) {
+  Debugger *debugger = memory.getDebugger();
+  uint32_t start = fetchStart;
+  uint32_t end = fetchStart + fetchLength;
+  if (debugger->isBreakpoint(address)) {
+    uint32_t length = fetchLength;
+    fetchLength = 0;  // no page if it stops
+    debugger->hitBreakpoint(address);  // throws if it stops, nothing has run yet
+    fetchLength = length;
+    start = address;
+    fetchGeneration--;  // stale on purpose, the next fetch (even from here) is checked again
+  }
+  debugger->clampToBreakpoints(address, start, end);
+  fetchBase += start - fetchStart;
+  fetchStart = start;
+  fetchLength = end - start;
+}
+
+Debugger *CPU::getDebugger() {
+  return memory.getDebugger();
+}
+
+void CPU::setDebugger(Debugger *d) {
+  memory.setDebugger(d);
+  dropDecodedCode();
+}
+
+void CPU::dropDecodedCode() {
+  blockCache.clear();
+  fetchLength = 0;
+}
+
+// The threaded interpreter reads opcodes from the decode cache, this only keeps the fetch
+// page (and with it the region used for fetch timing) in step
+void CPU::syncFetchPage(uint32_t address) {
+  if (address - fetchStart >= fetchLength || fetchGeneration != memory.getMappingGeneration()) {
+    refreshFetchPage(address);
+  }
+}
+
+uint32_t CPU::fetchWord(uint32_t address) {
+  uint32_t offset = address - fetchStart;
+  if ((uint64_t)offset + 4 > fetchLength || fetchGeneration != memory.getMappingGeneration()) {
+    // Executing from I/O or unmapped space goes through the bus (and throws there)
+    if (!refreshFetchPage(address) || address - fetchStart + 4 > fetchLength) {
+      return memory.readWord(address);
+    }
+    offset = address - fetchStart;
+  }
+  stats.regionReads[fetchRegion].add();
+  uint32_t value;
+  std::memcpy(&value, fetchBase + offset, 4);
+  return value;
+}
+
+uint16_t CPU::fetchHalfWord(uint32_t address) {
+  uint32_t offset = address - fetchStart;
+  if ((uint64_t)offset + 2 > fetchLength || fetchGeneration != memory.getMappingGeneration()) {
+    if (!refreshFetchPage(address) || address - fetchStart + 2 > fetchLength) {
+      return memory.readHalfWord(address);
+    }
+    offset = address - fetchStart;
+  }
+  stats.regionReads[fetchRegion].add();
+  uint16_t value;
+  std::memcpy(&value, fetchBase + offset, 2);
+  return value;
+}
+
+bool CPU::peekHalfWord(uint32_t address, uint16_t &value) const {
+  uint32_t offset = address - fetchStart;
+  if ((uint64_t)offset + 2 > fetchLength || fetchGeneration != memory.getMappingGeneration()) {
+    return false;
+  }
+  std::memcpy(&value, fetchBase + offset, 2);
+  return true;
+}
+
+// Cycles taken by an opcode fetch.
+// https://problemkaputt.de/gbatek.htm#gbasystemcontrol (Game Pak prefetch)
+uint32_t CPU::fetchCycles(uint32_t address, bool thumb) {
+  uint32_t halfwords = thumb ? 1 : 2;
+  bool sequential = address == lastFetchEnd;
+  lastFetchEnd = address + halfwords * 2;
+
+  if (fetchRegion != REGION_ROM) {
+    return memory.getAccessCycles(fetchRegion, thumb ? 1 : 2);
+  }
+
+  uint32_t s = memory.getROMSequentialCycles();
+  if (!sequential) {
+    // Branch: the buffer is flushed and starts over behind this opcode
+    prefetchCount = 0;
+    prefetchProgress = 0;
+    return memory.getAccessCycles(REGION_ROM, 1) + (halfwords - 1) * s;
+  }
+  if (!memory.isPrefetchEnabled()) {
+    return halfwords * s;
+  }
+
+  // Buffered halfwords cost 1 cycle, otherwise wait for the one being fetched
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < halfwords; ++i) {
+    if (prefetchCount > 0) {
+      prefetchCount--;
+      total += 1;
+    } else {
+      total += s - prefetchProgress;
+      prefetchProgress = 0;
+    }
+  }
+  return total;
+}
+
+// The buffer keeps filling while the CPU is busy with something other than the Game Pak
+void CPU::runPrefetch(uint32_t idleCycles, bool romAccessed) {
+  if (romAccessed) {
+    // Data access to the Game Pak stops the prefetcher, the next opcode fetch is non-sequential
+    prefetchCount = 0;
+    prefetchProgress = 0;
+    lastFetchEnd = 0xFFFFFFFF;
+    return;
+  }
+  if (!memory.isPrefetchEnabled() || fetchRegion != REGION_ROM) {
+    return;
+  }
+
+  uint32_t s = memory.getROMSequentialCycles();
+  prefetchProgress += idleCycles;
+  while (prefetchProgress >= s && prefetchCount < 8) {
+    prefetchCount++;
+    prefetchProgress -= s;
+  }
+  if (prefetchCount == 8) {
+    prefetchProgress = 0;
+  }
+}
+
+// Everything the scheduler has due by now
+void CPU::runEvents() {
+  EventType type;
+  uint64_t when;
+  while (scheduler.popDue(cycles, type, when)) {
+    stats.schedulerEvents.add();
+    if (type == EVENT_IRQ) {
+      interrupts.dispatch();
+    } else if (type == EVENT_SERIAL || type == EVENT_LINK_SYNC) {
+      serial.handleEvent(type, when);
+    } else {
+      ppu.handleEvent(type, when);
+    }
+  }
+}
+
+// Events due by now, then the wait of a halted CPU, until there's an instruction to run
+bool CPU::readyToExecute(uint64_t target) {
+  const uint64_t &horizon = scheduler.getHorizon();
+  while (cycles < target) {
+    if (cycles >= horizon) {
+      if (memory.getDebugger() != nullptr) {
+        memory.getDebugger()->takeStop();  // a watchpoint breaks out to here after the access
+      }
+      runEvents();
+    }
+    if (interrupts.isHalted()) {
+      // Nothing happens until an event raises an interrupt, go straight to the next one
+      uint64_t wake = std::max(cycles, std::min(target, scheduler.getNextEvent()));
+      stats.haltedCycles.add(wake - cycles);
+      cycles = wake;
+      continue;
+    }
+    return true;
+  }
+  return false;
+}
+
+// Run until at least 'cycleBudget' cycles have passed.
+// The interpreters run to the scheduler's horizon, events only get looked at once it's hit.
+void CPU::runFor(uint64_t cycleBudget) {
+  ScopedTimer timer(&stats, SUBSYSTEM_CPU);
+  uint64_t target = cycles + cycleBudget;
+  scheduler.setBudgetEnd(target);
+  const uint64_t &horizon = scheduler.getHorizon();
+  while (readyToExecute(target)) {
+    // The debug chatter only comes out of the regular path
+    if (threadedInterpreter && !verboseLogging && (registers.cpsr & 0x20) == 0) {
+      ARM::runThreaded(this, &memory, horizon);
+      if (cycles >= horizon) {
+        continue;
+      }
+      // Thumb, or code the decode cache can't serve: one instruction the regular way
+    }
+    executeinst();
+    if (verboseLogging) {
+      printState();
+    }
+  }
+  if (memory.getDebugger() != nullptr) {
+    memory.getDebugger()->takeStop();
+  }
+}
+
+void CPU::printState() const {
+  std::cout << "r0: " << std::hex << registers.r[0] << std::endl;
+  std::cout << "r1: " << std::hex << registers.r[1] << std::endl;
+  std::cout << "r2: " << std::hex << registers.r[2] << std::endl;
+  std::cout << "r3: " << std::hex << registers.r[3] << std::endl;
+  std::cout << "r4: " << std::hex << registers.r[4] << std::endl;
+  std::cout << "r5: " << std::hex << registers.r[5] << std::endl;
+  std::cout << "r6: " << std::hex << registers.r[6] << std::endl;
+  std::cout << "CPSR: " << std::bitset<32>(registers.cpsr) << std::endl;
+  std::cout << "N (Negative): " << ((registers.cpsr >> 31) & 1) << std::endl;
+  std::cout << "Z (Zero): " << ((registers.cpsr >> 30) & 1) << std::endl;
+  std::cout << "C (Carry): " << ((registers.cpsr >> 29) & 1) << std::endl;
+  std::cout << "V (Overflow): " << ((registers.cpsr >> 28) & 1) << std::endl;
+  std::cout << "T (Thumb mode): " << ((registers.cpsr >> 5) & 1) << std::endl;
+}
+
+void CPU::boot() {
   detectThumbinst();
   std::cout << "ROM Size: " << memory.getROMSize() << std::endl;
-  memory.dumpROM();
-  for (;;) {
-    executeinst();
-    std::cout << "r0: " << std::hex << registers.r[0] << std::endl;
-    std::cout << "r1: " << std::hex << registers.r[1] << std::endl;
-    std::cout << "r2: " << std::hex << registers.r[2] << std::endl;
-    std::cout << "r3: " << std::hex << registers.r[3] << std::endl;
-    std::cout << "r4: " << std::hex << registers.r[4] << std::endl;
-    std::cout << "r5: " << std::hex << registers.r[5] << std::endl;
-    std::cout << "r6: " << std::hex << registers.r[6] << std::endl;
-    std::cout << "CPSR: " << std::bitset<32>(registers.cpsr) << std::endl;
-    std::cout << "N (Negative): " << ((registers.cpsr >> 31) & 1) << std::endl;
-    std::cout << "Z (Zero): " << ((registers.cpsr >> 30) & 1) << std::endl;
-    std::cout << "C (Carry): " << ((registers.cpsr >> 29) & 1) << std::endl;
-    std::cout << "V (Overflow): " << ((registers.cpsr >> 28) & 1) << std::endl;
-    std::cout << "T (Thumb mode): " << ((registers.cpsr >> 5) & 1) << std::endl;
+  if (verboseLogging) {
+    memory.dumpROM();
+  }
+}
+
+// Ends on a frame boundary even if the last one overshot by an instruction, so frames stay
+// lined up with the display (keyframes and per-frame input land at the same spot every time)
+void CPU::runFrame() {
+  stats.beginFrame();
+  runFor(CYCLES_PER_FRAME - cycles % CYCLES_PER_FRAME);
+  stats.endFrame();
+  if (Stats::dumpRequested()) {
+    stats.writeJSON("plusboy_stats.json");
+  }
+}
+
+// Run the CPU
+void CPU::run(uint64_t frames) {
+  boot();
+  for (uint64_t frame = 0; frames == 0 || frame < frames; ++frame) {
+    runFrame();
   }
   std::cout << "\n\n----Reached END----\n\n";
-}
\ No newline at end of file
+}
+
+void CPU::saveState(std::vector<uint8_t> &out) const {
+  StateWriter writer(out);
+  writer.putBytes(SAVE_STATE_MAGIC, 7);
+  writer.put<uint8_t>(SAVE_STATE_VERSION);
+  writer.put(registers.r);
+  writer.put(registers.cpsr);
+  writer.put(registers.spsr);
+  writer.put(registers.bankedR8R12);
+  writer.put(registers.bankedSP);
+  writer.put(registers.bankedLR);
+  writer.put(registers.bankedSPSR);
+  writer.put(cycles);
+  writer.put(hleIntrWait);
+  writer.put(lastFetchEnd);
+  writer.put(prefetchCount);
+  writer.put(prefetchProgress);
+  interrupts.saveState(writer);
+  scheduler.saveState(writer);
+  memory.saveState(writer);
+}
+
+void CPU::loadState(const uint8_t *data, size_t size) {
+  StateReader reader(data, size);
+  char magic[7];
+  uint8_t version;
+  reader.getBytes(magic, 7);
+  reader.get(version);
+  if (std::memcmp(magic, SAVE_STATE_MAGIC, 7) != 0 || version != SAVE_STATE_VERSION) {
+    std::cerr << "Not a save state of this version" << std::endl;
+    throw std::runtime_error("CPU::loadState: bad header");
+  }
+  reader.get(registers.r);
+  reader.get(registers.cpsr);
+  reader.get(registers.spsr);
+  reader.get(registers.bankedR8R12);
+  reader.get(registers.bankedSP);
+  reader.get(registers.bankedLR);
+  reader.get(registers.bankedSPSR);
+  reader.get(cycles);
+  reader.get(hleIntrWait);
+  reader.get(lastFetchEnd);
+  reader.get(prefetchCount);
+  reader.get(prefetchProgress);
+  interrupts.loadState(reader);
+  scheduler.loadState(reader);
+  memory.loadState(reader);
+  if (!reader.atEnd()) {
+    throw std::runtime_error("CPU::loadState: trailing bytes");
+  }
+  fetchLength = 0;  // PC moved, look the fetch page up again
+  ppu.restartFrame();
+}
@@ -0,0 +1,128 @@
+#include "../include/debugger.hpp"
+
+#include <algorithm>
+
+#include "../include/cpu.hpp"
+#include "../include/memory.hpp"
+
+DebugStop::DebugStop(const DebugEvent &event)
+    : std::runtime_error(event.type == DEBUG_BREAKPOINT ? "breakpoint" : "watchpoint"),
+      event(event) {}
+
+Debugger::Debugger(CPU &cpu)
+    : cpu(cpu), memory(cpu.getMemory()), resuming(false), resumeAddress(0), stopPending(false),
+      pendingStop() {
+  cpu.setDebugger(this);
+}
+
+Debugger::~Debugger() {
+  for (const Watchpoint &watch : watchpoints) {
+    memory.watchPages(watch.start, watch.length, false);
+  }
+  breakpoints.clear();
+  cpu.setDebugger(nullptr);
+}
+
+// Decoded blocks and the fetch page were cut for the old set of breakpoints
+void Debugger::codeChanged() {
+  cpu.dropDecodedCode();
+}
+
+void Debugger::addBreakpoint(uint32_t address) {
+  auto it = std::lower_bound(breakpoints.begin(), breakpoints.end(), address);
+  if (it == breakpoints.end() || *it != address) {
+    breakpoints.insert(it, address);
+    codeChanged();
+  }
+}
+
+bool Debugger::removeBreakpoint(uint32_t address) {
+  auto it = std::lower_bound(breakpoints.begin(), breakpoints.end(), address);
+  if (it == breakpoints.end() || *it != address) {
+    return false;
+  }
+  breakpoints.erase(it);
+  codeChanged();
+  return true;
+}
+
+void Debugger::addWatchpoint(uint32_t address, uint32_t length, uint32_t kinds) {
+  if (length == 0 || (uint64_t)address + length > 0x100000000 ||
+      !(kinds & (WATCH_READ | WATCH_WRITE))) {
+    throw std::runtime_error("Debugger::addWatchpoint: empty watchpoint");
+  }
+  watchpoints.push_back({address, length, kinds});
+  memory.watchPages(address, length, true);
+}
+
+bool Debugger::removeWatchpoint(uint32_t address) {
+  for (auto it = watchpoints.begin(); it != watchpoints.end(); ++it) {
+    if (it->start == address) {
+      memory.watchPages(it->start, it->length, false);
+      watchpoints.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Debugger::isBreakpoint(uint32_t address) const {
+  return std::binary_search(breakpoints.begin(), breakpoints.end(), address);
+}
+
+void Debugger::clampToBreakpoints(uint32_t address, uint32_t &start, uint32_t &end) const {
+  auto after = std::upper_bound(breakpoints.begin(), breakpoints.end(), address);
+  if (after != breakpoints.end() && *after < end) {
+    end = *after;
+  }
+  auto before = std::lower_bound(breakpoints.begin(), breakpoints.end(), address);
+  if (before != breakpoints.begin() && *(before - 1) >= start) {
+    start = *(before - 1) + 1;
+  }
+}
+
+bool Debugger::report(const DebugEvent &event) {
+  return handler ? handler(event) : true;
+}
+
+void Debugger::hitBreakpoint(uint32_t address) {
+  if (resuming && address == resumeAddress) {
+    resuming = false;
+    return;
+  }
+  DebugEvent event{DEBUG_BREAKPOINT, address, cpu.getCycles(), address, 0, 0};
+  if (report(event)) {
+    resuming = true;
+    resumeAddress = address;
+    throw DebugStop(event);
+  }
+}
+
+void Debugger::takeStop() {
+  if (stopPending) {
+    stopPending = false;
+    throw DebugStop(pendingStop);
+  }
+}
+
+void Debugger::checkAccess(uint32_t address, uint32_t value, int width, bool write) {
+  uint32_t kind = write ? WATCH_WRITE : WATCH_READ;
+  uint64_t end = (uint64_t)address + (1u << width);
+  for (const Watchpoint &watch : watchpoints) {
+    if (!(watch.kinds & kind) || address >= (uint64_t)watch.start + watch.length ||
+        end <= watch.start) {
+      continue;
+    }
+    // The PC already points past the instruction doing the access
+    const Registers &registers = cpu.getRegisters();
+    uint32_t pc = registers.pc - ((registers.cpsr & CPSR_THUMB) ? 2 : 4);
+    DebugEvent event{write ? DEBUG_WRITE : DEBUG_READ, pc, cpu.getCycles(), address, value,
+                     width};
+    if (report(event) && !stopPending) {
+      stopPending = true;
+      pendingStop = event;
+      cpu.getScheduler().breakOut();
+    }
+    return;
+  }
+}
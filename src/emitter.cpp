@@ -0,0 +1,277 @@
+#include "../include/emitter.hpp"
+
+#include <stdexcept>
+#include <string>
+
+Emitter::Emitter(uint32_t base) : base(base) {}
+
+Emitter::Label Emitter::newLabel() {
+  labels.push_back(-1);
+  return (Label)labels.size() - 1;
+}
+
+void Emitter::bind(Label label) {
+  if (label < 0 || (size_t)label >= labels.size() || labels[label] != -1) {
+    throw std::runtime_error("Emitter::bind: unknown or already bound label");
+  }
+  labels[label] = here();
+}
+
+bool Emitter::encodeImmediate(uint32_t value, uint32_t &field) {
+  for (uint32_t rotate = 0; rotate < 16; ++rotate) {
+    // value = imm ror (2 * rotate), so imm = value rol (2 * rotate)
+    uint32_t shift = rotate * 2;
+    uint32_t imm = shift == 0 ? value : (value << shift) | (value >> (32 - shift));
+    if (imm <= 0xFF) {
+      field = (rotate << 8) | imm;
+      return true;
+    }
+  }
+  return false;
+}
+
+void Emitter::arm(uint32_t inst) {
+  if (code.size() % 4 != 0) {
+    throw std::runtime_error("Emitter::arm: ARM code has to be word aligned");
+  }
+  code.resize(code.size() + 4);
+  patch32(code.size() - 4, inst);
+}
+
+void Emitter::thumb(uint16_t inst) {
+  code.resize(code.size() + 2);
+  patch16(code.size() - 2, inst);
+}
+
+void Emitter::patch32(size_t offset, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    code[offset + i] = (uint8_t)(value >> (i * 8));
+  }
+}
+
+void Emitter::patch16(size_t offset, uint16_t value) {
+  code[offset] = (uint8_t)value;
+  code[offset + 1] = (uint8_t)(value >> 8);
+}
+
+void Emitter::alu(ArmAluOp op, int rd, int rn, uint32_t imm, bool setFlags, int cond) {
+  uint32_t field;
+  if (!encodeImmediate(imm, field)) {
+    throw std::runtime_error("Emitter::alu: immediate " + std::to_string(imm) +
+                             " can't be encoded");
+  }
+  bool compare = op >= ALU_TST && op <= ALU_CMN;  // always set flags, no Rd
+  bool move = op == ALU_MOV || op == ALU_MVN;      // no Rn
+  arm(((uint32_t)cond << 28) | (1u << 25) | (op << 21) | ((setFlags || compare) << 20) |
+      ((move ? 0 : (uint32_t)rn) << 16) | ((compare ? 0 : (uint32_t)rd) << 12) | field);
+}
+
+void Emitter::aluReg(ArmAluOp op, int rd, int rn, int rm, int shiftType, int shiftAmount,
+                     bool setFlags, int cond) {
+  bool compare = op >= ALU_TST && op <= ALU_CMN;
+  bool move = op == ALU_MOV || op == ALU_MVN;
+  arm(((uint32_t)cond << 28) | (op << 21) | ((setFlags || compare) << 20) |
+      ((move ? 0 : (uint32_t)rn) << 16) | ((compare ? 0 : (uint32_t)rd) << 12) |
+      ((uint32_t)(shiftAmount & 0x1F) << 7) | ((uint32_t)shiftType << 5) | (uint32_t)rm);
+}
+
+void Emitter::mul(int rd, int rm, int rs, bool setFlags, int cond) {
+  arm(((uint32_t)cond << 28) | (setFlags << 20) | ((uint32_t)rd << 16) | ((uint32_t)rs << 8) |
+      0x90 | (uint32_t)rm);
+}
+
+void Emitter::loadStore(bool load, bool byte, int rd, int rn, uint32_t offset, int cond) {
+  if (offset > 0xFFF) {
+    throw std::runtime_error("Emitter::loadStore: offset out of range");
+  }
+  // Pre-indexed, up, no writeback
+  arm(((uint32_t)cond << 28) | 0x05800000 | (byte << 22) | (load << 20) | ((uint32_t)rn << 16) |
+      ((uint32_t)rd << 12) | offset);
+}
+
+void Emitter::ldr(int rd, int rn, uint32_t offset, int cond) {
+  loadStore(true, false, rd, rn, offset, cond);
+}
+
+void Emitter::str(int rd, int rn, uint32_t offset, int cond) {
+  loadStore(false, false, rd, rn, offset, cond);
+}
+
+void Emitter::ldrb(int rd, int rn, uint32_t offset, int cond) {
+  loadStore(true, true, rd, rn, offset, cond);
+}
+
+void Emitter::strb(int rd, int rn, uint32_t offset, int cond) {
+  loadStore(false, true, rd, rn, offset, cond);
+}
+
+void Emitter::blockTransfer(bool load, int rn, uint16_t list, BlockMode mode, bool writeback,
+                            int cond) {
+  static const uint32_t modeBits[4] = {0x01, 0x03, 0x00, 0x02};  // U, P (bit 23, 24)
+  arm(((uint32_t)cond << 28) | 0x08000000 | (modeBits[mode] << 23) | (writeback << 21) |
+      (load << 20) | ((uint32_t)rn << 16) | list);
+}
+
+void Emitter::ldm(int rn, uint16_t list, BlockMode mode, bool writeback, int cond) {
+  blockTransfer(true, rn, list, mode, writeback, cond);
+}
+
+void Emitter::stm(int rn, uint16_t list, BlockMode mode, bool writeback, int cond) {
+  blockTransfer(false, rn, list, mode, writeback, cond);
+}
+
+void Emitter::push(uint16_t list) {
+  stm(13, list, BLOCK_DB, true);
+}
+
+void Emitter::pop(uint16_t list) {
+  ldm(13, list, BLOCK_IA, true);
+}
+
+void Emitter::b(Label label, int cond) {
+  fixups.push_back({code.size(), label, FIXUP_ARM_BRANCH, 0});
+  arm(((uint32_t)cond << 28) | 0x0A000000);
+}
+
+void Emitter::bl(Label label, int cond) {
+  fixups.push_back({code.size(), label, FIXUP_ARM_BRANCH, 0});
+  arm(((uint32_t)cond << 28) | 0x0B000000);
+}
+
+void Emitter::bx(int rm, int cond) {
+  arm(((uint32_t)cond << 28) | 0x012FFF10 | (uint32_t)rm);
+}
+
+void Emitter::swi(uint32_t comment, int cond) {
+  arm(((uint32_t)cond << 28) | 0x0F000000 | (comment & 0xFFFFFF));
+}
+
+void Emitter::msrControl(uint32_t value) {
+  uint32_t field;
+  if (!encodeImmediate(value & 0xFF, field)) {
+    throw std::runtime_error("Emitter::msrControl: can't be encoded");
+  }
+  arm(0xE321F000 | field);  // field mask 'c'
+}
+
+void Emitter::mrs(int rd, bool spsr) {
+  arm(0xE10F0000 | (spsr << 22) | ((uint32_t)rd << 12));
+}
+
+void Emitter::loadConstant(int rd, uint32_t value) {
+  uint32_t field;
+  if (encodeImmediate(value, field)) {
+    alu(ALU_MOV, rd, 0, value);
+    return;
+  }
+  if (encodeImmediate(~value, field)) {
+    alu(ALU_MVN, rd, 0, ~value);
+    return;
+  }
+  bool first = true;
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    uint32_t part = value & (0xFFu << shift);
+    if (part == 0) continue;
+    alu(first ? ALU_MOV : ALU_ORR, rd, rd, part);
+    first = false;
+  }
+}
+
+void Emitter::loadAddress(int rd, Label label, bool thumb) {
+  fixups.push_back({code.size(), label, FIXUP_ADDRESS, thumb ? 1u : 0u});
+  alu(ALU_MOV, rd, 0, 0);
+  for (int i = 0; i < 3; ++i) {
+    alu(ALU_ORR, rd, rd, 0);
+  }
+}
+
+void Emitter::thumbMov(int rd, uint32_t imm) {
+  thumb(0x2000 | (rd << 8) | (imm & 0xFF));
+}
+
+void Emitter::thumbAdd(int rd, int rs, int rn) {
+  thumb(0x1800 | (rn << 6) | (rs << 3) | rd);
+}
+
+void Emitter::thumbB(Label label) {
+  fixups.push_back({code.size(), label, FIXUP_THUMB_BRANCH, 0});
+  thumb(0xE000);
+}
+
+void Emitter::thumbBL(Label label) {
+  fixups.push_back({code.size(), label, FIXUP_THUMB_BL, 0});
+  thumb(0xF000);
+  thumb(0xF800);
+}
+
+void Emitter::thumbBX(int rm) {
+  thumb(0x4700 | (rm << 3));
+}
+
+void Emitter::thumbSWI(uint32_t comment) {
+  thumb(0xDF00 | (comment & 0xFF));
+}
+
+void Emitter::word(uint32_t value) {
+  align(4);
+  arm(value);
+}
+
+void Emitter::align(uint32_t alignment) {
+  while (here() % alignment != 0) {
+    code.push_back(0);
+  }
+}
+
+std::vector<uint8_t> Emitter::finish() {
+  for (const Fixup &fixup : fixups) {
+    if (labels[fixup.label] == -1) {
+      throw std::runtime_error("Emitter::finish: label " + std::to_string(fixup.label) +
+                               " was never bound");
+    }
+    uint32_t target = (uint32_t)labels[fixup.label] + fixup.addend;
+    uint32_t address = base + (uint32_t)fixup.offset;
+    switch (fixup.kind) {
+      case FIXUP_ARM_BRANCH: {
+        int32_t distance = (int32_t)(target - (address + 8));
+        if (distance < -(1 << 25) || distance >= (1 << 25)) {
+          throw std::runtime_error("Emitter::finish: ARM branch out of range");
+        }
+        uint32_t inst = (uint32_t)code[fixup.offset + 3] << 24;
+        patch32(fixup.offset, inst | (((uint32_t)distance >> 2) & 0xFFFFFF));
+        break;
+      }
+      case FIXUP_THUMB_BRANCH: {
+        int32_t distance = (int32_t)(target - (address + 4));
+        if (distance < -2048 || distance >= 2048) {
+          throw std::runtime_error("Emitter::finish: Thumb branch out of range");
+        }
+        patch16(fixup.offset, 0xE000 | (((uint32_t)distance >> 1) & 0x7FF));
+        break;
+      }
+      case FIXUP_THUMB_BL: {
+        int32_t distance = (int32_t)(target - (address + 4));
+        if (distance < -(1 << 22) || distance >= (1 << 22)) {
+          throw std::runtime_error("Emitter::finish: Thumb BL out of range");
+        }
+        patch16(fixup.offset, 0xF000 | (((uint32_t)distance >> 12) & 0x7FF));
+        patch16(fixup.offset + 2, 0xF800 | (((uint32_t)distance >> 1) & 0x7FF));
+        break;
+      }
+      case FIXUP_ADDRESS: {
+        // One byte per instruction, rotations 0, 24, 16, 8 put it in place
+        static const uint32_t rotations[4] = {0, 12, 8, 4};
+        for (int i = 0; i < 4; ++i) {
+          int byte = 3 - i;
+          size_t offset = fixup.offset + i * 4;
+          uint32_t inst = code[offset] | (code[offset + 1] << 8) | (code[offset + 2] << 16) |
+                          ((uint32_t)code[offset + 3] << 24);
+          uint32_t imm = (target >> (byte * 8)) & 0xFF;
+          patch32(offset, (inst & ~0xFFFu) | (rotations[byte] << 8) | imm);
+        }
+        break;
+      }
+    }
+  }
+  return code;
+}
@@ -1,13 +1,573 @@
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
+#include "../include/audio.hpp"
+#include "../include/audiopacer.hpp"
+#include "../include/codediscovery.hpp"
 #include "../include/cpu.hpp"
+#include "../include/debugger.hpp"
+#include "../include/framering.hpp"
+#include "../include/framewriter.hpp"
+#include "../include/keypad.hpp"
+#include "../include/linkcable.hpp"
 #include "../include/memory.hpp"
-int main() {
+#include "../include/log.hpp"
+#include "../include/movie.hpp"
+#include "../include/profiler.hpp"
+#include "../include/runahead.hpp"
+#include "../include/sha1.hpp"
+#include "../include/snapshotfarm.hpp"
+#include "../include/trace.hpp"
+
+// Written by writeReports on every way out of main
+static std::unique_ptr<Profiler> profiler;
+static Stats* finalStats = nullptr;
+static std::unique_ptr<TraceWriter> tracer;
+static BlockCache* savedBlocks = nullptr;
+static std::unique_ptr<FrameRing> frameRing;
+static std::unique_ptr<FrameWriter> frameWriter;
+static std::unique_ptr<Movie> movie;
+static std::string movieSavePath;  // set once keyframes were added
+
+// $PLUSBOY_CACHE_DIR, else the XDG cache directory
+static std::string blockCacheDirectory() {
+  if (const char* dir = std::getenv("PLUSBOY_CACHE_DIR")) {
+    return dir;
+  }
+  if (const char* xdg = std::getenv("XDG_CACHE_HOME")) {
+    return std::string(xdg) + "/plusboy";
+  }
+  if (const char* home = std::getenv("HOME")) {
+    return std::string(home) + "/.cache/plusboy";
+  }
+  return "";
+}
+
+static void writeReports() {
+  if (profiler) {
+    profiler->writeHotSpots("profile_hotspots.txt");
+    profiler->writeFoldedStacks("profile_stacks.folded");
+    profiler.reset();
+  }
+  if (finalStats != nullptr) {
+    finalStats->writeJSON("plusboy_stats.json");
+    finalStats = nullptr;
+  }
+  if (tracer) {
+    tracer->close();
+  }
+  if (savedBlocks != nullptr) {
+    savedBlocks->saveFile();
+    savedBlocks = nullptr;
+  }
+  if (frameWriter) {
+    frameWriter->close();
+    std::cerr << "Recorded " << frameWriter->getFramesWritten() << " frames ("
+              << frameWriter->getFramesDropped() << " dropped)" << std::endl;
+    frameWriter.reset();
+  }
+  if (movie && !movieSavePath.empty()) {
+    movie->save(movieSavePath);
+    std::cerr << "Movie: " << movie->getKeyframeCount() << " keyframes saved" << std::endl;
+    movieSavePath.clear();
+  }
+}
+
+static void writeHash(std::ofstream* hashes, uint64_t frame, uint64_t hash) {
+  char line[40];
+  std::snprintf(line, sizeof(line), "%llu %016llx\n", (unsigned long long)frame,
+                (unsigned long long)hash);
+  *hashes << line;
+}
+
+// Input movie playback: keys from the movie in every frame, starting at frame 'start' (from
+// the last keyframe before it), for 'frames' frames or until the movie ends. With an interval,
+// a keyframe is stored every that many frames on the way. With a hash file, every frame from
+// 'start' on gets a line "frame hash"; with run-ahead those are the frames shown, numbered by
+// the frame they show.
+static void playMovie(CPU& cpu, RunAhead* runAhead, uint64_t start, uint64_t frames,
+                      uint32_t keyframeInterval, std::ofstream* hashes) {
+  cpu.boot();
+  uint64_t frame = 0;
+  if (const Movie::Keyframe* keyframe = movie->findKeyframe(start)) {
+    std::vector<uint8_t> state = movie->getState(*keyframe);
+    cpu.loadState(state.data(), state.size());
+    frame = keyframe->frame;
+  }
+  uint64_t end = frames != 0 ? start + frames : movie->getFrameCount();
+  if (frames == 0 && movie->getFrameCount() == 0) {
+    end = UINT64_MAX;  // hashes without a movie, runs forever like run()
+  }
+  std::vector<uint8_t> state;
+  auto begin = std::chrono::steady_clock::now();
+  for (; frame < end; ++frame) {
+    if (keyframeInterval != 0 && frame % keyframeInterval == 0 && frame != 0 &&
+        !movie->hasKeyframe((uint32_t)frame)) {
+      state.clear();
+      cpu.saveState(state);
+      movie->addKeyframe((uint32_t)frame, state);
+    }
+    if (runAhead) {
+      uint64_t shown = runAhead->getFramesShown();
+      runAhead->runFrame(movie->getKeys(frame));
+      if (hashes != nullptr && runAhead->getFramesShown() != shown &&
+          runAhead->getShownFrame() >= start) {
+        writeHash(hashes, runAhead->getShownFrame(), runAhead->getShownHash());
+      }
+      continue;
+    }
+    cpu.getKeypad().setPressed(movie->getKeys(frame));
+    uint64_t drawn = cpu.getPPU().getFramesDrawn();
+    cpu.runFrame();
+    if (hashes != nullptr && frame >= start && cpu.getPPU().getFramesDrawn() != drawn) {
+      writeHash(hashes, frame, cpu.getPPU().getFrameHash());
+    }
+  }
+  if (runAhead) {
+    uint64_t shown = runAhead->getFramesShown();
+    runAhead->finish();
+    if (hashes != nullptr && runAhead->getFramesShown() != shown) {
+      writeHash(hashes, runAhead->getShownFrame(), runAhead->getShownHash());
+    }
+  }
+  double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  uint64_t played = end > start ? end - start : 0;
+  std::cerr << "Movie: " << played << " frames from " << start << " in " << seconds << " s ("
+            << (seconds > 0 ? played / seconds : 0) << " fps)" << std::endl;
+  if (runAhead) {
+    std::cerr << "Run-ahead: " << runAhead->getAverageFrameMs() << " ms per frame (state save "
+              << runAhead->getAverageSaveUs() << " us, load " << runAhead->getAverageLoadUs()
+              << " us)" << std::endl;
+  }
+}
+
+// --watch=ADDRESS[:LENGTH][:r|w|rw], hex, 4 bytes and writes unless given
+static bool parseWatch(const char* text, uint32_t& address, uint32_t& length, uint32_t& kinds) {
+  char* end;
+  address = std::strtoul(text, &end, 16);
+  length = 4;
+  kinds = WATCH_WRITE;
+  if (end == text) {
+    return false;
+  }
+  if (*end == ':' && std::isxdigit((unsigned char)end[1])) {
+    text = end + 1;
+    length = std::strtoul(text, &end, 16);
+  }
+  if (*end == ':') {
+    std::string kind = end + 1;
+    if (kind == "r") {
+      kinds = WATCH_READ;
+    } else if (kind == "rw") {
+      kinds = WATCH_READ | WATCH_WRITE;
+    } else if (kind != "w") {
+      return false;
+    }
+    return length != 0;
+  }
+  return *end == '\0' && length != 0;
+}
+
+static void printDebugEvent(const DebugEvent& event) {
+  static const char* const widths[] = {"8", "16", "32"};
+  char line[120];
+  if (event.type == DEBUG_BREAKPOINT) {
+    std::snprintf(line, sizeof(line), "Breakpoint %08x at cycle %llu", event.address,
+                  (unsigned long long)event.cycle);
+  } else {
+    std::snprintf(line, sizeof(line), "Watch: %s %08x = %x (%s-bit) by %08x at cycle %llu",
+                  event.type == DEBUG_READ ? "read" : "write", event.address, event.value,
+                  widths[event.width], event.pc, (unsigned long long)event.cycle);
+  }
+  std::cerr << line << std::endl;
+}
+
+// Link cable: players - 1 more instances of the same ROM next to 'cpu' (the parent), headless
+// and with their saves in memory only, each running on its own thread
+static void runLinked(CPU& cpu, uint32_t players, uint64_t frames) {
+  Memory& memory = cpu.getMemory();
+  std::vector<std::unique_ptr<Memory>> memories;
+  std::vector<std::unique_ptr<CPU>> cpus;
+  std::vector<CPU*> linked = {&cpu};
+  for (uint32_t i = 1; i < players; ++i) {
+    memories.push_back(std::make_unique<Memory>());
+    if (memory.isFastmemEnabled()) {
+      memories.back()->enableFastmem();
+    }
+    memories.back()->loadROMData(memory.getROMData(), memory.getROMSize());
+    if (memory.getBackup() != nullptr) {
+      memories.back()->attachBackup("");
+    }
+    cpus.push_back(std::make_unique<CPU>(*memories.back()));
+    cpus.back()->setThreadedInterpreter(cpu.isThreadedInterpreter());
+    cpus.back()->detectThumbinst();
+    linked.push_back(cpus.back().get());
+  }
+  cpu.boot();
+  LinkCable cable(linked);
+  cable.run(frames);
+
+  uint64_t waits = 0;
+  for (CPU* player : linked) {
+    waits += player->getStats().linkWaits.get();
+  }
+  std::cerr << "Link: " << players << " players, " << cpu.getStats().serialTransfers.get()
+            << " transfers, " << waits << " waits" << std::endl;
+}
+
+// Snapshot farm: boots once (to --warm-frames, or to --warm-pc within that many frames) and
+// forks 'jobs' jobs from there. Each one runs 'frames' frames pressing keys of its own (seeded
+// by the job number, new ones every 8 frames) and prints the hash of its last frame.
+static int runFarm(CPU& cpu, uint32_t jobs, uint32_t workers, uint64_t warmFrames,
+                   const std::string& warmPC, uint64_t frames) {
+  SnapshotFarm farm(cpu);
+  auto begin = std::chrono::steady_clock::now();
+  if (warmPC.empty()) {
+    farm.warmUp(warmFrames);
+  } else if (!farm.warmUpTo(std::strtoul(warmPC.c_str(), nullptr, 16),
+                            warmFrames != 0 ? warmFrames : UINT64_MAX)) {
+    std::cerr << "Farm: never got to " << warmPC << std::endl;
+    return 1;
+  }
+  double warmSeconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+  std::vector<int> statuses = farm.run(jobs, workers, [frames](CPU& job, uint32_t index) {
+    FrameRing ring("");
+    job.getPPU().setFrameRing(&ring);
+    uint32_t seed = index * 0x9E3779B9 + 1;
+    for (uint64_t frame = 0; frame < frames; ++frame) {
+      if (frame % 8 == 0) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        job.getKeypad().setPressed(seed & KEY_ALL);
+      }
+      job.runFrame();
+    }
+    std::printf("Job %u: frame %016llx\n", index, (unsigned long long)job.getPPU().getFrameHash());
+    return 0;
+  });
+  uint32_t failed = (uint32_t)std::count_if(statuses.begin(), statuses.end(),
+                                            [](int status) { return status != 0; });
+  std::cerr << "Farm: warmed up in " << warmSeconds * 1000 << " ms, " << jobs << " jobs ("
+            << failed << " failed), started in " << farm.getAverageStartUs() << " us on average, "
+            << farm.getMaxStartUs() << " us at most" << std::endl;
+  return failed != 0 ? 1 : 0;
+}
+
+// Real-time speed, clocked by the audio device (a null sink until there's a host backend)
+static void runPaced(CPU& cpu, double latencyMs, uint64_t frames) {
+  AudioDevice device((uint32_t)(latencyMs * AUDIO_OUTPUT_RATE / 1000) * 2, &cpu.getStats());
+  AudioPacer pacer(cpu, device, latencyMs);
+  cpu.boot();
+  auto begin = std::chrono::steady_clock::now();
+  for (uint64_t frame = 0; frames == 0 || frame < frames; ++frame) {
+    pacer.runFrame();
+  }
+  double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  std::cerr << "Audio: " << frames << " frames in " << seconds << " s ("
+            << (seconds > 0 ? frames / seconds : 0) << " fps), latency "
+            << device.getAverageLatencyMs() << " ms on average (target " << latencyMs << "), "
+            << device.getUnderruns() << " underruns, rate " << pacer.getRatio() << std::endl;
+}
+
+int main(int argc, char** argv) {
+  std::string romPath = "./bin/kernel.gba";
+  bool writeStats = false;
+  bool useFastmem = false;
+  bool threaded = true;
+  bool validateFlags = false;
+  bool persistBlocks = true;
+  uint64_t frames = 0;
+  std::string shmName;
+  std::string recordPath;
+  std::string moviePath;
+  std::string hashPath;
+  uint64_t seek = 0;
+  uint32_t keyframeInterval = 0;
+  std::string savePath;  // next to the ROM unless given
+  bool persistSave = true;
+  uint32_t runAheadFrames = 0;
+  bool runAheadThread = false;
+  uint32_t frameskip = 0;
+  uint32_t linkPlayers = 0;
+  bool reuseLines = true;
+  std::vector<uint32_t> breakpoints;
+  std::vector<std::string> watches;
+  uint32_t farmJobs = 0;
+  uint32_t farmWorkers = 1;
+  uint64_t warmFrames = 0;
+  std::string warmPC;
+  double audioLatencyMs = 0;  // 0: no pacing, as fast as the host goes
+  // The cores the emulation doesn't use find the ROM's code ahead of it
+  uint32_t discoveryThreads = std::min<uint32_t>(
+      std::max(std::thread::hardware_concurrency(), 1u) - 1, DISCOVERY_MAX_THREADS);
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--profile") == 0) {
+      profiler = std::make_unique<Profiler>(Profiler::Mode::Exact);
+    } else if (std::strncmp(argv[i], "--profile-sample=", 17) == 0) {
+      profiler = std::make_unique<Profiler>(Profiler::Mode::Sampling, std::atoi(argv[i] + 17));
+    } else if (std::strcmp(argv[i], "--stats") == 0) {
+      writeStats = true;
+    } else if (std::strncmp(argv[i], "--trace=", 8) == 0) {
+      tracer = std::make_unique<TraceWriter>(argv[i] + 8);
+    } else if (std::strcmp(argv[i], "--fastmem") == 0) {
+      useFastmem = true;
+    } else if (std::strcmp(argv[i], "--no-threaded") == 0) {
+      threaded = false;  // call-based loop, for comparing against the threaded interpreter
+    } else if (std::strcmp(argv[i], "--validate-flags") == 0) {
+      validateFlags = true;  // full flags everywhere, reports reads the liveness missed
+    } else if (std::strcmp(argv[i], "--no-block-cache") == 0) {
+      persistBlocks = false;
+    } else if (std::strncmp(argv[i], "--frames=", 9) == 0) {
+      frames = std::strtoull(argv[i] + 9, nullptr, 10);
+    } else if (std::strncmp(argv[i], "--shm=", 6) == 0) {
+      shmName = argv[i] + 6;  // frame ring for other processes, e.g. /plusboy
+    } else if (std::strncmp(argv[i], "--record=", 9) == 0) {
+      recordPath = argv[i] + 9;  // .y4m or raw RGB
+    } else if (std::strncmp(argv[i], "--movie=", 8) == 0) {
+      moviePath = argv[i] + 8;  // input movie, see PlusBoyMovie
+    } else if (std::strncmp(argv[i], "--seek=", 7) == 0) {
+      seek = std::strtoull(argv[i] + 7, nullptr, 10);
+    } else if (std::strncmp(argv[i], "--keyframes=", 12) == 0) {
+      keyframeInterval = std::strtoul(argv[i] + 12, nullptr, 10);  // adds them to the movie
+    } else if (std::strncmp(argv[i], "--frame-hashes=", 15) == 0) {
+      hashPath = argv[i] + 15;
+    } else if (std::strncmp(argv[i], "--save=", 7) == 0) {
+      savePath = argv[i] + 7;
+    } else if (std::strcmp(argv[i], "--no-save") == 0) {
+      persistSave = false;  // save chip in memory only
+    } else if (std::strncmp(argv[i], "--run-ahead=", 12) == 0) {
+      runAheadFrames = std::strtoul(argv[i] + 12, nullptr, 10);  // frames shown ahead
+    } else if (std::strcmp(argv[i], "--run-ahead-thread") == 0) {
+      runAheadThread = true;  // the frames ahead run on a second core
+    } else if (std::strncmp(argv[i], "--frameskip=", 12) == 0) {
+      frameskip = std::strtoul(argv[i] + 12, nullptr, 10);  // fast-forward, draws 1 in N + 1
+    } else if (std::strcmp(argv[i], "--no-line-reuse") == 0) {
+      reuseLines = false;
+    } else if (std::strncmp(argv[i], "--link=", 7) == 0) {
+      linkPlayers = std::strtoul(argv[i] + 7, nullptr, 10);  // 2-4 copies on a link cable
+    } else if (std::strncmp(argv[i], "--break=", 8) == 0) {
+      breakpoints.push_back(std::strtoul(argv[i] + 8, nullptr, 16));  // stops there
+    } else if (std::strncmp(argv[i], "--watch=", 8) == 0) {
+      watches.push_back(argv[i] + 8);  // prints every access, see parseWatch()
+    } else if (std::strncmp(argv[i], "--farm=", 7) == 0) {
+      farmJobs = std::strtoul(argv[i] + 7, nullptr, 10);  // jobs forked from a warm state
+    } else if (std::strncmp(argv[i], "--farm-workers=", 15) == 0) {
+      farmWorkers = std::strtoul(argv[i] + 15, nullptr, 10);  // jobs running at once
+    } else if (std::strncmp(argv[i], "--warm-frames=", 14) == 0) {
+      warmFrames = std::strtoull(argv[i] + 14, nullptr, 10);
+    } else if (std::strncmp(argv[i], "--warm-pc=", 10) == 0) {
+      warmPC = argv[i] + 10;  // hex, boots until the CPU gets there
+    } else if (std::strcmp(argv[i], "--audio-pacing") == 0) {
+      audioLatencyMs = AUDIO_DEFAULT_LATENCY_MS;
+    } else if (std::strncmp(argv[i], "--audio-pacing=", 15) == 0) {
+      audioLatencyMs = std::strtod(argv[i] + 15, nullptr);  // target latency in ms
+    } else if (std::strncmp(argv[i], "--discovery-threads=", 20) == 0) {
+      discoveryThreads = std::strtoul(argv[i] + 20, nullptr, 10);  // 0: decodes on demand only
+    } else if (std::strcmp(argv[i], "--verbose") == 0) {
+      verboseLogging = true;
+    } else if (std::strcmp(argv[i], "--quiet") == 0) {
+      verboseLogging = false;  // the default, kept for older scripts
+    } else if (argv[i][0] != '-') {
+      romPath = argv[i];
+    } else {
+      std::cerr << "Unknown option: " << argv[i] << std::endl;
+      return 1;
+    }
+  }
+
+  if (runAheadFrames != 0 && (profiler || tracer)) {
+    std::cerr << "--run-ahead can't be combined with --profile or --trace" << std::endl;
+    return 1;
+  }
+
+  bool debugging = !breakpoints.empty() || !watches.empty();
+  if (debugging && runAheadFrames != 0) {
+    std::cerr << "--break and --watch can't be combined with --run-ahead" << std::endl;
+    return 1;
+  }
+
+  if (linkPlayers != 0 && (linkPlayers < 2 || linkPlayers > LINK_MAX_PLAYERS)) {
+    std::cerr << "--link takes 2 to " << LINK_MAX_PLAYERS << " players" << std::endl;
+    return 1;
+  }
+  if (linkPlayers != 0 && (runAheadFrames != 0 || !moviePath.empty() || !hashPath.empty())) {
+    std::cerr << "--link can't be combined with --run-ahead, --movie or --frame-hashes"
+              << std::endl;
+    return 1;
+  }
+
+  // The farm forks, only the calling thread comes along and every job would share a save file
+  if (farmJobs != 0 && (runAheadFrames != 0 || linkPlayers != 0 || debugging || tracer ||
+                        profiler || !moviePath.empty() || !hashPath.empty() ||
+                        !shmName.empty() || !recordPath.empty())) {
+    std::cerr << "--farm can't be combined with --run-ahead, --link, --break, --watch, --trace, "
+                 "--profile, --movie, --frame-hashes, --shm or --record"
+              << std::endl;
+    return 1;
+  }
+
+  if (audioLatencyMs != 0 && (runAheadFrames != 0 || linkPlayers != 0 || farmJobs != 0 ||
+                              !moviePath.empty() || !hashPath.empty())) {
+    std::cerr << "--audio-pacing can't be combined with --run-ahead, --link, --farm, --movie or "
+                 "--frame-hashes"
+              << std::endl;
+    return 1;
+  }
+
   Memory memory;
-  memory.loadBinFile("./bin/kernel.gba");
+  if (useFastmem) {
+    memory.enableFastmem();
+  }
+  memory.loadBinFile(romPath);
+  // Movies start from a blank save, whatever the last session left behind would desync them
+  if (!persistSave || !moviePath.empty() || !hashPath.empty() || farmJobs != 0) {
+    savePath.clear();
+  } else if (savePath.empty()) {
+    savePath = std::filesystem::path(romPath).replace_extension(".sav").string();
+  }
+  memory.attachBackup(savePath);
   CPU cpu(memory);
+  cpu.getPPU().setFrameskip(frameskip);
+  cpu.getPPU().setReusingLines(reuseLines);
+  cpu.setThreadedInterpreter(threaded);
+  if (threaded && verboseLogging) {
+    std::cerr << "--verbose logs from the call loop, the threaded interpreter stays off"
+              << std::endl;
+  }
+  cpu.setValidatingFlags(validateFlags);
+  std::string cacheDirectory = persistBlocks ? blockCacheDirectory() : "";
+  if (!cacheDirectory.empty()) {
+    std::error_code error;
+    std::filesystem::create_directories(cacheDirectory, error);
+    if (!error) {
+      cpu.getBlockCache().attachDirectory(cacheDirectory);
+      savedBlocks = &cpu.getBlockCache();
+    }
+  }
+  // Not for the farm: nothing but the calling thread may run while it forks
+  std::unique_ptr<CodeDiscovery> discovery;
+  if (discoveryThreads != 0 && farmJobs == 0) {
+    discovery = std::make_unique<CodeDiscovery>(memory, discoveryThreads);
+    cpu.getBlockCache().setDiscovery(discovery.get());
+  }
+  if (!moviePath.empty() || !hashPath.empty() || runAheadFrames != 0) {
+    movie = std::make_unique<Movie>();  // without a file: nothing pressed, runs 'frames' frames
+    SHA1::Digest romHash = SHA1::hash(memory.getROMData(), memory.getROMSize());
+    if (!moviePath.empty()) {
+      try {
+        movie->load(moviePath);
+      } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+      }
+      if (movie->getROMHash() != romHash) {
+        std::cerr << "Movie: recorded with another ROM, it won't play back the same"
+                  << std::endl;
+      }
+    } else {
+      movie->setROMHash(romHash);
+    }
+    if (keyframeInterval != 0 && !moviePath.empty()) {
+      movieSavePath = moviePath;
+    }
+  }
+  if (!shmName.empty() || !recordPath.empty() || !hashPath.empty()) {
+    frameRing = std::make_unique<FrameRing>(shmName);
+    cpu.getPPU().setFrameRing(frameRing.get());
+    if (!recordPath.empty()) {
+      frameWriter = std::make_unique<FrameWriter>(*frameRing, recordPath);
+    }
+  }
+  std::unique_ptr<RunAhead> runAhead;
+  if (runAheadFrames != 0) {
+    runAhead = std::make_unique<RunAhead>(cpu, runAheadFrames, runAheadThread, frameRing.get());
+  }
+  cpu.setProfiler(profiler.get());
+  cpu.setTracer(tracer.get());
+  std::unique_ptr<Debugger> debugger;
+  if (debugging) {
+    debugger = std::make_unique<Debugger>(cpu);
+    debugger->setHandler([](const DebugEvent& event) {
+      printDebugEvent(event);
+      return event.type == DEBUG_BREAKPOINT;
+    });
+    for (uint32_t address : breakpoints) {
+      debugger->addBreakpoint(address);
+    }
+    for (const std::string& watch : watches) {
+      uint32_t address, length, kinds;
+      if (!parseWatch(watch.c_str(), address, length, kinds)) {
+        std::cerr << "Bad --watch: " << watch << std::endl;
+        return 1;
+      }
+      debugger->addWatchpoint(address, length, kinds);
+    }
+  }
+  if (writeStats) {
+    finalStats = &cpu.getStats();
+  }
+  Stats::installSignalHandler();  // kill -USR1 dumps the counters at the next frame
+
+  std::ofstream hashes;
+  if (!hashPath.empty()) {
+    hashes.open(hashPath);
+  }
 
-  cpu.run();
+  try {
+    if (movie) {
+      playMovie(cpu, runAhead.get(), seek, frames, keyframeInterval,
+                hashPath.empty() ? nullptr : &hashes);
+    } else if (linkPlayers != 0) {
+      runLinked(cpu, linkPlayers, frames);
+    } else if (audioLatencyMs != 0) {
+      runPaced(cpu, audioLatencyMs, frames);
+    } else if (farmJobs != 0) {
+      int status = runFarm(cpu, farmJobs, farmWorkers, warmFrames, warmPC, frames);
+      writeReports();
+      return status;
+    } else {
+      cpu.run(frames);
+    }
+  } catch (const DebugStop&) {
+    const Registers& registers = cpu.getRegisters();
+    for (int i = 0; i < 16; ++i) {
+      char reg[24];
+      std::snprintf(reg, sizeof(reg), "r%-2d %08x%s", i, registers.r[i], i % 4 == 3 ? "\n" : "  ");
+      std::cerr << reg;
+    }
+    std::cerr << "cpsr " << std::hex << registers.cpsr << std::dec << std::endl;
+    writeReports();
+    return 0;
+  } catch (const std::exception& e) {
+    std::cerr << "Emulation stopped: " << e.what() << std::endl;
+    writeReports();
+    return 1;
+  }
 
+  const PPU& ppu = cpu.getPPU();
+  if (frameRing && !runAhead) {
+    uint64_t lines = ppu.getLinesDrawn() + ppu.getLinesReused();
+    std::cerr << "Display: " << ppu.getFramesDrawn() << " frames drawn, "
+              << ppu.getFramesSkipped() << " skipped, "
+              << (lines != 0 ? ppu.getLinesReused() * 100.0 / lines : 0)
+              << "% of the lines copied from the last frame" << std::endl;
+  }
+  writeReports();
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,193 @@
+#include "../include/fastmem.hpp"
+
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+
+#include "../include/hostbuffer.hpp"
+
+#if defined(__linux__) && defined(__x86_64__)
+#define FASTMEM_SUPPORTED 1
+#include <signal.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#else
+#define FASTMEM_SUPPORTED 0
+#endif
+
+#if FASTMEM_SUPPORTED
+
+// Every guest access through the reservation happens inside these stubs. No stack is
+// used, so a faulting stub can be resumed at fastmemFault which returns false to the caller.
+// (SysV: rdi = host address, rsi = value or out pointer)
+asm(R"(
+  .pushsection .text
+  .p2align 4
+  .globl fastmemAccessBegin, fastmemAccessEnd, fastmemFault
+  .globl fastmemLoad8, fastmemLoad16, fastmemLoad32
+  .globl fastmemStore8, fastmemStore16, fastmemStore32
+  .type fastmemLoad8, @function
+  .type fastmemLoad16, @function
+  .type fastmemLoad32, @function
+  .type fastmemStore8, @function
+  .type fastmemStore16, @function
+  .type fastmemStore32, @function
+fastmemAccessBegin:
+fastmemLoad8:
+  movzbl (%rdi), %eax
+  movb %al, (%rsi)
+  movl $1, %eax
+  ret
+fastmemLoad16:
+  movzwl (%rdi), %eax
+  movw %ax, (%rsi)
+  movl $1, %eax
+  ret
+fastmemLoad32:
+  movl (%rdi), %eax
+  movl %eax, (%rsi)
+  movl $1, %eax
+  ret
+fastmemStore8:
+  movb %sil, (%rdi)
+  movl $1, %eax
+  ret
+fastmemStore16:
+  movw %si, (%rdi)
+  movl $1, %eax
+  ret
+fastmemStore32:
+  movl %esi, (%rdi)
+  movl $1, %eax
+  ret
+fastmemAccessEnd:
+fastmemFault:
+  xorl %eax, %eax
+  ret
+  .popsection
+)");
+
+extern "C" const char fastmemAccessBegin[], fastmemAccessEnd[], fastmemFault[];
+
+static struct sigaction previousAction;
+
+static void handleFault(int signal, siginfo_t *info, void *context) {
+  ucontext_t *uc = static_cast<ucontext_t *>(context);
+  greg_t &rip = uc->uc_mcontext.gregs[REG_RIP];
+  if (rip >= (greg_t)fastmemAccessBegin && rip < (greg_t)fastmemAccessEnd) {
+    rip = (greg_t)fastmemFault;
+    return;
+  }
+
+  // Not ours, hand it to whoever was there before (or crash like we normally would)
+  if (previousAction.sa_flags & SA_SIGINFO) {
+    previousAction.sa_sigaction(signal, info, context);
+  } else if (previousAction.sa_handler == SIG_IGN || previousAction.sa_handler == SIG_DFL) {
+    sigaction(SIGSEGV, &previousAction, nullptr);  // the access faults again and we die
+  } else {
+    previousAction.sa_handler(signal);
+  }
+}
+
+static void installFaultHandler() {
+  static std::once_flag installed;
+  std::call_once(installed, [] {
+    struct sigaction action = {};
+    action.sa_sigaction = handleFault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previousAction);
+  });
+}
+
+#else
+
+// Never called, Fastmem can't be constructed on this host
+extern "C" {
+bool fastmemLoad8(const uint8_t *, uint8_t *) {
+  return false;
+}
+bool fastmemLoad16(const uint8_t *, uint16_t *) {
+  return false;
+}
+bool fastmemLoad32(const uint8_t *, uint32_t *) {
+  return false;
+}
+bool fastmemStore8(uint8_t *, uint8_t) {
+  return false;
+}
+bool fastmemStore16(uint8_t *, uint16_t) {
+  return false;
+}
+bool fastmemStore32(uint8_t *, uint32_t) {
+  return false;
+}
+}
+
+#endif
+
+bool Fastmem::isSupported() {
+  return FASTMEM_SUPPORTED;
+}
+
+Fastmem::Fastmem() : base(nullptr) {
+#if FASTMEM_SUPPORTED
+  void *reservation = mmap(nullptr, FASTMEM_SIZE + FASTMEM_GUARD, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (reservation == MAP_FAILED) {
+    std::cerr << "Fastmem: Failed to reserve the guest address space" << std::endl;
+    throw std::runtime_error("Fastmem: Failed to reserve address space");
+  }
+  base = static_cast<uint8_t *>(reservation);
+  installFaultHandler();
+#else
+  throw std::runtime_error("Fastmem: Not supported on this host");
+#endif
+}
+
+Fastmem::~Fastmem() {
+#if FASTMEM_SUPPORTED
+  munmap(base, FASTMEM_SIZE + FASTMEM_GUARD);
+#endif
+}
+
+void Fastmem::mapView(uint32_t address, const HostBuffer &buffer, size_t offset, size_t length) {
+#if FASTMEM_SUPPORTED
+  if (!buffer.isShared() || offset + length > buffer.getMappedSize()) {
+    throw std::runtime_error("Fastmem::mapView: Buffer isn't shared or too small");
+  }
+  if (length == 0) {
+    return;
+  }
+  void *view = mmap(base + address, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                    buffer.getFd(), offset);
+  if (view == MAP_FAILED) {
+    std::cerr << "Fastmem::mapView: Failed to map 0x" << std::hex << address << std::endl;
+    throw std::runtime_error("Fastmem::mapView: mmap failed");
+  }
+#else
+  (void)address, (void)buffer, (void)offset, (void)length;
+#endif
+}
+
+void Fastmem::mapMirrored(uint32_t start, uint32_t end, const HostBuffer &buffer) {
+  size_t size = buffer.getMappedSize();
+  if (size == 0) {
+    return;
+  }
+  for (uint64_t address = start; address + size - 1 <= end; address += size) {
+    mapView((uint32_t)address, buffer, 0, size);
+  }
+}
+
+void Fastmem::unmap(uint32_t address, size_t length) {
+#if FASTMEM_SUPPORTED
+  void *hole = mmap(base + address, length, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  if (hole == MAP_FAILED) {
+    throw std::runtime_error("Fastmem::unmap: mmap failed");
+  }
+#else
+  (void)address, (void)length;
+#endif
+}
@@ -0,0 +1,183 @@
+#include "../include/framering.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define FRAME_POLL_MICROSECONDS 1000  // readers in other processes
+
+struct FrameRing::Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t slots;
+  uint32_t width;
+  uint32_t height;
+  uint32_t format;
+  uint32_t reserved;
+  std::atomic<uint64_t> latest;
+};
+
+struct FrameRing::Slot {
+  std::atomic<uint32_t> sequence;
+  uint32_t reserved;
+  uint64_t frame;
+  uint32_t pixels[FRAME_PIXELS];
+};
+
+// Both sides of the mapping have to agree on these without any locking
+static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+                  std::atomic<uint32_t>::is_always_lock_free,
+              "frame ring atomics must be lock free to live in shared memory");
+
+FrameRing::FrameRing(const std::string &name) : FrameRing(name, true) {}
+
+FrameRing::FrameRing(const std::string &name, bool owner)
+    : name(name),
+      owner(owner),
+      mapping(nullptr),
+      mappingSize(sizeof(Header) + FRAME_RING_SLOTS * sizeof(Slot)),
+      header(nullptr),
+      drawing(0),
+      wakeups(0) {
+#ifdef __linux__
+  if (!name.empty()) {
+    int fd = owner ? shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)
+                   : shm_open(name.c_str(), O_RDONLY, 0);
+    struct stat info;
+    if (fd < 0 || (owner && ftruncate(fd, mappingSize) != 0) || fstat(fd, &info) != 0 ||
+        (size_t)info.st_size != mappingSize) {
+      if (fd >= 0) close(fd);
+      if (owner) {
+        std::cerr << "FrameRing: Failed to create shared memory " << name << std::endl;
+        throw std::runtime_error("FrameRing::FrameRing: shm_open failed");
+      }
+      return;  // attach() reports it
+    }
+    mapping = mmap(nullptr, mappingSize, owner ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                   fd, 0);
+    close(fd);
+  } else {
+    mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                   0);
+  }
+  if (mapping == MAP_FAILED) {
+    mapping = nullptr;
+    if (owner) throw std::runtime_error("FrameRing::FrameRing: mmap failed");
+    return;
+  }
+#else
+  if (!name.empty()) {
+    throw std::runtime_error("FrameRing::FrameRing: shared memory needs Linux");
+  }
+  mapping = std::calloc(1, mappingSize);
+#endif
+  header = static_cast<Header *>(mapping);
+  if (!owner) {
+    return;
+  }
+  // Fresh pages are zero, so every slot starts out with an even sequence and frame 0
+  std::memcpy(header->magic, FRAME_RING_MAGIC, 8);
+  header->version = FRAME_RING_VERSION;
+  header->slots = FRAME_RING_SLOTS;
+  header->width = WIDTH;
+  header->height = HEIGHT;
+  header->format = FRAME_FORMAT_XRGB8888;
+  header->latest.store(0, std::memory_order_release);
+}
+
+FrameRing::~FrameRing() {
+  if (mapping == nullptr) {
+    return;
+  }
+#ifdef __linux__
+  munmap(mapping, mappingSize);
+  if (owner && !name.empty()) {
+    shm_unlink(name.c_str());  // readers that still have it mapped keep their view
+  }
+#else
+  std::free(mapping);
+#endif
+}
+
+std::unique_ptr<FrameRing> FrameRing::attach(const std::string &name) {
+  std::unique_ptr<FrameRing> ring(new FrameRing(name, false));
+  if (ring->header == nullptr || std::memcmp(ring->header->magic, FRAME_RING_MAGIC, 8) != 0 ||
+      ring->header->version != FRAME_RING_VERSION || ring->header->slots != FRAME_RING_SLOTS ||
+      ring->header->width != WIDTH || ring->header->height != HEIGHT) {
+    return nullptr;
+  }
+  return ring;
+}
+
+FrameRing::Slot *FrameRing::slot(uint64_t frame) const {
+  Slot *slots = reinterpret_cast<Slot *>(header + 1);
+  return &slots[frame % FRAME_RING_SLOTS];
+}
+
+uint32_t *FrameRing::beginFrame() {
+  drawing = header->latest.load(std::memory_order_relaxed) + 1;
+  Slot *target = slot(drawing);
+  target->sequence.store(target->sequence.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);  // odd before any pixel changes
+  target->frame = drawing;
+  return target->pixels;
+}
+
+void FrameRing::endFrame() {
+  if (drawing == 0) {
+    return;
+  }
+  Slot *target = slot(drawing);
+  target->sequence.store(target->sequence.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_release);
+  header->latest.store(drawing, std::memory_order_release);
+  drawing = 0;
+  wake();
+}
+
+uint64_t FrameRing::getLatest() const {
+  return header->latest.load(std::memory_order_acquire);
+}
+
+bool FrameRing::readFrame(uint64_t frame, uint32_t *pixels) const {
+  if (frame == 0 || frame > getLatest()) {
+    return false;
+  }
+  const Slot *source = slot(frame);
+  uint32_t before = source->sequence.load(std::memory_order_acquire);
+  if ((before & 1) || source->frame != frame) {
+    return false;
+  }
+  std::memcpy(pixels, source->pixels, sizeof(source->pixels));
+  std::atomic_thread_fence(std::memory_order_acquire);  // the copy before the second look
+  return source->sequence.load(std::memory_order_relaxed) == before && source->frame == frame;
+}
+
+void FrameRing::waitForFrame(uint64_t seen) const {
+  if (!owner) {
+    while (getLatest() <= seen) {
+      std::this_thread::sleep_for(std::chrono::microseconds(FRAME_POLL_MICROSECONDS));
+    }
+    return;
+  }
+  uint32_t ticket = wakeups.load(std::memory_order_acquire);
+  if (getLatest() <= seen) {
+    wakeups.wait(ticket, std::memory_order_acquire);
+  }
+}
+
+void FrameRing::wake() {
+  wakeups.fetch_add(1, std::memory_order_release);
+  wakeups.notify_all();
+}
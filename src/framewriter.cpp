@@ -0,0 +1,99 @@
+#include "../include/framewriter.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "../include/framering.hpp"
+
+// 16.78 MHz / 280896 cycles per frame
+#define Y4M_HEADER "YUV4MPEG2 W240 H160 F16777216:280896 Ip A1:1 C444\n"
+
+FrameWriter::FrameWriter(FrameRing &ring, const std::string &filename)
+    : ring(ring),
+      file(filename, std::ios::binary | std::ios::trunc),
+      y4m(filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".y4m") == 0),
+      pixels(FRAME_PIXELS),
+      encoded(FRAME_PIXELS * 3),
+      written(0),
+      dropped(0),
+      closing(false),
+      lastFrame(0) {
+  if (!file.is_open()) {
+    std::cerr << "FrameWriter: Failed to open " << filename << std::endl;
+    throw std::runtime_error("FrameWriter::FrameWriter: Failed to open file");
+  }
+  if (y4m) {
+    file << Y4M_HEADER;
+  }
+  writer = std::thread(&FrameWriter::writerLoop, this);
+}
+
+FrameWriter::~FrameWriter() {
+  close();
+}
+
+void FrameWriter::close() {
+  if (!writer.joinable()) {
+    return;
+  }
+  lastFrame.store(ring.getLatest(), std::memory_order_relaxed);
+  closing.store(true, std::memory_order_release);
+  ring.wake();
+  writer.join();
+  file.close();
+}
+
+void FrameWriter::writerLoop() {
+  uint64_t next = ring.getLatest() + 1;
+  for (;;) {
+    uint64_t latest = ring.getLatest();
+    bool stopping = closing.load(std::memory_order_acquire);
+    if (stopping) {
+      latest = std::min(latest, lastFrame.load(std::memory_order_relaxed));
+    }
+    if (next > latest) {
+      if (stopping) {
+        return;
+      }
+      ring.waitForFrame(latest);
+      continue;
+    }
+    // The slot after the newest one is being drawn into, anything older than that is gone
+    if (latest - next >= FRAME_RING_SLOTS - 1) {
+      uint64_t oldest = latest - (FRAME_RING_SLOTS - 2);
+      dropped.fetch_add(oldest - next, std::memory_order_relaxed);
+      next = oldest;
+    }
+    if (ring.readFrame(next, pixels.data())) {
+      writeFrame();
+      written.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    ++next;
+  }
+}
+
+void FrameWriter::writeFrame() {
+  if (!y4m) {
+    for (size_t i = 0; i < FRAME_PIXELS; ++i) {
+      encoded[i * 3] = pixels[i] >> 16;
+      encoded[i * 3 + 1] = pixels[i] >> 8;
+      encoded[i * 3 + 2] = pixels[i];
+    }
+    file.write(reinterpret_cast<const char *>(encoded.data()), encoded.size());
+    return;
+  }
+
+  // Planar Y, U, V
+  uint8_t *y = encoded.data(), *u = y + FRAME_PIXELS, *v = u + FRAME_PIXELS;
+  for (size_t i = 0; i < FRAME_PIXELS; ++i) {
+    int r = (pixels[i] >> 16) & 0xFF, g = (pixels[i] >> 8) & 0xFF, b = pixels[i] & 0xFF;
+    y[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+    u[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+    v[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+  }
+  file << "FRAME\n";
+  file.write(reinterpret_cast<const char *>(encoded.data()), encoded.size());
+}
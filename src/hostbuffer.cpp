@@ -0,0 +1,199 @@
+#include "../include/hostbuffer.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static size_t roundToPages(size_t size) {
+#ifdef __linux__
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+#else
+  size_t page = 4096;
+#endif
+  return (size + page - 1) & ~(page - 1);
+}
+
+HostBuffer::HostBuffer(size_t size)
+    : bytes(nullptr), length(0), mapped(0), fd(-1), privateView(false) {
+  resize(size);
+}
+
+HostBuffer::~HostBuffer() {
+  release();
+}
+
+void HostBuffer::release() {
+#ifdef __linux__
+  if (fd >= 0 || privateView) {
+    if (bytes != nullptr) munmap(bytes, mapped);
+    if (fd >= 0) close(fd);
+    bytes = nullptr;
+    fd = -1;
+    privateView = false;
+    return;
+  }
+#endif
+  std::free(bytes);
+  bytes = nullptr;
+}
+
+void HostBuffer::copyToHeap() {
+  uint8_t *heap = static_cast<uint8_t *>(std::malloc(std::max<size_t>(length, 1)));
+  if (heap == nullptr) {
+    throw std::bad_alloc();
+  }
+  if (length != 0) {
+    std::memcpy(heap, bytes, length);
+  }
+  size_t size = length;
+  release();
+  bytes = heap;
+  length = size;
+  mapped = 0;
+}
+
+void HostBuffer::resize(size_t newSize) {
+  if (fd >= 0) {
+    mapShared(newSize);
+    return;
+  }
+  if (privateView) {
+    copyToHeap();
+  }
+
+  if (newSize == 0) {
+    std::free(bytes);
+    bytes = nullptr;
+    length = 0;
+    return;
+  }
+  uint8_t *grown = static_cast<uint8_t *>(std::realloc(bytes, newSize));
+  if (grown == nullptr) {
+    throw std::bad_alloc();
+  }
+  if (newSize > length) {
+    std::memset(grown + length, 0, newSize - length);
+  }
+  bytes = grown;
+  length = newSize;
+}
+
+// The memfd already holds the bytes, only the size and our view change
+void HostBuffer::mapShared(size_t newSize) {
+#ifdef __linux__
+  size_t newMapped = roundToPages(newSize);
+  if (newSize < length) {
+    std::memset(bytes + newSize, 0, length - newSize);  // later growth has to read zeros
+  }
+  if (newMapped != mapped) {
+    if (bytes != nullptr) munmap(bytes, mapped);
+    bytes = nullptr;
+    // Shrinking the file drops the tail, growing it reads back as zeros
+    if (ftruncate(fd, newMapped) != 0) {
+      std::cerr << "HostBuffer::resize: ftruncate failed" << std::endl;
+      throw std::runtime_error("HostBuffer::resize: Failed to resize memfd");
+    }
+    if (newMapped != 0) {
+      void *view = mmap(nullptr, newMapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (view == MAP_FAILED) {
+        throw std::runtime_error("HostBuffer::resize: Failed to map memfd");
+      }
+      bytes = static_cast<uint8_t *>(view);
+    }
+  }
+  length = newSize;
+  mapped = newMapped;
+#else
+  (void)newSize;
+#endif
+}
+
+bool HostBuffer::share() {
+#ifdef __linux__
+  if (fd >= 0) {
+    return true;
+  }
+  if (privateView) {
+    copyToHeap();
+  }
+  int file = memfd_create("plusboy", MFD_CLOEXEC);
+  if (file < 0) {
+    return false;
+  }
+
+  uint8_t *heap = bytes;
+  size_t size = length;
+  fd = file;
+  bytes = nullptr;
+  length = 0;
+  mapped = 0;
+  mapShared(size);
+  if (size != 0) {
+    std::memcpy(bytes, heap, size);
+  }
+  std::free(heap);
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool HostBuffer::reshare() {
+#ifdef __linux__
+  if (fd < 0) {
+    return true;
+  }
+  int file = memfd_create("plusboy", MFD_CLOEXEC);
+  if (file < 0) {
+    return false;
+  }
+
+  uint8_t *old = bytes;
+  size_t oldMapped = mapped;
+  int oldFd = fd;
+  size_t size = length;
+  fd = file;
+  bytes = nullptr;
+  length = 0;
+  mapped = 0;
+  mapShared(size);
+  if (size != 0) {
+    std::memcpy(bytes, old, size);
+  }
+  if (old != nullptr) munmap(old, oldMapped);
+  close(oldFd);
+#endif
+  return true;
+}
+
+bool HostBuffer::mapPrivate(HostBuffer &base) {
+#ifdef __linux__
+  if (&base == this || !base.share()) {
+    return false;
+  }
+  void *view = nullptr;
+  if (base.mapped != 0) {
+    view = mmap(nullptr, base.mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE, base.fd, 0);
+    if (view == MAP_FAILED) {
+      return false;
+    }
+  }
+  release();
+  bytes = static_cast<uint8_t *>(view);
+  length = base.length;
+  mapped = base.mapped;
+  privateView = true;
+  return true;
+#else
+  (void)base;
+  return false;
+#endif
+}
@@ -0,0 +1,62 @@
+#include "../include/interrupts.hpp"
+
+#include "../include/bios.hpp"
+#include "../include/cpu.hpp"
+#include "../include/memory.hpp"
+#include "../include/savestate.hpp"
+#include "../include/scheduler.hpp"
+
+InterruptController::InterruptController(CPU &cpu, Memory &memory, Scheduler &scheduler)
+    : cpu(cpu), memory(memory), scheduler(scheduler), pending(false), halted(false) {}
+
+void InterruptController::raise(uint16_t sources) {
+  memory.writeIO(INTERRUPT_FLAGS, memory.readIO(INTERRUPT_FLAGS) | sources);
+  update();
+}
+
+void InterruptController::update() {
+  uint16_t flagged = memory.readIO(INTERRUPT_ENABLE) & memory.readIO(INTERRUPT_FLAGS) & IRQ_ALL;
+  if (halted && flagged != 0) {
+    halted = false;
+  }
+
+  bool now = flagged != 0 && (memory.readIO(INTERRUPT_MASTER) & 1) &&
+             !(cpu.getRegisters().cpsr & CPSR_IRQ_DISABLE);
+  if (now && !pending) {
+    scheduler.schedule(EVENT_IRQ, cpu.getCycles());
+  } else if (!now && pending) {
+    scheduler.cancel(EVENT_IRQ);
+  }
+  pending = now;
+}
+
+void InterruptController::halt() {
+  if ((memory.readIO(INTERRUPT_ENABLE) & memory.readIO(INTERRUPT_FLAGS) & IRQ_ALL) != 0) {
+    return;  // would wake up right away
+  }
+  halted = true;
+  scheduler.breakOut();
+}
+
+// https://problemkaputt.de/gbatek.htm#armcpuexceptions
+void InterruptController::dispatch() {
+  if (!pending) {
+    return;  // cancelled events never come up, but don't trust it
+  }
+  cpu.getStats().interruptsTaken.add();
+  if (cpu.isHLEBios()) {
+    BIOS::enterIRQ(&cpu, &memory);
+  } else {
+    cpu.enterException(VECTOR_IRQ, MODE_IRQ, cpu.getRegisters().pc + 4);
+  }
+}
+
+void InterruptController::saveState(StateWriter &writer) const {
+  writer.put(pending);
+  writer.put(halted);
+}
+
+void InterruptController::loadState(StateReader &reader) {
+  reader.get(pending);
+  reader.get(halted);
+}
@@ -0,0 +1,31 @@
+#include "../include/keypad.hpp"
+
+#include "../include/interrupts.hpp"
+#include "../include/memory.hpp"
+
+Keypad::Keypad(Memory &memory, InterruptController &interrupts)
+    : memory(memory), interrupts(interrupts) {
+  memory.writeIO(KEYINPUT, KEY_ALL);  // nothing pressed
+}
+
+void Keypad::setPressed(uint16_t keys) {
+  keys &= KEY_ALL;
+  if (keys == getPressed()) {
+    return;
+  }
+  memory.writeIO(KEYINPUT, ~keys & KEY_ALL);
+
+  uint16_t control = memory.readIO(KEYCNT);
+  uint16_t selected = control & KEY_ALL;
+  if (!(control & KEYCNT_IRQ) || selected == 0) {
+    return;
+  }
+  bool hit = (control & KEYCNT_AND) ? (keys & selected) == selected : (keys & selected) != 0;
+  if (hit) {
+    interrupts.raise(IRQ_KEYPAD);
+  }
+}
+
+uint16_t Keypad::getPressed() const {
+  return ~memory.readIO(KEYINPUT) & KEY_ALL;
+}
@@ -0,0 +1,267 @@
+#include "../include/lanebatch.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string_view>
+
+#include "../include/cpu.hpp"
+#include "../include/keypad.hpp"
+#include "../include/lanevector.hpp"
+#include "../include/memory.hpp"
+
+#define NO_KEYS 0xFFFF  // groupKeys: no lane of the group seen yet
+
+LaneBatch::LaneBatch(CPU &origin, uint32_t lanes, uint32_t mergeInterval)
+    : origin(origin),
+      mergeInterval(mergeInterval),
+      lockstep(true),
+      laneGroups(lanes, 0),
+      frame(0),
+      laneFrames(0),
+      groupFrames(0),
+      splits(0),
+      merges(0),
+      bundleSteps(0),
+      vectorSteps(0),
+      bundledInstructions(0),
+      singleInstructions(0) {
+  if (lanes == 0) {
+    throw std::runtime_error("LaneBatch::LaneBatch: no lanes");
+  }
+  origin.saveState(state);
+  if (!origin.getMemory().isFastmemEnabled()) {
+    base = takeInstance();  // before there's a base, it gets RAM of its own
+    base->cpu->loadState(state.data(), state.size());
+  }
+  groups.push_back(takeInstance());
+  groups[0]->cpu->loadState(state.data(), state.size());
+}
+
+LaneBatch::~LaneBatch() = default;
+
+std::unique_ptr<LaneBatch::Instance> LaneBatch::takeInstance() {
+  if (!spares.empty()) {
+    std::unique_ptr<Instance> instance = std::move(spares.back());
+    spares.pop_back();
+    return instance;
+  }
+  Memory &memory = origin.getMemory();
+  auto instance = std::make_unique<Instance>();
+  instance->memory = std::make_unique<Memory>();
+  if (memory.isFastmemEnabled()) {
+    instance->memory->enableFastmem();
+  }
+  if (!instance->memory->shareROM(memory)) {
+    instance->memory->loadROMData(memory.getROMData(), memory.getROMSize());
+  }
+  if (base != nullptr) {
+    instance->memory->shareRAM(*base->memory);  // a copy of its own if it can't
+  }
+  if (memory.getBackup() != nullptr) {
+    instance->memory->attachBackup("");  // in memory only, the state carries its contents
+  }
+  instance->cpu = std::make_unique<CPU>(*instance->memory);
+  instance->cpu->setThreadedInterpreter(!lockstep && origin.isThreadedInterpreter());
+  instance->cpu->setHLEBios(origin.isHLEBios());
+  return instance;
+}
+
+CPU &LaneBatch::getCPU(uint32_t lane) {
+  if (lane >= laneGroups.size()) {
+    throw std::runtime_error("LaneBatch::getCPU: no such lane");
+  }
+  return *groups[laneGroups[lane]]->cpu;
+}
+
+void LaneBatch::runFrame(const uint16_t *keys) {
+  split(keys);
+  for (uint32_t group = 0; group < groups.size(); ++group) {
+    groups[group]->cpu->getKeypad().setPressed(groupKeys[group]);
+  }
+  // After the keys are in, groups only match if they hold the same ones
+  if (mergeInterval != 0 && ++frame % mergeInterval == 0 && groups.size() > 1) {
+    merge();
+  }
+  if (lockstep && groups.size() > 1) {
+    runLockstep();
+  } else {
+    for (std::unique_ptr<Instance> &instance : groups) {
+      instance->cpu->runFrame();
+    }
+  }
+  laneFrames += laneGroups.size();
+  groupFrames += groups.size();
+}
+
+void LaneBatch::setLockstep(bool enabled) {
+  lockstep = enabled;
+  for (auto *instances : {&groups, &spares}) {
+    for (std::unique_ptr<Instance> &instance : *instances) {
+      instance->cpu->setThreadedInterpreter(!lockstep && origin.isThreadedInterpreter());
+    }
+  }
+}
+
+// One frame of every group, CPU::runFrame for all of them at once. The groups at the lowest
+// PC go first: bundled if there are two or more in ARM code, otherwise one by one until
+// they're past the next group's PC (for good in Thumb code). Branches over an 'if' part
+// bundles, this lets the ones that skipped it wait for the others at the end of it.
+void LaneBatch::runLockstep() {
+  uint32_t count = (uint32_t)groups.size();
+  frameEnds.resize(count);
+  running.clear();
+  for (uint32_t group = 0; group < count; ++group) {
+    CPU &cpu = *groups[group]->cpu;
+    cpu.getStats().beginFrame();
+    frameEnds[group] = cpu.getCycles() + CYCLES_PER_FRAME - cpu.getCycles() % CYCLES_PER_FRAME;
+    cpu.getScheduler().setBudgetEnd(frameEnds[group]);
+    running.push_back(group);
+  }
+
+  for (;;) {
+    std::erase_if(running, [this](uint32_t group) {
+      return !groups[group]->cpu->readyToExecute(frameEnds[group]);
+    });
+    if (running.empty()) {
+      break;
+    }
+    uint32_t lowest = UINT32_MAX, next = UINT32_MAX;
+    for (uint32_t group : running) {
+      uint32_t pc = groups[group]->cpu->getRegisters().pc;
+      if (pc < lowest) {
+        next = lowest;
+        lowest = pc;
+      } else if (pc > lowest && pc < next) {
+        next = pc;
+      }
+    }
+    bundle.clear();
+    for (uint32_t group : running) {
+      CPU &cpu = *groups[group]->cpu;
+      if (cpu.getRegisters().pc == lowest && (cpu.getRegisters().cpsr & CPSR_THUMB) == 0) {
+        bundle.push_back(&cpu);
+      }
+    }
+
+    if (bundle.size() >= 2) {
+      for (size_t first = 0; first < bundle.size(); first += LANE_WIDTH) {
+        uint32_t lanes = (uint32_t)std::min<size_t>(LANE_WIDTH, bundle.size() - first);
+        uint32_t steps = LaneVector::runBundle(&bundle[first], lanes, vectorSteps);
+        bundleSteps += steps;
+        bundledInstructions += (uint64_t)steps * lanes;
+      }
+      continue;
+    }
+    for (uint32_t group : running) {
+      CPU &cpu = *groups[group]->cpu;
+      if (cpu.getRegisters().pc != lowest) {
+        continue;
+      }
+      do {
+        cpu.executeinst();
+        singleInstructions++;
+      } while (cpu.readyToExecute(frameEnds[group]) &&
+               ((cpu.getRegisters().cpsr & CPSR_THUMB) || cpu.getRegisters().pc < next));
+    }
+  }
+
+  for (std::unique_ptr<Instance> &instance : groups) {
+    instance->cpu->getStats().endFrame();
+  }
+}
+
+// The first lane of a group seen keeps it, lanes with other keys move to a new group for
+// each set of keys, copied from the old one before anything runs
+void LaneBatch::split(const uint16_t *keys) {
+  uint32_t count = (uint32_t)groups.size();
+  groupKeys.assign(count, NO_KEYS);
+  splitFrom.clear();
+  for (uint32_t lane = 0; lane < laneGroups.size(); ++lane) {
+    uint32_t group = laneGroups[lane];
+    uint16_t laneKeys = keys[lane] & KEY_ALL;
+    if (groupKeys[group] == NO_KEYS) {
+      groupKeys[group] = laneKeys;
+    }
+    if (groupKeys[group] == laneKeys) {
+      continue;
+    }
+    uint32_t target = count;
+    while (target < groupKeys.size() &&
+           (splitFrom[target - count] != group || groupKeys[target] != laneKeys)) {
+      ++target;
+    }
+    if (target == groupKeys.size()) {
+      groupKeys.push_back(laneKeys);
+      splitFrom.push_back(group);
+    }
+    laneGroups[lane] = target;
+  }
+
+  for (uint32_t target = count; target < groupKeys.size(); ++target) {
+    groups.push_back(takeInstance());
+  }
+  // One save per group that split, however many ways
+  for (uint32_t group = 0; group < count; ++group) {
+    bool saved = false;
+    for (uint32_t target = count; target < groupKeys.size(); ++target) {
+      if (splitFrom[target - count] != group) {
+        continue;
+      }
+      if (!saved) {
+        state.clear();
+        groups[group]->cpu->saveState(state);
+        saved = true;
+      }
+      groups[target]->cpu->loadState(state.data(), state.size());
+      splits++;
+    }
+  }
+}
+
+uint64_t LaneBatch::hashState(CPU &cpu) {
+  state.clear();
+  cpu.saveState(state);
+  return std::hash<std::string_view>{}(
+      std::string_view(reinterpret_cast<const char *>(state.data()), state.size()));
+}
+
+void LaneBatch::merge() {
+  uint32_t count = (uint32_t)groups.size();
+  groupHashes.resize(count);
+  mergedInto.resize(count);
+  for (uint32_t group = 0; group < count; ++group) {
+    groupHashes[group] = hashState(*groups[group]->cpu);
+    mergedInto[group] = group;
+    for (uint32_t other = 0; other < group; ++other) {
+      if (mergedInto[other] != other || groupHashes[other] != groupHashes[group]) {
+        continue;
+      }
+      otherState.clear();
+      groups[other]->cpu->saveState(otherState);
+      if (otherState == state) {
+        mergedInto[group] = other;
+        break;
+      }
+    }
+  }
+
+  // Keep the first of every set of equal groups, in order, and send the rest to the spares
+  uint32_t kept = 0;
+  for (uint32_t group = 0; group < count; ++group) {
+    if (mergedInto[group] != group) {
+      mergedInto[group] = mergedInto[mergedInto[group]];  // already renumbered, it's earlier
+      spares.push_back(std::move(groups[group]));
+      merges++;
+      continue;
+    }
+    mergedInto[group] = kept;
+    groups[kept] = std::move(groups[group]);
+    groupKeys[kept] = groupKeys[group];
+    kept++;
+  }
+  groups.resize(kept);
+  groupKeys.resize(kept);
+  for (uint32_t &group : laneGroups) {
+    group = mergedInto[group];
+  }
+}
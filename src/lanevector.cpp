@@ -0,0 +1,293 @@
+#include "../include/lanevector.hpp"
+
+#include <bit>
+
+#include "../include/arm.hpp"
+#include "../include/cpu.hpp"
+#include "../include/memory.hpp"
+
+// x86-64 gets an AVX2 and a baseline copy of the vector code, the loader picks the one the
+// host runs (elsewhere the compiler's default vectors, still one op for all lanes)
+#if defined(__x86_64__) && defined(__GNUC__)
+#define LANE_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define LANE_TARGETS
+#endif
+
+typedef int32_t LaneSigned __attribute__((vector_size(LANE_WIDTH * 4)));
+
+static void gather(LaneRegisters &regs, CPU *const *cpus, uint32_t count) {
+  for (uint32_t lane = 0; lane < count; ++lane) {
+    const Registers &registers = cpus[lane]->getRegisters();
+    for (int i = 0; i < 16; ++i) {
+      regs.r[i][lane] = registers.r[i];
+    }
+    regs.cpsr[lane] = registers.cpsr;
+  }
+}
+
+// The PC stays with the CPUs, the rest goes back
+static void scatter(const LaneRegisters &regs, CPU *const *cpus, uint32_t count) {
+  for (uint32_t lane = 0; lane < count; ++lane) {
+    Registers &registers = cpus[lane]->getRegisters();
+    for (int i = 0; i < 15; ++i) {
+      registers.r[i] = regs.r[i][lane];
+    }
+    registers.cpsr = regs.cpsr[lane];
+  }
+}
+
+// What the lanes can run together, the rest goes through decodeARM one lane at a time
+static bool runsOnLanes(uint32_t inst) {
+  if ((inst & 0x0E000000) == 0x0A000000) {
+    return true;  // B, BL
+  } else if ((inst & 0x0C000000) != 0) {
+    return false;  // the rest of the table's order is only worth going through for these
+  }
+  uint32_t opcode = EXTRACT_BITS(inst, 21, 4);
+  bool compare = opcode >= 0x8 && opcode <= 0xB;
+  return ARM::isALU(inst) && (compare || EXTRACT_BITS(inst, 12, 4) != 15);  // no PC writes
+}
+
+// Macros rather than helpers, so no vector crosses a call (both copies of executeLanes get them)
+#define LANE_SPLAT(value) (LaneWord{} + (uint32_t)(value))
+#define LANE_SELECT(keep, a, b) (((a) & (keep)) | ((b) & ~(keep)))
+#define LANE_BITS(comparison) ((LaneWord)(comparison) & 1)  // 1 where it holds
+
+// checkCondition for every lane, then the instruction at 'pc' on the lanes that pass:
+// executeALU with selectOperand2/Shifter, quirks and all, or the LR of a BL. Returns the lanes
+// that passed, as bits.
+LANE_TARGETS static uint32_t executeLanes(LaneRegisters &regs, uint32_t inst, uint32_t pc) {
+  LaneWord cpsr = regs.cpsr;
+  LaneWord n = cpsr >> 31, z = (cpsr >> 30) & 1, c = (cpsr >> 29) & 1, v = (cpsr >> 28) & 1;
+  LaneWord pass;
+  switch (inst >> 28) {
+    case 0x0: pass = z; break;                      // EQ
+    case 0x1: pass = z ^ 1; break;                  // NE
+    case 0x2: pass = c; break;                      // CS
+    case 0x3: pass = c ^ 1; break;                  // CC
+    case 0x4: pass = n; break;                      // MI
+    case 0x5: pass = n ^ 1; break;                  // PL
+    case 0x6: pass = v; break;                      // VS
+    case 0x7: pass = v ^ 1; break;                  // VC
+    case 0x8: pass = c & (z ^ 1); break;            // HI
+    case 0x9: pass = (c ^ 1) | z; break;            // LS
+    case 0xA: pass = n ^ v ^ 1; break;              // GE
+    case 0xB: pass = n ^ v; break;                  // LT
+    case 0xC: pass = (z ^ 1) & (n ^ v ^ 1); break;  // GT
+    case 0xD: pass = z | (n ^ v); break;            // LE
+    case 0xE: pass = LANE_SPLAT(1); break;          // AL
+    default: pass = LANE_SPLAT(0); break;           // NV
+  }
+  uint32_t passed = 0;
+  for (int lane = 0; lane < LANE_WIDTH; ++lane) {
+    passed |= pass[lane] << lane;
+  }
+  if (passed == 0 || inst == 0) {
+    return 0;  // opcode 0 is skipped like decodeARM does
+  }
+  LaneWord keep = 0 - pass;
+
+  if ((inst & 0x0E000000) == 0x0A000000) {
+    if (CHECK_BIT(inst, 24)) {
+      regs.r[14] = LANE_SELECT(keep, LANE_SPLAT(pc + 4), regs.r[14]);  // BL
+    }
+    return passed;  // the PCs are the caller's
+  }
+
+  uint32_t opcode = EXTRACT_BITS(inst, 21, 4);
+  uint32_t rd = EXTRACT_BITS(inst, 12, 4);
+  regs.r[15] = LANE_SPLAT(pc + 4);  // what readRegister(15) sees in executeinst
+  LaneWord operand2;
+  LaneWord carry = LANE_SPLAT(0);
+  if (CHECK_BIT(inst, 25)) {
+    operand2 = LANE_SPLAT(std::rotr<uint32_t>(inst & 0xFF, EXTRACT_BITS(inst, 8, 4) * 2));
+  } else {
+    LaneWord value = regs.r[EXTRACT_BITS(inst, 0, 4)];
+    uint32_t amount = EXTRACT_BITS(inst, 7, 5);
+    switch (EXTRACT_BITS(inst, 5, 2)) {
+      case 0:  // LSL, #0 clears the carry
+        if (amount != 0) {
+          carry = (value >> (32 - amount)) & 1;
+          value <<= amount;
+        }
+        break;
+      case 1:  // LSR, #0 gives 0
+        if (amount != 0) {
+          carry = (value >> (amount - 1)) & 1;
+          value >>= amount;
+        } else {
+          value = LANE_SPLAT(0);
+        }
+        break;
+      case 2:  // ASR, #0 keeps bit 31 in bit 0
+        if (amount != 0) {
+          carry = (value >> (amount - 1)) & 1;
+          value = (LaneWord)((LaneSigned)value >> amount);
+        } else {
+          value >>= 31;
+        }
+        break;
+      default:  // ROR, #0 is RRX
+        if (amount != 0) {
+          carry = (value >> (amount - 1)) & 1;
+          value = (value >> amount) | (value << (32 - amount));
+        } else {
+          carry = value & 1;
+          value = (value >> 1) | (c << 31);
+        }
+        break;
+    }
+    operand2 = value;
+  }
+
+  LaneWord src = regs.r[EXTRACT_BITS(inst, 16, 4)];
+  LaneWord result;
+  LaneWord overflow = LANE_SPLAT(0);
+  switch (opcode) {
+    case 0x0:  // AND
+    case 0x8:  // TST
+      result = src & operand2;
+      break;
+    case 0x1:  // EOR
+    case 0x9:  // TEQ
+      result = src ^ operand2;
+      break;
+    case 0x2:  // SUB
+    case 0xA:  // CMP
+      result = src - operand2;
+      carry = LANE_BITS(src >= operand2);
+      overflow = ((src ^ operand2) & (src ^ result)) >> 31;
+      break;
+    case 0x3:  // RSB
+      result = operand2 - src;
+      carry = LANE_BITS(operand2 >= src);
+      overflow = ((operand2 ^ src) & (operand2 ^ result)) >> 31;
+      break;
+    case 0x4:  // ADD
+    case 0xB:  // CMN
+      result = src + operand2;
+      carry = LANE_BITS(result < src);
+      overflow = ((src ^ ~operand2) & (src ^ result)) >> 31;
+      break;
+    case 0x5: {  // ADC, the carry out of either add
+      LaneWord sum = src + operand2;
+      result = sum + c;
+      carry = LANE_BITS((sum < src) | (result < sum));
+      overflow = ((src ^ ~operand2) & (src ^ result)) >> 31;
+      break;
+    }
+    case 0x6: {  // SBC, carry clear borrows one more
+      LaneWord borrow = c ^ 1;
+      result = src - operand2 - borrow;
+      carry = LANE_SELECT(0 - borrow, LANE_BITS(src > operand2), LANE_BITS(src >= operand2));
+      overflow = ((src ^ operand2) & (src ^ result)) >> 31;
+      break;
+    }
+    case 0x7: {  // RSC
+      LaneWord borrow = c ^ 1;
+      result = operand2 - src - borrow;
+      carry = LANE_SELECT(0 - borrow, LANE_BITS(operand2 > src), LANE_BITS(operand2 >= src));
+      overflow = ((operand2 ^ src) & (operand2 ^ result)) >> 31;
+      break;
+    }
+    case 0xC:  // ORR
+      result = src | operand2;
+      break;
+    case 0xD:  // MOV
+      result = operand2;
+      break;
+    case 0xE:  // BIC
+      result = src & ~operand2;
+      break;
+    default:  // MVN
+      result = ~operand2;
+      break;
+  }
+
+  // Compares always set the flags (executeArmALU doesn't look at their S bit)
+  bool compare = opcode >= 0x8 && opcode <= 0xB;
+  if (!compare) {
+    regs.r[rd] = LANE_SELECT(keep, result, regs.r[rd]);
+  }
+  if (compare || CHECK_BIT(inst, 20)) {
+    LaneWord flags = (result & 0x80000000) | LANE_BITS(result == 0) << 30 | carry << 29 |
+                     overflow << 28;
+    regs.cpsr = LANE_SELECT(keep, (cpsr & 0x0FFFFFFF) | flags, cpsr);
+  }
+  return passed;
+}
+
+uint32_t LaneVector::runBundle(CPU *const *cpus, uint32_t count, uint64_t &vectorSteps) {
+  // The registers are in 'regs' while 'inLanes', in the CPUs otherwise: a run of lane by lane
+  // instructions only moves them once
+  LaneRegisters regs = {};
+  bool inLanes = false;
+  uint32_t lanes = (1u << count) - 1;
+  uint32_t opcodes[LANE_WIDTH];
+  uint32_t steps = 0;
+
+  for (;;) {
+    // Stop where runFor would look at events, or where the lanes went their own ways
+    uint32_t pc = cpus[0]->getRegisters().pc;
+    bool together = true;
+    for (uint32_t lane = 0; lane < count; ++lane) {
+      CPU &cpu = *cpus[lane];
+      together = together && cpu.getCycles() < cpu.getScheduler().getHorizon() &&
+                 cpu.getRegisters().pc == pc;
+    }
+    if (!together) {
+      break;
+    }
+
+    bool same = true;
+    for (uint32_t lane = 0; lane < count; ++lane) {
+      opcodes[lane] = cpus[lane]->fetchARM();
+      same = same && opcodes[lane] == opcodes[0];
+    }
+    uint32_t inst = opcodes[0];
+    bool onLanes = same && runsOnLanes(inst);
+    if (onLanes) {
+      if (!inLanes) {
+        gather(regs, cpus, count);
+        inLanes = true;
+      }
+      uint32_t passed = executeLanes(regs, inst, pc) & lanes;
+      if ((inst & 0x0E000000) == 0x0A000000) {
+        int32_t offset = (int32_t)(inst << 8) >> 6;
+        for (uint32_t lane = 0; lane < count; ++lane) {
+          if (passed & (1u << lane)) cpus[lane]->getRegisters().pc = pc + 8 + offset;
+        }
+      }
+      vectorSteps++;
+    } else {
+      if (inLanes) {
+        scatter(regs, cpus, count);
+        inLanes = false;
+      }
+      for (uint32_t lane = 0; lane < count; ++lane) {
+        ARM::decodeARM(cpus[lane], &cpus[lane]->getMemory(), opcodes[lane]);
+      }
+    }
+    for (uint32_t lane = 0; lane < count; ++lane) {
+      cpus[lane]->retireInstruction();
+    }
+    steps++;
+
+    // Thumb, or waiting for an interrupt now: runFor's business
+    if (!onLanes) {
+      for (uint32_t lane = 0; lane < count; ++lane) {
+        CPU &cpu = *cpus[lane];
+        together = together && (cpu.getRegisters().cpsr & CPSR_THUMB) == 0 &&
+                   !cpu.getInterrupts().isHalted();
+      }
+      if (!together) {
+        break;
+      }
+    }
+  }
+  if (inLanes) {
+    scatter(regs, cpus, count);
+  }
+  return steps;
+}
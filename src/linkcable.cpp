@@ -0,0 +1,111 @@
+#include "../include/linkcable.hpp"
+
+#include <stdexcept>
+#include <thread>
+
+#include "../include/cpu.hpp"
+
+LinkCable::LinkCable(const std::vector<CPU *> &cpus)
+    : playerCount((uint32_t)cpus.size()),
+      lookahead(SerialPort::transferCycles(SIOCNT_BAUD_MASK, (uint32_t)cpus.size())) {
+  if (cpus.size() < 2 || cpus.size() > LINK_MAX_PLAYERS) {
+    throw std::runtime_error("LinkCable::LinkCable: takes 2 to 4 players");
+  }
+  for (CPU *cpu : cpus) {
+    if (cpu->getCycles() != cpus[0]->getCycles()) {
+      throw std::runtime_error("LinkCable::LinkCable: players have to start at the same cycle");
+    }
+  }
+  parentClock.store(cpus[0]->getCycles(), std::memory_order_relaxed);
+  for (uint32_t i = 0; i < playerCount; ++i) {
+    players[i].cpu = cpus[i];
+    cpus[i]->getSerial().attach(this, i);
+  }
+}
+
+LinkCable::~LinkCable() {
+  for (uint32_t i = 0; i < playerCount; ++i) {
+    players[i].cpu->getSerial().attach(nullptr, 0);
+  }
+}
+
+void LinkCable::run(uint64_t frames) {
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < playerCount; ++i) {
+    players[i].stopped.store(false, std::memory_order_relaxed);
+    players[i].error = nullptr;
+  }
+  for (uint32_t i = 0; i < playerCount; ++i) {
+    threads.emplace_back(&LinkCable::runPlayer, this, i, frames);
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  for (uint32_t i = 0; i < playerCount; ++i) {
+    if (players[i].error) {
+      std::rethrow_exception(players[i].error);
+    }
+  }
+}
+
+void LinkCable::runPlayer(uint32_t player, uint64_t frames) {
+  CPU &cpu = *players[player].cpu;
+  try {
+    for (uint64_t frame = 0; frames == 0 || frame < frames; ++frame) {
+      cpu.runFrame();
+    }
+  } catch (...) {
+    players[player].error = std::current_exception();
+  }
+  // Whoever waits for it gets 0xFFFF from now on, children stop waiting for the parent
+  players[player].stopped.store(true, std::memory_order_release);
+  for (uint32_t i = 0; i < playerCount; ++i) {
+    if (i != player) notify(i);
+  }
+}
+
+void LinkCable::notify(uint32_t player) {
+  players[player].signal.fetch_add(1, std::memory_order_release);
+  players[player].signal.notify_all();
+}
+
+void LinkCable::publishParentClock(uint64_t cycle) {
+  parentClock.store(cycle, std::memory_order_release);
+  for (uint32_t i = 1; i < playerCount; ++i) {
+    notify(i);
+  }
+}
+
+uint64_t LinkCable::getChildHorizon() const {
+  if (players[0].stopped.load(std::memory_order_acquire)) {
+    return UINT64_MAX;
+  }
+  return parentClock.load(std::memory_order_acquire) + lookahead - LINK_SYNC_MARGIN;
+}
+
+void LinkCable::send(uint32_t from, uint32_t to, const LinkMessage &message) {
+  if (!queues[from][to].push(message)) {
+    throw std::runtime_error("LinkCable::send: queue full");
+  }
+  notify(to);
+}
+
+bool LinkCable::peek(uint32_t to, uint32_t from, LinkMessage &message) const {
+  return queues[from][to].peek(message);
+}
+
+void LinkCable::drop(uint32_t to, uint32_t from) {
+  queues[from][to].drop();
+}
+
+bool LinkCable::hasStopped(uint32_t player) const {
+  return players[player].stopped.load(std::memory_order_acquire);
+}
+
+uint32_t LinkCable::getSignal(uint32_t player) const {
+  return players[player].signal.load(std::memory_order_acquire);
+}
+
+void LinkCable::wait(uint32_t player, uint32_t signal) const {
+  players[player].signal.wait(signal, std::memory_order_acquire);
+}
@@ -1,9 +1,23 @@
 #include "../include/memory.hpp"
 
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <stdexcept>
 
+#include "../include/arm.hpp"
+#include "../include/backup.hpp"
 #include "../include/cpu.hpp"
+#include "../include/debugger.hpp"
+#include "../include/fastmem.hpp"
+#include "../include/interrupts.hpp"
+#include "../include/keypad.hpp"
+#include "../include/log.hpp"
+#include "../include/ppu.hpp"
+#include "../include/savestate.hpp"
+#include "../include/serial.hpp"
+#include "../include/stats.hpp"
 
 // i Fucking hate little edian
 // I also hate myself
@@ -16,50 +30,389 @@ Memory::Memory()
       palette(PALETTE_SIZE),
       vram(VRAM_SIZE),
       oam(OAM_SIZE),
-      rom()  // ROM size will be determined when loading
-{}
+      rom(),  // ROM size will be determined when loading
+      stats(nullptr),
+      interrupts(nullptr),
+      serial(nullptr),
+      busCycles(0),
+      romDataAccess(false),
+      mappingGeneration(0),
+      pageVersions((WRAM_SIZE + IWRAM_SIZE) / FETCH_PAGE_SIZE),
+      videoVersion(0),
+      debugger(nullptr),
+      watchedPageCount(0),
+      regionWatchedPages() {
+  updateWaitstates();
+  updateAccessBuffers();
+}
 
-uint32_t Memory::readWord(uint32_t address) const {
-  std::cout << "readWord: Address: 0x" << std::hex << address << std::endl;
+Memory::~Memory() = default;
+
+// https://problemkaputt.de/gbatek.htm#gbasystemcontrol
+void Memory::updateWaitstates() {
+  static const uint8_t firstAccess[4] = {4, 3, 2, 8};
+  uint16_t waitcnt = io[WAITCNT - IO_START] | (io[WAITCNT - IO_START + 1] << 8);
+
+  // Only wait state 0 (0x08000000-0x09FFFFFF) is mapped
+  uint32_t romN = 1 + firstAccess[EXTRACT_BITS(waitcnt, 2, 2)];
+  uint32_t romS = 1 + (CHECK_BIT(waitcnt, 4) ? 1 : 2);
+  prefetchEnabled = CHECK_BIT(waitcnt, 14);
+  romSequentialCycles = romS;
+
+  static const uint8_t fixed[REGION_COUNT][3] = {
+      {1, 1, 1},  // BIOS
+      {3, 3, 6},  // WRAM, 16-bit bus with 2 waitstates
+      {1, 1, 1},  // IWRAM
+      {1, 1, 1},  // IO
+      {1, 1, 2},  // Palette, 16-bit bus
+      {1, 1, 2},  // VRAM, 16-bit bus
+      {1, 1, 1},  // OAM
+      {0, 0, 0},  // ROM, filled in below
+      {0, 0, 0},  // Backup, filled in below
+  };
+  for (int i = 0; i < REGION_COUNT; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      accessCycles[i][j] = fixed[i][j];
+    }
+  }
+  accessCycles[REGION_ROM][0] = romN;
+  accessCycles[REGION_ROM][1] = romN;
+  accessCycles[REGION_ROM][2] = romN + romS;  // two 16-bit accesses, the second one sequential
+  uint32_t sram = 1 + firstAccess[EXTRACT_BITS(waitcnt, 0, 2)];
+  for (int j = 0; j < 3; ++j) {
+    accessCycles[REGION_BACKUP][j] = sram;  // 8-bit bus, wider accesses are still one byte
+  }
+}
 
-  size_t regionSize = 0;
-  const std::vector<uint8_t> *region = nullptr;
+// Stores a byte written to an I/O register and runs its side effects
+void Memory::ioWrite(uint32_t offset, uint8_t value) {
+  uint32_t address = IO_START + offset;
+  switch (address & ~1u) {
+    case INTERRUPT_FLAGS:
+      io[offset] &= ~value;  // acknowledge
+      break;
+    case DISPSTAT:
+      io[offset] = (address == DISPSTAT) ? (io[offset] & 0x07) | (value & ~0x07) : value;
+      break;
+    case SIOCNT:
+      // Busy, ID and the terminal bits belong to the port
+      if (address == SIOCNT) {
+        io[offset] = (io[offset] & SIOCNT_PORT_BITS) | (value & SIOCNT_BAUD_MASK);
+      } else {
+        io[offset] = value;
+      }
+      break;
+    case VCOUNT:
+    case KEYINPUT:
+      break;  // read-only
+    default:
+      io[offset] = value;
+      break;
+  }
 
-  size_t offset = 0;
+  switch (address & ~1u) {
+    case WAITCNT:
+      updateWaitstates();
+      break;
+    case INTERRUPT_ENABLE:
+    case INTERRUPT_FLAGS:
+    case INTERRUPT_MASTER:
+      if (interrupts != nullptr) interrupts->update();
+      break;
+    case SIOCNT:
+      if (address == SIOCNT && (value & SIOCNT_BUSY) && serial != nullptr) serial->start();
+      break;
+    case HALTCNT & ~1u:
+      // Bit 7 picks stop mode, which only the keypad/serial/Game Pak wake from, same thing here
+      if (address == HALTCNT && interrupts != nullptr) interrupts->halt();
+      break;
+  }
+}
+
+uint16_t Memory::readIO(uint32_t address) const {
+  return io[address - IO_START] | (io[address - IO_START + 1] << 8);
+}
+
+void Memory::writeIO(uint32_t address, uint16_t value) {
+  io[address - IO_START] = value & 0xFF;
+  io[address - IO_START + 1] = value >> 8;
+}
+
+void Memory::saveState(StateWriter &writer) const {
+  for (const HostBuffer *buffer : {&wram, &iwram, &io, &palette, &vram, &oam}) {
+    writer.putBytes(buffer->data(), buffer->size());
+  }
+  writer.put<uint8_t>(backup != nullptr);
+  if (backup) {
+    backup->saveState(writer);
+  }
+}
+
+void Memory::loadState(StateReader &reader) {
+  // RAM pages the state leaves alone keep their decoded code
+  const std::pair<HostBuffer *, uint32_t> ram[] = {{&wram, WRAM_START}, {&iwram, IWRAM_START}};
+  for (const auto &[buffer, start] : ram) {
+    const uint8_t *saved = reader.take(buffer->size());
+    for (size_t page = 0; page < buffer->size(); page += FETCH_PAGE_SIZE) {
+      if (std::memcmp(buffer->data() + page, saved + page, FETCH_PAGE_SIZE) != 0) {
+        std::memcpy(buffer->data() + page, saved + page, FETCH_PAGE_SIZE);
+        markWritten(start + (uint32_t)page, FETCH_PAGE_SIZE);
+      }
+    }
+  }
+  reader.getBytes(io.data(), io.size());
+  reader.getBytes(palette.data(), palette.size());
+  const uint8_t *saved = reader.take(vram.size());
+  for (size_t page = 0; page < vram.size(); page += FETCH_PAGE_SIZE) {
+    if (std::memcmp(vram.data() + page, saved + page, FETCH_PAGE_SIZE) != 0) {
+      std::memcpy(vram.data() + page, saved + page, FETCH_PAGE_SIZE);
+    }
+  }
+  reader.getBytes(oam.data(), oam.size());
+  videoVersion++;
+  uint8_t hasBackup;
+  reader.get(hasBackup);
+  if (hasBackup != (backup != nullptr)) {
+    throw std::runtime_error("Memory::loadState: state is from a ROM with another save type");
+  }
+  if (backup) {
+    backup->loadState(reader);
+  }
+  updateWaitstates();
+}
 
+// Step 1 of every access: find the buffer behind the address
+const HostBuffer *Memory::resolve(uint32_t address, size_t &offset, MemoryRegion &region) const {
   if (address >= BIOS_START && address <= BIOS_END) {
-    regionSize = BIOS_SIZE;
-    region = &bios;
+    region = REGION_BIOS;
     offset = address - BIOS_START;
-  } else if (address >= WRAM_START && address <= WRAM_END) {
-    regionSize = WRAM_SIZE;
-    region = &wram;
-    offset = address - WRAM_START;
-  } else if (address >= IWRAM_START && address <= IWRAM_END) {
-    regionSize = IWRAM_SIZE;
-    region = &iwram;
-    offset = address - IWRAM_START;
+    return &bios;
+  } else if (address >= WRAM_START && address <= MIRROR_END(WRAM_START)) {
+    region = REGION_WRAM;
+    offset = (address - WRAM_START) & (WRAM_SIZE - 1);
+    return &wram;
+  } else if (address >= IWRAM_START && address <= MIRROR_END(IWRAM_START)) {
+    region = REGION_IWRAM;
+    offset = (address - IWRAM_START) & (IWRAM_SIZE - 1);
+    return &iwram;
   } else if (address >= IO_START && address <= IO_END) {
-    regionSize = IO_END - IO_START + 1;
-    region = &io;
+    region = REGION_IO;
     offset = address - IO_START;
-  } else if (address >= PALETTE_START && address <= PALETTE_END) {
-    regionSize = PALETTE_SIZE;
-    region = &palette;
-    offset = address - PALETTE_START;
-  } else if (address >= VRAM_START && address <= VRAM_END) {
-    regionSize = VRAM_SIZE;
-    region = &vram;
-    offset = address - VRAM_START;
-  } else if (address >= OAM_START && address <= OAM_END) {
-    regionSize = OAM_SIZE;
-    region = &oam;
-    offset = address - OAM_START;
+    return &io;
+  } else if (address >= PALETTE_START && address <= MIRROR_END(PALETTE_START)) {
+    region = REGION_PALETTE;
+    offset = (address - PALETTE_START) & (PALETTE_SIZE - 1);
+    return &palette;
+  } else if (address >= VRAM_START && address <= MIRROR_END(VRAM_START)) {
+    region = REGION_VRAM;
+    offset = (address - VRAM_START) & (VRAM_MIRROR_SIZE - 1);
+    if (offset >= VRAM_SIZE) {
+      offset -= 0x8000;  // 0x18000-0x1FFFF shows 0x10000-0x17FFF again
+    }
+    return &vram;
+  } else if (address >= OAM_START && address <= MIRROR_END(OAM_START)) {
+    region = REGION_OAM;
+    offset = (address - OAM_START) & (OAM_SIZE - 1);
+    return &oam;
   } else if (address >= ROM_START && address <= ROM_END) {
-    regionSize = rom.size();
-    region = &rom;
+    region = REGION_ROM;
     offset = address - ROM_START;
-  } else {
+    return &rom;
+  }
+  return nullptr;
+}
+
+HostBuffer *Memory::resolve(uint32_t address, size_t &offset, MemoryRegion &region) {
+  return const_cast<HostBuffer *>(
+      static_cast<const Memory *>(this)->resolve(address, offset, region));
+}
+
+const HostBuffer *Memory::resolveAccess(uint32_t address, size_t &offset,
+                                        MemoryRegion &region) const {
+  if (resolve(address, offset, region) == nullptr) {
+    region = REGION_COUNT;
+    return nullptr;
+  }
+  return accessBuffers[region];
+}
+
+HostBuffer *Memory::resolveAccess(uint32_t address, size_t &offset, MemoryRegion &region) {
+  return const_cast<HostBuffer *>(
+      static_cast<const Memory *>(this)->resolveAccess(address, offset, region));
+}
+
+// Region behind a guest address that fastmem served (anything else faults before we get here)
+static MemoryRegion fastmemRegion(uint32_t address) {
+  static const MemoryRegion regions[16] = {
+      REGION_BIOS,    REGION_BIOS, REGION_WRAM, REGION_IWRAM, REGION_IO,  REGION_PALETTE,
+      REGION_VRAM,    REGION_OAM,  REGION_ROM,  REGION_ROM,   REGION_ROM, REGION_ROM,
+      REGION_ROM,     REGION_ROM,  REGION_ROM,  REGION_ROM};
+  return regions[(address >> 24) & 0xF];
+}
+
+void Memory::countAccess(MemoryRegion region, int width, bool write) const {
+  if (stats != nullptr) {
+    (write ? stats->regionWrites : stats->regionReads)[region].add();
+  }
+  busCycles += accessCycles[region][width];
+  romDataAccess |= region == REGION_ROM;
+}
+
+static const uint32_t fixedPageVersion = 0;
+
+// End of the display registers (DISPCNT up to the blending ones)
+#define DISPLAY_IO_END 0x04000060
+
+void Memory::noteWrite(MemoryRegion region, uint32_t address) {
+  if (region == REGION_WRAM) {
+    pageVersions[(address & (WRAM_SIZE - 1)) / FETCH_PAGE_SIZE]++;
+  } else if (region == REGION_IWRAM) {
+    pageVersions[(WRAM_SIZE + (address & (IWRAM_SIZE - 1))) / FETCH_PAGE_SIZE]++;
+  } else if (region >= REGION_PALETTE && region <= REGION_OAM) {
+    videoVersion++;
+  } else if (region == REGION_IO) {
+    if (address < DISPLAY_IO_END && (address < DISPSTAT || address > VCOUNT + 1)) {
+      videoVersion++;
+    }
+  }
+}
+
+// Other pages of a watched region (and the save chip) come through here too
+void Memory::watchAccess(uint32_t address, uint32_t value, int width, bool write) const {
+  if (!watchedPages.empty() && watchedPages[address / FETCH_PAGE_SIZE] != 0 &&
+      debugger != nullptr) {
+    debugger->checkAccess(address, value, width, write);
+  }
+}
+
+// The regular path's accesses for the regions with a watched page. Reads have no side effects
+// there, the bytes are all there is to them.
+uint32_t Memory::readWatched(uint32_t address, int width) const {
+  size_t offset = 0;
+  MemoryRegion id;
+  const HostBuffer *region = resolve(address, offset, id);
+  if (offset + (1u << width) > region->size()) {
+    throw std::out_of_range("Memory::readWatched: Address out of range");
+  }
+  countAccess(id, width, false);
+  uint32_t value = 0;
+  for (int i = (1 << width) - 1; i >= 0; --i) {
+    value = (value << 8) | (*region)[offset + i];
+  }
+  watchAccess(address, value, width, false);
+  return value;
+}
+
+void Memory::writeWatched(uint32_t address, uint32_t value, int width) {
+  size_t offset = 0;
+  MemoryRegion id;
+  HostBuffer *region = resolve(address, offset, id);
+  if (offset + (1u << width) > region->size()) {
+    throw std::out_of_range("Memory::writeWatched: Address out of range");
+  }
+  countAccess(id, width, true);
+  noteWrite(id, address);
+  watchAccess(address, value, width, true);
+  for (int i = 0; i < (1 << width); ++i) {
+    if (id == REGION_IO) {
+      ioWrite(offset + i, value >> (i * 8));
+    } else {
+      (*region)[offset + i] = value >> (i * 8);
+    }
+  }
+}
+
+void Memory::updateAccessBuffers() {
+  HostBuffer *buffers[REGION_COUNT] = {&bios,    &wram, &iwram, &io,    &palette,
+                                       &vram,    &oam,  &rom,   nullptr};
+  for (int i = 0; i < REGION_COUNT; ++i) {
+    accessBuffers[i] = regionWatchedPages[i] == 0 ? buffers[i] : nullptr;
+  }
+}
+
+void Memory::watchPages(uint32_t address, uint32_t length, bool watched) {
+  uint64_t first = address / FETCH_PAGE_SIZE;
+  uint64_t last = ((uint64_t)address + std::max<uint32_t>(length, 1) - 1) / FETCH_PAGE_SIZE;
+  if (!watched) {
+    // All or nothing, the counts stay as they are if one of them isn't watched
+    for (uint64_t page = first; page <= last; ++page) {
+      if (watchedPages.empty() || watchedPages[page] == 0) {
+        throw std::runtime_error("Memory::watchPages: page isn't watched");
+      }
+    }
+  }
+  if (watchedPages.empty()) {
+    watchedPages.resize(((uint64_t)1 << 32) / FETCH_PAGE_SIZE);
+  }
+  for (uint64_t page = first; page <= last; ++page) {
+    uint16_t &watches = watchedPages[page];
+    if (watched ? watches++ != 0 : --watches != 0) {
+      continue;  // no change for the page itself
+    }
+    int change = watched ? 1 : -1;
+    watchedPageCount += change;
+    size_t offset = 0;
+    MemoryRegion region;
+    if (resolve((uint32_t)(page * FETCH_PAGE_SIZE), offset, region) != nullptr) {
+      regionWatchedPages[region] += change;
+    }
+  }
+  updateAccessBuffers();
+  if (watchedPageCount == 0) {
+    watchedPages = {};
+  }
+  if (fastmem) {
+    mapFastmem();  // maps everything again, minus the watched pages
+  }
+}
+
+const uint32_t *Memory::getPageVersion(uint32_t address) const {
+  size_t offset = 0;
+  MemoryRegion region;
+  if (resolve(address, offset, region) == nullptr) {
+    return &fixedPageVersion;
+  }
+  if (region == REGION_WRAM) {
+    return &pageVersions[offset / FETCH_PAGE_SIZE];
+  } else if (region == REGION_IWRAM) {
+    return &pageVersions[(WRAM_SIZE + offset) / FETCH_PAGE_SIZE];
+  }
+  return &fixedPageVersion;
+}
+
+void Memory::markWritten(uint32_t address, size_t length) {
+  size_t offset = 0;
+  MemoryRegion region;
+  if (length == 0 || resolve(address, offset, region) == nullptr) {
+    return;
+  }
+  for (uint64_t page = address & ~(FETCH_PAGE_SIZE - 1); page < (uint64_t)address + length;
+       page += FETCH_PAGE_SIZE) {
+    noteWrite(region, (uint32_t)page);
+  }
+}
+
+uint32_t Memory::readWord(uint32_t address) const {
+  DEBUG_LOG("readWord: Address: 0x" << std::hex << address);
+  if (fastmem) {
+    uint32_t value;
+    if (fastmem->load32(address, value)) {
+      countAccess(fastmemRegion(address), 2, false);
+      return value;
+    }
+    if (stats != nullptr) stats->fastmemFallbacks.add();
+  }
+
+  size_t offset = 0;
+  MemoryRegion id;
+  const HostBuffer *region = resolveAccess(address, offset, id);
+  if (region == nullptr && id != REGION_COUNT) {
+    return readWatched(address, 2);
+  }
+  if (region == nullptr && backup != nullptr && backup->contains(address)) {
+    return readBackup(address, 2);
+  }
+  if (region == nullptr) {
     std::cerr << "readWord: Invalid address: 0x" << std::hex << address << std::endl;
     throw std::out_of_range("Memory::readWord: Invalid address");
   }
@@ -67,11 +420,12 @@ uint32_t Memory::readWord(uint32_t address) const {
   // Hopefully this will never happen
   // It happened ALOT
 
-  if (offset + 3 >= regionSize) {
+  if (offset + 3 >= region->size()) {
     std::cerr << "readWord: OUT OF RANGE! Offset: 0x" << std::hex << offset
-              << " is beyond region size: 0x" << std::hex << regionSize << std::endl;
+              << " is beyond region size: 0x" << std::hex << region->size() << std::endl;
     throw std::out_of_range("Memory::readWord: Address out of range");
   }
+  countAccess(id, 2, false);
 
   // Step 2. Read the 4 bytes (word) starting from the offset
   uint8_t byte0 = (*region)[offset];
@@ -85,46 +439,28 @@ uint32_t Memory::readWord(uint32_t address) const {
 }
 
 void Memory::writeWord(uint32_t address, uint32_t value) {
-  std::cout << "writeWord: Address: 0x" << std::hex << address << " Value: 0x" << std::hex << value
-            << std::endl;
-
-  size_t regionSize = 0;
-  std::vector<uint8_t> *region = nullptr;
+  DEBUG_LOG("writeWord: Address: 0x" << std::hex << address << " Value: 0x" << std::hex << value);
+  if (fastmem) {
+    if (fastmem->store32(address, value)) {
+      countAccess(fastmemRegion(address), 2, true);
+      noteWrite(fastmemRegion(address), address);
+      return;
+    }
+    if (stats != nullptr) stats->fastmemFallbacks.add();
+  }
 
   size_t offset = 0;
-  if (address >= BIOS_START && address <= BIOS_END) {
-    regionSize = BIOS_SIZE;
-    region = &bios;
-    offset = address - BIOS_START;
-  } else if (address >= WRAM_START && address <= WRAM_END) {
-    regionSize = WRAM_SIZE;
-    region = &wram;
-    offset = address - WRAM_START;
-  } else if (address >= IWRAM_START && address <= IWRAM_END) {
-    regionSize = IWRAM_SIZE;
-    region = &iwram;
-    offset = address - IWRAM_START;
-  } else if (address >= IO_START && address <= IO_END) {
-    regionSize = IO_END - IO_START + 1;
-    region = &io;
-    offset = address - IO_START;
-  } else if (address >= PALETTE_START && address <= PALETTE_END) {
-    regionSize = PALETTE_SIZE;
-    region = &palette;
-    offset = address - PALETTE_START;
-  } else if (address >= VRAM_START && address <= VRAM_END) {
-    regionSize = VRAM_SIZE;
-    region = &vram;
-    offset = address - VRAM_START;
-  } else if (address >= OAM_START && address <= OAM_END) {
-    regionSize = OAM_SIZE;
-    region = &oam;
-    offset = address - OAM_START;
-  } else if (address >= ROM_START && address <= ROM_END) {
-    regionSize = rom.size();
-    region = &rom;
-    offset = address - ROM_START;
-  } else {
+  MemoryRegion id;
+  HostBuffer *region = resolveAccess(address, offset, id);
+  if (region == nullptr && id != REGION_COUNT) {
+    writeWatched(address, value, 2);
+    return;
+  }
+  if (region == nullptr && backup != nullptr && backup->contains(address)) {
+    writeBackup(address, value, 2);
+    return;
+  }
+  if (region == nullptr) {
     std::cerr << "writeWord: Invalid address: 0x" << std::hex << address << std::endl;
     throw std::out_of_range("Memory::writeWord: Invalid address");
   }
@@ -132,12 +468,18 @@ void Memory::writeWord(uint32_t address, uint32_t value) {
 
   // Future me: it did happen (a lot)
 
-  if (offset + 3 >= regionSize) {
+  if (offset + 3 >= region->size()) {
     std::cerr << "writeWord: OUT OF RANGE! Offset: 0x" << std::hex << offset
-              << " is beyond region size: 0x" << std::hex << regionSize << std::endl;
+              << " is beyond region size: 0x" << std::hex << region->size() << std::endl;
     throw std::out_of_range("Memory::writeWord: Address out of range");
   }
+  countAccess(id, 2, true);
+  noteWrite(id, address);
 
+  if (id == REGION_IO) {
+    for (int i = 0; i < 4; ++i) ioWrite(offset + i, value >> (i * 8));
+    return;
+  }
   (*region)[offset] = value & 0xFF;
   (*region)[offset + 1] = (value >> 8) & 0xFF;
   (*region)[offset + 2] = (value >> 16) & 0xFF;
@@ -156,14 +498,179 @@ void Memory::loadBinFile(const std::string &filename) {
   size_t size = file.tellg();
   file.seekg(0, std::ios::beg);
 
-  // Resize the 'rom' vector and read the file data
-  rom.resize(size);
-  file.read(reinterpret_cast<char *>(&rom[0]), size);
+  std::vector<uint8_t> data(size);
+  file.read(reinterpret_cast<char *>(data.data()), size);
   file.close();
+  loadROMData(data.data(), size);
 
   std::cout << "ROM loaded successfully (" << size << " bytes)" << std::endl;
 }
 
+void Memory::loadROMData(const uint8_t *data, size_t size) {
+  rom.resize(size);
+  std::memcpy(rom.data(), data, size);
+  mappingGeneration++;  // the ROM buffer moved
+  if (fastmem) {
+    mapFastmem();
+  }
+}
+
+BackupType Memory::attachBackup(const std::string &savePath) {
+  BackupType type = Backup::detect(rom.data(), rom.size());
+  backup.reset();
+  if (type != BACKUP_NONE) {
+    backup = std::make_unique<Backup>(type, savePath);
+  }
+  std::cout << "Save type: " << Backup::typeName(type) << std::endl;
+  return type;
+}
+
+bool Memory::shareROM(Memory &base) {
+  if (fastmem || !rom.mapPrivate(base.rom)) {
+    return false;
+  }
+  mappingGeneration++;  // the ROM buffer moved, and the base's did if it wasn't shared yet
+  base.mappingGeneration++;
+  return true;
+}
+
+bool Memory::shareRAM(Memory &base) {
+  if (fastmem) {
+    return false;
+  }
+  const std::pair<HostBuffer *, HostBuffer *> views[] = {
+      {&wram, &base.wram}, {&iwram, &base.iwram}, {&vram, &base.vram}};
+  for (const auto &[buffer, baseBuffer] : views) {
+    if (!buffer->mapPrivate(*baseBuffer)) {
+      return false;  // the ones before stay views, they hold the same bytes either way
+    }
+  }
+  mappingGeneration++;
+  base.mappingGeneration++;
+  markWritten(WRAM_START, WRAM_SIZE);  // other contents, decoded code is stale
+  markWritten(IWRAM_START, IWRAM_SIZE);
+  videoVersion++;
+  return true;
+}
+
+// SRAM and Flash sit on an 8-bit bus: reads see the byte in every lane, writes keep the lane
+// the address picks. EEPROM only looks at bit 0.
+uint32_t Memory::readBackup(uint32_t address, int width) const {
+  countAccess(REGION_BACKUP, width, false);
+  uint32_t value;
+  if (backup->getType() == BACKUP_EEPROM) {
+    value = backup->readSerial();
+  } else {
+    uint32_t byte = backup->read8(address);
+    value = width == 0 ? byte : width == 1 ? byte * 0x0101 : byte * 0x01010101;
+  }
+  watchAccess(address, value, width, false);
+  return value;
+}
+
+void Memory::writeBackup(uint32_t address, uint32_t value, int width) {
+  countAccess(REGION_BACKUP, width, true);
+  watchAccess(address, value, width, true);
+  if (backup->getType() == BACKUP_EEPROM) {
+    backup->writeSerial(value);
+    return;
+  }
+  uint32_t lane = address & ((1u << width) - 1);
+  backup->write8(address, value >> (lane * 8));
+}
+
+bool Memory::enableFastmem() {
+  if (fastmem) {
+    return true;
+  }
+  if (!Fastmem::isSupported()) {
+    std::cerr << "Fastmem isn't supported on this host, using the regular bus" << std::endl;
+    return false;
+  }
+
+  HostBuffer *mapped[] = {&bios, &wram, &iwram, &vram, &rom};
+  for (HostBuffer *buffer : mapped) {
+    if (!buffer->share()) {
+      std::cerr << "Fastmem: memfd_create failed, using the regular bus" << std::endl;
+      return false;
+    }
+  }
+  fastmem = std::make_unique<Fastmem>();
+  mapFastmem();
+  mappingGeneration++;  // the buffers moved into their memfds
+  return true;
+}
+
+bool Memory::unshareAfterFork() {
+  if (!fastmem) {
+    return true;
+  }
+  // The ROM too: writes to it land in the buffer like on a flash cart
+  for (HostBuffer *buffer : {&bios, &wram, &iwram, &vram, &rom}) {
+    if (!buffer->reshare()) {
+      return false;
+    }
+  }
+  mappingGeneration++;  // the buffers moved
+  mapFastmem();
+  return true;
+}
+
+// Palette and OAM (1 KB mirrors) are smaller than a host page, they stay on the slow path
+// together with I/O
+void Memory::mapFastmem() {
+  fastmem->mapView(BIOS_START, bios, 0, bios.getMappedSize());
+  fastmem->mapMirrored(WRAM_START, MIRROR_END(WRAM_START), wram);
+  fastmem->mapMirrored(IWRAM_START, MIRROR_END(IWRAM_START), iwram);
+  for (uint32_t address = VRAM_START; address < MIRROR_END(VRAM_START);
+       address += VRAM_MIRROR_SIZE) {
+    fastmem->mapView(address, vram, 0, VRAM_SIZE);
+    fastmem->mapView(address + VRAM_SIZE, vram, 0x10000, VRAM_MIRROR_SIZE - VRAM_SIZE);
+  }
+
+  // The ROM can be reloaded with a different size
+  size_t romWindow = ROM_END - ROM_START + 1;
+  fastmem->unmap(ROM_START, romWindow);
+  fastmem->mapView(ROM_START, rom, 0, std::min(rom.getMappedSize(), romWindow));
+
+  // Watched pages fault to the regular path, which checks them
+  for (size_t page = 0; page < watchedPages.size(); ++page) {
+    if (watchedPages[page] != 0) {
+      fastmem->unmap((uint32_t)(page * FETCH_PAGE_SIZE), FETCH_PAGE_SIZE);
+    }
+  }
+}
+
+uint8_t *Memory::getHostPointer(uint32_t address, size_t &available) {
+  size_t offset = 0;
+  MemoryRegion id;
+  HostBuffer *region = resolve(address, offset, id);
+
+  // I/O is left out on purpose, writes there have side effects
+  if (region == nullptr || id == REGION_IO || offset >= region->size()) {
+    available = 0;
+    return nullptr;
+  }
+
+  available = region->size() - offset;
+  return region->data() + offset;
+}
+
+const uint8_t *Memory::getFetchPage(uint32_t address, uint32_t &start, uint32_t &length,
+                                    MemoryRegion &region) const {
+  size_t offset = 0;
+  const HostBuffer *buffer = resolve(address, offset, region);
+  if (buffer == nullptr || region == REGION_IO || offset >= buffer->size()) {
+    return nullptr;
+  }
+
+  // Clamp the page to the end of the region (palette, OAM and the ROM tail are short)
+  size_t pageOffset = offset & ~(size_t)(FETCH_PAGE_SIZE - 1);
+  start = address - (offset - pageOffset);
+  length = std::min<size_t>(FETCH_PAGE_SIZE, buffer->size() - pageOffset);
+  return buffer->data() + pageOffset;
+}
+
 size_t Memory::getROMSize() const {
   return rom.size();
 }
@@ -184,53 +691,35 @@ void Memory::dumpROM() const {
 }
 
 uint16_t Memory::readHalfWord(uint32_t address) const {
-  size_t regionSize = 0;
-  const std::vector<uint8_t> *region = nullptr;
+  if (fastmem) {
+    uint16_t value;
+    if (fastmem->load16(address, value)) {
+      countAccess(fastmemRegion(address), 1, false);
+      return value;
+    }
+    if (stats != nullptr) stats->fastmemFallbacks.add();
+  }
 
   size_t offset = 0;
-
-  if (address >= BIOS_START && address <= BIOS_END) {
-    regionSize = BIOS_SIZE;
-    region = &bios;
-    offset = address - BIOS_START;
-  } else if (address >= WRAM_START && address <= WRAM_END) {
-    regionSize = WRAM_SIZE;
-    region = &wram;
-    offset = address - WRAM_START;
-  } else if (address >= IWRAM_START && address <= IWRAM_END) {
-    regionSize = IWRAM_SIZE;
-    region = &iwram;
-    offset = address - IWRAM_START;
-  } else if (address >= IO_START && address <= IO_END) {
-    regionSize = IO_END - IO_START + 1;
-    region = &io;
-    offset = address - IO_START;
-  } else if (address >= PALETTE_START && address <= PALETTE_END) {
-    regionSize = PALETTE_SIZE;
-    region = &palette;
-    offset = address - PALETTE_START;
-  } else if (address >= VRAM_START && address <= VRAM_END) {
-    regionSize = VRAM_SIZE;
-    region = &vram;
-    offset = address - VRAM_START;
-  } else if (address >= OAM_START && address <= OAM_END) {
-    regionSize = OAM_SIZE;
-    region = &oam;
-    offset = address - OAM_START;
-  } else if (address >= ROM_START && address <= ROM_END) {
-    regionSize = rom.size();
-    region = &rom;
-    offset = address - ROM_START;
-  } else {
+  MemoryRegion id;
+  const HostBuffer *region = resolveAccess(address, offset, id);
+  if (region == nullptr && id != REGION_COUNT) {
+    return (uint16_t)readWatched(address, 1);
+  }
+  if (region == nullptr && backup != nullptr && backup->contains(address)) {
+    return readBackup(address, 1);
+  }
+  if (region == nullptr) {
     std::cerr << "readHalfWord: Invalid address: 0x" << std::hex << address << std::endl;
     throw std::out_of_range("Memory::readHalfWord: Invalid address");
   }
 
-  if (offset + 1 >= regionSize) {
+  if (offset + 1 >= region->size()) {
     std::cerr << "readHalfWord: OUT OF RANGE! Offset: 0x" << std::hex << offset
-              << " is beyond region size: 0x" << std::hex << regionSize << std::endl;
+              << " is beyond region size: 0x" << std::hex << region->size() << std::endl;
     throw std::out_of_range("Memory::readHalfWord: Address out of range");
   }
+  countAccess(id, 1, false);
 
   // Step 2. Read the 2 bytes starting from the offset
   uint8_t byte0 = (*region)[offset];
@@ -242,112 +731,83 @@ uint16_t Memory::readHalfWord(uint32_t address) const {
 }
 
 void Memory::writeHalfWord(uint32_t address, uint16_t value) {
-  std::cout << "writeHalfWord: Address: 0x" << std::hex << address << " Value: 0x" << std::hex
-            << value << std::endl;
-
-  size_t regionSize = 0;
-  std::vector<uint8_t> *region = nullptr;
+  DEBUG_LOG("writeHalfWord: Address: 0x" << std::hex << address << " Value: 0x" << std::hex
+                                         << value);
+  if (fastmem) {
+    if (fastmem->store16(address, value)) {
+      countAccess(fastmemRegion(address), 1, true);
+      noteWrite(fastmemRegion(address), address);
+      return;
+    }
+    if (stats != nullptr) stats->fastmemFallbacks.add();
+  }
 
   size_t offset = 0;
-
-  if (address >= BIOS_START && address <= BIOS_END) {
-    regionSize = BIOS_SIZE;
-    region = &bios;
-    offset = address - BIOS_START;
-  } else if (address >= WRAM_START && address <= WRAM_END) {
-    regionSize = WRAM_SIZE;
-    region = &wram;
-    offset = address - WRAM_START;
-  } else if (address >= IWRAM_START && address <= IWRAM_END) {
-    regionSize = IWRAM_SIZE;
-    region = &iwram;
-    offset = address - IWRAM_START;
-  } else if (address >= IO_START && address <= IO_END) {
-    regionSize = IO_END - IO_START + 1;
-    region = &io;
-    offset = address - IO_START;
-  } else if (address >= PALETTE_START && address <= PALETTE_END) {
-    regionSize = PALETTE_SIZE;
-    region = &palette;
-    offset = address - PALETTE_START;
-  } else if (address >= VRAM_START && address <= VRAM_END) {
-    regionSize = VRAM_SIZE;
-    region = &vram;
-    offset = address - VRAM_START;
-  } else if (address >= OAM_START && address <= OAM_END) {
-    regionSize = OAM_SIZE;
-    region = &oam;
-    offset = address - OAM_START;
-  } else if (address >= ROM_START && address <= ROM_END) {
-    regionSize = rom.size();
-    region = &rom;
-    offset = address - ROM_START;
-  } else {
+  MemoryRegion id;
+  HostBuffer *region = resolveAccess(address, offset, id);
+  if (region == nullptr && id != REGION_COUNT) {
+    writeWatched(address, value, 1);
+    return;
+  }
+  if (region == nullptr && backup != nullptr && backup->contains(address)) {
+    writeBackup(address, value, 1);
+    return;
+  }
+  if (region == nullptr) {
     std::cerr << "writeHalfWord: Invalid address: 0x" << std::hex << address << std::endl;
     throw std::out_of_range("Memory::writeHalfWord: Invalid address");
   }
 
   // Hopefully this will never happen
-  if (offset + 1 >= regionSize) {
+  if (offset + 1 >= region->size()) {
     std::cerr << "writeHalfWord: OUT OF RANGE! Offset: 0x" << std::hex << offset
-              << " is beyond region size: 0x" << std::hex << regionSize << std::endl;
+              << " is beyond region size: 0x" << std::hex << region->size() << std::endl;
     throw std::out_of_range("Memory::writeHalfWord: Address out of range");
   }
+  countAccess(id, 1, true);
+  noteWrite(id, address);
 
-  (*region)[offset] = value & 0xFF;
-  (*region)[offset + 1] = (value >> 8) & 0xFF;
+  if (id == REGION_IO) {
+    ioWrite(offset, value & 0xFF);
+    ioWrite(offset + 1, value >> 8);
+  } else {
+    (*region)[offset] = value & 0xFF;
+    (*region)[offset + 1] = (value >> 8) & 0xFF;
+  }
 
-  std::cout << "writeHalfWord: Value written: 0x" << std::hex << (int)value << std::endl;
+  DEBUG_LOG("writeHalfWord: Value written: 0x" << std::hex << (int)value);
 }
 
 uint8_t Memory::readByte(uint32_t address) const {
-  size_t regionSize = 0;
-  const std::vector<uint8_t> *region = nullptr;
+  if (fastmem) {
+    uint8_t value;
+    if (fastmem->load8(address, value)) {
+      countAccess(fastmemRegion(address), 0, false);
+      return value;
+    }
+    if (stats != nullptr) stats->fastmemFallbacks.add();
+  }
 
   size_t offset = 0;
-
-  if (address >= BIOS_START && address <= BIOS_END) {
-    regionSize = BIOS_SIZE;
-    region = &bios;
-    offset = address - BIOS_START;
-  } else if (address >= WRAM_START && address <= WRAM_END) {
-    regionSize = WRAM_SIZE;
-    region = &wram;
-    offset = address - WRAM_START;
-  } else if (address >= IWRAM_START && address <= IWRAM_END) {
-    regionSize = IWRAM_SIZE;
-    region = &iwram;
-    offset = address - IWRAM_START;
-  } else if (address >= IO_START && address <= IO_END) {
-    regionSize = IO_END - IO_START + 1;
-    region = &io;
-    offset = address - IO_START;
-  } else if (address >= PALETTE_START && address <= PALETTE_END) {
-    regionSize = PALETTE_SIZE;
-    region = &palette;
-    offset = address - PALETTE_START;
-  } else if (address >= VRAM_START && address <= VRAM_END) {
-    regionSize = VRAM_SIZE;
-    region = &vram;
-    offset = address - VRAM_START;
-  } else if (address >= OAM_START && address <= OAM_END) {
-    regionSize = OAM_SIZE;
-    region = &oam;
-    offset = address - OAM_START;
-  } else if (address >= ROM_START && address <= ROM_END) {
-    regionSize = rom.size();
-    region = &rom;
-    offset = address - ROM_START;
-  } else {
-    std::cerr << "readHalfWord: Invalid address: 0x" << std::hex << address << std::endl;
-    throw std::out_of_range("Memory::readHalfWord: Invalid address");
+  MemoryRegion id;
+  const HostBuffer *region = resolveAccess(address, offset, id);
+  if (region == nullptr && id != REGION_COUNT) {
+    return (uint8_t)readWatched(address, 0);
+  }
+  if (region == nullptr && backup != nullptr && backup->contains(address)) {
+    return readBackup(address, 0);
+  }
+  if (region == nullptr) {
+    std::cerr << "readByte: Invalid address: 0x" << std::hex << address << std::endl;
+    throw std::out_of_range("Memory::readByte: Invalid address");
   }
 
-  if (offset + 1 >= regionSize) {
-    std::cerr << "readHalfWord: OUT OF RANGE! Offset: 0x" << std::hex << offset
-              << " is beyond region size: 0x" << std::hex << regionSize << std::endl;
-    throw std::out_of_range("Memory::readHalfWord: Address out of range");
+  if (offset >= region->size()) {
+    std::cerr << "readByte: OUT OF RANGE! Offset: 0x" << std::hex << offset
+              << " is beyond region size: 0x" << std::hex << region->size() << std::endl;
+    throw std::out_of_range("Memory::readByte: Address out of range");
   }
+  countAccess(id, 0, false);
 
   uint8_t byte = (*region)[offset];
 
@@ -355,61 +815,47 @@ uint8_t Memory::readByte(uint32_t address) const {
 }
 
 void Memory::writeByte(uint32_t address, uint8_t value) {
-  {
-    std::cout << "writeByte: Address: 0x" << std::hex << address << " Value: 0x" << std::hex
-              << value << std::endl;
-
-    size_t regionSize = 0;
-    std::vector<uint8_t> *region = nullptr;
-
-    size_t offset = 0;
-
-    if (address >= BIOS_START && address <= BIOS_END) {
-      regionSize = BIOS_SIZE;
-      region = &bios;
-      offset = address - BIOS_START;
-    } else if (address >= WRAM_START && address <= WRAM_END) {
-      regionSize = WRAM_SIZE;
-      region = &wram;
-      offset = address - WRAM_START;
-    } else if (address >= IWRAM_START && address <= IWRAM_END) {
-      regionSize = IWRAM_SIZE;
-      region = &iwram;
-      offset = address - IWRAM_START;
-    } else if (address >= IO_START && address <= IO_END) {
-      regionSize = IO_END - IO_START + 1;
-      region = &io;
-      offset = address - IO_START;
-    } else if (address >= PALETTE_START && address <= PALETTE_END) {
-      regionSize = PALETTE_SIZE;
-      region = &palette;
-      offset = address - PALETTE_START;
-    } else if (address >= VRAM_START && address <= VRAM_END) {
-      regionSize = VRAM_SIZE;
-      region = &vram;
-      offset = address - VRAM_START;
-    } else if (address >= OAM_START && address <= OAM_END) {
-      regionSize = OAM_SIZE;
-      region = &oam;
-      offset = address - OAM_START;
-    } else if (address >= ROM_START && address <= ROM_END) {
-      regionSize = rom.size();
-      region = &rom;
-      offset = address - ROM_START;
-    } else {
-      std::cerr << "writeByte: Invalid address: 0x" << std::hex << address << std::endl;
-      throw std::out_of_range("Memory::writeByte: Invalid address");
+  DEBUG_LOG("writeByte: Address: 0x" << std::hex << address << " Value: 0x" << std::hex
+                                     << value);
+  if (fastmem) {
+    if (fastmem->store8(address, value)) {
+      countAccess(fastmemRegion(address), 0, true);
+      noteWrite(fastmemRegion(address), address);
+      return;
     }
+    if (stats != nullptr) stats->fastmemFallbacks.add();
+  }
 
-    // Hopefully this will never happen
-    if (offset + 1 >= regionSize) {
-      std::cerr << "writeByte: OUT OF RANGE! Offset: 0x" << std::hex << offset
-                << " is beyond region size: 0x" << std::hex << regionSize << std::endl;
-      throw std::out_of_range("Memory::writeByte: Address out of range");
-    }
+  size_t offset = 0;
+  MemoryRegion id;
+  HostBuffer *region = resolveAccess(address, offset, id);
+  if (region == nullptr && id != REGION_COUNT) {
+    writeWatched(address, value, 0);
+    return;
+  }
+  if (region == nullptr && backup != nullptr && backup->contains(address)) {
+    writeBackup(address, value, 0);
+    return;
+  }
+  if (region == nullptr) {
+    std::cerr << "writeByte: Invalid address: 0x" << std::hex << address << std::endl;
+    throw std::out_of_range("Memory::writeByte: Invalid address");
+  }
 
-    (*region)[offset] = value & 0xFF;
+  // Hopefully this will never happen
+  if (offset >= region->size()) {
+    std::cerr << "writeByte: OUT OF RANGE! Offset: 0x" << std::hex << offset
+              << " is beyond region size: 0x" << std::hex << region->size() << std::endl;
+    throw std::out_of_range("Memory::writeByte: Address out of range");
+  }
+  countAccess(id, 0, true);
+  noteWrite(id, address);
 
-    std::cout << "writeByte: Value written: 0x" << std::hex << (int)value << std::endl;
+  if (id == REGION_IO) {
+    ioWrite(offset, value);
+  } else {
+    (*region)[offset] = value & 0xFF;
   }
-}
\ No newline at end of file
+
+  DEBUG_LOG("writeByte: Value written: 0x" << std::hex << (int)value);
+}
@@ -0,0 +1,135 @@
+#include "../include/movie.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "../include/trace.hpp"
+
+static void putU16(std::ofstream &file, uint16_t value) {
+  uint8_t bytes[2] = {(uint8_t)value, (uint8_t)(value >> 8)};
+  file.write(reinterpret_cast<char *>(bytes), 2);
+}
+
+static void putU32(std::ofstream &file, uint32_t value) {
+  uint8_t bytes[4] = {(uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16),
+                      (uint8_t)(value >> 24)};
+  file.write(reinterpret_cast<char *>(bytes), 4);
+}
+
+static uint16_t getU16(std::ifstream &file) {
+  uint8_t bytes[2];
+  if (!file.read(reinterpret_cast<char *>(bytes), 2)) {
+    throw std::runtime_error("Movie: Truncated file");
+  }
+  return bytes[0] | (bytes[1] << 8);
+}
+
+static uint32_t getU32(std::ifstream &file) {
+  uint8_t bytes[4];
+  if (!file.read(reinterpret_cast<char *>(bytes), 4)) {
+    throw std::runtime_error("Movie: Truncated file");
+  }
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+Movie::Movie() : romHash{} {}
+
+void Movie::load(const std::string &filename) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file.is_open()) {
+    throw std::runtime_error("Movie: Failed to open file");
+  }
+  char magic[8];
+  if (!file.read(magic, 8) || std::memcmp(magic, MOVIE_MAGIC, 7) != 0) {
+    throw std::runtime_error("Movie: Not a PlusBoy movie");
+  }
+  if (magic[7] != MOVIE_VERSION) {
+    throw std::runtime_error("Movie: Unsupported movie version");
+  }
+  if (!file.read(reinterpret_cast<char *>(romHash.data()), romHash.size())) {
+    throw std::runtime_error("Movie: Truncated file");
+  }
+  uint32_t frameCount = getU32(file);
+  uint32_t keyframeCount = getU32(file);
+
+  inputs.resize(frameCount);
+  for (uint16_t &keys : inputs) {
+    keys = getU16(file);
+  }
+  keyframes.clear();
+  for (uint32_t i = 0; i < keyframeCount; ++i) {
+    Keyframe keyframe;
+    keyframe.frame = getU32(file);
+    keyframe.rawSize = getU32(file);
+    keyframe.compressed.resize(getU32(file));
+    if (!file.read(reinterpret_cast<char *>(keyframe.compressed.data()),
+                   keyframe.compressed.size())) {
+      throw std::runtime_error("Movie: Truncated file");
+    }
+    keyframes.push_back(std::move(keyframe));
+  }
+  std::sort(keyframes.begin(), keyframes.end(),
+            [](const Keyframe &a, const Keyframe &b) { return a.frame < b.frame; });
+}
+
+void Movie::save(const std::string &filename) const {
+  std::ofstream file(filename, std::ios::binary);
+  if (!file.is_open()) {
+    throw std::runtime_error("Movie: Failed to open file");
+  }
+  file.write(MOVIE_MAGIC, 7);
+  file.put((char)MOVIE_VERSION);
+  file.write(reinterpret_cast<const char *>(romHash.data()), romHash.size());
+  putU32(file, (uint32_t)inputs.size());
+  putU32(file, (uint32_t)keyframes.size());
+  for (uint16_t keys : inputs) {
+    putU16(file, keys);
+  }
+  for (const Keyframe &keyframe : keyframes) {
+    putU32(file, keyframe.frame);
+    putU32(file, keyframe.rawSize);
+    putU32(file, (uint32_t)keyframe.compressed.size());
+    file.write(reinterpret_cast<const char *>(keyframe.compressed.data()),
+               keyframe.compressed.size());
+  }
+  if (!file) {
+    throw std::runtime_error("Movie: Failed to write file");
+  }
+}
+
+void Movie::addKeyframe(uint32_t frame, const std::vector<uint8_t> &state) {
+  Keyframe keyframe;
+  keyframe.frame = frame;
+  keyframe.rawSize = (uint32_t)state.size();
+  TraceCodec::compress(state, keyframe.compressed);
+
+  auto it = std::lower_bound(keyframes.begin(), keyframes.end(), frame,
+                             [](const Keyframe &k, uint32_t f) { return k.frame < f; });
+  if (it != keyframes.end() && it->frame == frame) {
+    *it = std::move(keyframe);
+  } else {
+    keyframes.insert(it, std::move(keyframe));
+  }
+}
+
+bool Movie::hasKeyframe(uint32_t frame) const {
+  const Keyframe *keyframe = findKeyframe(frame);
+  return keyframe != nullptr && keyframe->frame == frame;
+}
+
+const Movie::Keyframe *Movie::findKeyframe(uint64_t frame) const {
+  auto it = std::upper_bound(keyframes.begin(), keyframes.end(), frame,
+                             [](uint64_t f, const Keyframe &k) { return f < k.frame; });
+  return it == keyframes.begin() ? nullptr : &*(it - 1);
+}
+
+std::vector<uint8_t> Movie::getState(const Keyframe &keyframe) const {
+  std::vector<uint8_t> state;
+  if (!TraceCodec::decompress(keyframe.compressed.data(), keyframe.compressed.size(), state,
+                              keyframe.rawSize)) {
+    throw std::runtime_error("Movie: Corrupt keyframe");
+  }
+  return state;
+}
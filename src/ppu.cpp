@@ -0,0 +1,214 @@
+#include "../include/ppu.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "../include/framering.hpp"
+#include "../include/interrupts.hpp"
+#include "../include/memory.hpp"
+#include "../include/stats.hpp"
+
+// Bitmap layouts, https://problemkaputt.de/gbatek.htm#lcdvrambitmapbgmodes
+#define MODE5_WIDTH 160
+#define MODE5_HEIGHT 128
+#define BITMAP_FRAME_OFFSET 0xA000  // second frame of modes 4 and 5
+
+#define LINE_NEVER_DRAWN UINT64_MAX
+
+PPU::PPU(Memory &memory, Scheduler &scheduler, InterruptController &interrupts)
+    : memory(memory), scheduler(scheduler), interrupts(interrupts), stats(nullptr),
+      frameRing(nullptr),
+      frame(nullptr),
+      framesDrawn(0),
+      frameHash(0),
+      frameskip(0),
+      framesToSkip(0),
+      framesSkipped(0),
+      reusingLines(true),
+      hashStale(true),
+      linesDrawn(0),
+      linesReused(0) {
+  std::fill(lineVersions, lineVersions + VISIBLE_SCANLINES, LINE_NEVER_DRAWN);
+  startScanline(0, 0);
+}
+
+void PPU::setFrameRing(FrameRing *ring) {
+  if (frame != nullptr) {
+    frameRing->endFrame();  // publishes what it got so far
+    frame = nullptr;
+  }
+  frameRing = ring;
+  framesToSkip = 0;
+  restartFrame();
+}
+
+void PPU::setFrameskip(uint32_t skip) {
+  frameskip = skip;
+  framesToSkip = 0;
+}
+
+void PPU::setReusingLines(bool enabled) {
+  reusingLines = enabled;
+  // The copy isn't kept up to date while it's off
+  std::fill(lineVersions, lineVersions + VISIBLE_SCANLINES, LINE_NEVER_DRAWN);
+}
+
+void PPU::restartFrame() {
+  if (frame != nullptr) {
+    frameRing->endFrame();
+    frame = nullptr;
+  }
+  bool lineZeroDrawn = memory.readIO(DISPSTAT) & DISPSTAT_HBLANK;
+  if (frameRing != nullptr && memory.readIO(VCOUNT) == 0 && !lineZeroDrawn) {
+    frame = frameRing->beginFrame();
+    lastPixels.resize(FRAME_PIXELS);
+    framesToSkip = frameskip;
+  }
+}
+
+static uint64_t hashPixels(const uint32_t *pixels) {
+  uint64_t hash = 0xCBF29CE484222325;  // FNV-1a 64
+  for (size_t i = 0; i < FRAME_PIXELS; ++i) {
+    hash = (hash ^ pixels[i]) * 0x100000001B3;
+  }
+  return hash;
+}
+
+// BGR555 to 0xFFRRGGBB, the low bits repeat the high ones so white stays white
+static uint32_t toXRGB(uint16_t color) {
+  uint32_t r = color & 0x1F, g = (color >> 5) & 0x1F, b = (color >> 10) & 0x1F;
+  r = (r << 3) | (r >> 2);
+  g = (g << 3) | (g >> 2);
+  b = (b << 3) | (b >> 2);
+  return 0xFF000000 | (r << 16) | (g << 8) | b;
+}
+
+// A line of the last frame is still right if nothing was written since it was drawn
+void PPU::updateScanline(uint32_t line) {
+  uint32_t *out = frame + line * WIDTH;
+  uint32_t *last = lastPixels.data() + line * WIDTH;
+  uint64_t version = memory.getVideoVersion();
+  if (reusingLines && lineVersions[line] == version) {
+    std::memcpy(out, last, WIDTH * sizeof(uint32_t));
+    linesReused++;
+    return;
+  }
+  drawScanline(line);
+  if (reusingLines) {
+    std::memcpy(last, out, WIDTH * sizeof(uint32_t));
+    lineVersions[line] = version;
+  }
+  hashStale = true;
+  linesDrawn++;
+}
+
+// Straight out of the host buffers, drawing isn't a bus access
+void PPU::drawScanline(uint32_t line) {
+  uint32_t *out = frame + line * WIDTH;
+  uint16_t control = memory.readIO(DISPCNT);
+  if (control & DISPCNT_FORCED_BLANK) {
+    std::fill(out, out + WIDTH, 0xFFFFFFFF);
+    return;
+  }
+
+  size_t available;
+  const uint8_t *vram = memory.getHostPointer(VRAM_START, available);
+  const uint8_t *palette = memory.getHostPointer(PALETTE_START, available);
+  uint16_t backdrop;
+  std::memcpy(&backdrop, palette, 2);
+  uint32_t page = (control & DISPCNT_FRAME_SELECT) ? BITMAP_FRAME_OFFSET : 0;
+
+  switch (control & DISPCNT_MODE_MASK) {
+    case 3: {  // 240x160, 15-bit color
+      const uint8_t *row = vram + line * WIDTH * 2;
+      for (uint32_t x = 0; x < WIDTH; ++x) {
+        out[x] = toXRGB(row[x * 2] | (row[x * 2 + 1] << 8));
+      }
+      break;
+    }
+    case 4: {  // 240x160, 8-bit palette indices, two frames
+      const uint8_t *row = vram + page + line * WIDTH;
+      for (uint32_t x = 0; x < WIDTH; ++x) {
+        out[x] = toXRGB(palette[row[x] * 2] | (palette[row[x] * 2 + 1] << 8));
+      }
+      break;
+    }
+    case 5: {  // 160x128, 15-bit color, two frames, backdrop around it
+      std::fill(out, out + WIDTH, toXRGB(backdrop));
+      if (line >= MODE5_HEIGHT) {
+        break;
+      }
+      const uint8_t *row = vram + page + line * MODE5_WIDTH * 2;
+      for (uint32_t x = 0; x < MODE5_WIDTH; ++x) {
+        out[x] = toXRGB(row[x * 2] | (row[x * 2 + 1] << 8));
+      }
+      break;
+    }
+    default:
+      std::fill(out, out + WIDTH, toXRGB(backdrop));
+      break;
+  }
+}
+
+void PPU::handleEvent(EventType type, uint64_t when) {
+  uint16_t status = memory.readIO(DISPSTAT);
+  if (type == EVENT_HBLANK) {
+    uint32_t line = memory.readIO(VCOUNT);
+    if (frame != nullptr && line < VISIBLE_SCANLINES) {
+      ScopedTimer timer(stats, SUBSYSTEM_PPU);
+      updateScanline(line);
+    }
+    memory.writeIO(DISPSTAT, status | DISPSTAT_HBLANK);
+    if (status & DISPSTAT_HBLANK_IRQ) {
+      interrupts.raise(IRQ_HBLANK);
+    }
+    return;
+  }
+  uint32_t line = (memory.readIO(VCOUNT) + 1) % SCANLINES_PER_FRAME;
+  startScanline(line, when);
+}
+
+// Events are scheduled from the cycle the last one was due, not from when it ran, so
+// the display never drifts against the CPU
+void PPU::startScanline(uint32_t line, uint64_t when) {
+  uint16_t status = memory.readIO(DISPSTAT) & ~DISPSTAT_HBLANK;
+  uint16_t raised = 0;
+  memory.writeIO(VCOUNT, line);
+
+  if (line == 0 && frameRing != nullptr && framesToSkip != 0) {
+    framesToSkip--;
+    framesSkipped++;
+  } else if (line == 0 && frameRing != nullptr) {
+    frame = frameRing->beginFrame();
+    lastPixels.resize(FRAME_PIXELS);
+    framesToSkip = frameskip;
+  } else if (line == VISIBLE_SCANLINES && frame != nullptr) {
+    if (hashStale) {
+      frameHash = hashPixels(frame);
+      hashStale = false;
+    }
+    framesDrawn++;
+    frameRing->endFrame();
+    frame = nullptr;
+  }
+
+  if (line == VISIBLE_SCANLINES) {
+    status |= DISPSTAT_VBLANK;
+    if (status & DISPSTAT_VBLANK_IRQ) raised |= IRQ_VBLANK;
+  } else if (line == SCANLINES_PER_FRAME - 1) {
+    status &= ~DISPSTAT_VBLANK;  // the flag is already clear on the last line
+  }
+  if (line == (uint32_t)(status >> 8)) {
+    status |= DISPSTAT_VCOUNT_MATCH;
+    if (status & DISPSTAT_VCOUNT_IRQ) raised |= IRQ_VCOUNT;
+  } else {
+    status &= ~DISPSTAT_VCOUNT_MATCH;
+  }
+  memory.writeIO(DISPSTAT, status);
+  if (raised != 0) {
+    interrupts.raise(raised);
+  }
+
+  scheduler.schedule(EVENT_HBLANK, when + HDRAW_CYCLES);
+  scheduler.schedule(EVENT_SCANLINE, when + CYCLES_PER_SCANLINE);
+}
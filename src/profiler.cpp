@@ -0,0 +1,254 @@
+#include "../include/profiler.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include "../include/arm.hpp"
+#include "../include/cpu.hpp"
+
+#define PROFILER_MAX_DEPTH 256
+#define PROFILER_NO_RETURN 0xFFFFFFFF  // never a valid (aligned) PC
+
+Profiler::Profiler(Mode mode, uint32_t sampleInterval)
+    : mode(mode),
+      sampleInterval(sampleInterval == 0 ? 1 : sampleInterval),
+      countdown(sampleInterval == 0 ? 1 : sampleInterval),
+      lastPC(0),
+      lastCycles(0),
+      started(false),
+      blockStart(0),
+      lastClass(nullptr),
+      currentFrame(0),
+      expectedReturn(PROFILER_NO_RETURN) {
+  frames.push_back({0, 0, 0, {}});  // root
+}
+
+void Profiler::count(uint32_t pc, uint32_t opcode, bool thumb, uint64_t cycles) {
+  if (started) {
+    uint64_t elapsed = cycles - lastCycles;
+    instructions[lastPC].cycles += elapsed;
+    blocks[blockStart].cycles += elapsed;
+    frames[currentFrame].cycles += elapsed;
+  }
+
+  // Anything that isn't the next ARM or Thumb instruction starts a new block
+  const char *instructionClass =
+      thumb ? CPU::thumbInstructionClass(opcode) : ARM::instructionClass(opcode);
+  if (!started || (pc != lastPC + 4 && pc != lastPC + 2)) {
+    blockStart = pc;
+    blocks[pc].executions++;
+  } else {
+    pairs[{lastClass, instructionClass}]++;
+  }
+  instructions[pc].executions++;
+  lastClass = instructionClass;
+
+  lastPC = pc;
+  lastCycles = cycles;
+  started = true;
+}
+
+void Profiler::sample(uint32_t pc, uint64_t cycles) {
+  uint64_t elapsed = started ? cycles - lastCycles : 0;
+  charge(pc, sampleInterval, elapsed);
+  lastPC = pc;
+  lastCycles = cycles;
+  started = true;
+}
+
+void Profiler::charge(uint32_t pc, uint64_t executions, uint64_t cycles) {
+  Counter &counter = instructions[pc];
+  counter.executions += executions;
+  counter.cycles += cycles;
+  frames[currentFrame].cycles += cycles;
+}
+
+void Profiler::recordCall(uint32_t from, uint32_t to, uint32_t returnAddress) {
+  callEdges[{from, to}]++;
+  if (returnStack.size() >= PROFILER_MAX_DEPTH) {
+    return;  // runaway recursion or calls that never return, stay where we are
+  }
+
+  auto it = frames[currentFrame].children.find(to);
+  uint32_t child;
+  if (it != frames[currentFrame].children.end()) {
+    child = it->second;
+  } else {
+    child = frames.size();
+    frames.push_back({to, currentFrame, 0, {}});
+    frames[currentFrame].children[to] = child;
+  }
+
+  returnStack.push_back(returnAddress);
+  currentFrame = child;
+  expectedReturn = returnAddress;
+}
+
+void Profiler::returnFrom() {
+  returnStack.pop_back();
+  currentFrame = frames[currentFrame].parent;
+  expectedReturn = returnStack.empty() ? PROFILER_NO_RETURN : returnStack.back();
+}
+
+std::string Profiler::stackName(uint32_t frame) const {
+  std::vector<uint32_t> path;
+  for (uint32_t f = frame; f != 0; f = frames[f].parent) {
+    path.push_back(frames[f].function);
+  }
+
+  std::string name = "entry";
+  char buffer[16];
+  for (auto it = path.rbegin(); it != path.rend(); ++it) {
+    std::snprintf(buffer, sizeof(buffer), ";sub_%08X", *it);
+    name += buffer;
+  }
+  return name;
+}
+
+template <typename Map>
+static std::vector<std::pair<uint32_t, Profiler::Counter>> sortedByCycles(const Map &counters) {
+  std::vector<std::pair<uint32_t, Profiler::Counter>> sorted(counters.begin(), counters.end());
+  std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+    if (a.second.cycles != b.second.cycles) return a.second.cycles > b.second.cycles;
+    return a.second.executions > b.second.executions;
+  });
+  return sorted;
+}
+
+void Profiler::writeHotSpots(const std::string &filename, size_t limit) {
+  std::ofstream out(filename);
+  if (!out.is_open()) {
+    throw std::runtime_error("Profiler::writeHotSpots: Failed to open file");
+  }
+
+  uint64_t total = 0;
+  for (const auto &[pc, counter] : instructions) {
+    total += counter.cycles;
+  }
+  auto percent = [total](uint64_t cycles) { return total ? 100.0 * cycles / total : 0.0; };
+  char line[128];
+
+  out << "# PlusBoy profile (" << (mode == Mode::Exact ? "exact" : "sampling") << "), " << total
+      << " cycles\n";
+
+  out << "\n## Hot instructions\n";
+  out << "address     executions        cycles       %\n";
+  auto hotInstructions = sortedByCycles(instructions);
+  for (size_t i = 0; i < hotInstructions.size() && i < limit; ++i) {
+    const auto &[pc, counter] = hotInstructions[i];
+    std::snprintf(line, sizeof(line), "0x%08X %12llu %13llu %6.2f\n", pc,
+                  (unsigned long long)counter.executions, (unsigned long long)counter.cycles,
+                  percent(counter.cycles));
+    out << line;
+  }
+
+  // Sampling mode doesn't see block boundaries, so neighbouring samples are grouped instead
+  std::unordered_map<uint32_t, Counter> sampledBlocks;
+  if (mode == Mode::Sampling) {
+    std::vector<uint32_t> pcs;
+    for (const auto &[pc, counter] : instructions) {
+      pcs.push_back(pc);
+    }
+    std::sort(pcs.begin(), pcs.end());
+    uint32_t start = 0;
+    for (size_t i = 0; i < pcs.size(); ++i) {
+      if (i == 0 || pcs[i] - pcs[i - 1] > 4) {
+        start = pcs[i];
+      }
+      Counter &block = sampledBlocks[start];
+      block.executions += instructions[pcs[i]].executions;
+      block.cycles += instructions[pcs[i]].cycles;
+    }
+  }
+
+  out << "\n## Hot blocks\n";
+  out << "start       entries           cycles       %\n";
+  auto hotBlocks = sortedByCycles(mode == Mode::Sampling ? sampledBlocks : blocks);
+  for (size_t i = 0; i < hotBlocks.size() && i < limit; ++i) {
+    const auto &[pc, counter] = hotBlocks[i];
+    std::snprintf(line, sizeof(line), "0x%08X %12llu %13llu %6.2f\n", pc,
+                  (unsigned long long)counter.executions, (unsigned long long)counter.cycles,
+                  percent(counter.cycles));
+    out << line;
+  }
+
+  // Self time per function, summed over every stack the function appears in
+  std::unordered_map<uint32_t, Counter> functions;
+  for (size_t f = 1; f < frames.size(); ++f) {
+    functions[frames[f].function].cycles += frames[f].cycles;
+  }
+  for (const auto &[edge, calls] : callEdges) {
+    functions[edge.second].executions += calls;
+  }
+  functions[0].cycles += frames[0].cycles;
+
+  out << "\n## Hot functions (self)\n";
+  out << "function    calls             cycles       %\n";
+  auto hotFunctions = sortedByCycles(functions);
+  for (size_t i = 0; i < hotFunctions.size() && i < limit; ++i) {
+    const auto &[function, counter] = hotFunctions[i];
+    if (function == 0 && counter.executions == 0) {
+      std::snprintf(line, sizeof(line), "entry      %12s %13llu %6.2f\n", "-",
+                    (unsigned long long)counter.cycles, percent(counter.cycles));
+    } else {
+      std::snprintf(line, sizeof(line), "0x%08X %12llu %13llu %6.2f\n", function,
+                    (unsigned long long)counter.executions, (unsigned long long)counter.cycles,
+                    percent(counter.cycles));
+    }
+    out << line;
+  }
+
+  out << "\n## Call edges\n";
+  out << "caller      callee            calls\n";
+  std::vector<std::pair<std::pair<uint32_t, uint32_t>, uint64_t>> edges(callEdges.begin(),
+                                                                        callEdges.end());
+  std::sort(edges.begin(), edges.end(),
+            [](const auto &a, const auto &b) { return a.second > b.second; });
+  for (const auto &[edge, calls] : edges) {
+    std::snprintf(line, sizeof(line), "0x%08X  0x%08X %12llu\n", edge.first, edge.second,
+                  (unsigned long long)calls);
+    out << line;
+  }
+
+  if (mode == Mode::Exact) {
+    uint64_t totalPairs = 0;
+    for (const auto &[pair, executions] : pairs) {
+      totalPairs += executions;
+    }
+    std::vector<std::pair<std::pair<const char *, const char *>, uint64_t>> hotPairs(
+        pairs.begin(), pairs.end());
+    std::sort(hotPairs.begin(), hotPairs.end(),
+              [](const auto &a, const auto &b) { return a.second > b.second; });
+
+    out << "\n## Instruction pairs\n";
+    out << "first           second             executions       %\n";
+    for (size_t i = 0; i < hotPairs.size() && i < limit; ++i) {
+      const auto &[pair, executions] = hotPairs[i];
+      std::snprintf(line, sizeof(line), "%-15s %-15s %13llu %6.2f\n", pair.first, pair.second,
+                    (unsigned long long)executions,
+                    totalPairs ? 100.0 * executions / totalPairs : 0.0);
+      out << line;
+    }
+  }
+
+  std::cout << "Profiler: hot spots written to " << filename << std::endl;
+}
+
+void Profiler::writeFoldedStacks(const std::string &filename) {
+  std::ofstream out(filename);
+  if (!out.is_open()) {
+    throw std::runtime_error("Profiler::writeFoldedStacks: Failed to open file");
+  }
+
+  for (size_t f = 0; f < frames.size(); ++f) {
+    if (frames[f].cycles == 0) {
+      continue;
+    }
+    out << stackName(f) << " " << frames[f].cycles << "\n";
+  }
+
+  std::cout << "Profiler: folded stacks written to " << filename << std::endl;
+}
@@ -0,0 +1,172 @@
+#include "../include/runahead.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+#include "../include/cpu.hpp"
+#include "../include/keypad.hpp"
+#include "../include/memory.hpp"
+#include "../include/ppu.hpp"
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+RunAhead::RunAhead(CPU &cpu, uint32_t frames, bool secondCore, FrameRing *ring)
+    : cpu(cpu),
+      frames(std::max<uint32_t>(frames, 1)),
+      ring(ring),
+      current(0),
+      shownFrame(0),
+      shownHash(0),
+      framesShown(0),
+      resultFrame(0),
+      resultHash(0),
+      resultDrawn(false),
+      steps(0),
+      frameSeconds(0),
+      saveSeconds(0),
+      loadSeconds(0),
+      pending(false),
+      job(0),
+      stopping(false) {
+  cpu.getPPU().setFrameRing(nullptr);  // the real frames are never shown
+  if (!secondCore) {
+    return;
+  }
+  Memory &memory = cpu.getMemory();
+  workerMemory = std::make_unique<Memory>();
+  if (memory.isFastmemEnabled()) {
+    workerMemory->enableFastmem();
+  }
+  workerMemory->loadROMData(memory.getROMData(), memory.getROMSize());
+  if (memory.getBackup() != nullptr) {
+    workerMemory->attachBackup("");
+  }
+  workerCPU = std::make_unique<CPU>(*workerMemory);
+  workerCPU->setThreadedInterpreter(cpu.isThreadedInterpreter());
+  workerCPU->setHLEBios(cpu.isHLEBios());
+  worker = std::thread(&RunAhead::workerLoop, this);
+}
+
+RunAhead::~RunAhead() {
+  if (!worker.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  changed.notify_all();
+  worker.join();
+}
+
+void RunAhead::runFrame(uint16_t keys) {
+  auto start = std::chrono::steady_clock::now();
+  cpu.getKeypad().setPressed(keys);
+  cpu.runFrame();
+
+  std::vector<uint8_t> &state = states[current];
+  state.clear();  // keeps its capacity, no allocation after the first frame
+  auto saveStart = std::chrono::steady_clock::now();
+  cpu.saveState(state);
+  saveSeconds += secondsSince(saveStart);
+
+  if (workerCPU) {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] { return !pending; });
+    collect();
+    job = current;
+    pending = true;
+    lock.unlock();
+    changed.notify_all();
+    current ^= 1;  // the worker reads that one now
+  } else {
+    runAhead(cpu, state);
+    collect();
+  }
+  frameSeconds += secondsSince(start);
+  steps++;
+}
+
+void RunAhead::finish() {
+  if (workerCPU) {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] { return !pending; });
+    collect();
+  }
+}
+
+void RunAhead::collect() {
+  if (error) {
+    std::exception_ptr thrown = error;
+    error = nullptr;
+    std::rethrow_exception(thrown);
+  }
+  if (resultDrawn) {
+    shownFrame = resultFrame;
+    shownHash = resultHash;
+    framesShown++;
+    resultDrawn = false;
+  }
+}
+
+// The real CPU starts out at 'state' already and goes back to it, the worker loads it first
+void RunAhead::runAhead(CPU &target, const std::vector<uint8_t> &state) {
+  bool own = &target == &cpu;
+  if (!own) {
+    auto loadStart = std::chrono::steady_clock::now();
+    target.loadState(state.data(), state.size());
+    loadSeconds += secondsSince(loadStart);
+  }
+
+  PPU &ppu = target.getPPU();
+  uint64_t drawn = ppu.getFramesDrawn();
+  for (uint32_t i = 0; i < frames; ++i) {
+    if (i + 1 == frames) {
+      ppu.setFrameRing(ring);
+    }
+    target.runFrame();
+  }
+  ppu.setFrameRing(nullptr);
+  resultDrawn = ppu.getFramesDrawn() != drawn;
+  resultFrame = target.getCycles() / CYCLES_PER_FRAME - 1;
+  resultHash = ppu.getFrameHash();
+
+  if (own) {
+    auto loadStart = std::chrono::steady_clock::now();
+    target.loadState(state.data(), state.size());
+    loadSeconds += secondsSince(loadStart);
+  }
+}
+
+void RunAhead::workerLoop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    changed.wait(lock, [this] { return stopping || pending; });
+    if (stopping) {
+      return;
+    }
+    lock.unlock();
+    try {
+      runAhead(*workerCPU, states[job]);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    lock.lock();
+    pending = false;
+    changed.notify_all();
+  }
+}
+
+double RunAhead::getAverageFrameMs() const {
+  return steps != 0 ? frameSeconds * 1e3 / steps : 0;
+}
+
+double RunAhead::getAverageSaveUs() const {
+  return steps != 0 ? saveSeconds * 1e6 / steps : 0;
+}
+
+double RunAhead::getAverageLoadUs() const {
+  return steps != 0 ? loadSeconds * 1e6 / steps : 0;
+}
@@ -0,0 +1,124 @@
+#include "../include/savefile.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+SaveFile::SaveFile(const std::string &path, size_t size, uint8_t fill)
+    : path(path),
+      bytes(nullptr),
+      length(size),
+      mapped(false),
+      writes(0),
+      dirty(false),
+      syncs(0),
+      stopping(false) {
+#ifdef __linux__
+  if (!path.empty()) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat info;
+    if (fd >= 0 && fstat(fd, &info) == 0) {
+      size_t existing = info.st_size;
+      if (existing >= size || ftruncate(fd, size) == 0) {
+        void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping != MAP_FAILED) {
+          bytes = static_cast<uint8_t *>(mapping);
+          mapped = true;
+          if (existing < size) {
+            std::memset(bytes + existing, fill, size - existing);
+          }
+        }
+      }
+    }
+    if (fd >= 0) close(fd);
+    if (!mapped) {
+      std::cerr << "SaveFile: can't map " << path << ", the save stays in memory" << std::endl;
+    }
+  }
+#endif
+  if (!mapped) {
+    bytes = new uint8_t[size];
+    std::memset(bytes, fill, size);
+#ifndef __linux__
+    std::ifstream file(path, std::ios::binary);
+    file.read(reinterpret_cast<char *>(bytes), size);
+#endif
+  }
+  if (!path.empty()) {
+    flusher = std::thread(&SaveFile::flusherLoop, this);
+  }
+}
+
+SaveFile::~SaveFile() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  changed.notify_one();
+  if (flusher.joinable()) {
+    flusher.join();
+  }
+  if (dirty.load() && !path.empty()) {
+    sync();
+  }
+#ifdef __linux__
+  if (mapped) {
+    munmap(bytes, length);
+    return;
+  }
+#endif
+  delete[] bytes;
+}
+
+void SaveFile::sync() {
+  syncs.fetch_add(1, std::memory_order_relaxed);
+  dirty.store(false);  // before the sync, writes during it schedule another one
+#ifdef __linux__
+  if (mapped) {
+    msync(bytes, length, MS_SYNC);
+  }
+#else
+  if (!path.empty()) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(bytes), length);
+  }
+#endif
+}
+
+void SaveFile::flusherLoop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    changed.wait(lock, [this] { return stopping || dirty.load(); });
+    if (stopping) {
+      return;  // the destructor does the last sync
+    }
+
+    // Wait for the writes to settle
+    auto first = std::chrono::steady_clock::now();
+    uint64_t seen = writes.load(std::memory_order_relaxed);
+    for (;;) {
+      if (changed.wait_for(lock, std::chrono::milliseconds(SAVE_FLUSH_DEBOUNCE_MS),
+                           [this] { return stopping; })) {
+        return;
+      }
+      uint64_t now = writes.load(std::memory_order_relaxed);
+      if (now == seen || std::chrono::steady_clock::now() - first >=
+                             std::chrono::milliseconds(SAVE_FLUSH_MAX_DELAY_MS)) {
+        break;
+      }
+      seen = now;
+    }
+
+    lock.unlock();
+    sync();
+    lock.lock();
+  }
+}
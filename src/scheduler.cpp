@@ -0,0 +1,76 @@
+#include "../include/scheduler.hpp"
+
+#include <algorithm>
+#include <functional>
+
+#include "../include/savestate.hpp"
+
+Scheduler::Scheduler() : budgetEnd(0), horizon(0) {
+  std::fill(std::begin(due), std::end(due), SCHEDULER_NEVER);
+}
+
+void Scheduler::schedule(EventType type, uint64_t when) {
+  due[type] = when;
+  heap.push_back({when, type});
+  std::push_heap(heap.begin(), heap.end(), std::greater<Entry>());
+  if (when < horizon) {
+    horizon = when;
+  }
+}
+
+// The heap entry stays behind and gets dropped once it reaches the top
+void Scheduler::cancel(EventType type) {
+  due[type] = SCHEDULER_NEVER;
+}
+
+// Replaced or cancelled entries on top of the heap
+void Scheduler::dropStale() {
+  while (!heap.empty() && heap.front().when != due[heap.front().type]) {
+    std::pop_heap(heap.begin(), heap.end(), std::greater<Entry>());
+    heap.pop_back();
+  }
+}
+
+uint64_t Scheduler::getNextEvent() {
+  dropStale();
+  return heap.empty() ? SCHEDULER_NEVER : heap.front().when;
+}
+
+bool Scheduler::popDue(uint64_t now, EventType &type, uint64_t &when) {
+  dropStale();
+  if (heap.empty() || heap.front().when > now) {
+    updateHorizon();
+    return false;
+  }
+  type = heap.front().type;
+  when = heap.front().when;
+  due[type] = SCHEDULER_NEVER;  // a duplicate at the same time is stale now
+  std::pop_heap(heap.begin(), heap.end(), std::greater<Entry>());
+  heap.pop_back();
+  return true;
+}
+
+void Scheduler::setBudgetEnd(uint64_t end) {
+  budgetEnd = end;
+  updateHorizon();
+}
+
+void Scheduler::updateHorizon() {
+  horizon = std::min(budgetEnd, getNextEvent());
+}
+
+void Scheduler::saveState(StateWriter &writer) const {
+  writer.put(due);
+}
+
+void Scheduler::loadState(StateReader &reader) {
+  reader.get(due);
+  heap.clear();
+  for (int type = 0; type < EVENT_COUNT; ++type) {
+    if (due[type] != SCHEDULER_NEVER) {
+      heap.push_back({due[type], (EventType)type});
+    }
+  }
+  std::make_heap(heap.begin(), heap.end(), std::greater<Entry>());
+  updateHorizon();
+}
@@ -0,0 +1,158 @@
+#include "../include/serial.hpp"
+
+#include <stdexcept>
+
+#include "../include/cpu.hpp"
+#include "../include/interrupts.hpp"
+#include "../include/linkcable.hpp"
+#include "../include/memory.hpp"
+
+SerialPort::SerialPort(CPU &cpu, Memory &memory, Scheduler &scheduler,
+                       InterruptController &interrupts)
+    : cpu(cpu), memory(memory), scheduler(scheduler), interrupts(interrupts), cable(nullptr),
+      player(0),
+      received(),
+      receivedData(),
+      receivedFor() {}
+
+void SerialPort::attach(LinkCable *linkCable, uint32_t index) {
+  cable = linkCable;
+  player = cable != nullptr ? index : 0;
+  std::fill(std::begin(received), std::end(received), false);
+  uint16_t control = memory.readIO(SIOCNT) & ~(SIOCNT_CHILD | SIOCNT_READY);
+  if (cable != nullptr) {
+    control |= SIOCNT_READY | (player != 0 ? SIOCNT_CHILD : 0);
+    scheduler.schedule(EVENT_LINK_SYNC, cpu.getCycles());
+  } else {
+    scheduler.cancel(EVENT_LINK_SYNC);
+  }
+  memory.writeIO(SIOCNT, control);
+}
+
+uint64_t SerialPort::transferCycles(uint32_t baud, uint32_t players) {
+  static const uint32_t rates[4] = {9600, 38400, 57600, 115200};
+  return (uint64_t)SIO_BITS_PER_PLAYER * players * SIO_CLOCK / rates[baud & SIOCNT_BAUD_MASK];
+}
+
+bool SerialPort::isMultiplayer() const {
+  return (memory.readIO(SIOCNT) & SIOCNT_MODE_MASK) == SIOCNT_MODE_MULTIPLAYER &&
+         !(memory.readIO(RCNT) & RCNT_GENERAL_PURPOSE);
+}
+
+// Only the parent gets here with an effect, the children's busy bit stays clear
+void SerialPort::start() {
+  uint16_t control = memory.readIO(SIOCNT);
+  if (!isMultiplayer() || (control & (SIOCNT_CHILD | SIOCNT_BUSY))) {
+    return;
+  }
+  memory.writeIO(SIOCNT, control | SIOCNT_BUSY);
+  uint32_t players = cable != nullptr ? cable->getPlayerCount() : 1;
+  uint64_t end = cpu.getCycles() + transferCycles(control & SIOCNT_BAUD_MASK, players);
+  for (uint32_t i = 0; i < players; ++i) {
+    if (i != player) cable->send(player, i, {end, true, 0});
+  }
+  scheduler.schedule(EVENT_SERIAL, end);
+}
+
+void SerialPort::handleEvent(EventType type, uint64_t when) {
+  if (type == EVENT_SERIAL) {
+    finishTransfer(when);
+  } else {
+    sync(when);
+  }
+}
+
+// Announcements become events, data is kept until the transfer it's for ends (a player can
+// be a transfer ahead, its next data waits in the queue)
+void SerialPort::receive() {
+  for (uint32_t from = 0; from < cable->getPlayerCount(); ++from) {
+    LinkMessage message;
+    while (from != player && cable->peek(player, from, message)) {
+      if (message.start) {
+        if (message.end < cpu.getCycles()) {
+          throw std::runtime_error("SerialPort::receive: transfer announced too late");
+        }
+        scheduler.schedule(EVENT_SERIAL, message.end);
+      } else if (!received[from]) {
+        received[from] = true;
+        receivedData[from] = message.data;
+        receivedFor[from] = message.end;
+      } else {
+        break;
+      }
+      cable->drop(player, from);
+    }
+  }
+}
+
+void SerialPort::finishTransfer(uint64_t when) {
+  uint16_t data[LINK_MAX_PLAYERS] = {0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF};
+  data[player] = memory.readIO(SIOMLT_SEND);
+  if (cable != nullptr) {
+    uint32_t players = cable->getPlayerCount();
+    for (uint32_t i = 0; i < players; ++i) {
+      if (i != player) cable->send(player, i, {when, false, data[player]});
+    }
+    if (player == 0) {
+      cable->publishParentClock(cpu.getCycles());  // the children may be waiting to get here
+    }
+    for (uint32_t i = 0; i < players; ++i) {
+      while (i != player) {
+        uint32_t signal = cable->getSignal(player);
+        bool stopped = cable->hasStopped(i);  // before receive(), its last data is in by then
+        receive();
+        if (received[i]) {
+          if (receivedFor[i] != when) {
+            throw std::runtime_error("SerialPort::finishTransfer: players out of step");
+          }
+          data[i] = receivedData[i];
+          received[i] = false;
+          break;
+        }
+        if (stopped) {
+          break;
+        }
+        cpu.getStats().linkWaits.add();
+        ScopedTimer timer(&cpu.getStats(), SUBSYSTEM_LINK_WAIT);
+        cable->wait(player, signal);
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < LINK_MAX_PLAYERS; ++i) {
+    memory.writeIO(SIOMULTI0 + i * 2, data[i]);
+  }
+  uint16_t control = memory.readIO(SIOCNT) & ~(SIOCNT_BUSY | SIOCNT_ERROR | SIOCNT_ID_MASK);
+  memory.writeIO(SIOCNT, control | (player << SIOCNT_ID_SHIFT));
+  cpu.getStats().serialTransfers.add();
+  if (control & SIOCNT_IRQ) {
+    interrupts.raise(IRQ_SERIAL);
+  }
+}
+
+// The parent publishes how far it got, a child runs on to the horizon that gives it
+void SerialPort::sync(uint64_t when) {
+  if (cable == nullptr) {
+    return;  // from a state saved while linked
+  }
+  uint64_t now = cpu.getCycles();
+  if (player == 0) {
+    cable->publishParentClock(now);
+    scheduler.schedule(EVENT_LINK_SYNC, when + cable->getLookahead() / 2);
+    return;
+  }
+  uint64_t horizon;
+  for (;;) {
+    uint32_t signal = cable->getSignal(player);
+    horizon = cable->getChildHorizon();
+    receive();  // after the horizon, everything announced before it is in
+    if (horizon > now) {
+      break;
+    }
+    cpu.getStats().linkWaits.add();
+    ScopedTimer timer(&cpu.getStats(), SUBSYSTEM_LINK_WAIT);
+    cable->wait(player, signal);
+  }
+  scheduler.schedule(EVENT_LINK_SYNC,
+                     horizon != UINT64_MAX ? horizon : now + cable->getLookahead());
+}
@@ -0,0 +1,95 @@
+#include "../include/sha1.hpp"
+
+#include <cstring>
+
+namespace SHA1 {
+
+static uint32_t rotl(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+// https://datatracker.ietf.org/doc/html/rfc3174
+static void processChunk(uint32_t state[5], const uint8_t *chunk) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; ++i) {
+    w[i] = (chunk[i * 4] << 24) | (chunk[i * 4 + 1] << 16) | (chunk[i * 4 + 2] << 8) |
+           chunk[i * 4 + 3];
+  }
+  for (int i = 16; i < 80; ++i) {
+    w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+  for (int i = 0; i < 80; ++i) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+    uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rotl(b, 30);
+    b = a;
+    a = temp;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+Digest hash(const uint8_t *data, size_t size) {
+  uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+  size_t whole = size & ~(size_t)63;
+  for (size_t i = 0; i < whole; i += 64) {
+    processChunk(state, data + i);
+  }
+
+  // Padding: 0x80, zeros, then the length in bits (big endian) at the end of a chunk
+  uint8_t tail[128] = {};
+  size_t rest = size - whole;
+  if (rest != 0) std::memcpy(tail, data + whole, rest);
+  tail[rest] = 0x80;
+  size_t tailSize = rest < 56 ? 64 : 128;
+  uint64_t bits = (uint64_t)size * 8;
+  for (int i = 0; i < 8; ++i) {
+    tail[tailSize - 1 - i] = (uint8_t)(bits >> (i * 8));
+  }
+  for (size_t i = 0; i < tailSize; i += 64) {
+    processChunk(state, tail + i);
+  }
+
+  Digest digest;
+  for (int i = 0; i < 5; ++i) {
+    digest[i * 4] = state[i] >> 24;
+    digest[i * 4 + 1] = state[i] >> 16;
+    digest[i * 4 + 2] = state[i] >> 8;
+    digest[i * 4 + 3] = state[i];
+  }
+  return digest;
+}
+
+std::string toHex(const Digest &digest) {
+  static const char digits[] = "0123456789abcdef";
+  std::string hex;
+  for (uint8_t byte : digest) {
+    hex += digits[byte >> 4];
+    hex += digits[byte & 0xF];
+  }
+  return hex;
+}
+
+}  // namespace SHA1
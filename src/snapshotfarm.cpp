@@ -0,0 +1,133 @@
+#include "../include/snapshotfarm.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+
+#include "../include/backup.hpp"
+#include "../include/cpu.hpp"
+#include "../include/debugger.hpp"
+#include "../include/memory.hpp"
+#include "../include/savefile.hpp"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+SnapshotFarm::SnapshotFarm(CPU &cpu) : cpu(cpu), totalStartUs(0), maxStartUs(0), jobsStarted(0) {}
+
+void SnapshotFarm::warmUp(uint64_t frames) {
+  cpu.boot();
+  for (uint64_t frame = 0; frame < frames; ++frame) {
+    cpu.runFrame();
+  }
+}
+
+bool SnapshotFarm::warmUpTo(uint32_t pc, uint64_t maxFrames) {
+  cpu.boot();
+  Debugger debugger(cpu);
+  debugger.addBreakpoint(pc);
+  try {
+    for (uint64_t frame = 0; frame < maxFrames; ++frame) {
+      cpu.runFrame();
+    }
+  } catch (const DebugStop &) {
+    return true;  // the debugger detaches, the jobs run on from the breakpoint
+  }
+  return false;
+}
+
+double SnapshotFarm::getAverageStartUs() const {
+  return jobsStarted != 0 ? totalStartUs / jobsStarted : 0;
+}
+
+#ifdef __linux__
+std::vector<int> SnapshotFarm::run(uint32_t count, uint32_t workers, const Job &job) {
+  Backup *backup = cpu.getMemory().getBackup();
+  if (backup != nullptr && !backup->getFile().getPath().empty()) {
+    throw std::runtime_error("SnapshotFarm::run: the save chip has to be in memory only");
+  }
+  workers = std::max<uint32_t>(workers, 1);
+
+  // Each child writes its start time here, the parent's copy sees it
+  size_t startsSize = std::max<size_t>(count, 1) * sizeof(double);
+  void *shared =
+      mmap(nullptr, startsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    throw std::runtime_error("SnapshotFarm::run: mmap failed");
+  }
+  double *starts = static_cast<double *>(shared);
+
+  std::vector<int> statuses(count, 0);
+  std::vector<std::pair<pid_t, uint32_t>> running;
+  auto reap = [&]() {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    auto it = std::find_if(running.begin(), running.end(),
+                           [pid](const auto &child) { return child.first == pid; });
+    if (it == running.end()) {
+      return;  // not one of ours
+    }
+    statuses[it->second] = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    running.erase(it);
+  };
+
+  std::fflush(nullptr);  // or the children write out what the parent had buffered again
+  for (uint32_t index = 0; index < count; ++index) {
+    while (running.size() >= workers) {
+      reap();
+    }
+    starts[index] = -1;
+    auto forked = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) {
+      while (!running.empty()) {
+        reap();
+      }
+      munmap(shared, startsSize);
+      throw std::runtime_error("SnapshotFarm::run: fork failed");
+    }
+    if (pid == 0) {
+      int status = 1;
+      try {
+        if (!cpu.getMemory().unshareAfterFork()) {
+          throw std::runtime_error("SnapshotFarm::run: can't unshare fastmem");
+        }
+        starts[index] = std::chrono::duration<double, std::micro>(
+                            std::chrono::steady_clock::now() - forked)
+                            .count();
+        status = job(cpu, index);
+      } catch (const std::exception &e) {
+        std::cerr << "Job " << index << ": " << e.what() << std::endl;
+      }
+      std::fflush(nullptr);
+      _exit(status & 0xFF);  // no atexit handlers, those are the parent's
+    }
+    running.emplace_back(pid, index);
+  }
+  while (!running.empty()) {
+    reap();
+  }
+
+  totalStartUs = 0;
+  maxStartUs = 0;
+  jobsStarted = 0;
+  for (uint32_t index = 0; index < count; ++index) {
+    if (starts[index] >= 0) {
+      totalStartUs += starts[index];
+      maxStartUs = std::max(maxStartUs, starts[index]);
+      jobsStarted++;
+    }
+  }
+  munmap(shared, startsSize);
+  return statuses;
+}
+#else
+std::vector<int> SnapshotFarm::run(uint32_t, uint32_t, const Job &) {
+  throw std::runtime_error("SnapshotFarm::run: needs fork()");
+}
+#endif
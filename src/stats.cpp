@@ -0,0 +1,119 @@
+#include "../include/stats.hpp"
+
+#include <algorithm>
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include "../include/arm.hpp"
+
+static const char *regionNames[REGION_COUNT] = {"bios",    "wram", "iwram", "io",
+                                                "palette", "vram", "oam",   "rom",
+                                                "backup"};
+static const char *subsystemNames[SUBSYSTEM_COUNT] = {"cpu", "ppu", "audio", "linkWait"};
+
+static volatile std::sig_atomic_t dumpSignal = 0;
+
+static void handleDumpSignal(int) {
+  dumpSignal = 1;
+}
+
+void Stats::installSignalHandler() {
+  std::signal(SIGUSR1, handleDumpSignal);
+}
+
+bool Stats::dumpRequested() {
+  if (dumpSignal == 0) {
+    return false;
+  }
+  dumpSignal = 0;
+  return true;
+}
+
+void Stats::beginFrame() {
+  frameStartEvents = schedulerEvents.get();
+}
+
+void Stats::endFrame() {
+  if (frames.get() == 0) {
+    auto elapsed = std::chrono::steady_clock::now() - created;
+    timeToFirstFrameNanos.set(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+  }
+  frames.add();
+  schedulerEventsLastFrame.set(schedulerEvents.get() - frameStartEvents);
+  for (int i = 0; i < SUBSYSTEM_COUNT; ++i) {
+    hostNanos[i].add(frameNanos[i]);
+    hostNanosLastFrame[i].set(frameNanos[i]);
+    frameNanos[i] = 0;
+  }
+}
+
+std::string Stats::toJSON() const {
+  std::ostringstream json;
+  json << "{\n";
+
+  json << "  \"memory\": {\n";
+  for (int i = 0; i < REGION_COUNT; ++i) {
+    json << "    \"" << regionNames[i] << "\": {\"reads\": " << regionReads[i].get()
+         << ", \"writes\": " << regionWrites[i].get() << "}" << (i + 1 < REGION_COUNT ? "," : "")
+         << "\n";
+  }
+  json << "  },\n";
+  json << "  \"fastmem\": {\"fallbacks\": " << fastmemFallbacks.get() << "},\n";
+
+  json << "  \"dispatch\": {\n";
+  size_t entries = std::min<size_t>(ARM::handlerCount(), STATS_MAX_DISPATCH_ENTRIES);
+  for (size_t i = 0; i < entries; ++i) {
+    json << "    \"" << ARM::dispatchTableName(i) << "\": " << armDispatch[i].get()
+         << (i + 1 < entries ? "," : "") << "\n";
+  }
+  json << "  },\n";
+
+  uint64_t hits = blockCacheHits.get();
+  uint64_t lookups = hits + blockCacheMisses.get();
+  json << "  \"instructions\": {\"arm\": " << armInstructions.get()
+       << ", \"thumb\": " << thumbInstructions.get() << "},\n";
+  json << "  \"blockCache\": {\"hits\": " << hits << ", \"misses\": " << blockCacheMisses.get()
+       << ", \"loaded\": " << blockCacheLoads.get()
+       << ", \"discovered\": " << blockCacheDiscovered.get()
+       << ", \"hitRate\": " << (lookups ? (double)hits / lookups : 0.0)
+       << ", \"idleLoopSkips\": " << idleLoopSkips.get()
+       << ", \"flagCheckFailures\": " << flagCheckFailures.get() << "},\n";
+  json << "  \"interrupts\": {\"taken\": " << interruptsTaken.get()
+       << ", \"haltedCycles\": " << haltedCycles.get() << "},\n";
+  json << "  \"serial\": {\"transfers\": " << serialTransfers.get()
+       << ", \"linkWaits\": " << linkWaits.get() << "},\n";
+  json << "  \"audio\": {\"underruns\": " << audioUnderruns.get()
+       << ", \"latencyMicros\": " << audioLatencyMicros.get() << "},\n";
+
+  json << "  \"frames\": {\"count\": " << frames.get()
+       << ", \"timeToFirstFrameNanos\": " << timeToFirstFrameNanos.get()
+       << ", \"schedulerEvents\": " << schedulerEvents.get()
+       << ", \"schedulerEventsLastFrame\": " << schedulerEventsLastFrame.get() << ",\n";
+  json << "    \"hostNanos\": {";
+  for (int i = 0; i < SUBSYSTEM_COUNT; ++i) {
+    json << "\"" << subsystemNames[i] << "\": " << hostNanos[i].get()
+         << (i + 1 < SUBSYSTEM_COUNT ? ", " : "");
+  }
+  json << "},\n    \"hostNanosLastFrame\": {";
+  for (int i = 0; i < SUBSYSTEM_COUNT; ++i) {
+    json << "\"" << subsystemNames[i] << "\": " << hostNanosLastFrame[i].get()
+         << (i + 1 < SUBSYSTEM_COUNT ? ", " : "");
+  }
+  json << "}\n  }\n";
+
+  json << "}\n";
+  return json.str();
+}
+
+void Stats::writeJSON(const std::string &filename) const {
+  std::ofstream out(filename);
+  if (!out.is_open()) {
+    throw std::runtime_error("Stats::writeJSON: Failed to open file");
+  }
+  out << toJSON();
+  std::cerr << "Stats written to " << filename << std::endl;
+}
@@ -1,48 +1,122 @@
+#include <cstdio>
 #include <iostream>
+#include <stdexcept>
 
+#include "../include/bios.hpp"
 #include "../include/cpu.hpp"
+#include "../include/log.hpp"
 #include "../include/memory.hpp"
+#include "../include/profiler.hpp"
 /*
 I've split this to keep too much code accumulation in one file
 This file will contain the implementation of the Thumb CPU class methods.
 */
 // Decode and execute Thumb insts
 void CPU::decodeThumb(uint16_t inst) {
-  std::cout << "Thumb inst: 0x" << std::hex << inst << std::endl;
+  DEBUG_LOG("Thumb inst: 0x" << std::hex << inst);
+
+  // Thumb SWI keeps the BIOS function number in the low byte
+  if ((inst & 0xFF00) == 0xDF00) {
+    uint32_t comment = inst & 0xFF;
+    if (hleBios && BIOS::handleSWI(this, &memory, comment)) {
+      return;
+    }
+    if (!hleBios) {
+      enterException(VECTOR_SWI, MODE_SUPERVISOR, registers.pc);
+      return;
+    }
+    char message[64];
+    std::snprintf(message, sizeof(message), "CPU::decodeThumb: unhandled SWI %04x", inst);
+    throw std::runtime_error(message);
+  }
 
   uint16_t opcode = (inst >> 10) & 0x3F;  // Common opcode extraction
 
-  std::cout << "Opcode: 0x" << std::hex << opcode << std::endl;
+  DEBUG_LOG("Opcode: 0x" << std::hex << opcode);
 
   switch (opcode) {
-    case 0x12:  // Thumb MOV Rd, #imm (8-bit)
-    {
+    case 0x08:  // Thumb MOV Rd, #imm (8-bit), sets N and Z
+    case 0x09: {
       uint32_t reg = (inst >> 8) & 0x7;
       uint32_t imm = inst & 0xFF;
       writeRegister(reg, imm);
+      registers.cpsr &= ~(3u << 30);
+      if (imm == 0) registers.cpsr |= 1u << 30;
       break;
     }
-    case 0x20:  // Thumb ADD Rd, Rs, Rn
+    case 0x06:  // Thumb ADD/SUB Rd, Rs, Rn
     {
       uint32_t destReg = (inst >> 0) & 0x7;
       uint32_t sourceReg = (inst >> 3) & 0x7;
       uint32_t addReg = (inst >> 6) & 0x7;
-      writeRegister(destReg, readRegister(sourceReg) + readRegister(addReg));
+      uint32_t a = readRegister(sourceReg), b = readRegister(addReg);
+      if (inst & 0x0200) {
+        uint32_t result = a - b;
+        updateFlags(result, a >= b, ((a ^ b) & (a ^ result) & 0x80000000) != 0);
+        writeRegister(destReg, result);
+      } else {
+        uint32_t result = a + b;
+        updateFlags(result, result < a, ((a ^ ~b) & (a ^ result) & 0x80000000) != 0);
+        writeRegister(destReg, result);
+      }
       break;
     }
-    case 0x38:  // Thumb B (conditional branch)
-    {
+    case 0x38:  // Thumb B (unconditional branch)
+    case 0x39: {
       int32_t offset = (inst & 0x7FF) << 1;  // Extract 11-bit offset, multiply by 2
-      offset = (offset << 21) >> 21;         // Sign-extend the 12-bit offset
-      registers.pc += offset;
-      registers.pc -= 2;  // Undo the increment from the loop
+      offset = (offset << 20) >> 20;         // Sign-extend the 12-bit offset
+      registers.pc += offset + 2;            // relative to the instruction + 4
+      break;
+    }
+    case 0x3C:  // BL, first half: LR = PC + (offset << 12)
+    case 0x3D: {
+      int32_t high = ((int32_t)(inst & 0x7FF) << 21) >> 9;
+      uint32_t second = registers.pc;
+      uint16_t low;
+      // Both halves in one step when the second one follows (not while tracing, profiling or
+      // debugging, those want to see every halfword and a breakpoint can sit on the second)
+      if (profiler == nullptr && tracer == nullptr && memory.getDebugger() == nullptr &&
+          peekHalfWord(second, low) && (low & 0xF800) == 0xF800) {
+        stats.regionReads[fetchRegion].add();
+        cycles += fetchCycles(second, true);
+        stats.thumbInstructions.add();
+        registers.lr = (second + 2) | 1;
+        registers.pc = second + 2 + high + ((low & 0x7FF) << 1);
+        break;
+      }
+      registers.lr = second + 2 + high;
+      break;
+    }
+    case 0x3E:  // BL, second half: call LR + (offset << 1), LR = return address | 1
+    case 0x3F: {
+      uint32_t target = registers.lr + ((inst & 0x7FF) << 1);
+      registers.lr = registers.pc | 1;
+      registers.pc = target;
+      if (profiler != nullptr) {
+        profiler->recordCall((registers.lr & ~1u) - 4, target, registers.lr & ~1u);
+      }
       break;
     }
-    case 0x24:  // LDR (literal)
+    case 0x11:  // Hi register ops, only BX so far: bit 0 of the target stays in Thumb
     {
+      if ((inst & 0xFF80) != 0x4700) {
+        std::cerr << "Unknown Thumb inst: 0x" << std::hex << inst << std::endl;
+        break;
+      }
+      uint32_t target = readRegister((inst >> 3) & 0xF);
+      if (target & 1) {
+        registers.pc = target & ~1u;
+      } else {
+        registers.cpsr &= ~CPSR_THUMB;
+        registers.pc = target & ~3u;
+      }
+      break;
+    }
+    case 0x12:  // LDR (literal)
+    case 0x13: {
       uint32_t reg = (inst >> 8) & 0x7;
       uint32_t imm = (inst & 0xFF) << 2;  // 8-bit immediate value, shifted left by 2
-      uint32_t address = (registers.pc & 0xFFFFFFFC) + imm;
+      uint32_t address = ((registers.pc + 2) & 0xFFFFFFFC) + imm;  // from the instruction + 4
       uint32_t value = memory.readWord(address);
       writeRegister(reg, value);
       break;
@@ -52,4 +126,28 @@ void CPU::decodeThumb(uint16_t inst) {
       break;
     }
   }
-}
\ No newline at end of file
+}
+
+// Instruction formats, https://problemkaputt.de/gbatek.htm#thumbinstructionsummary
+const char *CPU::thumbInstructionClass(uint16_t inst) {
+  static const char *const immediateNames[4] = {"MOV(imm)", "CMP(imm)", "ADD(imm)", "SUB(imm)"};
+  if ((inst & 0xF800) == 0xF000) return "BL(high)";
+  if ((inst & 0xF800) == 0xF800) return "BL(low)";
+  if ((inst & 0xFF00) == 0xDF00) return "SWI";
+  if ((inst & 0xF000) == 0xD000) return "Bcc";
+  if ((inst & 0xF800) == 0xE000) return "B";
+  if ((inst & 0xFF00) == 0x4700) return "BX";
+  if ((inst & 0xF800) == 0x4800) return "LDR(literal)";
+  if ((inst & 0xE000) == 0x2000) return immediateNames[(inst >> 11) & 3];
+  if ((inst & 0xF800) == 0x1800) return "ADD/SUB";
+  if ((inst & 0xE000) == 0x0000) return "Shift";
+  if ((inst & 0xFC00) == 0x4000) return "ALU";
+  if ((inst & 0xFC00) == 0x4400) return "Hi register op";
+  if ((inst & 0xF600) == 0xB400) return "PUSH/POP";
+  if ((inst & 0xF000) == 0xC000) return "LDMIA/STMIA";
+  if ((inst & 0xF000) == 0x5000 || (inst & 0xE000) == 0x6000 || (inst & 0xF000) == 0x8000 ||
+      (inst & 0xF000) == 0x9000) {
+    return "LDR/STR";
+  }
+  return "Other";
+}
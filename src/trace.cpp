@@ -0,0 +1,351 @@
+#include "../include/trace.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#define TRACE_QUEUE_DEPTH 8  // blocks in flight before the emulator has to wait
+
+#define TRACE_FLAG_JUMP 0x1
+#define TRACE_FLAG_THUMB 0x2
+#define TRACE_FLAG_REGISTERS 0x4
+
+static uint32_t zigzag(int32_t value) {
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value) {
+  return (int32_t)((value >> 1) ^ -(value & 1));
+}
+
+static void putU32(std::ofstream &file, uint32_t value) {
+  uint8_t bytes[4] = {(uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16),
+                      (uint8_t)(value >> 24)};
+  file.write(reinterpret_cast<char *>(bytes), 4);
+}
+
+static bool getU32(std::ifstream &file, uint32_t &value) {
+  uint8_t bytes[4];
+  if (!file.read(reinterpret_cast<char *>(bytes), 4)) {
+    return false;
+  }
+  value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+  return true;
+}
+
+namespace TraceCodec {
+
+// LZ4-like sequences: token (literal length << 4 | match length - 4), extra length bytes,
+// literals, 16-bit match offset, extra match length bytes. The last sequence has no match.
+
+static void putLength(std::vector<uint8_t> &out, size_t length) {
+  while (length >= 255) {
+    out.push_back(255);
+    length -= 255;
+  }
+  out.push_back((uint8_t)length);
+}
+
+static void putSequence(std::vector<uint8_t> &out, const uint8_t *literals, size_t literalLength,
+                        size_t offset, size_t matchLength) {
+  size_t matchCode = matchLength ? matchLength - 4 : 0;
+  uint8_t token = (uint8_t)((std::min<size_t>(literalLength, 15) << 4) |
+                            std::min<size_t>(matchCode, 15));
+  out.push_back(token);
+  if (literalLength >= 15) putLength(out, literalLength - 15);
+  out.insert(out.end(), literals, literals + literalLength);
+  if (matchLength == 0) {
+    return;
+  }
+  out.push_back(offset & 0xFF);
+  out.push_back(offset >> 8);
+  if (matchCode >= 15) putLength(out, matchCode - 15);
+}
+
+void compress(const std::vector<uint8_t> &in, std::vector<uint8_t> &out) {
+  static thread_local std::vector<int32_t> table;
+  table.assign(1 << 14, -1);
+  out.clear();
+
+  const uint8_t *data = in.data();
+  size_t size = in.size();
+  size_t anchor = 0;
+  size_t i = 0;
+  while (i + 4 <= size) {
+    uint32_t sequence;
+    std::memcpy(&sequence, data + i, 4);
+    uint32_t hash = (sequence * 2654435761u) >> 18;
+    int32_t candidate = table[hash];
+    table[hash] = (int32_t)i;
+
+    uint32_t previous;
+    if (candidate < 0 || i - candidate > 0xFFFF ||
+        (std::memcpy(&previous, data + candidate, 4), previous != sequence)) {
+      ++i;
+      continue;
+    }
+
+    size_t length = 4;
+    while (i + length < size && data[candidate + length] == data[i + length]) {
+      ++length;
+    }
+    putSequence(out, data + anchor, i - anchor, i - candidate, length);
+    i += length;
+    anchor = i;
+  }
+  putSequence(out, data + anchor, size - anchor, 0, 0);
+}
+
+bool decompress(const uint8_t *in, size_t inSize, std::vector<uint8_t> &out, size_t outSize) {
+  out.resize(outSize);
+  size_t ip = 0, op = 0;
+
+  auto getLength = [&](size_t length) -> size_t {
+    if (length != 15) return length;
+    uint8_t extra;
+    do {
+      if (ip >= inSize) return SIZE_MAX;
+      extra = in[ip++];
+      length += extra;
+    } while (extra == 255);
+    return length;
+  };
+
+  while (op < outSize) {
+    if (ip >= inSize) return false;
+    uint8_t token = in[ip++];
+
+    size_t literalLength = getLength(token >> 4);
+    if (literalLength > inSize - ip || literalLength > outSize - op) return false;
+    std::memcpy(out.data() + op, in + ip, literalLength);
+    ip += literalLength;
+    op += literalLength;
+    if (op >= outSize) break;
+
+    if (ip + 2 > inSize) return false;
+    size_t offset = in[ip] | (in[ip + 1] << 8);
+    ip += 2;
+    size_t matchLength = getLength(token & 0xF);
+    if (matchLength == SIZE_MAX) return false;
+    matchLength += 4;
+    if (offset == 0 || offset > op || matchLength > outSize - op) return false;
+    for (size_t j = 0; j < matchLength; ++j, ++op) {
+      out[op] = out[op - offset];  // may overlap, byte by byte on purpose
+    }
+  }
+  return true;
+}
+
+}  // namespace TraceCodec
+
+TraceWriter::TraceWriter(const std::string &filename)
+    : file(filename, std::ios::binary),
+      blockRecords(0),
+      records(0),
+      expectedPC(0),
+      previous{},
+      closing(false) {
+  if (!file.is_open()) {
+    throw std::runtime_error("TraceWriter: Failed to open file");
+  }
+  file.write(TRACE_MAGIC, 7);
+  file.put((char)TRACE_VERSION);
+  block.reserve(TRACE_BLOCK_SIZE + 128);
+  writer = std::thread(&TraceWriter::writerLoop, this);
+}
+
+TraceWriter::~TraceWriter() {
+  close();
+}
+
+void TraceWriter::putVarint(uint64_t value) {
+  while (value >= 0x80) {
+    block.push_back((uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+  block.push_back((uint8_t)value);
+}
+
+void TraceWriter::record(uint32_t pc, uint32_t opcode, bool thumb, const uint32_t *r,
+                         uint32_t cpsr) {
+  // r15 isn't stored, it's the PC of the next record
+  uint32_t mask = 0;
+  for (int i = 0; i < 15; ++i) {
+    if (r[i] != previous[i]) mask |= 1 << i;
+  }
+  if (cpsr != previous[16]) mask |= 1 << 16;
+
+  uint8_t flags = 0;
+  if (pc != expectedPC) flags |= TRACE_FLAG_JUMP;
+  if (thumb) flags |= TRACE_FLAG_THUMB;
+  if (mask) flags |= TRACE_FLAG_REGISTERS;
+
+  block.push_back(flags);
+  if (flags & TRACE_FLAG_JUMP) putVarint(zigzag((int32_t)(pc - expectedPC)));
+  block.push_back(opcode & 0xFF);
+  block.push_back((opcode >> 8) & 0xFF);
+  if (!thumb) {
+    block.push_back((opcode >> 16) & 0xFF);
+    block.push_back(opcode >> 24);
+  }
+  if (mask) {
+    putVarint(mask);
+    for (int i = 0; i < 15; ++i) {
+      if (mask & (1 << i)) {
+        putVarint(zigzag((int32_t)(r[i] - previous[i])));
+        previous[i] = r[i];
+      }
+    }
+    if (mask & (1 << 16)) {
+      putVarint(zigzag((int32_t)(cpsr - previous[16])));
+      previous[16] = cpsr;
+    }
+  }
+
+  expectedPC = pc + (thumb ? 2 : 4);
+  ++blockRecords;
+  ++records;
+  if (block.size() >= TRACE_BLOCK_SIZE) {
+    submitBlock();
+  }
+}
+
+void TraceWriter::submitBlock() {
+  if (blockRecords == 0) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(queueLock);
+  queueChanged.wait(lock, [this] { return queue.size() < TRACE_QUEUE_DEPTH; });
+  queue.emplace_back(std::move(block), blockRecords);
+  if (!spare.empty()) {
+    block = std::move(spare.back());
+    spare.pop_back();
+  } else {
+    block = std::vector<uint8_t>();
+    block.reserve(TRACE_BLOCK_SIZE + 128);
+  }
+  block.clear();
+  blockRecords = 0;
+  queueChanged.notify_all();
+}
+
+void TraceWriter::writerLoop() {
+  std::vector<uint8_t> compressed;
+  for (;;) {
+    std::pair<std::vector<uint8_t>, uint32_t> job;
+    {
+      std::unique_lock<std::mutex> lock(queueLock);
+      queueChanged.wait(lock, [this] { return !queue.empty() || closing; });
+      if (queue.empty()) {
+        return;
+      }
+      job = std::move(queue.front());
+      queue.pop_front();
+    }
+
+    TraceCodec::compress(job.first, compressed);
+    putU32(file, (uint32_t)job.first.size());
+    putU32(file, (uint32_t)compressed.size());
+    putU32(file, job.second);
+    file.write(reinterpret_cast<const char *>(compressed.data()), compressed.size());
+
+    std::lock_guard<std::mutex> lock(queueLock);
+    spare.push_back(std::move(job.first));
+    queueChanged.notify_all();
+  }
+}
+
+void TraceWriter::close() {
+  if (!writer.joinable()) {
+    return;
+  }
+  submitBlock();
+  {
+    std::lock_guard<std::mutex> lock(queueLock);
+    closing = true;
+  }
+  queueChanged.notify_all();
+  writer.join();
+  file.close();
+  std::cerr << "Trace: " << std::dec << records << " instructions written" << std::endl;
+}
+
+TraceReader::TraceReader(const std::string &filename)
+    : file(filename, std::ios::binary), position(0), index(0), expectedPC(0), state{} {
+  if (!file.is_open()) {
+    throw std::runtime_error("TraceReader: Failed to open file");
+  }
+  char magic[8];
+  if (!file.read(magic, 8) || std::memcmp(magic, TRACE_MAGIC, 7) != 0) {
+    throw std::runtime_error("TraceReader: Not a PlusBoy trace");
+  }
+  if (magic[7] != TRACE_VERSION) {
+    throw std::runtime_error("TraceReader: Unsupported trace version");
+  }
+}
+
+bool TraceReader::loadBlock() {
+  uint32_t rawSize, compressedSize, count;
+  if (!getU32(file, rawSize) || !getU32(file, compressedSize) || !getU32(file, count)) {
+    return false;
+  }
+  compressed.resize(compressedSize);
+  if (!file.read(reinterpret_cast<char *>(compressed.data()), compressedSize) ||
+      !TraceCodec::decompress(compressed.data(), compressedSize, block, rawSize)) {
+    throw std::runtime_error("TraceReader: Corrupt block");
+  }
+  position = 0;
+  return true;
+}
+
+uint64_t TraceReader::getVarint() {
+  uint64_t value = 0;
+  for (int shift = 0; position < block.size(); shift += 7) {
+    uint8_t byte = block[position++];
+    value |= (uint64_t)(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      return value;
+    }
+  }
+  throw std::runtime_error("TraceReader: Truncated record");
+}
+
+bool TraceReader::next(TraceRecord &record) {
+  if (position >= block.size() && !loadBlock()) {
+    return false;
+  }
+
+  uint8_t flags = block[position++];
+  record.thumb = flags & TRACE_FLAG_THUMB;
+  record.pc = expectedPC;
+  if (flags & TRACE_FLAG_JUMP) {
+    record.pc += unzigzag((uint32_t)getVarint());
+  }
+
+  size_t opcodeSize = record.thumb ? 2 : 4;
+  if (position + opcodeSize > block.size()) {
+    throw std::runtime_error("TraceReader: Truncated record");
+  }
+  record.opcode = block[position] | (block[position + 1] << 8);
+  if (!record.thumb) {
+    record.opcode |= (block[position + 2] << 16) | ((uint32_t)block[position + 3] << 24);
+  }
+  position += opcodeSize;
+
+  record.changedMask = 0;
+  if (flags & TRACE_FLAG_REGISTERS) {
+    record.changedMask = (uint32_t)getVarint();
+    for (int i = 0; i < TRACE_REGISTERS; ++i) {
+      if (record.changedMask & (1 << i)) {
+        state[i] += unzigzag((uint32_t)getVarint());
+      }
+    }
+  }
+
+  state[15] = record.pc;
+  std::memcpy(record.registers, state, sizeof(state));
+  expectedPC = record.pc + opcodeSize;
+  ++index;
+  return true;
+}
@@ -0,0 +1,321 @@
+#include "../include/workload.hpp"
+
+#include <algorithm>
+
+#include "../include/cpu.hpp"
+#include "../include/emitter.hpp"
+#include "../include/memory.hpp"
+#include "../include/serial.hpp"
+
+namespace Workload {
+
+// xorshift32, the same seed gives the same ROM everywhere
+static uint32_t nextRandom(uint32_t &state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+const std::vector<Info> &list() {
+  static const std::vector<Info> workloads = {
+      {"alu", WORKLOAD_ALU, 0, 0, false},
+      {"ls-ewram", WORKLOAD_LOAD_STORE, WRAM_START, 0x4000, true},
+      {"ls-iwram", WORKLOAD_LOAD_STORE, IWRAM_START, 0x4000, true},  // below the stacks
+      {"ls-palette", WORKLOAD_LOAD_STORE, PALETTE_START, 0x400, true},
+      {"ls-vram", WORKLOAD_LOAD_STORE, VRAM_START, 0x4000, true},
+      {"ls-oam", WORKLOAD_LOAD_STORE, OAM_START, 0x400, true},
+      {"ls-rom", WORKLOAD_LOAD_STORE, ROM_START, 0x4000, false},
+      {"ldm-stm", WORKLOAD_BLOCK_TRANSFER, 0, 0, false},
+      {"branches", WORKLOAD_BRANCHES, 0, 0, false},
+      {"modes", WORKLOAD_MODES, 0, 0, false},
+      {"thumb", WORKLOAD_THUMB, 0, 0, false},
+      {"link", WORKLOAD_LINK, 0, 0, false},
+  };
+  return workloads;
+}
+
+const Info *find(const std::string &name) {
+  for (const Info &info : list()) {
+    if (name == info.name) {
+      return &info;
+    }
+  }
+  return nullptr;
+}
+
+static void buildALU(Emitter &e, const Options &options) {
+  static const ArmAluOp ops[] = {ALU_AND, ALU_EOR, ALU_SUB, ALU_RSB, ALU_ADD, ALU_ADC,
+                                 ALU_SBC, ALU_RSC, ALU_ORR, ALU_MOV, ALU_BIC, ALU_MVN};
+  static const ArmAluOp compares[] = {ALU_TST, ALU_TEQ, ALU_CMP, ALU_CMN};
+  static const int conditions[] = {COND_EQ, COND_NE, COND_CS, COND_CC, COND_MI,
+                                   COND_PL, COND_HI, COND_LS, COND_GE, COND_LT};
+  uint32_t random = options.seed | 1;
+  for (int r = 1; r <= 9; ++r) {
+    e.loadConstant(r, nextRandom(random));
+  }
+  e.alu(ALU_MOV, 0, 0, 0);
+
+  Emitter::Label loop = e.newLabel();
+  e.bind(loop);
+  for (uint32_t i = 0; i < options.size; ++i) {
+    uint32_t pick = nextRandom(random);
+    int rd = 1 + pick % 9;
+    int rn = 1 + (pick >> 4) % 9;
+    int rm = 1 + (pick >> 8) % 9;
+    bool setFlags = (pick >> 12) % 4 == 0;
+    int cond = (pick >> 14) % 8 == 0 ? conditions[(pick >> 17) % 10] : COND_AL;
+    ArmAluOp op = ops[(pick >> 21) % 12];
+    uint32_t kind = pick >> 28;
+    if (kind < 6) {
+      uint32_t rotate = (pick >> 24) % 16 * 2;
+      uint32_t imm = pick & 0xFF;
+      e.alu(op, rd, rn, rotate == 0 ? imm : (imm >> rotate) | (imm << (32 - rotate)), setFlags,
+            cond);
+    } else if (kind < 12) {
+      int shiftType = (pick >> 24) % 4;
+      // Amount 0 is LSR/ASR #32 or RRX for the other types, keep to the plain shifts
+      int amount = shiftType == SHIFT_LSL ? (pick >> 6) % 32 : 1 + (pick >> 6) % 31;
+      e.aluReg(op, rd, rn, rm, shiftType, amount, setFlags, cond);
+    } else if (kind < 14) {
+      e.alu(compares[(pick >> 24) % 4], 0, rn, pick & 0xFF);
+    } else if (kind < 15) {
+      e.aluReg(compares[(pick >> 24) % 4], 0, rn, rm);
+    } else {
+      e.mul(rd, rd == rm ? 1 + rm % 9 : rm, rn, setFlags, cond);  // Rd = Rm is unpredictable
+    }
+  }
+  e.alu(ALU_ADD, 0, 0, 1);
+  e.b(loop);
+}
+
+static void buildLoadStore(Emitter &e, const Info &info, const Options &options) {
+  // Transfers per pass: a power of two so the step is an immediate, one window at most
+  uint32_t count = 1;
+  while (count * 2 <= std::min<uint32_t>(options.size, std::min<uint32_t>(info.window, 4096) / 4)) {
+    count *= 2;
+  }
+  // Bytes only where the bus takes them as they are (VRAM, palette and OAM widen or drop them)
+  bool bytes = info.region < IO_START;
+
+  Emitter::Label data = e.newLabel();
+  if (info.region == ROM_START) {
+    e.loadAddress(8, data);
+  } else {
+    e.loadConstant(8, info.region);
+  }
+  e.alu(ALU_MOV, 9, 0, 0);
+  for (int r = 1; r <= 4; ++r) {
+    e.alu(ALU_MOV, r, 0, r * 0x11);
+  }
+
+  Emitter::Label loop = e.newLabel();
+  e.bind(loop);
+  e.aluReg(ALU_ADD, 10, 8, 9);
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t offset = i * 4;
+    if (!info.writable) {
+      e.ldr(1 + i % 6, 10, offset);
+      continue;
+    }
+    switch (i % 4) {
+      case 0:
+        e.str(1 + i % 4, 10, offset);
+        break;
+      case 1:
+        e.ldr(5, 10, offset - 4);
+        break;
+      case 2:
+        bytes ? e.strb(2, 10, offset + 1) : e.str(2, 10, offset);
+        break;
+      case 3:
+        bytes ? e.ldrb(6, 10, offset - 1) : e.ldr(6, 10, offset - 4);
+        break;
+    }
+  }
+  e.aluReg(ALU_EOR, 1, 1, 5);
+  e.alu(ALU_ADD, 9, 9, count * 4);
+  e.alu(ALU_CMP, 0, 9, info.window);
+  e.alu(ALU_MOV, 9, 0, 0, false, COND_CS);
+  e.b(loop);
+
+  if (info.region == ROM_START) {
+    uint32_t random = options.seed | 1;
+    e.align(4);
+    e.bind(data);
+    for (uint32_t i = 0; i < info.window / 4; ++i) {
+      e.word(nextRandom(random));
+    }
+  }
+}
+
+static void buildBlockTransfer(Emitter &e, const Options &options) {
+  // 16 bytes per LDM/STM pair, copied from the start of WRAM to 8 KB in
+  uint32_t copies = std::clamp<uint32_t>(options.size / 4, 1, 512);
+  Emitter::Label loop = e.newLabel(), function = e.newLabel(), leaf = e.newLabel();
+  e.loadConstant(8, WRAM_START);
+  e.loadConstant(9, WRAM_START + 0x2000);
+
+  e.bind(loop);
+  e.bl(function);
+  e.aluReg(ALU_MOV, 10, 0, 8);
+  e.aluReg(ALU_MOV, 11, 0, 9);
+  for (uint32_t i = 0; i < copies; ++i) {
+    e.ldm(10, 0x000F);
+    e.stm(11, 0x000F);
+  }
+  e.alu(ALU_ADD, 12, 12, 1);
+  e.b(loop);
+
+  e.bind(function);
+  e.push(0x4FF0);  // r4-r11, lr
+  for (int r = 4; r <= 11; ++r) {
+    e.alu(ALU_ADD, r, r, r);
+  }
+  e.bl(leaf);
+  e.pop(0x8FF0);  // r4-r11, pc
+
+  e.bind(leaf);
+  e.push(0x00F0);
+  for (int r = 4; r <= 7; ++r) {
+    e.aluReg(ALU_EOR, r, r, 12);
+  }
+  e.pop(0x00F0);
+  e.bx(14);
+}
+
+static void buildBranches(Emitter &e, const Options &options) {
+  Emitter::Label loop = e.newLabel();
+  Emitter::Label functions[4] = {e.newLabel(), e.newLabel(), e.newLabel(), e.newLabel()};
+  e.alu(ALU_MOV, 0, 0, 0);
+
+  e.bind(loop);
+  e.alu(ALU_ADD, 0, 0, 1);
+  for (uint32_t i = 0; i < options.size; ++i) {
+    Emitter::Label skip = e.newLabel();
+    int r = 1 + i % 6;
+    e.alu(ALU_TST, 0, 0, 1u << (i % 8));
+    e.b(skip, COND_EQ);
+    e.alu(ALU_ADD, r, r, i & 0xFF);
+    if (i % 4 == 3) {
+      e.bl(functions[(i / 4) % 4]);
+    }
+    if (i % 8 == 7) {
+      Emitter::Label inner = e.newLabel();
+      e.alu(ALU_MOV, 11, 0, 3);
+      e.bind(inner);
+      e.alu(ALU_SUB, 11, 11, 1, true);
+      e.b(inner, COND_NE);
+    }
+    e.bind(skip);
+  }
+  e.b(loop);
+
+  for (int k = 0; k < 4; ++k) {
+    e.bind(functions[k]);
+    e.alu(ALU_ADD, 7, 7, k + 1);
+    e.bx(14);
+  }
+}
+
+static void buildModes(Emitter &e, const Options &options) {
+  static const uint32_t modes[] = {MODE_IRQ, MODE_SUPERVISOR, MODE_FIQ, MODE_SYSTEM};
+  Emitter::Label loop = e.newLabel(), thumbCode = e.newLabel(), back = e.newLabel();
+  e.loadAddress(12, thumbCode, true);
+  e.loadAddress(11, back);
+
+  e.bind(loop);
+  for (uint32_t i = 0; i < options.size; ++i) {
+    // Interrupts masked while away from system mode
+    e.msrControl(modes[i % 4] | CPSR_IRQ_DISABLE | CPSR_FIQ_DISABLE);
+    e.alu(ALU_ADD, 8, 8, 1);    // banked in FIQ
+    e.alu(ALU_ADD, 14, 14, 1);  // banked everywhere but system
+  }
+  e.msrControl(MODE_SYSTEM);  // r11 and r12 are the user ones again
+  e.bx(12);
+  e.bind(back);
+  e.b(loop);
+
+  e.bind(thumbCode);
+  for (uint32_t i = 0; i < std::max<uint32_t>(options.size / 4, 1); ++i) {
+    e.thumbMov(i % 4, i & 0xFF);
+    e.thumbAdd(4 + i % 4, 4 + i % 4, i % 4);
+  }
+  e.thumbBX(11);
+}
+
+static void buildThumb(Emitter &e, const Options &options) {
+  Emitter::Label loop = e.newLabel(), function = e.newLabel();
+  e.loadAddress(12, loop, true);
+  e.bx(12);
+
+  e.bind(loop);
+  for (uint32_t i = 0; i < options.size; ++i) {
+    if (i % 16 == 15) {
+      e.thumbBL(function);
+    } else if (i % 4 == 0) {
+      e.thumbMov(i % 8, i & 0xFF);
+    } else {
+      e.thumbAdd(i % 8, (i + 1) % 8, (i + 3) % 8);
+    }
+  }
+  e.thumbB(loop);
+
+  e.bind(function);
+  e.thumbAdd(7, 7, 6);
+  e.thumbBX(14);
+}
+
+static void buildLink(Emitter &e, const Options &options) {
+  // One word store covers SIOCNT and SIOMLT_SEND: the loop count goes out, and on the parent
+  // the busy bit starts a transfer unless one is running already
+  Emitter::Label loop = e.newLabel();
+  e.loadConstant(8, SIOMULTI0);
+  e.alu(ALU_MOV, 0, 0, 0);
+  e.str(0, 8, RCNT - SIOMULTI0);
+  e.loadConstant(1, SIOCNT_MODE_MULTIPLAYER | SIOCNT_BAUD_MASK | SIOCNT_BUSY);
+
+  e.bind(loop);
+  e.alu(ALU_ADD, 0, 0, 1);
+  for (uint32_t i = 0; i < options.size; ++i) {
+    int r = 2 + i % 4;
+    e.aluReg(i % 3 == 0 ? ALU_EOR : ALU_ADD, r, r, 0, SHIFT_LSL, i % 8);
+  }
+  e.aluReg(ALU_ORR, 6, 1, 0, SHIFT_LSL, 16);
+  e.str(6, 8, SIOCNT - SIOMULTI0);
+  e.ldr(6, 8, 0);  // SIOMULTI0/1
+  e.aluReg(ALU_ADD, 7, 7, 6);
+  e.ldr(6, 8, 4);  // SIOMULTI2/3
+  e.aluReg(ALU_EOR, 7, 7, 6);
+  e.b(loop);
+}
+
+std::vector<uint8_t> build(const Info &info, const Options &options) {
+  Emitter e;
+  switch (info.kind) {
+    case WORKLOAD_ALU:
+      buildALU(e, options);
+      break;
+    case WORKLOAD_LOAD_STORE:
+      buildLoadStore(e, info, options);
+      break;
+    case WORKLOAD_BLOCK_TRANSFER:
+      buildBlockTransfer(e, options);
+      break;
+    case WORKLOAD_BRANCHES:
+      buildBranches(e, options);
+      break;
+    case WORKLOAD_MODES:
+      buildModes(e, options);
+      break;
+    case WORKLOAD_THUMB:
+      buildThumb(e, options);
+      break;
+    case WORKLOAD_LINK:
+      buildLink(e, options);
+      break;
+  }
+  return e.finish();
+}
+
+}  // namespace Workload
@@ -0,0 +1,52 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+
+#include "../include/framering.hpp"
+#include "../include/framewriter.hpp"
+
+/*
+Records frames from an emulator started with --shm=<name>, without touching its process.
+Usage: PlusBoyFrameGrab <name> <output.y4m|output.rgb> [frames]
+Stops after 'frames' frames (default 60) or once the emulator stops producing any.
+*/
+
+#define GRAB_IDLE_TIMEOUT_MS 2000
+
+int main(int argc, char **argv) {
+  if (argc != 3 && argc != 4) {
+    std::cerr << "Usage: " << argv[0] << " <name> <output.y4m|output.rgb> [frames]" << std::endl;
+    return 2;
+  }
+  uint64_t wanted = argc == 4 ? std::strtoull(argv[3], nullptr, 10) : 60;
+
+  std::unique_ptr<FrameRing> ring = FrameRing::attach(argv[1]);
+  if (!ring) {
+    std::cerr << "No frame ring at " << argv[1] << std::endl;
+    return 1;
+  }
+
+  try {
+    FrameWriter writer(*ring, argv[2]);
+    uint64_t latest = ring->getLatest();
+    auto lastFrame = std::chrono::steady_clock::now();
+    while (writer.getFramesWritten() + writer.getFramesDropped() < wanted) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      if (ring->getLatest() != latest) {
+        latest = ring->getLatest();
+        lastFrame = std::chrono::steady_clock::now();
+      } else if (std::chrono::steady_clock::now() - lastFrame >
+                 std::chrono::milliseconds(GRAB_IDLE_TIMEOUT_MS)) {
+        break;
+      }
+    }
+    writer.close();
+    std::cout << "Recorded " << writer.getFramesWritten() << " frames ("
+              << writer.getFramesDropped() << " dropped)" << std::endl;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
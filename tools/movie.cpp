@@ -0,0 +1,119 @@
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../include/keypad.hpp"
+#include "../include/movie.hpp"
+#include "../include/sha1.hpp"
+
+/*
+Makes and inspects input movies for PlusBoy --movie.
+Usage: PlusBoyMovie make <rom> <script.txt> <output.pbm>
+       PlusBoyMovie info <movie.pbm>
+Script lines are "<frames> [keys...]": hold those keys (A B SELECT START RIGHT LEFT UP DOWN
+R L, none for nothing) for that many frames. '#' starts a comment.
+Keyframes are added by playing the movie: PlusBoy rom --movie=x.pbm --keyframes=600
+*/
+
+static const struct {
+  const char *name;
+  uint16_t bit;
+} keyNames[] = {{"A", KEY_A},         {"B", KEY_B},       {"SELECT", KEY_SELECT},
+                {"START", KEY_START}, {"RIGHT", KEY_RIGHT}, {"LEFT", KEY_LEFT},
+                {"UP", KEY_UP},       {"DOWN", KEY_DOWN}, {"R", KEY_R},
+                {"L", KEY_L}};
+
+static bool parseKey(const std::string &name, uint16_t &keys) {
+  for (const auto &key : keyNames) {
+    if (name == key.name) {
+      keys |= key.bit;
+      return true;
+    }
+  }
+  return false;
+}
+
+static int make(const char *romPath, const char *scriptPath, const char *outPath) {
+  std::ifstream romFile(romPath, std::ios::binary);
+  std::ifstream script(scriptPath);
+  if (!romFile.is_open() || !script.is_open()) {
+    std::cerr << "Can't open " << (romFile.is_open() ? scriptPath : romPath) << std::endl;
+    return 1;
+  }
+  std::vector<uint8_t> rom((std::istreambuf_iterator<char>(romFile)),
+                           std::istreambuf_iterator<char>());
+
+  Movie movie;
+  movie.setROMHash(SHA1::hash(rom.data(), rom.size()));
+  std::string line;
+  for (int lineNumber = 1; std::getline(script, line); ++lineNumber) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream words(line);
+    uint64_t frames;
+    if (!(words >> frames)) {
+      continue;  // blank or comment
+    }
+    uint16_t keys = 0;
+    std::string name;
+    while (words >> name) {
+      if (!parseKey(name, keys)) {
+        std::cerr << scriptPath << ":" << lineNumber << ": unknown key " << name << std::endl;
+        return 1;
+      }
+    }
+    for (uint64_t i = 0; i < frames; ++i) {
+      movie.appendKeys(keys);
+    }
+  }
+
+  try {
+    movie.save(outPath);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  std::cout << outPath << ": " << movie.getFrameCount() << " frames" << std::endl;
+  return 0;
+}
+
+static int info(const char *path) {
+  Movie movie;
+  try {
+    movie.load(path);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  uint64_t pressedFrames = 0;
+  for (uint32_t frame = 0; frame < movie.getFrameCount(); ++frame) {
+    pressedFrames += movie.getKeys(frame) != 0;
+  }
+  std::cout << "ROM SHA-1: " << SHA1::toHex(movie.getROMHash()) << std::endl;
+  std::cout << "Frames:    " << movie.getFrameCount() << " (" << pressedFrames
+            << " with keys held)" << std::endl;
+  std::cout << "Keyframes: " << movie.getKeyframeCount();
+  for (uint32_t frame = 0; frame < movie.getFrameCount(); ++frame) {
+    if (movie.hasKeyframe(frame)) {
+      std::cout << " " << frame;
+    }
+  }
+  std::cout << std::endl;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 5 && std::strcmp(argv[1], "make") == 0) {
+    return make(argv[2], argv[3], argv[4]);
+  }
+  if (argc == 3 && std::strcmp(argv[1], "info") == 0) {
+    return info(argv[2]);
+  }
+  std::cerr << "Usage: " << argv[0] << " make <rom> <script.txt> <output.pbm>" << std::endl;
+  std::cerr << "       " << argv[0] << " info <movie.pbm>" << std::endl;
+  return 2;
+}
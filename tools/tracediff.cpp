@@ -0,0 +1,80 @@
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+
+#include "../include/trace.hpp"
+
+/*
+Compares two binary traces and reports the first instruction where they diverge.
+Usage: PlusBoyTraceDiff <golden.trace> <test.trace>
+*/
+
+static const char *registerName(int index) {
+  static const char *names[TRACE_REGISTERS] = {"r0", "r1", "r2",  "r3",  "r4",  "r5",
+                                               "r6", "r7", "r8",  "r9",  "r10", "r11",
+                                               "r12", "sp", "lr", "pc",  "cpsr"};
+  return names[index];
+}
+
+static void printRecord(const char *label, const TraceRecord &record) {
+  std::printf("  %-7s pc=%08X %s %0*X\n", label, record.pc, record.thumb ? "thumb" : "arm  ",
+              record.thumb ? 4 : 8, record.opcode);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " <golden.trace> <test.trace>" << std::endl;
+    return 2;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  try {
+    TraceReader golden(argv[1]);
+    TraceReader test(argv[2]);
+    TraceRecord a, b, previous{};
+
+    for (;;) {
+      bool hasA = golden.next(a);
+      bool hasB = test.next(b);
+      if (!hasA || !hasB) {
+        if (hasA != hasB) {
+          std::printf("Traces diverge in length after %llu instructions (%s ends first)\n",
+                      (unsigned long long)(golden.getIndex() - (hasA ? 1 : 0)),
+                      hasA ? argv[2] : argv[1]);
+          return 1;
+        }
+        break;
+      }
+
+      bool same = a.pc == b.pc && a.opcode == b.opcode && a.thumb == b.thumb;
+      for (int i = 0; i < TRACE_REGISTERS && same; ++i) {
+        same = a.registers[i] == b.registers[i];
+      }
+      if (!same) {
+        std::printf("First divergence at instruction %llu\n",
+                    (unsigned long long)(golden.getIndex() - 1));
+        printRecord("before", previous);
+        printRecord("golden", a);
+        printRecord("test", b);
+        for (int i = 0; i < TRACE_REGISTERS; ++i) {
+          if (a.registers[i] != b.registers[i]) {
+            std::printf("  %-4s golden=%08X test=%08X\n", registerName(i), a.registers[i],
+                        b.registers[i]);
+          }
+        }
+        return 1;
+      }
+      previous = a;
+    }
+
+    double seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::printf("Traces match: %llu instructions (%.2f s, %.1f M/s)\n",
+                (unsigned long long)golden.getIndex(), seconds,
+                golden.getIndex() / seconds / 1e6);
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 2;
+  }
+  return 0;
+}